@@ -128,7 +128,7 @@ zx_status_t El2CpuState::Create(fbl::unique_ptr<El2CpuState>* out) {
 
     // Setup EL2 for all online CPUs.
     cpu_mask_t cpu_mask = percpu_exec(OnTask, cpu_state.get());
-    if (cpu_mask != mp_get_online_mask()) {
+    if (!cpu_mask_equal(cpu_mask, mp_get_online_mask())) {
         mp_sync_exec(MP_IPI_TARGET_MASK, cpu_mask, el2_off_task, nullptr);
         return ZX_ERR_NOT_SUPPORTED;
     }
@@ -138,7 +138,7 @@ zx_status_t El2CpuState::Create(fbl::unique_ptr<El2CpuState>* out) {
 }
 
 El2CpuState::~El2CpuState() {
-    mp_sync_exec(MP_IPI_TARGET_ALL, 0, el2_off_task, nullptr);
+    mp_sync_exec(MP_IPI_TARGET_ALL, cpu_mask_none(), el2_off_task, nullptr);
 }
 
 zx_status_t alloc_vmid(uint8_t* vmid) {
@@ -66,16 +66,16 @@ static uint arch_curr_cpu_num_slow() {
 }
 
 zx_status_t arch_mp_send_ipi(mp_ipi_target_t target, cpu_mask_t mask, mp_ipi_t ipi) {
-    LTRACEF("target %d mask %#x, ipi %d\n", target, mask, ipi);
+    LTRACEF("target %d mask lowest %u, ipi %d\n", target, lowest_cpu_set(mask), ipi);
 
     // translate the high level target + mask mechanism into just a mask
     switch (target) {
     case MP_IPI_TARGET_ALL:
-        mask = (1ul << SMP_MAX_CPUS) - 1;
+        mask = cpu_mask_all();
         break;
     case MP_IPI_TARGET_ALL_BUT_LOCAL:
-        mask = (1ul << SMP_MAX_CPUS) - 1;
-        mask &= ~cpu_num_to_mask(arch_curr_cpu_num());
+        mask = cpu_mask_all();
+        cpu_mask_remove(&mask, arch_curr_cpu_num());
         break;
     case MP_IPI_TARGET_MASK:;
     }
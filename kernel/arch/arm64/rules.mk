@@ -40,11 +40,11 @@ KERNEL_DEFINES += \
 	ARM_ISA_ARMV8=1 \
 	ARM_ISA_ARMV8A=1
 
-# unless otherwise specified, limit to 2 clusters and 8 CPUs per cluster
-SMP_CPU_MAX_CLUSTERS ?= 2
+# unless otherwise specified, limit to 8 clusters and 8 CPUs per cluster
+SMP_CPU_MAX_CLUSTERS ?= 8
 SMP_CPU_MAX_CLUSTER_CPUS ?= 8
 
-SMP_MAX_CPUS ?= 16
+SMP_MAX_CPUS ?= 64
 
 MODULE_SRCS += \
 	$(LOCAL_DIR)/mp.cpp
@@ -117,19 +117,18 @@ void arch_resume(void) {
 }
 
 [[ noreturn, gnu::noinline ]] static void finish_secondary_entry(
-    volatile int* aps_still_booting, thread_t* thread, uint cpu_num) {
+    cpu_mask_t* aps_still_booting, thread_t* thread, uint cpu_num) {
 
     // Signal that this CPU is initialized.  It is important that after this
     // operation, we do not touch any resources associated with bootstrap
     // besides our thread_t and stack, since this is the checkpoint the
     // bootstrap process uses to identify completion.
-    int old_val = atomic_and(aps_still_booting, ~(1U << cpu_num));
-    if (old_val == 0) {
-        // If the value is already zero, then booting this CPU timed out.
+    if (!cpu_mask_atomic_remove(aps_still_booting, cpu_num)) {
+        // If our bit is already clear, then booting this CPU timed out.
         goto fail;
     }
 
-    // Defer configuring memory settings until after the atomic_and above.
+    // Defer configuring memory settings until after the atomic remove above.
     // This ensures that we were in no-fill cache mode for the duration of early
     // AP init.
     DEBUG_ASSERT(x86_get_cr0() & X86_CR0_CD);
@@ -137,7 +136,7 @@ void arch_resume(void) {
 
     // Load the appropriate PAT/MTRRs.  This must happen after init_percpu, so
     // that this CPU is considered online.
-    x86_pat_sync(1U << cpu_num);
+    x86_pat_sync(cpu_num_to_mask(cpu_num));
 
     /* run early secondary cpu init routines up to the threading level */
     lk_init_level(LK_INIT_FLAG_SECONDARY_CPUS, LK_INIT_LEVEL_EARLIEST, LK_INIT_LEVEL_THREADING - 1);
@@ -163,7 +162,7 @@ fail:
 // this function is simple enough that the compiler won't
 // want to generate stack-protector prologue/epilogue code,
 // which would use %gs.
-__NO_SAFESTACK __NO_RETURN void x86_secondary_entry(volatile int* aps_still_booting,
+__NO_SAFESTACK __NO_RETURN void x86_secondary_entry(cpu_mask_t* aps_still_booting,
                                                     thread_t* thread) {
     // Would prefer this to be in init_percpu, but there is a dependency on a
     // page mapping existing, and the BP calls that before the VM subsystem is
@@ -8,6 +8,7 @@
 #include <arch/x86/cpu_topology.h>
 #include <arch/x86/feature.h>
 #include <bits.h>
+#include <kernel/mp.h>
 #include <pow2.h>
 #include <stdio.h>
 #include <string.h>
@@ -149,3 +150,9 @@ void x86_cpu_topology_decode(uint32_t apic_id, x86_cpu_topology_t* topo) {
     topo->core_id = (apic_id & core_mask) >> core_shift;
     topo->smt_id = apic_id & smt_mask;
 }
+
+void x86_cpu_topology_register(uint cpu_num, uint32_t apic_id) {
+    x86_cpu_topology_t topo;
+    x86_cpu_topology_decode(apic_id, &topo);
+    mp_set_cpu_topology(cpu_num, topo.package_id, topo.core_id);
+}
@@ -42,7 +42,7 @@ static void hwp_enable(void) {
         return;
     }
 
-    mp_sync_exec(MP_IPI_TARGET_ALL, 0, hwp_enable_sync_task, nullptr);
+    mp_sync_exec(MP_IPI_TARGET_ALL, cpu_mask_none(), hwp_enable_sync_task, nullptr);
 
     hwp_enabled = true;
 }
@@ -66,7 +66,7 @@ static void hwp_set_hint(unsigned long hint) {
         printf("HWP hint not supported\n");
         return;
     }
-    mp_sync_exec(MP_IPI_TARGET_ALL, 0, hwp_set_hint_sync_task, (void*)hint);
+    mp_sync_exec(MP_IPI_TARGET_ALL, cpu_mask_none(), hwp_set_hint_sync_task, (void*)hint);
 }
 
 static int cmd_hwp(int argc, const cmd_args* argv, uint32_t flags) {
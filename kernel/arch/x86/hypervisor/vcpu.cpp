@@ -648,6 +648,12 @@ zx_status_t Vcpu::Resume(zx_port_packet_t* packet) {
             vmx_state_.host_state.xcr0 = x86_xgetbv(0);
             x86_xsetbv(0, vmx_state_.guest_state.xcr0);
         }
+        // The PCID in cr3 changes whenever this CPU recycles the slot held by
+        // our aspace, so the host cr3 must be refreshed on every entry, or a
+        // VM exit could resume the host on another aspace's stale
+        // translations.  Interrupts are disabled, so cr3 can't change before
+        // we enter, and reading cr3 never returns the no-flush bit.
+        vmcs.Write(VmcsFieldXX::HOST_CR3, x86_get_cr3());
         running_.store(true);
         status = vmx_enter(&vmx_state_);
         running_.store(false);
@@ -202,14 +202,14 @@ zx_status_t VmxCpuState::Create(fbl::unique_ptr<VmxCpuState>* out) {
 
     // Enable VMX for all online CPUs.
     cpu_mask_t cpu_mask = percpu_exec(vmxon_task, &vmxon_pages);
-    if (cpu_mask != mp_get_online_mask()) {
+    if (!cpu_mask_equal(cpu_mask, mp_get_online_mask())) {
         mp_sync_exec(MP_IPI_TARGET_MASK, cpu_mask, vmxoff_task, nullptr);
         return ZX_ERR_NOT_SUPPORTED;
     }
 
     fbl::unique_ptr<VmxCpuState> cpu_state(new (&ac) VmxCpuState);
     if (!ac.check()) {
-        mp_sync_exec(MP_IPI_TARGET_ALL, 0, vmxoff_task, nullptr);
+        mp_sync_exec(MP_IPI_TARGET_ALL, cpu_mask_none(), vmxoff_task, nullptr);
         return ZX_ERR_NO_MEMORY;
     }
     zx_status_t status = cpu_state->Init();
@@ -222,7 +222,7 @@ zx_status_t VmxCpuState::Create(fbl::unique_ptr<VmxCpuState>* out) {
 }
 
 VmxCpuState::~VmxCpuState() {
-    mp_sync_exec(MP_IPI_TARGET_ALL, 0, vmxoff_task, nullptr);
+    mp_sync_exec(MP_IPI_TARGET_ALL, cpu_mask_none(), vmxoff_task, nullptr);
 }
 
 zx_status_t alloc_vpid(uint16_t* vpid) {
@@ -13,6 +13,7 @@
 #include <fbl/algorithm.h>
 #include <fbl/atomic.h>
 #include <fbl/canary.h>
+#include <kernel/cpu.h>
 #include <vm/arch_vm_aspace.h>
 #include <zircon/compiler.h>
 #include <zircon/types.h>
@@ -41,8 +42,7 @@ private:
     IntermediatePtFlags intermediate_flags() final;
     PtFlags terminal_flags(PageTableLevel level, uint flags) final;
     PtFlags split_flags(PageTableLevel level, PtFlags flags) final;
-    void TlbInvalidatePage(PageTableLevel level, vaddr_t vaddr, bool global_page,
-                           bool was_terminal) final;
+    void TlbInvalidate(PendingTlbInvalidation* pending) final;
     uint pt_flags_to_mmu_flags(PtFlags flags, PageTableLevel level) final;
     bool needs_cache_flushes() final { return false; }
 
@@ -64,8 +64,7 @@ private:
     IntermediatePtFlags intermediate_flags() final;
     PtFlags terminal_flags(PageTableLevel level, uint flags) final;
     PtFlags split_flags(PageTableLevel level, PtFlags flags) final;
-    void TlbInvalidatePage(PageTableLevel level, vaddr_t vaddr, bool global_page,
-                           bool was_terminal) final;
+    void TlbInvalidate(PendingTlbInvalidation* pending) final;
     uint pt_flags_to_mmu_flags(PtFlags flags, PageTableLevel level) final;
     bool needs_cache_flushes() final { return false; }
 };
@@ -96,7 +95,16 @@ public:
     paddr_t pt_phys() const { return pt_->phys(); }
     size_t pt_pages() const { return pt_->pages(); }
 
-    int active_cpus() { return active_cpus_.load(); }
+    cpu_mask_t active_cpus() const { return cpu_mask_atomic_load(&active_cpus_); }
+
+    // Identifies this aspace in the per-CPU PCID tables.  Never reused.
+    uint64_t pcid_ctx_id() const { return pcid_ctx_id_; }
+
+    // Bumped on every TLB invalidation of this aspace, so that CPUs which
+    // kept its translations cached under a PCID know to flush them when they
+    // switch back in.
+    uint64_t tlb_generation() const { return tlb_generation_.load(); }
+    void IncrementTlbGeneration() { tlb_generation_.fetch_add(1); }
 
     IoBitmap& io_bitmap() { return io_bitmap_; }
 
@@ -128,9 +136,13 @@ private:
     vaddr_t base_ = 0;
     size_t size_ = 0;
 
-    // CPUs that are currently executing in this aspace.
-    // Actually an mp_cpu_mask_t, but header dependencies.
-    fbl::atomic_int active_cpus_{0};
+    // CPUs that are currently executing in this aspace.  Only modified with
+    // the cpu_mask_atomic_* routines.
+    cpu_mask_t active_cpus_ = {};
+
+    // See pcid_ctx_id() and tlb_generation().
+    uint64_t pcid_ctx_id_ = 0;
+    fbl::atomic<uint64_t> tlb_generation_{1};
 };
 
 using ArchVmAspace = X86ArchVmAspace;
@@ -23,6 +23,7 @@
 
 #ifndef __ASSEMBLER__
 #include <assert.h>
+#include <kernel/cpu.h>
 #include <vm/vm_aspace.h>
 #include <zircon/compiler.h>
 #include <zircon/types.h>
@@ -80,8 +81,8 @@ struct __PACKED x86_ap_bootstrap_data {
 
     // Counter for APs to use to determine which stack to take
     uint32_t cpu_id_counter;
-    // Pointer to value to use to determine when APs are done with boot
-    volatile int *cpu_waiting_mask;
+    // Pointer to the mask of APs that have not finished booting
+    cpu_mask_t *cpu_waiting_mask;
 
     // Per-cpu data
     struct __PACKED {
@@ -21,4 +21,7 @@ typedef struct {
 void x86_cpu_topology_init(void);
 void x86_cpu_topology_decode(uint32_t apic_id, x86_cpu_topology_t *topo);
 
+/* decode |apic_id| and report the placement of |cpu_num| to the scheduler */
+void x86_cpu_topology_register(uint cpu_num, uint32_t apic_id);
+
 __END_CDECLS
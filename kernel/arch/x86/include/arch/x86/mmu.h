@@ -102,6 +102,10 @@ void x86_mmu_init(void);
 
 paddr_t x86_kernel_cr3(void);
 
+/* Invalidates the TLB and paging-structure caches of this CPU for every PCID,
+ * including global entries. */
+void x86_tlb_flush_all_contexts(void);
+
 __END_CDECLS
 
 #endif // !__ASSEMBLER__
@@ -129,7 +129,7 @@ static void arch_set_in_int_handler(bool in_irq)
 enum handler_return x86_ipi_generic_handler(void);
 enum handler_return x86_ipi_reschedule_handler(void);
 void x86_ipi_halt_handler(void) __NO_RETURN;
-void x86_secondary_entry(volatile int *aps_still_booting, thread_t *thread);
+void x86_secondary_entry(cpu_mask_t *aps_still_booting, thread_t *thread);
 
 __END_CDECLS
 
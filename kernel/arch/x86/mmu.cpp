@@ -17,6 +17,7 @@
 #include <arch/x86/mmu.h>
 #include <arch/x86/mmu_mem_types.h>
 #include <kernel/mp.h>
+#include <lib/counters.h>
 #include <vm/arch_vm_aspace.h>
 #include <vm/pmm.h>
 #include <vm/vm.h>
@@ -33,6 +34,35 @@ uint8_t g_paddr_width = 32;
 /* True if the system supports 1GB pages */
 static bool supports_huge_pages = false;
 
+/* True if CR4.PCIDE has been turned on */
+static bool use_pcid = false;
+
+namespace {
+
+// Each CPU hands out PCIDs 1..kNumPcids to the user aspaces that most
+// recently ran on it, recycling them round-robin.  PCID 0 is used for the
+// kernel aspace and whenever PCIDs are not in use.
+constexpr uint16_t kNumPcids = 8;
+
+struct PcidSlot {
+    // X86ArchVmAspace::pcid_ctx_id() of the owner, or 0 if unassigned.
+    uint64_t ctx_id;
+    // The owner's TLB generation as of the last time this CPU flushed it.
+    uint64_t tlb_generation;
+};
+
+struct PcidState {
+    PcidSlot slots[kNumPcids];
+    uint16_t next_victim;
+} __CPU_ALIGN;
+
+// Only touched by the owning CPU, with interrupts disabled.
+PcidState pcid_state[SMP_MAX_CPUS];
+
+fbl::atomic<uint64_t> next_pcid_ctx_id(1);
+
+} // namespace
+
 /* top level kernel page tables, initialized in start.S */
 volatile pt_entry_t pml4[NO_OF_PT_ENTRIES] __ALIGNED(PAGE_SIZE);
 volatile pt_entry_t pdp[NO_OF_PT_ENTRIES] __ALIGNED(PAGE_SIZE); /* temporary */
@@ -50,6 +80,12 @@ volatile pt_entry_t linear_map_pdp[(64ULL * GB) / (2 * MB)] __ALIGNED(PAGE_SIZE)
 /* kernel base top level page table in physical space */
 static const paddr_t kernel_pt_phys = (vaddr_t)KERNEL_PT - KERNEL_BASE + KERNEL_LOAD_OFFSET;
 
+KCOUNTER(tlb_shootdowns, "kernel.mmu.tlb_shootdown");
+KCOUNTER(tlb_shootdown_pages, "kernel.mmu.tlb_shootdown_pages");
+KCOUNTER(tlb_full_shootdowns, "kernel.mmu.tlb_full_shootdown");
+KCOUNTER(pcid_switch_noflush, "kernel.mmu.pcid_switch_noflush");
+KCOUNTER(pcid_switch_flush, "kernel.mmu.pcid_switch_flush");
+
 /* valid EPT MMU flags */
 static const uint kValidEptFlags =
     ARCH_MMU_FLAG_PERM_READ | ARCH_MMU_FLAG_PERM_WRITE | ARCH_MMU_FLAG_PERM_EXECUTE;
@@ -106,66 +142,128 @@ static bool x86_mmu_check_paddr(paddr_t paddr) {
 }
 
 /**
- * @brief  invalidate all TLB entries, including global entries
+ * @brief  invalidate all TLB entries and paging-structure caches for every PCID
  */
-static void x86_tlb_global_invalidate() {
-    /* See Intel 3A section 4.10.4.1 */
-    ulong cr4 = x86_get_cr4();
-    if (likely(cr4 & X86_CR4_PGE)) {
-        x86_set_cr4(cr4 & ~X86_CR4_PGE);
-        x86_set_cr4(cr4);
+void x86_tlb_flush_all_contexts(void) {
+    /* invlpg and cr3 reloads only drop paging-structure caches for the
+     * current PCID.  INVPCID type 2 and any change to CR4.PGE act on all of
+     * them; see Intel 3A section 4.10.4.1. */
+    if (x86_feature_test(X86_FEATURE_INVPCID)) {
+        struct {
+            uint64_t pcid;
+            uint64_t addr;
+        } desc = {0, 0};
+        __asm__ volatile("invpcid %0, %1" ::"m"(desc), "r"(2ul) : "memory");
     } else {
-        x86_set_cr3(x86_get_cr3());
+        ulong cr4 = x86_get_cr4();
+        x86_set_cr4(cr4 ^ X86_CR4_PGE);
+        x86_set_cr4(cr4);
     }
 }
 
-/* Task used for invalidating a TLB entry on each CPU */
+/* Task used for invalidating a batch of TLB entries on each CPU */
 struct TlbInvalidatePage_context {
     ulong target_cr3;
-    vaddr_t vaddr;
-    enum PageTableLevel level;
-    bool global_page;
+    uint64_t target_pcid_ctx_id;
+    const PendingTlbInvalidation* pending;
 };
 static void TlbInvalidatePage_task(void* raw_context) {
     DEBUG_ASSERT(arch_ints_disabled());
     TlbInvalidatePage_context* context = (TlbInvalidatePage_context*)raw_context;
 
     ulong cr3 = x86_get_cr3();
-    if (context->target_cr3 != cr3 && !context->global_page) {
-        /* This invalidation doesn't apply to this CPU, ignore it */
+    if (context->target_cr3 != (cr3 & X86_CR3_BASE_MASK)) {
+        /* The target aspace may still have translations cached under its
+         * PCID on this CPU; make sure they get flushed when it next runs
+         * here.  invlpg only acts on the current PCID. */
+        if (use_pcid && context->target_pcid_ctx_id != 0) {
+            PcidState* state = &pcid_state[arch_curr_cpu_num()];
+            for (uint16_t i = 0; i < kNumPcids; ++i) {
+                if (state->slots[i].ctx_id == context->target_pcid_ctx_id) {
+                    state->slots[i].tlb_generation = 0;
+                }
+            }
+        }
+        if (!context->pending->contains_global) {
+            /* This invalidation doesn't apply to this CPU, ignore it */
+            return;
+        }
+    }
+
+    /* Kernel page tables are shared by every aspace, so paging-structure
+     * caches for other PCIDs on this CPU may still point through a kernel
+     * entry that was changed or a kernel page table that was freed. */
+    if (use_pcid && context->pending->contains_global) {
+        for (size_t i = 0; i < context->pending->count; ++i) {
+            const auto& item = context->pending->item[i];
+            if (item.is_global && !item.is_terminal) {
+                x86_tlb_flush_all_contexts();
+                return;
+            }
+        }
+    }
+
+    if (context->pending->full_shootdown) {
+        if (context->pending->contains_global) {
+            x86_tlb_flush_all_contexts();
+        } else {
+            /* Reloading cr3 drops all non-global entries for the current
+             * PCID (the read value never has X86_CR3_NOFLUSH set) */
+            x86_set_cr3(cr3);
+        }
         return;
     }
 
-    switch (context->level) {
-    case PML4_L:
-        x86_tlb_global_invalidate();
-        break;
-    case PDP_L:
-    case PD_L:
-    case PT_L:
-        __asm__ volatile("invlpg %0" ::"m"(*(uint8_t*)context->vaddr));
-        break;
+    for (size_t i = 0; i < context->pending->count; ++i) {
+        const auto& item = context->pending->item[i];
+        switch (item.page_level) {
+        case PML4_L:
+            panic("PML4_L invld found; should not be here\n");
+        case PDP_L:
+        case PD_L:
+        case PT_L:
+            if (context->target_cr3 != (cr3 & X86_CR3_BASE_MASK) && !item.is_global) {
+                /* This entry belongs to a different address space */
+                continue;
+            }
+            __asm__ volatile("invlpg %0" ::"m"(*(uint8_t*)item.addr));
+            break;
+        }
     }
 }
 
 /**
- * @brief Invalidate a single page at a given page table level
+ * @brief Execute a queued TLB invalidation
  *
  * @param pt The page table we're invalidating for (if nullptr, assume for current one)
- * @param vaddr The virtual address we are invalidating the TLB entry for
- * @param level The page table level that maps this vaddr
- * @param global_page True if we are invalidating a global mapping
+ * @param pending The planned invalidation
  *
- * TODO(ZX-979): Optimize this.  This is horribly inefficient.
- * We should also change this to pool invalidations from a single
- * "transaction" and then only execute a single mp_sync_exec for that
- * transaction, rather than one per page.
+ * All pages in |pending| are shot down with a single mp_sync_exec, or with a
+ * full flush of the target CPUs' TLBs if the batch overflowed.
  */
-static void x86_tlb_invalidate_page(X86PageTableBase* pt, vaddr_t vaddr,
-                                    enum PageTableLevel level, bool global_page) {
-    ulong cr3 = pt ? pt->phys() : x86_get_cr3();
+static void x86_tlb_invalidate(X86PageTableBase* pt, PendingTlbInvalidation* pending) {
+    if (pending->count == 0 && !pending->full_shootdown) {
+        return;
+    }
+
+    kcounter_add(tlb_shootdowns, 1u);
+    if (pending->full_shootdown) {
+        kcounter_add(tlb_full_shootdowns, 1u);
+    } else {
+        kcounter_add(tlb_shootdown_pages, pending->count);
+    }
+
+    ulong cr3 = pt ? pt->phys() : (x86_get_cr3() & X86_CR3_BASE_MASK);
+    uint64_t pcid_ctx_id = 0;
+    if (pt != nullptr) {
+        X86ArchVmAspace* aspace = static_cast<X86ArchVmAspace*>(pt->ctx());
+        pcid_ctx_id = aspace->pcid_ctx_id();
+        /* Must happen before active_cpus() is sampled below; see
+         * X86ArchVmAspace::ContextSwitch. */
+        aspace->IncrementTlbGeneration();
+    }
     struct TlbInvalidatePage_context task_context = {
-        .target_cr3 = cr3, .vaddr = vaddr, .level = level, .global_page = global_page,
+        .target_cr3 = cr3, .target_pcid_ctx_id = pcid_ctx_id, .pending = pending,
     };
 
     /* Target only CPUs this aspace is active on.  It may be the case that some
@@ -174,8 +272,8 @@ static void x86_tlb_invalidate_page(X86PageTableBase* pt, vaddr_t vaddr,
      * the write to the page table, so it will see the change.  In the latter
      * case, it will get a spurious request to flush. */
     mp_ipi_target_t target;
-    cpu_mask_t target_mask = 0;
-    if (global_page || pt == nullptr) {
+    cpu_mask_t target_mask = cpu_mask_none();
+    if (pending->contains_global || pt == nullptr) {
         target = MP_IPI_TARGET_ALL;
     } else {
         target = MP_IPI_TARGET_MASK;
@@ -183,6 +281,7 @@ static void x86_tlb_invalidate_page(X86PageTableBase* pt, vaddr_t vaddr,
     }
 
     mp_sync_exec(target, target_mask, TlbInvalidatePage_task, &task_context);
+    pending->clear();
 }
 
 bool X86PageTableMmu::check_paddr(paddr_t paddr) {
@@ -282,9 +381,8 @@ X86PageTableBase::PtFlags X86PageTableMmu::split_flags(PageTableLevel level,
     return flags;
 }
 
-void X86PageTableMmu::TlbInvalidatePage(PageTableLevel level, vaddr_t vaddr, bool global_page,
-                                        bool was_terminal) {
-    x86_tlb_invalidate_page(this, vaddr, level, global_page);
+void X86PageTableMmu::TlbInvalidate(PendingTlbInvalidation* pending) {
+    x86_tlb_invalidate(this, pending);
 }
 
 uint X86PageTableMmu::pt_flags_to_mmu_flags(PtFlags flags, PageTableLevel level) {
@@ -392,9 +490,9 @@ X86PageTableBase::PtFlags X86PageTableEpt::split_flags(PageTableLevel level,
     return flags;
 }
 
-void X86PageTableEpt::TlbInvalidatePage(PageTableLevel level, vaddr_t vaddr, bool global_page,
-                                        bool was_terminal) {
+void X86PageTableEpt::TlbInvalidate(PendingTlbInvalidation* pending) {
     // TODO(ZX-981): Implement this.
+    pending->clear();
 }
 
 uint X86PageTableEpt::pt_flags_to_mmu_flags(PtFlags flags, PageTableLevel level) {
@@ -420,7 +518,11 @@ void x86_mmu_early_init() {
 
     // Unmap the lower identity mapping.
     pml4[0] = 0;
-    x86_tlb_invalidate_page(nullptr, 0, PML4_L, false);
+    // Treat this as a global invalidation so every CPU drops all of its
+    // cached translations, including the paging-structure caches.
+    PendingTlbInvalidation tlb;
+    tlb.enqueue(0, PML4_L, /* global */ true, /* terminal */ false);
+    x86_tlb_invalidate(nullptr, &tlb);
 
     /* get the address width from the CPU */
     uint8_t vaddr_width = x86_linear_address_width();
@@ -491,7 +593,6 @@ X86ArchVmAspace::X86ArchVmAspace() {}
  * Fill in the high level x86 arch aspace structure and allocating a top level page table.
  */
 zx_status_t X86ArchVmAspace::Init(vaddr_t base, size_t size, uint mmu_flags) {
-    static_assert(sizeof(cpu_mask_t) == sizeof(active_cpus_), "err");
     canary_.Assert();
 
     LTRACEF("aspace %p, base %#" PRIxPTR ", size 0x%zx, mmu_flags 0x%x\n", this, base, size,
@@ -532,16 +633,18 @@ zx_status_t X86ArchVmAspace::Init(vaddr_t base, size_t size, uint mmu_flags) {
             return status;
         }
 
+        pcid_ctx_id_ = next_pcid_ctx_id.fetch_add(1);
+
         LTRACEF("user aspace: pt phys %#" PRIxPTR ", virt %p\n", pt_->phys(), pt_->virt());
     }
-    fbl::atomic_init(&active_cpus_, 0);
+    active_cpus_ = cpu_mask_none();
 
     return ZX_OK;
 }
 
 zx_status_t X86ArchVmAspace::Destroy() {
     canary_.Assert();
-    DEBUG_ASSERT(active_cpus_.load() == 0);
+    DEBUG_ASSERT(cpu_mask_is_empty(active_cpus()));
 
     if (flags_ & ARCH_ASPACE_FLAG_GUEST) {
         static_cast<X86PageTableEpt*>(pt_)->Destroy(base_, size_);
@@ -581,23 +684,66 @@ zx_status_t X86ArchVmAspace::Protect(vaddr_t vaddr, size_t count, uint mmu_flags
     return pt_->ProtectPages(vaddr, count, mmu_flags);
 }
 
+/*
+ * Compute the cr3 value to use for |aspace| on |cpu|, assigning it one of the
+ * CPU's PCIDs if it doesn't already own one.  The no-flush bit is set only if
+ * this CPU has not missed any invalidations of the aspace since it last ran
+ * it.
+ */
+static ulong x86_pcid_cr3(X86ArchVmAspace* aspace, cpu_num_t cpu) {
+    paddr_t phys = aspace->pt_phys();
+    uint64_t ctx_id = aspace->pcid_ctx_id();
+    if (!use_pcid || ctx_id == 0) {
+        return phys;
+    }
+
+    PcidState* state = &pcid_state[cpu];
+    uint64_t generation = aspace->tlb_generation();
+    for (uint16_t i = 0; i < kNumPcids; ++i) {
+        PcidSlot* slot = &state->slots[i];
+        if (slot->ctx_id != ctx_id) {
+            continue;
+        }
+        if (slot->tlb_generation == generation) {
+            kcounter_add(pcid_switch_noflush, 1u);
+            return phys | (i + 1) | X86_CR3_NOFLUSH;
+        }
+        slot->tlb_generation = generation;
+        kcounter_add(pcid_switch_flush, 1u);
+        return phys | (i + 1);
+    }
+
+    // Evict the next slot.  Loading cr3 without the no-flush bit discards
+    // whatever the previous owner left behind under this PCID.
+    uint16_t i = state->next_victim;
+    state->next_victim = static_cast<uint16_t>((i + 1) % kNumPcids);
+    state->slots[i].ctx_id = ctx_id;
+    state->slots[i].tlb_generation = generation;
+    kcounter_add(pcid_switch_flush, 1u);
+    return phys | (i + 1);
+}
+
 void X86ArchVmAspace::ContextSwitch(X86ArchVmAspace* old_aspace, X86ArchVmAspace* aspace) {
-    cpu_mask_t cpu_bit = cpu_num_to_mask(arch_curr_cpu_num());
+    cpu_num_t cpu = arch_curr_cpu_num();
     if (aspace != nullptr) {
         aspace->canary_.Assert();
-        paddr_t phys = aspace->pt_phys();
-        LTRACEF_LEVEL(3, "switching to aspace %p, pt %#" PRIXPTR "\n", aspace, phys);
-        x86_set_cr3(phys);
+        // Become active before sampling the aspace's TLB generation.  Any
+        // invalidation that bumps the generation after we read it is
+        // guaranteed to see us in active_cpus_ and shoot us down directly.
+        cpu_mask_atomic_add(&aspace->active_cpus_, cpu);
+
+        ulong cr3 = x86_pcid_cr3(aspace, cpu);
+        LTRACEF_LEVEL(3, "switching to aspace %p, cr3 %#" PRIxPTR "\n", aspace, cr3);
+        x86_set_cr3(cr3);
 
         if (old_aspace != nullptr) {
-            old_aspace->active_cpus_.fetch_and(~cpu_bit);
+            cpu_mask_atomic_remove(&old_aspace->active_cpus_, cpu);
         }
-        aspace->active_cpus_.fetch_or(cpu_bit);
     } else {
         LTRACEF_LEVEL(3, "switching to kernel aspace, pt %#" PRIxPTR "\n", kernel_pt_phys);
         x86_set_cr3(kernel_pt_phys);
         if (old_aspace != nullptr) {
-            old_aspace->active_cpus_.fetch_and(~cpu_bit);
+            cpu_mask_atomic_remove(&old_aspace->active_cpus_, cpu);
         }
     }
 
@@ -631,6 +777,13 @@ void x86_mmu_percpu_init(void) {
         cr4 |= X86_CR4_SMEP;
     if (x86_feature_test(X86_FEATURE_SMAP))
         cr4 |= X86_CR4_SMAP;
+    /* PCIDE may only be turned on while CR3[11:0] is zero, which is the case
+     * this early since we're still running on the kernel page tables. */
+    if (x86_feature_test(X86_FEATURE_PCID)) {
+        DEBUG_ASSERT((x86_get_cr3() & X86_CR3_PCID_MASK) == 0);
+        cr4 |= X86_CR4_PCIDE;
+        use_pcid = true;
+    }
     x86_set_cr4(cr4);
 
     // Set NXE bit in X86_MSR_IA32_EFER.
@@ -79,9 +79,10 @@ static struct mtrrs* target_mtrrs = &THE_MTRRS;
 /* Function called by all CPUs to setup their PAT */
 static void x86_pat_sync_task(void* context);
 struct pat_sync_task_context {
-    /* Barrier counters for the two barriers described in Intel's algorithm */
-    volatile int barrier1;
-    volatile int barrier2;
+    /* Barrier masks for the two barriers described in Intel's algorithm,
+     * only accessed with the cpu_mask_atomic_* routines */
+    cpu_mask_t barrier1;
+    cpu_mask_t barrier2;
 };
 
 void x86_mmu_mem_type_init(void) {
@@ -105,7 +106,7 @@ void x86_mmu_mem_type_init(void) {
 
     /* Update the PAT on the bootstrap processor (and sync any changes to the
      * MTRR that may have been made above). */
-    x86_pat_sync(1 << 0);
+    x86_pat_sync(cpu_num_to_mask(0));
 }
 
 /* @brief Give the specificed CPUs our Page Attribute Tables and
@@ -119,11 +120,11 @@ void x86_mmu_mem_type_init(void) {
  * This algorithm is based on section 11.11.8 of Intel 3A
  */
 void x86_pat_sync(cpu_mask_t targets) {
-    targets &= mp_get_online_mask();
+    targets = cpu_mask_and(targets, mp_get_online_mask());
 
     struct pat_sync_task_context context = {
-        .barrier1 = (int)targets,
-        .barrier2 = (int)targets,
+        .barrier1 = targets,
+        .barrier2 = targets,
     };
     /* Step 1: Broadcast to all processors to execute the sequence */
     mp_sync_exec(MP_IPI_TARGET_MASK, targets, x86_pat_sync_task, &context);
@@ -138,8 +139,8 @@ static void x86_pat_sync_task(void* raw_context) {
     uint cpu = arch_curr_cpu_num();
 
     /* Step 3: Wait for all processors to reach this point. */
-    atomic_and(&context->barrier1, ~(1 << cpu));
-    while (context->barrier1 != 0) {
+    cpu_mask_atomic_remove(&context->barrier1, cpu);
+    while (!cpu_mask_is_empty(cpu_mask_atomic_load(&context->barrier1))) {
         arch_spinloop_pause();
     }
 
@@ -160,9 +161,10 @@ static void x86_pat_sync_task(void* raw_context) {
     cr4 &= ~X86_CR4_PGE;
     x86_set_cr4(cr4);
 
-    /* Step 7: If the PGE flag wasn't set, flush the TLB via CR3 */
+    /* Step 7: If the PGE flag wasn't set, flush the TLB.  A cr3 reload
+     * would only flush the current PCID. */
     if (!pge_was_set) {
-        x86_set_cr3(x86_get_cr3());
+        x86_tlb_flush_all_contexts();
     }
 
     /* Step 8: Disable MTRRs */
@@ -208,7 +210,7 @@ static void x86_pat_sync_task(void* raw_context) {
     /* Step 11: Flush all cache and the TLB again */
     __asm volatile("wbinvd" ::
                        : "memory");
-    x86_set_cr3(x86_get_cr3());
+    x86_tlb_flush_all_contexts();
 
     /* Step 12: Enter the normal cache mode */
     cr0 = x86_get_cr0();
@@ -223,8 +225,8 @@ static void x86_pat_sync_task(void* raw_context) {
     }
 
     /* Step 14: Wait for all processors to reach this point. */
-    atomic_and(&context->barrier2, ~(1 << cpu));
-    while (context->barrier2 != 0) {
+    cpu_mask_atomic_remove(&context->barrier2, cpu);
+    while (!cpu_mask_is_empty(cpu_mask_atomic_load(&context->barrier2))) {
         arch_spinloop_pause();
     }
 }
@@ -296,7 +298,7 @@ static int cmd_memtype(int argc, const cmd_args* argv, uint32_t flags) {
         uint num_cpus = arch_max_num_cpus();
         for (uint i = 0; i < num_cpus; ++i) {
             printf("CPU %u Page Attribute Table types:\n", i);
-            mp_sync_exec(MP_IPI_TARGET_MASK, 1u << i, print_pat_entries, nullptr);
+            mp_sync_exec(MP_IPI_TARGET_MASK, cpu_num_to_mask(i), print_pat_entries, nullptr);
         }
     } else {
         printf("unknown command\n");
@@ -57,6 +57,7 @@ zx_status_t x86_allocate_ap_structures(uint32_t* apic_ids, uint8_t cpu_count) {
 
     uint32_t bootstrap_ap = apic_local_id();
     DEBUG_ASSERT(bootstrap_ap == apic_bsp_id());
+    x86_cpu_topology_register(0, bootstrap_ap);
 
     uint apic_idx = 0;
     for (uint i = 0; i < cpu_count; ++i) {
@@ -71,6 +72,7 @@ zx_status_t x86_allocate_ap_structures(uint32_t* apic_ids, uint8_t cpu_count) {
         ap_percpus[apic_idx].cpu_num = apic_idx + 1;
         ap_percpus[apic_idx].apic_id = apic_ids[i];
         ap_percpus[apic_idx].direct = &ap_percpus[apic_idx];
+        x86_cpu_topology_register(apic_idx + 1, apic_ids[i]);
         apic_idx++;
     }
 
@@ -223,30 +225,26 @@ zx_status_t arch_mp_send_ipi(mp_ipi_target_t target, cpu_mask_t mask, mp_ipi_t i
         return ZX_OK;
     }
 
-    ASSERT(x86_num_cpus <= sizeof(mask) * CHAR_BIT);
-
-    cpu_mask_t remaining = mask;
-    uint cpu_id = 0;
-    while (remaining && cpu_id < x86_num_cpus) {
-        if (remaining & 1) {
-            struct x86_percpu* percpu;
-            if (cpu_id == 0) {
-                percpu = &bp_percpu;
-            } else {
-                percpu = &ap_percpus[cpu_id - 1];
-            }
-            /* Reschedule IPIs may occur before all CPUs are fully up.  Just
-             * ignore attempts to send them to down CPUs. */
-            if (ipi != MP_IPI_RESCHEDULE) {
-                DEBUG_ASSERT(percpu->apic_id != INVALID_APIC_ID);
-            }
-            /* Make sure the CPU is actually up before sending the IPI */
-            if (percpu->apic_id != INVALID_APIC_ID) {
-                apic_send_ipi(vector, (uint8_t)percpu->apic_id, DELIVERY_MODE_FIXED);
-            }
+    cpu_num_t cpu_id;
+    cpu_mask_for_each(cpu_id, mask) {
+        if (cpu_id >= x86_num_cpus) {
+            break;
+        }
+        struct x86_percpu* percpu;
+        if (cpu_id == 0) {
+            percpu = &bp_percpu;
+        } else {
+            percpu = &ap_percpus[cpu_id - 1];
+        }
+        /* Reschedule IPIs may occur before all CPUs are fully up.  Just
+         * ignore attempts to send them to down CPUs. */
+        if (ipi != MP_IPI_RESCHEDULE) {
+            DEBUG_ASSERT(percpu->apic_id != INVALID_APIC_ID);
+        }
+        /* Make sure the CPU is actually up before sending the IPI */
+        if (percpu->apic_id != INVALID_APIC_ID) {
+            apic_send_ipi(vector, percpu->apic_id, DELIVERY_MODE_FIXED);
         }
-        remaining >>= 1;
-        cpu_id++;
     }
 
     return ZX_OK;
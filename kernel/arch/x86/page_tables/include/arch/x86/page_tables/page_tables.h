@@ -20,6 +20,44 @@ enum PageTableLevel {
     PML4_L,
 };
 
+// Structure for tracking an upcoming TLB invalidation.  Page table updates
+// enqueue the addresses they touched into one of these, and the owning
+// operation issues a single shootdown for the whole batch once the page
+// table lock work is done.
+struct PendingTlbInvalidation {
+    struct Item {
+        vaddr_t addr;
+        uint8_t page_level;
+        bool is_global;
+        bool is_terminal;
+    };
+
+    // If more than this many pages are queued, fall back to invalidating the
+    // entire TLB instead of issuing individual invlpgs.
+    static constexpr size_t kMaxPages = 32;
+
+    ~PendingTlbInvalidation();
+
+    // Add address |v|, translated at depth |level|, to the set of addresses to
+    // be invalidated.  |is_terminal| should be true iff this invalidation is
+    // targeting the final step of the translation rather than a higher page
+    // table entry.  |is_global_page| should be true iff this page was mapped
+    // with the global bit set.
+    void enqueue(vaddr_t v, PageTableLevel level, bool is_global_page, bool is_terminal);
+
+    // Clear the list of pending invalidations.
+    void clear();
+
+    // Number of valid entries in |item|.
+    size_t count = 0;
+    // If true, ignore |item| and perform a full invalidation for this context.
+    bool full_shootdown = false;
+    // If true, at least one enqueued entry was for a global page.
+    bool contains_global = false;
+
+    Item item[kMaxPages];
+};
+
 class X86PageTableBase {
 public:
     X86PageTableBase();
@@ -74,9 +112,8 @@ protected:
     // Return the hardware flags to use on smaller pages after a splitting a
     // large page with flags |flags|.
     virtual PtFlags split_flags(PageTableLevel level, PtFlags flags) = 0;
-    // Invalidate a single page at the given level
-    virtual void TlbInvalidatePage(PageTableLevel level, vaddr_t vaddr, bool global_page,
-                                   bool was_terminal) = 0;
+    // Invalidate all TLB entries named in |pending| and clear it.
+    virtual void TlbInvalidate(PendingTlbInvalidation* pending) = 0;
     // Convert PtFlags to ARCH_MMU_* flags.
     virtual uint pt_flags_to_mmu_flags(PtFlags flags, PageTableLevel level) = 0;
     // Returns true if a cache flush is necessary for pagetable changes to be
@@ -102,24 +139,30 @@ private:
 
     zx_status_t AddMapping(volatile pt_entry_t* table, uint mmu_flags,
                            PageTableLevel level, const MappingCursor& start_cursor,
-                           MappingCursor* new_cursor) TA_REQ(lock_);
+                           MappingCursor* new_cursor,
+                           PendingTlbInvalidation* pending) TA_REQ(lock_);
     zx_status_t AddMappingL0(volatile pt_entry_t* table, uint mmu_flags,
                              const MappingCursor& start_cursor,
-                             MappingCursor* new_cursor) TA_REQ(lock_);
+                             MappingCursor* new_cursor,
+                             PendingTlbInvalidation* pending) TA_REQ(lock_);
 
     bool RemoveMapping(volatile pt_entry_t* table,
                        PageTableLevel level, const MappingCursor& start_cursor,
-                       MappingCursor* new_cursor, list_node* to_free) TA_REQ(lock_);
+                       MappingCursor* new_cursor, list_node* to_free,
+                       PendingTlbInvalidation* pending) TA_REQ(lock_);
     bool RemoveMappingL0(volatile pt_entry_t* table,
                          const MappingCursor& start_cursor,
-                         MappingCursor* new_cursor) TA_REQ(lock_);
+                         MappingCursor* new_cursor,
+                         PendingTlbInvalidation* pending) TA_REQ(lock_);
 
     zx_status_t UpdateMapping(volatile pt_entry_t* table, uint mmu_flags,
                               PageTableLevel level, const MappingCursor& start_cursor,
-                              MappingCursor* new_cursor, list_node* to_free) TA_REQ(lock_);
+                              MappingCursor* new_cursor, list_node* to_free,
+                              PendingTlbInvalidation* pending) TA_REQ(lock_);
     zx_status_t UpdateMappingL0(volatile pt_entry_t* table, uint mmu_flags,
                                 const MappingCursor& start_cursor,
-                                MappingCursor* new_cursor) TA_REQ(lock_);
+                                MappingCursor* new_cursor,
+                                PendingTlbInvalidation* pending) TA_REQ(lock_);
 
     zx_status_t GetMapping(volatile pt_entry_t* table, vaddr_t vaddr,
                            PageTableLevel level,
@@ -130,12 +173,13 @@ private:
                              volatile pt_entry_t** mapping) TA_REQ(lock_);
 
     zx_status_t SplitLargePage(PageTableLevel level, vaddr_t vaddr,
-                               volatile pt_entry_t* pte, list_node* to_free) TA_REQ(lock_);
+                               volatile pt_entry_t* pte, list_node* to_free,
+                               PendingTlbInvalidation* pending) TA_REQ(lock_);
 
-    void UpdateEntry(CacheLineFlusher* flusher,
+    void UpdateEntry(CacheLineFlusher* flusher, PendingTlbInvalidation* pending,
                      PageTableLevel level, vaddr_t vaddr, volatile pt_entry_t* pte,
                      paddr_t paddr, PtFlags flags, bool was_terminal) TA_REQ(lock_);
-    void UnmapEntry(CacheLineFlusher* flusher,
+    void UnmapEntry(CacheLineFlusher* flusher, PendingTlbInvalidation* pending,
                     PageTableLevel level, vaddr_t vaddr, volatile pt_entry_t* pte,
                     bool was_terminal) TA_REQ(lock_);
 
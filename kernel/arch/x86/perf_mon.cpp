@@ -1509,7 +1509,7 @@ zx_status_t x86_ipm_start() {
     }
 
     ktrace(TAG_IPM_START, 0, 0, 0, 0);
-    mp_sync_exec(MP_IPI_TARGET_ALL, 0, x86_ipm_start_cpu_task, state);
+    mp_sync_exec(MP_IPI_TARGET_ALL, cpu_mask_none(), x86_ipm_start_cpu_task, state);
     atomic_store(&perfmon_active, true);
     return ZX_OK;
 }
@@ -1646,7 +1646,7 @@ zx_status_t x86_ipm_stop() {
     // multiple stops and still read register values.
 
     auto state = perfmon_state.get();
-    mp_sync_exec(MP_IPI_TARGET_ALL, 0, x86_ipm_stop_cpu_task, state);
+    mp_sync_exec(MP_IPI_TARGET_ALL, cpu_mask_none(), x86_ipm_stop_cpu_task, state);
     ktrace(TAG_IPM_STOP, 0, 0, 0, 0);
 
     // x86_ipm_start currently maps the buffers in, so we unmap them here.
@@ -1693,7 +1693,7 @@ zx_status_t x86_ipm_fini() {
     if (atomic_load(&perfmon_active))
         return ZX_ERR_BAD_STATE;
 
-    mp_sync_exec(MP_IPI_TARGET_ALL, 0, x86_ipm_reset_task, nullptr);
+    mp_sync_exec(MP_IPI_TARGET_ALL, cpu_mask_none(), x86_ipm_reset_task, nullptr);
 
     perfmon_state.reset();
 
@@ -1733,7 +1733,8 @@ static bool pmi_interrupt_handler(x86_iframe_t *frame, PerfmonState* state) {
 
     const uint64_t status = read_msr(IA32_PERF_GLOBAL_STATUS);
     uint64_t bits_to_clear = 0;
-    uint64_t cr3 = x86_get_cr3();
+    // Strip the PCID so records from one aspace all carry the same value.
+    uint64_t cr3 = x86_get_cr3() & X86_CR3_BASE_MASK;
 
     LTRACEF("cpu %u: status 0x%" PRIx64 "\n", cpu, status);
 
@@ -198,7 +198,7 @@ zx_status_t x86_ipt_alloc_trace(ipt_trace_mode_t mode) {
         return ZX_ERR_NOT_SUPPORTED;
     }
 
-    mp_sync_exec(MP_IPI_TARGET_ALL, 0, x86_ipt_set_mode_task,
+    mp_sync_exec(MP_IPI_TARGET_ALL, cpu_mask_none(), x86_ipt_set_mode_task,
                  reinterpret_cast<void*>(static_cast<uintptr_t>(mode)));
 
     trace_mode = mode;
@@ -288,7 +288,7 @@ zx_status_t x86_ipt_cpu_mode_start() {
            model_info->display_family, model_info->display_model,
            model_info->stepping);
 
-    mp_sync_exec(MP_IPI_TARGET_ALL, 0, x86_ipt_start_cpu_task, ipt_cpu_state);
+    mp_sync_exec(MP_IPI_TARGET_ALL, cpu_mask_none(), x86_ipt_start_cpu_task, ipt_cpu_state);
     return ZX_OK;
 }
 
@@ -339,7 +339,7 @@ zx_status_t x86_ipt_cpu_mode_stop() {
 
     TRACEF("Stopping processor trace\n");
 
-    mp_sync_exec(MP_IPI_TARGET_ALL, 0, x86_ipt_stop_cpu_task, ipt_cpu_state);
+    mp_sync_exec(MP_IPI_TARGET_ALL, cpu_mask_none(), x86_ipt_stop_cpu_task, ipt_cpu_state);
     ktrace(TAG_IPT_STOP, 0, 0, 0, 0);
     active = false;
 
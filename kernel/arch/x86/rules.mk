@@ -87,8 +87,10 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/smp.cpp \
 	$(LOCAL_DIR)/start16.S
 
-# default to 16 cpu max support
-SMP_MAX_CPUS ?= 16
+# default to 128 cpu max support. cpu masks are multi-word above 64 cpus;
+# configurations that never exceed 64 can set this lower to keep them to a
+# single word.
+SMP_MAX_CPUS ?= 128
 KERNEL_DEFINES += \
 	SMP_MAX_CPUS=$(SMP_MAX_CPUS)
 
@@ -35,7 +35,9 @@ void x86_init_smp(uint32_t* apic_ids, uint32_t num_cpus) {
 }
 
 zx_status_t x86_bringup_aps(uint32_t* apic_ids, uint32_t count) {
-    volatile int aps_still_booting = 0;
+    // Only accessed with the cpu_mask_atomic_* routines once the APs are
+    // started.
+    cpu_mask_t aps_still_booting = cpu_mask_none();
     zx_status_t status = ZX_ERR_INTERNAL;
 
     // if being asked to bring up 0 cpus, move on
@@ -53,7 +55,7 @@ zx_status_t x86_bringup_aps(uint32_t* apic_ids, uint32_t count) {
         if (mp_is_cpu_online(cpu)) {
             return ZX_ERR_BAD_STATE;
         }
-        aps_still_booting |= 1U << cpu;
+        cpu_mask_add(&aps_still_booting, cpu);
     }
 
     struct x86_ap_bootstrap_data* bootstrap_data = nullptr;
@@ -122,7 +124,7 @@ zx_status_t x86_bringup_aps(uint32_t* apic_ids, uint32_t count) {
             apic_send_ipi(vec, apic_id, DELIVERY_MODE_STARTUP);
         }
 
-        if (aps_still_booting == 0) {
+        if (cpu_mask_is_empty(cpu_mask_atomic_load(&aps_still_booting))) {
             break;
         }
         // Wait 1ms for cores to boot.  The docs recommend 200us between STARTUP
@@ -133,22 +135,22 @@ zx_status_t x86_bringup_aps(uint32_t* apic_ids, uint32_t count) {
     // The docs recommend waiting 200us for cores to boot.  We do a bit more
     // work before the cores report in, so wait longer (up to 1 second).
     for (int tries_left = 200;
-         aps_still_booting != 0 && tries_left > 0;
+         !cpu_mask_is_empty(cpu_mask_atomic_load(&aps_still_booting)) && tries_left > 0;
          --tries_left) {
 
         thread_sleep_relative(ZX_MSEC(5));
     }
 
-    uint failed_aps;
-    failed_aps = (uint)atomic_swap(&aps_still_booting, 0);
-    if (failed_aps != 0) {
-        printf("Failed to boot CPUs: mask %x\n", failed_aps);
+    cpu_mask_t failed_aps;
+    failed_aps = cpu_mask_atomic_exchange(&aps_still_booting, cpu_mask_none());
+    if (!cpu_mask_is_empty(failed_aps)) {
+        printf("Failed to boot %u CPUs\n", cpu_mask_count(failed_aps));
         for (uint i = 0; i < count; ++i) {
             int cpu = x86_apic_id_to_cpu_num(apic_ids[i]);
-            uint mask = 1U << cpu;
-            if ((failed_aps & mask) == 0) {
+            if (!cpu_mask_contains(failed_aps, cpu)) {
                 continue;
             }
+            printf("Failed to boot CPU %d (apic id %#x)\n", cpu, apic_ids[i]);
 
             // Shut the failed AP down
             apic_send_ipi(0, apic_ids[i], DELIVERY_MODE_INIT);
@@ -158,15 +160,15 @@ zx_status_t x86_bringup_aps(uint32_t* apic_ids, uint32_t count) {
             ASSERT(!mp_is_cpu_active(cpu));
 
             // Make sure the CPU is not marked online
-            atomic_and((volatile int*)&mp.online_cpus, ~mask);
+            cpu_mask_atomic_remove(&mp.online_cpus, cpu);
 
             // Free the failed AP's thread, it was cancelled before it could use
             // it.
             free((void*)bootstrap_data->per_cpu[i].thread);
 
-            failed_aps &= ~mask;
+            cpu_mask_remove(&failed_aps, cpu);
         }
-        DEBUG_ASSERT(failed_aps == 0);
+        DEBUG_ASSERT(cpu_mask_is_empty(failed_aps));
 
         status = ZX_ERR_TIMED_OUT;
 
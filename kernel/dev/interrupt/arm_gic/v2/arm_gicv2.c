@@ -287,11 +287,11 @@ static enum handler_return gic_handle_fiq(struct iframe* frame) {
 static zx_status_t gic_send_ipi(cpu_mask_t target, mp_ipi_t ipi) {
     uint gic_ipi_num = ipi + ipi_base;
 
-    /* filter out targets outside of the range of cpus we care about */
-    target &= ((1UL << SMP_MAX_CPUS) - 1);
-    if (target != 0) {
-        LTRACEF("target 0x%x, gic_ipi %u\n", target, gic_ipi_num);
-        arm_gic_sgi(gic_ipi_num, ARM_GIC_SGI_FLAG_NS, target);
+    /* the GICv2 target list can only address the first 8 cpus */
+    u_int target_list = (u_int)(target.words[0] & 0xff);
+    if (target_list != 0) {
+        LTRACEF("target 0x%x, gic_ipi %u\n", target_list, gic_ipi_num);
+        arm_gic_sgi(gic_ipi_num, ARM_GIC_SGI_FLAG_NS, target_list);
     }
 
     return ZX_OK;
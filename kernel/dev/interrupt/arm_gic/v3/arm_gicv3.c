@@ -162,7 +162,7 @@ static zx_status_t gic_init(void) {
     return ZX_OK;
 }
 
-static zx_status_t arm_gic_sgi(u_int irq, u_int flags, u_int cpu_mask) {
+static zx_status_t arm_gic_sgi(u_int irq, u_int flags, cpu_mask_t cpu_mask) {
     if (flags != ARM_GIC_SGI_FLAG_NS) {
         return ZX_ERR_INVALID_ARGS;
     }
@@ -176,12 +176,12 @@ static zx_status_t arm_gic_sgi(u_int irq, u_int flags, u_int cpu_mask) {
     uint cpu = 0;
     uint cluster = 0;
     uint64_t val = 0;
-    while (cpu_mask && cpu < arch_max_num_cpus()) {
+    while (!cpu_mask_is_empty(cpu_mask) && cpu < arch_max_num_cpus()) {
         u_int mask = 0;
-        while (arch_cpu_num_to_cluster_id(cpu) == cluster) {
-            if (cpu_mask & (1u << cpu)) {
+        while (cpu < arch_max_num_cpus() && arch_cpu_num_to_cluster_id(cpu) == cluster) {
+            if (cpu_mask_contains(cpu_mask, cpu)) {
                 mask |= 1u << arch_cpu_num_to_cpu_id(cpu);
-                cpu_mask &= ~(1u << cpu);
+                cpu_mask_remove(&cpu_mask, cpu);
             }
             cpu += 1;
         }
@@ -316,9 +316,9 @@ static zx_status_t gic_send_ipi(cpu_mask_t target, mp_ipi_t ipi) {
     uint gic_ipi_num = ipi + ipi_base;
 
     /* filter out targets outside of the range of cpus we care about */
-    target &= (cpu_mask_t)(((1UL << arch_max_num_cpus()) - 1));
-    if (target != 0) {
-        LTRACEF("target 0x%x, gic_ipi %u\n", target, gic_ipi_num);
+    target = cpu_mask_and(target, cpu_mask_first_n(arch_max_num_cpus()));
+    if (!cpu_mask_is_empty(target)) {
+        LTRACEF("target %u cpus, gic_ipi %u\n", cpu_mask_count(target), gic_ipi_num);
         arm_gic_sgi(gic_ipi_num, ARM_GIC_SGI_FLAG_NS, target);
     }
 
@@ -7,39 +7,199 @@
 #pragma once
 
 #include <assert.h>
+#include <limits.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 // types and routines for dealing with lists of cpus and cpu masks
+//
+// A cpu_mask_t is a set of cpu numbers stored as an array of 64 bit words,
+// so SMP_MAX_CPUS is not limited by the width of an integer. When
+// SMP_MAX_CPUS <= 64 the array has a single element and every routine below
+// compiles down to the plain integer operation on that word. Masks are small
+// and are passed around by value.
 
-typedef uint32_t cpu_mask_t;
+typedef uint64_t cpu_mask_word_t;
 typedef uint32_t cpu_num_t;
 
-static_assert(SMP_MAX_CPUS <= sizeof(cpu_mask_t) * CHAR_BIT, "");
+#define CPU_MASK_WORD_BITS (sizeof(cpu_mask_word_t) * CHAR_BIT)
+#define CPU_MASK_WORDS ((SMP_MAX_CPUS + CPU_MASK_WORD_BITS - 1) / CPU_MASK_WORD_BITS)
+
+typedef struct cpu_mask {
+    cpu_mask_word_t words[CPU_MASK_WORDS];
+} cpu_mask_t;
+
+static_assert(SMP_MAX_CPUS <= CPU_MASK_WORDS * CPU_MASK_WORD_BITS, "");
 
 #define INVALID_CPU ((cpu_num_t)-1)
-#define CPU_MASK_ALL ((cpu_mask_t)-1)
 
 static inline bool is_valid_cpu_num(cpu_num_t num) {
     return (num < SMP_MAX_CPUS);
 }
 
+static inline cpu_mask_t cpu_mask_none(void) {
+    cpu_mask_t mask = {{0}};
+    return mask;
+}
+
+// the cpus 0 .. count - 1
+static inline cpu_mask_t cpu_mask_first_n(cpu_num_t count) {
+    cpu_mask_t mask = cpu_mask_none();
+    for (unsigned i = 0; i < CPU_MASK_WORDS && count > 0; i++) {
+        if (count >= CPU_MASK_WORD_BITS) {
+            mask.words[i] = ~(cpu_mask_word_t)0;
+            count -= (cpu_num_t)CPU_MASK_WORD_BITS;
+        } else {
+            mask.words[i] = ((cpu_mask_word_t)1u << count) - 1;
+            count = 0;
+        }
+    }
+    return mask;
+}
+
+// every cpu the kernel can manage
+static inline cpu_mask_t cpu_mask_all(void) {
+    return cpu_mask_first_n(SMP_MAX_CPUS);
+}
+
 static inline cpu_mask_t cpu_num_to_mask(cpu_num_t num) {
+    cpu_mask_t mask = cpu_mask_none();
     if (!is_valid_cpu_num(num))
-        return 0;
+        return mask;
 
-    return ((cpu_mask_t)1u << num);
+    mask.words[num / CPU_MASK_WORD_BITS] = (cpu_mask_word_t)1u << (num % CPU_MASK_WORD_BITS);
+    return mask;
 }
 
-static inline cpu_num_t highest_cpu_set(cpu_mask_t mask) {
-    if (mask == 0)
-        return 0;
+static inline bool cpu_mask_is_empty(cpu_mask_t mask) {
+    cpu_mask_word_t any = 0;
+    for (unsigned i = 0; i < CPU_MASK_WORDS; i++)
+        any |= mask.words[i];
+    return any == 0;
+}
+
+static inline bool cpu_mask_contains(cpu_mask_t mask, cpu_num_t num) {
+    if (!is_valid_cpu_num(num))
+        return false;
+
+    return (mask.words[num / CPU_MASK_WORD_BITS] >> (num % CPU_MASK_WORD_BITS)) & 1;
+}
+
+static inline void cpu_mask_add(cpu_mask_t* mask, cpu_num_t num) {
+    if (is_valid_cpu_num(num))
+        mask->words[num / CPU_MASK_WORD_BITS] |= (cpu_mask_word_t)1u << (num % CPU_MASK_WORD_BITS);
+}
+
+static inline void cpu_mask_remove(cpu_mask_t* mask, cpu_num_t num) {
+    if (is_valid_cpu_num(num))
+        mask->words[num / CPU_MASK_WORD_BITS] &= ~((cpu_mask_word_t)1u << (num % CPU_MASK_WORD_BITS));
+}
+
+static inline cpu_mask_t cpu_mask_or(cpu_mask_t a, cpu_mask_t b) {
+    for (unsigned i = 0; i < CPU_MASK_WORDS; i++)
+        a.words[i] |= b.words[i];
+    return a;
+}
+
+static inline cpu_mask_t cpu_mask_and(cpu_mask_t a, cpu_mask_t b) {
+    for (unsigned i = 0; i < CPU_MASK_WORDS; i++)
+        a.words[i] &= b.words[i];
+    return a;
+}
+
+// a & ~b
+static inline cpu_mask_t cpu_mask_andnot(cpu_mask_t a, cpu_mask_t b) {
+    for (unsigned i = 0; i < CPU_MASK_WORDS; i++)
+        a.words[i] &= ~b.words[i];
+    return a;
+}
+
+static inline bool cpu_mask_intersects(cpu_mask_t a, cpu_mask_t b) {
+    return !cpu_mask_is_empty(cpu_mask_and(a, b));
+}
+
+static inline bool cpu_mask_equal(cpu_mask_t a, cpu_mask_t b) {
+    cpu_mask_word_t diff = 0;
+    for (unsigned i = 0; i < CPU_MASK_WORDS; i++)
+        diff |= a.words[i] ^ b.words[i];
+    return diff == 0;
+}
+
+static inline uint32_t cpu_mask_count(cpu_mask_t mask) {
+    uint32_t count = 0;
+    for (unsigned i = 0; i < CPU_MASK_WORDS; i++)
+        count += (uint32_t)__builtin_popcountll(mask.words[i]);
+    return count;
+}
 
-    return (cpu_num_t)(sizeof(cpu_mask_t) * CHAR_BIT - 1) - __builtin_clz(mask);
+static inline cpu_num_t highest_cpu_set(cpu_mask_t mask) {
+    for (unsigned i = CPU_MASK_WORDS; i-- > 0;) {
+        if (mask.words[i] != 0)
+            return (cpu_num_t)(i * CPU_MASK_WORD_BITS + CPU_MASK_WORD_BITS - 1 -
+                               __builtin_clzll(mask.words[i]));
+    }
+    return 0;
 }
 
 static inline cpu_num_t lowest_cpu_set(cpu_mask_t mask) {
-    if (mask == 0)
-        return 0;
+    for (unsigned i = 0; i < CPU_MASK_WORDS; i++) {
+        if (mask.words[i] != 0)
+            return (cpu_num_t)(i * CPU_MASK_WORD_BITS + __builtin_ctzll(mask.words[i]));
+    }
+    return 0;
+}
+
+// lowest cpu in |mask| that is >= |num|, or INVALID_CPU if there is none
+static inline cpu_num_t next_cpu_set(cpu_mask_t mask, cpu_num_t num) {
+    if (!is_valid_cpu_num(num))
+        return INVALID_CPU;
+
+    unsigned i = num / CPU_MASK_WORD_BITS;
+    cpu_mask_word_t word = mask.words[i] & (~(cpu_mask_word_t)0 << (num % CPU_MASK_WORD_BITS));
+    for (;;) {
+        if (word != 0)
+            return (cpu_num_t)(i * CPU_MASK_WORD_BITS + __builtin_ctzll(word));
+        if (++i == CPU_MASK_WORDS)
+            return INVALID_CPU;
+        word = mask.words[i];
+    }
+}
+
+// iterate |cpu| over every cpu in |mask| in ascending order
+#define cpu_mask_for_each(cpu, mask)                     \
+    for ((cpu) = next_cpu_set((mask), 0);                \
+         (cpu) != INVALID_CPU;                           \
+         (cpu) = next_cpu_set((mask), (cpu) + 1))
+
+// Atomic accessors for masks shared between cpus. Each word is read or
+// modified atomically on its own; a mask spanning several words is not
+// observed as a single snapshot.
+static inline cpu_mask_t cpu_mask_atomic_load(const cpu_mask_t* mask) {
+    cpu_mask_t val;
+    for (unsigned i = 0; i < CPU_MASK_WORDS; i++)
+        val.words[i] = __atomic_load_n(&mask->words[i], __ATOMIC_SEQ_CST);
+    return val;
+}
+
+static inline cpu_mask_t cpu_mask_atomic_exchange(cpu_mask_t* mask, cpu_mask_t val) {
+    for (unsigned i = 0; i < CPU_MASK_WORDS; i++)
+        val.words[i] = __atomic_exchange_n(&mask->words[i], val.words[i], __ATOMIC_SEQ_CST);
+    return val;
+}
+
+// both return whether |num| was in the mask beforehand
+static inline bool cpu_mask_atomic_add(cpu_mask_t* mask, cpu_num_t num) {
+    if (!is_valid_cpu_num(num))
+        return false;
+
+    cpu_mask_word_t bit = (cpu_mask_word_t)1u << (num % CPU_MASK_WORD_BITS);
+    return __atomic_fetch_or(&mask->words[num / CPU_MASK_WORD_BITS], bit, __ATOMIC_SEQ_CST) & bit;
+}
+
+static inline bool cpu_mask_atomic_remove(cpu_mask_t* mask, cpu_num_t num) {
+    if (!is_valid_cpu_num(num))
+        return false;
 
-    return (cpu_num_t)(__builtin_ctz(mask));
+    cpu_mask_word_t bit = (cpu_mask_word_t)1u << (num % CPU_MASK_WORD_BITS);
+    return __atomic_fetch_and(&mask->words[num / CPU_MASK_WORD_BITS], ~bit, __ATOMIC_SEQ_CST) & bit;
 }
@@ -17,7 +17,6 @@
 
 __BEGIN_CDECLS
 
-typedef void (*mp_ipi_task_func_t)(void* context);
 typedef void (*mp_sync_task_t)(void* context);
 
 /* by default, mp_mbx_reschedule does not signal to cpus that are running realtime
@@ -61,32 +60,34 @@ enum handler_return mp_mbx_reschedule_irq(void);
 /* called from arch code during generic task irq */
 enum handler_return mp_mbx_generic_irq(void);
 
-/* represents a pending task for some number of CPUs to execute */
-struct mp_ipi_task {
-    struct list_node node;
-
-    mp_ipi_task_func_t func;
-    void* context;
-};
-
 /* global mp state to track what the cpus are up to */
 struct mp_state {
-    /* cpus that are currently online */
-    volatile cpu_mask_t online_cpus;
+    /* cpus that are currently online. only modified with the cpu_mask_atomic_*
+     * routines */
+    cpu_mask_t online_cpus;
     /* cpus that are currently schedulable */
-    volatile cpu_mask_t active_cpus;
+    cpu_mask_t active_cpus;
 
     /* only safely accessible with thread lock held */
     cpu_mask_t idle_cpus;
     cpu_mask_t realtime_cpus;
 
     spin_lock_t ipi_task_lock;
-    /* list of outstanding tasks for CPUs to execute.  Should only be
-     * accessed with the ipi_task_lock held */
-    struct list_node ipi_task_list[SMP_MAX_CPUS];
+    /* list of outstanding mp_sync_exec tasks, each carrying the mask of CPUs
+     * that have yet to run it.  Should only be accessed with the
+     * ipi_task_lock held */
+    struct list_node ipi_task_list;
+    /* CPUs that may have a task waiting on ipi_task_list.  Set and cleared
+     * atomically with the ipi_task_lock held, read without it */
+    cpu_mask_t ipi_task_pending;
 
     /* lock for serializing CPU hotplug/unplug operations */
     mutex_t hotplug_lock;
+
+    /* cpus sharing a core (smt siblings) or a package with each cpu, not including
+     * the cpu itself. written once per cpu as the platform discovers its topology */
+    cpu_mask_t core_siblings[SMP_MAX_CPUS];
+    cpu_mask_t package_siblings[SMP_MAX_CPUS];
 };
 
 extern struct mp_state mp;
@@ -94,16 +95,30 @@ extern struct mp_state mp;
 void mp_set_curr_cpu_online(bool online);
 void mp_set_curr_cpu_active(bool active);
 
-static inline int mp_is_cpu_active(cpu_num_t cpu) {
-    return atomic_load((int*)&mp.active_cpus) & cpu_num_to_mask(cpu);
+/* record where |cpu| sits in the cache hierarchy. cpus with the same package_id
+ * share a last level cache, cpus that also share a core_id share every level.
+ * called by the platform during boot, before the secondary cpus are started */
+void mp_set_cpu_topology(cpu_num_t cpu, uint32_t package_id, uint32_t core_id);
+
+/* cpus sharing a core or a package with |cpu|, always including |cpu| itself */
+static inline cpu_mask_t mp_get_core_siblings(cpu_num_t cpu) {
+    return cpu_mask_or(mp.core_siblings[cpu], cpu_num_to_mask(cpu));
+}
+
+static inline cpu_mask_t mp_get_package_siblings(cpu_num_t cpu) {
+    return cpu_mask_or(mp.package_siblings[cpu], cpu_num_to_mask(cpu));
+}
+
+static inline bool mp_is_cpu_active(cpu_num_t cpu) {
+    return cpu_mask_contains(cpu_mask_atomic_load(&mp.active_cpus), cpu);
 }
 
-static inline int mp_is_cpu_idle(cpu_num_t cpu) {
-    return mp.idle_cpus & cpu_num_to_mask(cpu);
+static inline bool mp_is_cpu_idle(cpu_num_t cpu) {
+    return cpu_mask_contains(mp.idle_cpus, cpu);
 }
 
-static inline int mp_is_cpu_online(cpu_num_t cpu) {
-    return mp.online_cpus & cpu_num_to_mask(cpu);
+static inline bool mp_is_cpu_online(cpu_num_t cpu) {
+    return cpu_mask_contains(cpu_mask_atomic_load(&mp.online_cpus), cpu);
 }
 
 /* must be called with the thread lock held */
@@ -113,11 +128,11 @@ static inline int mp_is_cpu_online(cpu_num_t cpu) {
  * busy == !idle
  */
 static inline void mp_set_cpu_idle(cpu_num_t cpu) {
-    mp.idle_cpus |= cpu_num_to_mask(cpu);
+    cpu_mask_add(&mp.idle_cpus, cpu);
 }
 
 static inline void mp_set_cpu_busy(cpu_num_t cpu) {
-    mp.idle_cpus &= ~cpu_num_to_mask(cpu);
+    cpu_mask_remove(&mp.idle_cpus, cpu);
 }
 
 static inline cpu_mask_t mp_get_idle_mask(void) {
@@ -125,19 +140,19 @@ static inline cpu_mask_t mp_get_idle_mask(void) {
 }
 
 static inline cpu_mask_t mp_get_active_mask(void) {
-    return atomic_load((int*)&mp.active_cpus);
+    return cpu_mask_atomic_load(&mp.active_cpus);
 }
 
 static inline cpu_mask_t mp_get_online_mask(void) {
-    return mp.online_cpus;
+    return cpu_mask_atomic_load(&mp.online_cpus);
 }
 
 static inline void mp_set_cpu_realtime(cpu_num_t cpu) {
-    mp.realtime_cpus |= cpu_num_to_mask(cpu);
+    cpu_mask_add(&mp.realtime_cpus, cpu);
 }
 
 static inline void mp_set_cpu_non_realtime(cpu_num_t cpu) {
-    mp.realtime_cpus &= ~cpu_num_to_mask(cpu);
+    cpu_mask_remove(&mp.realtime_cpus, cpu);
 }
 
 static inline cpu_mask_t mp_get_realtime_mask(void) {
@@ -18,15 +18,19 @@
 __BEGIN_CDECLS
 
 struct percpu {
-    /* per cpu timer queue */
+    /* per cpu timer queue, sorted by deadline, and a tree indexing it */
     struct list_node timer_queue;
+    timer_t* timer_tree;
 
     /* per cpu preemption timer */
     timer_t preempt_timer;
 
-    /* per cpu run queue and bitmap to indicate which queues are non empty */
+    /* per cpu run queue and bitmap to indicate which queues are non empty.
+     * all three are protected by run_queue_lock, which nests inside thread_lock. */
+    spin_lock_t run_queue_lock;
     struct list_node run_queue[NUM_PRIORITIES];
     uint32_t run_queue_bitmap;
+    uint32_t run_queue_count;
 
     /* thread/cpu level statistics */
     struct cpu_stats stats;
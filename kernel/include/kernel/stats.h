@@ -19,6 +19,7 @@ struct cpu_stats {
     ulong irq_preempts;
     ulong preempts;
     ulong yields;
+    ulong steals;      /* threads pulled from another cpu's run queue while idle */
 
     /* cpu level interrupts and exceptions */
     ulong interrupts;  /* hardware interrupts, minus timer interrupts or inter-processor interrupts */
@@ -32,6 +32,15 @@ typedef struct timer {
     int magic;
     struct list_node node;
 
+    // position in the per cpu deadline tree that indexes the timer queue
+    struct {
+        struct timer* parent;
+        struct timer* left;
+        struct timer* right;
+        int height;
+    } tree;
+    uint queue_cpu; // cpu whose timer queue |node| is on
+
     zx_time_t scheduled_time;
     int64_t slack; // Stores the applied slack adjustment from
                    // the ideal scheduled_time.
@@ -46,6 +55,8 @@ typedef struct timer {
     {                                       \
         .magic = TIMER_MAGIC,               \
         .node = LIST_INITIAL_CLEARED_VALUE, \
+        .tree = {NULL, NULL, NULL, 0},      \
+        .queue_cpu = 0,                     \
         .scheduled_time = 0,                \
         .slack = 0,                         \
         .callback = NULL,                   \
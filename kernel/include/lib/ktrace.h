@@ -23,12 +23,16 @@ struct ktrace_probe_info {
     uint32_t num;
 } __ALIGNED(16); // align on multiple of 16 to match linker packing of the ktrace_probe section
 
+// Records returned by ktrace_open() must be passed to ktrace_close() once
+// their payload is filled in; streaming reads don't go past an open record.
 void* ktrace_open(uint32_t tag);
+void ktrace_close(void* payload);
 void ktrace_tiny(uint32_t tag, uint32_t arg);
 static inline void ktrace(uint32_t tag, uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
     uint32_t* data = (uint32_t*) ktrace_open(tag);
     if (data) {
         data[0] = a; data[1] = b; data[2] = c; data[3] = d;
+        ktrace_close(data);
     }
 }
 
@@ -39,7 +43,7 @@ static inline void ktrace(uint32_t tag, uint32_t a, uint32_t b, uint32_t c, uint
 
 #define ktrace_probe0(_name) do {                               \
     _ktrace_probe_prologue(_name);                              \
-    ktrace_open(TAG_PROBE_16(info.num));                        \
+    ktrace_close(ktrace_open(TAG_PROBE_16(info.num)));          \
 } while (0)
 
 #define ktrace_probe2(_name,arg0,arg1) do {                  \
@@ -48,6 +52,7 @@ static inline void ktrace(uint32_t tag, uint32_t a, uint32_t b, uint32_t c, uint
     if (args) {                                              \
       args[0] = arg0;                                        \
       args[1] = arg1;                                        \
+      ktrace_close(args);                                    \
     }                                                        \
 } while (0)
 
@@ -56,6 +61,7 @@ static inline void ktrace(uint32_t tag, uint32_t a, uint32_t b, uint32_t c, uint
     uint64_t* args = (uint64_t*)ktrace_open(TAG_PROBE_24(info.num));    \
     if (args) {                                              \
       *args = arg;                                           \
+      ktrace_close(args);                                    \
     }                                                        \
 } while (0)
 
@@ -64,6 +70,7 @@ int ktrace_read_user(void* ptr, uint32_t off, uint32_t len);
 zx_status_t ktrace_control(uint32_t action, uint32_t options, void* ptr);
 #else
 static inline void* ktrace_open(uint32_t tag) { return NULL; }
+static inline void ktrace_close(void* payload) {}
 static inline void ktrace_tiny(uint32_t tag, uint32_t arg) {}
 static inline void ktrace(uint32_t tag, uint32_t a, uint32_t b, uint32_t c, uint32_t d) {}
 static inline void ktrace_probe0(const char* name) {}
@@ -42,38 +42,68 @@ static void mp_sync_task(void* context);
 
 void mp_init(void) {
     mp.ipi_task_lock = SPIN_LOCK_INITIAL_VALUE;
-    for (uint i = 0; i < countof(mp.ipi_task_list); ++i) {
-        list_initialize(&mp.ipi_task_list[i]);
+    list_initialize(&mp.ipi_task_list);
+}
+
+void mp_set_cpu_topology(cpu_num_t cpu, uint32_t package_id, uint32_t core_id) {
+    static struct {
+        uint32_t package_id;
+        uint32_t core_id;
+    } topology[SMP_MAX_CPUS];
+    static cpu_mask_t known;
+
+    DEBUG_ASSERT(cpu < SMP_MAX_CPUS);
+
+    topology[cpu].package_id = package_id;
+    topology[cpu].core_id = core_id;
+
+    for (cpu_num_t i = 0; i < SMP_MAX_CPUS; i++) {
+        if (i == cpu || !cpu_mask_contains(known, i))
+            continue;
+        if (topology[i].package_id != package_id)
+            continue;
+
+        cpu_mask_add(&mp.package_siblings[cpu], i);
+        cpu_mask_add(&mp.package_siblings[i], cpu);
+        if (topology[i].core_id == core_id) {
+            cpu_mask_add(&mp.core_siblings[cpu], i);
+            cpu_mask_add(&mp.core_siblings[i], cpu);
+        }
     }
+    cpu_mask_add(&known, cpu);
+
+    LTRACEF("cpu %u package %u core %u: %u core siblings %u package siblings\n",
+            cpu, package_id, core_id, cpu_mask_count(mp.core_siblings[cpu]),
+            cpu_mask_count(mp.package_siblings[cpu]));
 }
 
 void mp_reschedule(mp_ipi_target_t target, cpu_mask_t mask, uint flags) {
     const cpu_num_t local_cpu = arch_curr_cpu_num();
 
-    LTRACEF("local %u, target %u, mask %#x\n", local_cpu, target, mask);
+    LTRACEF("local %u, target %u, mask lowest %u\n", local_cpu, target, lowest_cpu_set(mask));
 
     switch (target) {
     case MP_IPI_TARGET_ALL:
     case MP_IPI_TARGET_ALL_BUT_LOCAL:
-        arch_mp_send_ipi(target, 0, MP_IPI_RESCHEDULE);
+        arch_mp_send_ipi(target, cpu_mask_none(), MP_IPI_RESCHEDULE);
         break;
     case MP_IPI_TARGET_MASK:
-        if (mask == 0)
+        if (cpu_mask_is_empty(mask))
             return;
 
         /* mask out cpus that are not active and the local cpu */
-        mask &= mp.active_cpus;
-        mask &= ~cpu_num_to_mask(local_cpu);
+        mask = cpu_mask_and(mask, mp_get_active_mask());
+        cpu_mask_remove(&mask, local_cpu);
 
         /* this is generally a bad state, though this may be too aggressive */
-        DEBUG_ASSERT(mask != 0);
+        DEBUG_ASSERT(!cpu_mask_is_empty(mask));
 
         /* mask out cpus that are currently running realtime code */
         if ((flags & MP_RESCHEDULE_FLAG_REALTIME) == 0) {
-            mask &= ~mp.realtime_cpus;
+            mask = cpu_mask_andnot(mask, mp.realtime_cpus);
         }
 
-        LTRACEF("local %u, post mask target now 0x%x\n", local_cpu, mask);
+        LTRACEF("local %u, post mask %u targets\n", local_cpu, cpu_mask_count(mask));
 
         arch_mp_send_ipi(MP_IPI_TARGET_MASK, mask, MP_IPI_RESCHEDULE);
         break;
@@ -81,10 +111,14 @@ void mp_reschedule(mp_ipi_target_t target, cpu_mask_t mask, uint flags) {
 }
 
 struct mp_sync_context {
+    struct list_node node;
     mp_sync_task_t task;
     void* task_context;
-    /* Mask of which CPUs need to finish the task */
-    volatile cpu_mask_t outstanding_cpus;
+    /* Mask of which CPUs have yet to pick up the task.  Only accessed with
+     * the ipi_task_lock held */
+    cpu_mask_t pending_cpus;
+    /* Mask of which CPUs need to finish the task, updated atomically */
+    cpu_mask_t outstanding_cpus;
 };
 
 static void mp_sync_task(void* raw_context) {
@@ -92,7 +126,7 @@ static void mp_sync_task(void* raw_context) {
     context->task(context->task_context);
     /* use seq-cst atomic to ensure this update is not seen before the
      * side-effects of context->task */
-    atomic_and((int*)&context->outstanding_cpus, ~cpu_num_to_mask(arch_curr_cpu_num()));
+    cpu_mask_atomic_remove(&context->outstanding_cpus, arch_curr_cpu_num());
     arch_spinloop_signal();
 }
 
@@ -108,19 +142,17 @@ static void mp_sync_task(void* raw_context) {
  * set to true.
  */
 void mp_sync_exec(mp_ipi_target_t target, cpu_mask_t mask, mp_sync_task_t task, void* context) {
-    uint num_cpus = arch_max_num_cpus();
-
     if (target == MP_IPI_TARGET_ALL) {
         mask = mp_get_online_mask();
     } else if (target == MP_IPI_TARGET_ALL_BUT_LOCAL) {
         /* targeting all other CPUs but the current one is hazardous
          * if the local CPU may be changed underneath us */
         DEBUG_ASSERT(arch_ints_disabled());
-        mask = mp_get_online_mask() & ~cpu_num_to_mask(arch_curr_cpu_num());
+        mask = cpu_mask_andnot(mp_get_online_mask(), cpu_num_to_mask(arch_curr_cpu_num()));
     }
 
     /* Mask any offline CPUs from target list */
-    mask &= mp_get_online_mask();
+    mask = cpu_mask_and(mask, mp_get_online_mask());
 
     /* disable interrupts so our current CPU doesn't change */
     spin_lock_saved_state_t irqstate;
@@ -130,33 +162,25 @@ void mp_sync_exec(mp_ipi_target_t target, cpu_mask_t mask, mp_sync_task_t task,
     const uint local_cpu = arch_curr_cpu_num();
 
     /* remove self from target lists, since no need to IPI ourselves */
-    bool targetting_self = !!(mask & cpu_num_to_mask(local_cpu));
-    mask &= ~cpu_num_to_mask(local_cpu);
+    bool targetting_self = cpu_mask_contains(mask, local_cpu);
+    cpu_mask_remove(&mask, local_cpu);
 
-    /* create tasks to enqueue (we need one per target due to each containing
-     * a linked list node */
+    /* a single context is shared by every target, so the stack cost of this
+     * call does not grow with SMP_MAX_CPUS */
     struct mp_sync_context sync_context = {
+        .node = LIST_INITIAL_CLEARED_VALUE,
         .task = task,
         .task_context = context,
+        .pending_cpus = mask,
         .outstanding_cpus = mask,
     };
 
-    struct mp_ipi_task sync_tasks[SMP_MAX_CPUS] = {};
-    for (uint i = 0; i < num_cpus; ++i) {
-        sync_tasks[i].func = mp_sync_task;
-        sync_tasks[i].context = &sync_context;
-    }
-
-    /* enqueue tasks */
+    /* enqueue the task and flag it on every target */
     spin_lock(&mp.ipi_task_lock);
-    cpu_mask_t remaining = mask;
-    uint cpu_id = 0;
-    while (remaining && cpu_id < num_cpus) {
-        if (remaining & 1) {
-            list_add_tail(&mp.ipi_task_list[cpu_id], &sync_tasks[cpu_id].node);
-        }
-        remaining >>= 1;
-        cpu_id++;
+    list_add_tail(&mp.ipi_task_list, &sync_context.node);
+    cpu_num_t cpu_id;
+    cpu_mask_for_each(cpu_id, mask) {
+        cpu_mask_atomic_add(&mp.ipi_task_pending, cpu_id);
     }
     spin_unlock(&mp.ipi_task_lock);
 
@@ -180,19 +204,18 @@ void mp_sync_exec(mp_ipi_target_t target, cpu_mask_t mask, mp_sync_task_t task,
     while (1) {
         /* See comment in mp_unplug_trampoline about related CPU hotplug
          * guarantees. */
-        cpu_mask_t outstanding = atomic_load_relaxed(
-            (int*)&sync_context.outstanding_cpus);
+        cpu_mask_t outstanding = cpu_mask_atomic_load(&sync_context.outstanding_cpus);
         cpu_mask_t online = mp_get_online_mask();
-        if ((outstanding & online) == 0) {
+        if (!cpu_mask_intersects(outstanding, online)) {
             break;
         }
 
         /* If interrupts are still disabled, we need to attempt to process any
          * tasks queued for us in order to prevent deadlock. */
         if (ints_disabled) {
-            /* Optimistically check if our task list has work without the lock.
+            /* Optimistically check if there is work for us without the lock.
              * mp_mbx_generic_irq will take the lock and check again */
-            if (!list_is_empty(&mp.ipi_task_list[local_cpu])) {
+            if (cpu_mask_contains(cpu_mask_atomic_load(&mp.ipi_task_pending), local_cpu)) {
                 bool previous_in_int_handler = arch_in_int_handler();
                 arch_set_in_int_handler(true);
                 mp_mbx_generic_irq();
@@ -205,15 +228,10 @@ void mp_sync_exec(mp_ipi_target_t target, cpu_mask_t mask, mp_sync_task_t task,
     }
     smp_mb();
 
-    /* make sure the sync_tasks aren't in lists anymore, since they're
-     * stack allocated */
+    /* take the context off the task list, since it's stack allocated.  If a
+     * target never picked it up, it's because the CPU went offline. */
     spin_lock_irqsave(&mp.ipi_task_lock, irqstate);
-    for (uint i = 0; i < num_cpus; ++i) {
-        /* If a task is still around, it's because the CPU went offline. */
-        if (list_in_list(&sync_tasks[i].node)) {
-            list_delete(&sync_tasks[i].node);
-        }
-    }
+    list_delete(&sync_context.node);
     spin_unlock_irqrestore(&mp.ipi_task_lock, irqstate);
 }
 
@@ -258,14 +276,14 @@ zx_status_t mp_hotplug_cpu_mask(cpu_mask_t cpu_mask) {
     mutex_acquire(&mp.hotplug_lock);
 
     // Make sure all of the requested CPUs are offline
-    if (cpu_mask & mp_get_online_mask()) {
+    if (cpu_mask_intersects(cpu_mask, mp_get_online_mask())) {
         status = ZX_ERR_BAD_STATE;
         goto cleanup_mutex;
     }
 
-    while (cpu_mask != 0) {
+    while (!cpu_mask_is_empty(cpu_mask)) {
         cpu_num_t cpu_id = highest_cpu_set(cpu_mask);
-        cpu_mask &= ~cpu_num_to_mask(cpu_id);
+        cpu_mask_remove(&cpu_mask, cpu_id);
 
         status = platform_mp_cpu_hotplug(cpu_id);
         if (status != ZX_OK) {
@@ -356,14 +374,14 @@ zx_status_t mp_unplug_cpu_mask(cpu_mask_t cpu_mask) {
     mutex_acquire(&mp.hotplug_lock);
 
     // Make sure all of the requested CPUs are online
-    if (cpu_mask & ~mp_get_online_mask()) {
+    if (!cpu_mask_is_empty(cpu_mask_andnot(cpu_mask, mp_get_online_mask()))) {
         status = ZX_ERR_BAD_STATE;
         goto cleanup_mutex;
     }
 
-    while (cpu_mask != 0) {
+    while (!cpu_mask_is_empty(cpu_mask)) {
         cpu_num_t cpu_id = highest_cpu_set(cpu_mask);
-        cpu_mask &= ~cpu_num_to_mask(cpu_id);
+        cpu_mask_remove(&cpu_mask, cpu_id);
 
         status = mp_unplug_cpu_mask_single_locked(cpu_id);
         if (status != ZX_OK) {
@@ -378,17 +396,17 @@ cleanup_mutex:
 
 void mp_set_curr_cpu_online(bool online) {
     if (online) {
-        atomic_or((volatile int*)&mp.online_cpus, cpu_num_to_mask(arch_curr_cpu_num()));
+        cpu_mask_atomic_add(&mp.online_cpus, arch_curr_cpu_num());
     } else {
-        atomic_and((volatile int*)&mp.online_cpus, ~cpu_num_to_mask(arch_curr_cpu_num()));
+        cpu_mask_atomic_remove(&mp.online_cpus, arch_curr_cpu_num());
     }
 }
 
 void mp_set_curr_cpu_active(bool active) {
     if (active) {
-        atomic_or((volatile int*)&mp.active_cpus, cpu_num_to_mask(arch_curr_cpu_num()));
+        cpu_mask_atomic_add(&mp.active_cpus, arch_curr_cpu_num());
     } else {
-        atomic_and((volatile int*)&mp.active_cpus, ~cpu_num_to_mask(arch_curr_cpu_num()));
+        cpu_mask_atomic_remove(&mp.active_cpus, arch_curr_cpu_num());
     }
 }
 
@@ -399,15 +417,25 @@ enum handler_return mp_mbx_generic_irq(void) {
     CPU_STATS_INC(generic_ipis);
 
     while (1) {
-        struct mp_ipi_task* task;
+        struct mp_sync_context* task = NULL;
+        struct mp_sync_context* context;
         spin_lock(&mp.ipi_task_lock);
-        task = list_remove_head_type(&mp.ipi_task_list[local_cpu], struct mp_ipi_task, node);
+        list_for_every_entry (&mp.ipi_task_list, context, struct mp_sync_context, node) {
+            if (cpu_mask_contains(context->pending_cpus, local_cpu)) {
+                cpu_mask_remove(&context->pending_cpus, local_cpu);
+                task = context;
+                break;
+            }
+        }
+        if (task == NULL) {
+            cpu_mask_atomic_remove(&mp.ipi_task_pending, local_cpu);
+        }
         spin_unlock(&mp.ipi_task_lock);
         if (task == NULL) {
             break;
         }
 
-        task->func(task->context);
+        mp_sync_task(task);
     }
     return INT_NO_RESCHEDULE;
 }
@@ -419,7 +447,7 @@ enum handler_return mp_mbx_reschedule_irq(void) {
 
     CPU_STATS_INC(reschedule_ipis);
 
-    if (mp.active_cpus & cpu_num_to_mask(cpu))
+    if (mp_is_cpu_active(cpu))
         thread_preempt_set_pending();
 
     return INT_NO_RESCHEDULE;
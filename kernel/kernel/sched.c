@@ -114,74 +114,88 @@ static void deboost_thread(thread_t* t, bool quantum_expiration) {
     compute_effec_priority(t);
 }
 
-/* pick a 'random' cpu out of the passed in mask of cpus */
-static cpu_mask_t rand_cpu(cpu_mask_t mask) {
-    if (unlikely(mask == 0))
-        return 0;
-
-    /* check that the mask passed in has at least one bit set in the active mask */
-    cpu_mask_t active = mp_get_active_mask();
-    mask &= active;
-    if (unlikely(mask == 0))
-        return 0;
-
-    /* compute the highest cpu in the mask */
-    cpu_num_t highest_cpu = highest_cpu_set(mask);
-
-    /* not very random, round robins a bit through the mask until it gets a hit */
-    for (;;) {
-        /* protected by THREAD_LOCK, safe to use non atomically */
-        static uint rot = 0;
+/* the number of threads queued on |cpu|. placement and stealing read other cpus'
+ * counts without their run queue locks, so this is only a hint. */
+static inline uint run_queue_count(cpu_num_t cpu) {
+    return __atomic_load_n(&percpu[cpu].run_queue_count, __ATOMIC_RELAXED);
+}
 
-        if (++rot > highest_cpu)
-            rot = 0;
+/* pick the cpu in |mask| closest to |near| in the cache hierarchy: |near| itself, then
+ * its smt siblings, then the rest of its package, then anything. Within the chosen
+ * level, prefer the cpu with the fewest queued threads. */
+static cpu_mask_t nearest_cpu(cpu_mask_t mask, cpu_num_t near) {
+    mask = cpu_mask_and(mask, mp_get_active_mask());
+    if (unlikely(cpu_mask_is_empty(mask)))
+        return mask;
+
+    if (is_valid_cpu_num(near)) {
+        if (cpu_mask_contains(mask, near))
+            return cpu_num_to_mask(near);
+
+        cpu_mask_t level = cpu_mask_and(mask, mp_get_core_siblings(near));
+        if (cpu_mask_is_empty(level))
+            level = cpu_mask_and(mask, mp_get_package_siblings(near));
+        if (!cpu_mask_is_empty(level))
+            mask = level;
+    }
 
-        if ((1u << rot) & mask)
-            return (1u << rot);
+    /* fewest queued threads wins, ties go to the lowest numbered cpu */
+    cpu_num_t best = INVALID_CPU;
+    uint best_count = UINT_MAX;
+    cpu_num_t cpu;
+    cpu_mask_for_each(cpu, mask) {
+        uint count = run_queue_count(cpu);
+        if (count < best_count) {
+            best = cpu;
+            best_count = count;
+        }
     }
+    return cpu_num_to_mask(best);
 }
 
 /* find a cpu to wake up */
 static cpu_mask_t find_cpu_mask(thread_t* t) {
     /* get the last cpu the thread ran on */
-    cpu_mask_t last_ran_cpu_mask = cpu_num_to_mask(t->last_cpu);
+    cpu_num_t last_cpu = t->last_cpu;
 
     /* the current cpu */
-    cpu_mask_t curr_cpu_mask = cpu_num_to_mask(arch_curr_cpu_num());
+    cpu_num_t curr_cpu = arch_curr_cpu_num();
+    cpu_mask_t curr_cpu_mask = cpu_num_to_mask(curr_cpu);
 
     /* the thread's affinity mask */
     cpu_mask_t cpu_affinity = t->cpu_affinity;
 
-    LTRACEF_LEVEL(2, "last %#x curr %#x aff %#x name %s\n",
-                  last_ran_cpu_mask, curr_cpu_mask, cpu_affinity, t->name);
+    LTRACEF_LEVEL(2, "last %u curr %u aff lowest %u name %s\n",
+                  last_cpu, curr_cpu, lowest_cpu_set(cpu_affinity), t->name);
 
     /* get a list of idle cpus and mask off the ones that aren't in our affinity mask */
-    cpu_mask_t idle_cpu_mask = mp_get_idle_mask();
+    cpu_mask_t idle_cpu_mask = cpu_mask_and(mp_get_idle_mask(), cpu_affinity);
     cpu_mask_t active_cpu_mask = mp_get_active_mask();
-    idle_cpu_mask &= cpu_affinity;
-    if (idle_cpu_mask != 0) {
-        if (idle_cpu_mask & curr_cpu_mask) {
+    if (!cpu_mask_is_empty(idle_cpu_mask)) {
+        if (cpu_mask_contains(idle_cpu_mask, curr_cpu)) {
             /* the current cpu is idle and within our affinity mask, so run it here */
             return curr_cpu_mask;
         }
 
-        if (last_ran_cpu_mask & idle_cpu_mask) {
-            DEBUG_ASSERT(last_ran_cpu_mask & mp_get_active_mask());
+        if (cpu_mask_contains(idle_cpu_mask, last_cpu)) {
+            DEBUG_ASSERT(mp_is_cpu_active(last_cpu));
             /* the last core it ran on is idle and isn't the current cpu */
-            return last_ran_cpu_mask;
+            return cpu_num_to_mask(last_cpu);
         }
 
-        /* pick an idle_cpu */
-        DEBUG_ASSERT((idle_cpu_mask & mp_get_active_mask()) == idle_cpu_mask);
-        return rand_cpu(idle_cpu_mask);
+        /* pick the idle cpu sharing the most cache with where the thread last ran */
+        DEBUG_ASSERT(cpu_mask_is_empty(cpu_mask_andnot(idle_cpu_mask, mp_get_active_mask())));
+        cpu_mask_t mask = nearest_cpu(idle_cpu_mask, last_cpu);
+        if (!cpu_mask_is_empty(mask))
+            return mask;
     }
 
     /* no idle cpus in our affinity mask */
 
     /* if the last cpu it ran on is in the affinity mask and not the current cpu, pick that */
-    if ((last_ran_cpu_mask & cpu_affinity & active_cpu_mask) &&
-        last_ran_cpu_mask != curr_cpu_mask) {
-        return last_ran_cpu_mask;
+    if (cpu_mask_contains(cpu_mask_and(cpu_affinity, active_cpu_mask), last_cpu) &&
+        last_cpu != curr_cpu) {
+        return cpu_num_to_mask(last_cpu);
     }
 
     /* fall back to picking a cpu out of the affinity mask, preferring something other
@@ -189,36 +203,144 @@ static cpu_mask_t find_cpu_mask(thread_t* t) {
      * the affinity mask hard pins the thread to the cpus in the mask, so it's not possible
      * to pick a cpu outside of that list.
      */
-    cpu_mask_t mask = cpu_affinity & ~(curr_cpu_mask);
-    if (mask == 0)
+    cpu_mask_t mask = cpu_mask_andnot(cpu_affinity, curr_cpu_mask);
+    if (cpu_mask_is_empty(mask))
         return curr_cpu_mask; /* local cpu is the only choice */
 
-    mask = rand_cpu(mask);
-    if (mask == 0)
+    mask = nearest_cpu(mask, is_valid_cpu_num(last_cpu) ? last_cpu : curr_cpu);
+    if (cpu_mask_is_empty(mask))
         return curr_cpu_mask; /* local cpu is the only choice */
-    DEBUG_ASSERT((mask & mp_get_active_mask()) == mask);
+    DEBUG_ASSERT(cpu_mask_is_empty(cpu_mask_andnot(mask, mp_get_active_mask())));
     return mask;
 }
 
-/* run queue manipulation */
-static void insert_in_run_queue_head(cpu_num_t cpu, thread_t* t) {
+/* run queue manipulation
+ *
+ * each cpu's run queue, bitmap and count are protected by that cpu's
+ * run_queue_lock. lock ordering is thread_lock, then a single run_queue_lock:
+ * no path holds two cpus' run queue locks at once, so stealing and migration
+ * drop one queue's lock before taking another's. thread_lock is still held
+ * around every scheduler entry point since it also guards thread state.
+ */
+static void run_queue_add_locked(struct percpu* c, thread_t* t, bool head) {
+    DEBUG_ASSERT(spin_lock_held(&c->run_queue_lock));
     DEBUG_ASSERT(!list_in_list(&t->queue_node));
 
-    list_add_head(&percpu[cpu].run_queue[t->effec_priority], &t->queue_node);
-    percpu[cpu].run_queue_bitmap |= (1u << t->effec_priority);
+    if (head)
+        list_add_head(&c->run_queue[t->effec_priority], &t->queue_node);
+    else
+        list_add_tail(&c->run_queue[t->effec_priority], &t->queue_node);
+    c->run_queue_bitmap |= (1u << t->effec_priority);
+    __atomic_store_n(&c->run_queue_count, c->run_queue_count + 1, __ATOMIC_RELAXED);
+}
+
+static void insert_in_run_queue(cpu_num_t cpu, thread_t* t, bool head) {
+    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+
+    struct percpu* c = &percpu[cpu];
+    spin_lock(&c->run_queue_lock);
+    run_queue_add_locked(c, t, head);
+    spin_unlock(&c->run_queue_lock);
 
     /* mark the cpu as busy since the run queue now has at least one item in it */
     mp_set_cpu_busy(cpu);
 }
 
+static void insert_in_run_queue_head(cpu_num_t cpu, thread_t* t) {
+    insert_in_run_queue(cpu, t, true);
+}
+
 static void insert_in_run_queue_tail(cpu_num_t cpu, thread_t* t) {
-    DEBUG_ASSERT(!list_in_list(&t->queue_node));
+    insert_in_run_queue(cpu, t, false);
+}
 
-    list_add_tail(&percpu[cpu].run_queue[t->effec_priority], &t->queue_node);
-    percpu[cpu].run_queue_bitmap |= (1u << t->effec_priority);
+/* unlink |t| from |c|'s run queue at priority |pri| */
+static void run_queue_remove_locked(struct percpu* c, thread_t* t, uint pri) {
+    DEBUG_ASSERT(spin_lock_held(&c->run_queue_lock));
+    DEBUG_ASSERT(list_in_list(&t->queue_node));
 
-    /* mark the cpu as busy since the run queue now has at least one item in it */
-    mp_set_cpu_busy(cpu);
+    list_delete(&t->queue_node);
+    if (list_is_empty(&c->run_queue[pri]))
+        c->run_queue_bitmap &= ~(1u << pri);
+    DEBUG_ASSERT(c->run_queue_count > 0);
+    __atomic_store_n(&c->run_queue_count, c->run_queue_count - 1, __ATOMIC_RELAXED);
+}
+
+/* pull a ready thread out of |cpu|'s run queue at priority |pri| */
+static void remove_from_run_queue(cpu_num_t cpu, thread_t* t, int pri) {
+    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+
+    struct percpu* c = &percpu[cpu];
+    spin_lock(&c->run_queue_lock);
+    run_queue_remove_locked(c, t, pri);
+    spin_unlock(&c->run_queue_lock);
+}
+
+/* highest priority queue with anything in it, given a non empty bitmap */
+static inline uint highest_run_queue(uint32_t bitmap) {
+    return HIGHEST_PRIORITY - __builtin_clz(bitmap) -
+           (sizeof(bitmap) * CHAR_BIT - NUM_PRIORITIES);
+}
+
+/* an otherwise idle |cpu| takes the highest priority thread it is allowed to run
+ * from the busiest run queue nearest to it in the cache hierarchy. returns NULL
+ * if there is nothing to take. */
+static thread_t* steal_thread(cpu_num_t cpu) {
+    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+
+    cpu_mask_t searched = cpu_num_to_mask(cpu);
+    const cpu_mask_t active = mp_get_active_mask();
+    const cpu_mask_t levels[] = {
+        mp_get_core_siblings(cpu),
+        mp_get_package_siblings(cpu),
+        active,
+    };
+
+    for (size_t l = 0; l < countof(levels); l++) {
+        cpu_mask_t candidates = cpu_mask_andnot(cpu_mask_and(levels[l], active), searched);
+        searched = cpu_mask_or(searched, candidates);
+
+        while (!cpu_mask_is_empty(candidates)) {
+            /* busiest remaining candidate at this level */
+            cpu_num_t victim = INVALID_CPU;
+            uint victim_count = 0;
+            cpu_num_t i;
+            cpu_mask_for_each(i, candidates) {
+                uint count = run_queue_count(i);
+                if (count > victim_count) {
+                    victim = i;
+                    victim_count = count;
+                }
+            }
+            if (victim == INVALID_CPU)
+                break;
+            cpu_mask_remove(&candidates, victim);
+
+            /* the stolen thread goes straight to running here rather than into
+             * our own queue, so only the victim's lock is needed */
+            struct percpu* c = &percpu[victim];
+            spin_lock(&c->run_queue_lock);
+            for (uint32_t bitmap = c->run_queue_bitmap; bitmap != 0;) {
+                uint pri = highest_run_queue(bitmap);
+                bitmap &= ~(1u << pri);
+
+                thread_t* t;
+                list_for_every_entry (&c->run_queue[pri], t, thread_t, queue_node) {
+                    if (!cpu_mask_contains(t->cpu_affinity, cpu) || thread_is_idle(t))
+                        continue;
+
+                    run_queue_remove_locked(c, t, pri);
+                    spin_unlock(&c->run_queue_lock);
+                    t->curr_cpu = cpu;
+                    CPU_STATS_INC(steals);
+                    LOCAL_KTRACE2("sched_steal", victim, (uint32_t)t->user_tid);
+                    return t;
+                }
+            }
+            spin_unlock(&c->run_queue_lock);
+        }
+    }
+    return NULL;
 }
 
 static thread_t* sched_get_top_thread(cpu_num_t cpu) {
@@ -226,26 +348,28 @@ static thread_t* sched_get_top_thread(cpu_num_t cpu) {
      * queued up on the passed in cpu.
      */
     struct percpu* c = &percpu[cpu];
+    spin_lock(&c->run_queue_lock);
     if (likely(c->run_queue_bitmap)) {
-        uint highest_queue = HIGHEST_PRIORITY - __builtin_clz(c->run_queue_bitmap) -
-                             (sizeof(c->run_queue_bitmap) * CHAR_BIT - NUM_PRIORITIES);
+        uint highest_queue = highest_run_queue(c->run_queue_bitmap);
 
-        thread_t* newthread = list_remove_head_type(&c->run_queue[highest_queue], thread_t, queue_node);
+        thread_t* newthread = list_peek_head_type(&c->run_queue[highest_queue], thread_t, queue_node);
 
         DEBUG_ASSERT(newthread);
-        DEBUG_ASSERT_MSG(newthread->cpu_affinity & cpu_num_to_mask(cpu),
-                         "thread %p name %s, aff %#x cpu %u\n", newthread, newthread->name,
-                         newthread->cpu_affinity, cpu);
+        DEBUG_ASSERT_MSG(cpu_mask_contains(newthread->cpu_affinity, cpu),
+                         "thread %p name %s, aff lowest %u cpu %u\n", newthread, newthread->name,
+                         lowest_cpu_set(newthread->cpu_affinity), cpu);
         DEBUG_ASSERT(newthread->curr_cpu == cpu);
 
-        if (list_is_empty(&c->run_queue[highest_queue]))
-            c->run_queue_bitmap &= ~(1u << highest_queue);
+        run_queue_remove_locked(c, newthread, highest_queue);
+        spin_unlock(&c->run_queue_lock);
 
         LOCAL_KTRACE2("sched_get_top", newthread->priority_boost, newthread->base_priority);
 
         return newthread;
     }
 
+    spin_unlock(&c->run_queue_lock);
+
     /* no threads to run, select the idle thread for this cpu */
     return &c->idle_thread;
 }
@@ -279,13 +403,13 @@ static void find_cpu_and_insert(thread_t* t, bool* local_resched, cpu_mask_t* ac
     cpu_mask_t cpu = find_cpu_mask(t);
     cpu_num_t cpu_num;
 
-    DEBUG_ASSERT(cpu != 0);
+    DEBUG_ASSERT(!cpu_mask_is_empty(cpu));
 
     cpu_num = lowest_cpu_set(cpu);
     if (cpu_num == arch_curr_cpu_num()) {
         *local_resched = true;
     } else {
-        *accum_cpu_mask |= cpu_num_to_mask(cpu_num);
+        cpu_mask_add(accum_cpu_mask, cpu_num);
     }
 
     t->curr_cpu = cpu_num;
@@ -310,10 +434,10 @@ bool sched_unblock(thread_t* t) {
     t->state = THREAD_READY;
 
     bool local_resched = false;
-    cpu_mask_t mask = 0;
+    cpu_mask_t mask = cpu_mask_none();
     find_cpu_and_insert(t, &local_resched, &mask);
 
-    if (mask)
+    if (!cpu_mask_is_empty(mask))
         mp_reschedule(MP_IPI_TARGET_MASK, mask, 0);
     return local_resched;
 }
@@ -326,7 +450,7 @@ bool sched_unblock_list(struct list_node* list) {
 
     /* pop the list of threads and shove into the scheduler */
     bool local_resched = false;
-    cpu_mask_t accum_cpu_mask = 0;
+    cpu_mask_t accum_cpu_mask = cpu_mask_none();
     thread_t* t;
     while ((t = list_remove_tail_type(list, thread_t, queue_node))) {
         DEBUG_ASSERT(t->magic == THREAD_MAGIC);
@@ -340,7 +464,7 @@ bool sched_unblock_list(struct list_node* list) {
         find_cpu_and_insert(t, &local_resched, &accum_cpu_mask);
     }
 
-    if (accum_cpu_mask)
+    if (!cpu_mask_is_empty(accum_cpu_mask))
         mp_reschedule(MP_IPI_TARGET_MASK, accum_cpu_mask, 0);
 
     return local_resched;
@@ -351,7 +475,7 @@ void sched_unblock_idle(thread_t* t) {
     DEBUG_ASSERT(spin_lock_held(&thread_lock));
 
     DEBUG_ASSERT(thread_is_idle(t));
-    DEBUG_ASSERT(t->cpu_affinity && (t->cpu_affinity & (t->cpu_affinity - 1)) == 0);
+    DEBUG_ASSERT(cpu_mask_count(t->cpu_affinity) == 1);
 
     /* idle thread is special case, just jam it into the cpu's run queue in the thread's
      * affinity mask and mark it ready.
@@ -457,12 +581,12 @@ void sched_reschedule(void) {
 /* migrate the current thread to a new cpu and locally reschedule to seal the deal */
 static void migrate_current_thread(thread_t* current_thread) {
     bool local_resched = false;
-    cpu_mask_t accum_cpu_mask = 0;
+    cpu_mask_t accum_cpu_mask = cpu_mask_none();
 
     // current thread, so just shove ourself into another cpu's queue and reschedule locally
     current_thread->state = THREAD_READY;
     find_cpu_and_insert(current_thread, &local_resched, &accum_cpu_mask);
-    if (accum_cpu_mask)
+    if (!cpu_mask_is_empty(accum_cpu_mask))
         mp_reschedule(MP_IPI_TARGET_MASK, accum_cpu_mask, 0);
     sched_resched_internal();
 }
@@ -476,13 +600,13 @@ void sched_transition_off_cpu(cpu_num_t old_cpu) {
 
     thread_t* t;
     bool local_resched = false;
-    cpu_mask_t accum_cpu_mask = 0;
+    cpu_mask_t accum_cpu_mask = cpu_mask_none();
     while (!thread_is_idle(t = sched_get_top_thread(old_cpu))) {
         find_cpu_and_insert(t, &local_resched, &accum_cpu_mask);
         DEBUG_ASSERT(!local_resched);
     }
 
-    if (accum_cpu_mask) {
+    if (!cpu_mask_is_empty(accum_cpu_mask)) {
         mp_reschedule(MP_IPI_TARGET_MASK, accum_cpu_mask, 0);
     }
 }
@@ -494,7 +618,7 @@ static bool local_migrate_if_needed(thread_t* curr_thread) {
     DEBUG_ASSERT(curr_thread->state == THREAD_READY);
 
     /* if the affinity mask does not include the current cpu, migrate us right now */
-    if (unlikely((curr_thread->cpu_affinity & cpu_num_to_mask(curr_thread->curr_cpu)) == 0)) {
+    if (unlikely(!cpu_mask_contains(curr_thread->cpu_affinity, curr_thread->curr_cpu))) {
         migrate_current_thread(curr_thread);
         return true;
     }
@@ -508,11 +632,11 @@ void sched_migrate(thread_t* t) {
     DEBUG_ASSERT(spin_lock_held(&thread_lock));
 
     bool local_resched = false;
-    cpu_mask_t accum_cpu_mask = 0;
+    cpu_mask_t accum_cpu_mask = cpu_mask_none();
     switch (t->state) {
     case THREAD_RUNNING:
         // see if we need to migrate
-        if (t->cpu_affinity & cpu_num_to_mask(t->curr_cpu)) {
+        if (cpu_mask_contains(t->cpu_affinity, t->curr_cpu)) {
             // it's running and the new mask contains the core it's already running on, nothing to do.
             //TRACEF("t %p nomigrate\n", t);
             return;
@@ -529,7 +653,7 @@ void sched_migrate(thread_t* t) {
         }
         break;
     case THREAD_READY:
-        if (t->cpu_affinity & cpu_num_to_mask(t->curr_cpu)) {
+        if (cpu_mask_contains(t->cpu_affinity, t->curr_cpu)) {
             // it's ready and the new mask contains the core it's already waiting on, nothing to do.
             //TRACEF("t %p nomigrate\n", t);
             return;
@@ -537,14 +661,8 @@ void sched_migrate(thread_t* t) {
 
         // it's sitting in a run queue somewhere, so pull it out of that one and find a new home
         DEBUG_ASSERT_MSG(list_in_list(&t->queue_node), "thread %p name %s curr_cpu %u\n", t, t->name, t->curr_cpu);
-        list_delete(&t->queue_node);
-
         DEBUG_ASSERT(is_valid_cpu_num(t->curr_cpu));
-
-        struct percpu* c = &percpu[t->curr_cpu];
-        if (list_is_empty(&c->run_queue[t->effec_priority])) {
-            c->run_queue_bitmap &= ~(1u << t->effec_priority);
-        }
+        remove_from_run_queue(t->curr_cpu, t, t->effec_priority);
 
         find_cpu_and_insert(t, &local_resched, &accum_cpu_mask);
         break;
@@ -554,7 +672,7 @@ void sched_migrate(thread_t* t) {
     }
 
     // send some ipis based on the previous code
-    if (accum_cpu_mask) {
+    if (!cpu_mask_is_empty(accum_cpu_mask)) {
         mp_reschedule(MP_IPI_TARGET_MASK, accum_cpu_mask, 0);
     }
     if (local_resched) {
@@ -584,7 +702,7 @@ void sched_inheirit_priority(thread_t* t, int pri, bool *local_resched) {
     }
 
     // see if we need to do something based on the state of the thread
-    cpu_mask_t accum_cpu_mask = 0;
+    cpu_mask_t accum_cpu_mask = cpu_mask_none();
     switch (t->state) {
     case THREAD_RUNNING:
         if (t->effec_priority < old_ep) {
@@ -599,14 +717,8 @@ void sched_inheirit_priority(thread_t* t, int pri, bool *local_resched) {
     case THREAD_READY:
         // it's sitting in a run queue somewhere, remove and add back to the proper queue on that cpu
         DEBUG_ASSERT_MSG(list_in_list(&t->queue_node), "thread %p name %s curr_cpu %u\n", t, t->name, t->curr_cpu);
-        list_delete(&t->queue_node);
-
         DEBUG_ASSERT(is_valid_cpu_num(t->curr_cpu));
-
-        struct percpu* c = &percpu[t->curr_cpu];
-        if (list_is_empty(&c->run_queue[old_ep])) {
-            c->run_queue_bitmap &= ~(1u << old_ep);
-        }
+        remove_from_run_queue(t->curr_cpu, t, old_ep);
 
         if (t->effec_priority > old_ep) {
             insert_in_run_queue_head(t->curr_cpu, t);
@@ -626,7 +738,7 @@ void sched_inheirit_priority(thread_t* t, int pri, bool *local_resched) {
     }
 
     // send some ipis based on the previous code
-    if (accum_cpu_mask) {
+    if (!cpu_mask_is_empty(accum_cpu_mask)) {
         mp_reschedule(MP_IPI_TARGET_MASK, accum_cpu_mask, 0);
     }
 }
@@ -688,8 +800,13 @@ void sched_resched_internal(void) {
 
     CPU_STATS_INC(reschedules);
 
-    /* pick a new thread to run */
+    /* pick a new thread to run, rather than idling while another cpu has work queued */
     thread_t* newthread = sched_get_top_thread(cpu);
+    if (thread_is_idle(newthread) && mp_is_cpu_active(cpu)) {
+        thread_t* stolen = steal_thread(cpu);
+        if (stolen)
+            newthread = stolen;
+    }
 
     DEBUG_ASSERT(newthread);
 
@@ -818,7 +935,9 @@ void sched_resched_internal(void) {
 
 void sched_init_early(void) {
     /* initialize the run queues */
-    for (unsigned int cpu = 0; cpu < SMP_MAX_CPUS; cpu++)
+    for (unsigned int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        spin_lock_init(&percpu[cpu].run_queue_lock);
         for (unsigned int i = 0; i < NUM_PRIORITIES; i++)
             list_initialize(&percpu[cpu].run_queue[i]);
+    }
 }
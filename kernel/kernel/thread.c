@@ -146,7 +146,7 @@ thread_t* thread_create_etc(
     t->interruptable = false;
     t->curr_cpu = INVALID_CPU;
     t->last_cpu = INVALID_CPU;
-    t->cpu_affinity = CPU_MASK_ALL;
+    t->cpu_affinity = cpu_mask_all();
 
     t->retcode = 0;
     wait_queue_init(&t->retcode_wait_queue);
@@ -646,7 +646,7 @@ void thread_set_cpu_affinity(thread_t* t, cpu_mask_t affinity) {
     THREAD_LOCK(state);
 
     // make sure the passed in mask is valid and at least one cpu can run the thread
-    if (affinity & mp_get_active_mask()) {
+    if (cpu_mask_intersects(affinity, mp_get_active_mask())) {
         // set the affinity mask
         t->cpu_affinity = affinity;
 
@@ -1194,9 +1194,11 @@ void dump_thread(thread_t* t, bool full_dump) {
 
     if (full_dump) {
         dprintf(INFO, "dump_thread: t %p (%s:%s)\n", t, oname, t->name);
-        dprintf(INFO, "\tstate %s, curr/last cpu %d/%d, cpu_affinity %#x, priority %d [%d:%d,%d], "
-                      "remaining time slice %" PRIu64 "\n",
-                thread_state_to_str(t->state), (int)t->curr_cpu, (int)t->last_cpu, t->cpu_affinity,
+        dprintf(INFO, "\tstate %s, curr/last cpu %d/%d, cpu_affinity %u-%u (%u cpus), "
+                      "priority %d [%d:%d,%d], remaining time slice %" PRIu64 "\n",
+                thread_state_to_str(t->state), (int)t->curr_cpu, (int)t->last_cpu,
+                lowest_cpu_set(t->cpu_affinity), highest_cpu_set(t->cpu_affinity),
+                cpu_mask_count(t->cpu_affinity),
                 t->effec_priority, t->base_priority,
                 t->priority_boost, t->inheirited_priority, t->remaining_time_slice);
         dprintf(INFO, "\truntime_ns %" PRIu64 ", runtime_s %" PRIu64 "\n",
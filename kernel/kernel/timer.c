@@ -43,6 +43,173 @@ void timer_init(timer_t* timer) {
     *timer = (timer_t)TIMER_INITIAL_VALUE(*timer);
 }
 
+// Each cpu's timer_queue is kept sorted by scheduled_time, and the same
+// timers are also linked into an AVL tree rooted at percpu[cpu].timer_tree.
+// The list gives O(1) access to the head and to a timer's neighbors, the tree
+// finds where a new timer goes in O(log n) rather than walking the list with
+// interrupts disabled. Timers with equal scheduled_time are kept in the order
+// they were queued.
+
+static inline int timer_tree_height(const timer_t* t) {
+    return t ? t->tree.height : 0;
+}
+
+static inline void timer_tree_update_height(timer_t* t) {
+    int l = timer_tree_height(t->tree.left);
+    int r = timer_tree_height(t->tree.right);
+    t->tree.height = 1 + ((l > r) ? l : r);
+}
+
+static void timer_tree_replace_child(timer_t** root, timer_t* parent,
+                                     timer_t* old_child, timer_t* new_child) {
+    if (parent == NULL) {
+        *root = new_child;
+    } else if (parent->tree.left == old_child) {
+        parent->tree.left = new_child;
+    } else {
+        parent->tree.right = new_child;
+    }
+    if (new_child)
+        new_child->tree.parent = parent;
+}
+
+static timer_t* timer_tree_rotate_left(timer_t** root, timer_t* x) {
+    timer_t* y = x->tree.right;
+
+    x->tree.right = y->tree.left;
+    if (y->tree.left)
+        y->tree.left->tree.parent = x;
+    timer_tree_replace_child(root, x->tree.parent, x, y);
+    y->tree.left = x;
+    x->tree.parent = y;
+
+    timer_tree_update_height(x);
+    timer_tree_update_height(y);
+    return y;
+}
+
+static timer_t* timer_tree_rotate_right(timer_t** root, timer_t* x) {
+    timer_t* y = x->tree.left;
+
+    x->tree.left = y->tree.right;
+    if (y->tree.right)
+        y->tree.right->tree.parent = x;
+    timer_tree_replace_child(root, x->tree.parent, x, y);
+    y->tree.right = x;
+    x->tree.parent = y;
+
+    timer_tree_update_height(x);
+    timer_tree_update_height(y);
+    return y;
+}
+
+// restore heights and balance from |t| up to the root
+static void timer_tree_rebalance(timer_t** root, timer_t* t) {
+    while (t) {
+        timer_tree_update_height(t);
+
+        int balance = timer_tree_height(t->tree.left) - timer_tree_height(t->tree.right);
+        if (balance > 1) {
+            timer_t* l = t->tree.left;
+            if (timer_tree_height(l->tree.left) < timer_tree_height(l->tree.right))
+                timer_tree_rotate_left(root, l);
+            t = timer_tree_rotate_right(root, t);
+        } else if (balance < -1) {
+            timer_t* r = t->tree.right;
+            if (timer_tree_height(r->tree.right) < timer_tree_height(r->tree.left))
+                timer_tree_rotate_right(root, r);
+            t = timer_tree_rotate_left(root, t);
+        }
+
+        t = t->tree.parent;
+    }
+}
+
+// the last timer in the tree whose scheduled_time is before |time|, if any
+static timer_t* timer_tree_last_before(timer_t* root, zx_time_t time) {
+    timer_t* found = NULL;
+    while (root) {
+        if (root->scheduled_time < time) {
+            found = root;
+            root = root->tree.right;
+        } else {
+            root = root->tree.left;
+        }
+    }
+    return found;
+}
+
+// Adds |timer| to |cpu|'s queue at the position given by its scheduled_time,
+// after any timers with the same scheduled_time.
+static void timer_queue_add(uint cpu, timer_t* timer) {
+    timer_t** root = &percpu[cpu].timer_tree;
+    timer_t** link = root;
+    timer_t* parent = NULL;
+    timer_t* prev = NULL;
+
+    while (*link) {
+        parent = *link;
+        if (timer->scheduled_time < parent->scheduled_time) {
+            link = &parent->tree.left;
+        } else {
+            prev = parent;
+            link = &parent->tree.right;
+        }
+    }
+
+    timer->tree.parent = parent;
+    timer->tree.left = NULL;
+    timer->tree.right = NULL;
+    timer->tree.height = 1;
+    *link = timer;
+    timer_tree_rebalance(root, parent);
+
+    if (prev) {
+        list_add_after(&prev->node, &timer->node);
+    } else {
+        list_add_head(&percpu[cpu].timer_queue, &timer->node);
+    }
+    timer->queue_cpu = cpu;
+}
+
+static void timer_queue_remove(timer_t* timer) {
+    DEBUG_ASSERT(list_in_list(&timer->node));
+
+    timer_t** root = &percpu[timer->queue_cpu].timer_tree;
+    timer_t* rebalance_from;
+
+    if (timer->tree.left && timer->tree.right) {
+        // replace |timer| with its successor, the leftmost node of its right subtree
+        timer_t* succ = timer->tree.right;
+        while (succ->tree.left)
+            succ = succ->tree.left;
+
+        if (succ->tree.parent == timer) {
+            rebalance_from = succ;
+        } else {
+            rebalance_from = succ->tree.parent;
+            rebalance_from->tree.left = succ->tree.right;
+            if (succ->tree.right)
+                succ->tree.right->tree.parent = rebalance_from;
+            succ->tree.right = timer->tree.right;
+            succ->tree.right->tree.parent = succ;
+        }
+        succ->tree.left = timer->tree.left;
+        succ->tree.left->tree.parent = succ;
+        timer_tree_replace_child(root, timer->tree.parent, timer, succ);
+    } else {
+        timer_t* child = timer->tree.left ? timer->tree.left : timer->tree.right;
+        rebalance_from = timer->tree.parent;
+        timer_tree_replace_child(root, rebalance_from, timer, child);
+    }
+    timer_tree_rebalance(root, rebalance_from);
+
+    timer->tree.parent = NULL;
+    timer->tree.left = NULL;
+    timer->tree.right = NULL;
+    list_delete(&timer->node);
+}
+
 static void insert_timer_in_queue(uint cpu, timer_t* timer,
                                   uint64_t early_slack, uint64_t late_slack) {
 
@@ -53,108 +220,81 @@ static void insert_timer_in_queue(uint cpu, timer_t* timer,
     zx_time_t latest_deadline = timer->scheduled_time + late_slack;
 
     // For inserting the timer we consider several cases. In general we
-    // want to coalesce with the current timer unless we can prove that
+    // want to coalesce with an existing timer unless we can prove that
     // either that:
-    //  1- there is no slack overlap with current timer OR
+    //  1- there is no slack overlap with existing timers OR
     //  2- the next timer is a better fit.
     //
+    // Only the two timers on either side of the new timer matter, so look
+    // those up rather than walking the queue.
+    //
     // In diagrams that follow
-    // - Let |e| be the current (existing) timer deadline
+    // - Let |e| be the last existing timer deadline before the new timer
     // - Let |t| be the deadline of the timer we are inserting
-    // - Let |n| be the next timer deadline if any
-    // - Let |x| be the end of the list (not a timer)
+    // - Let |n| be the next timer deadline at or after the new timer
     // - Let |(| and |)| the earliest_deadline and latest_deadline.
     //
-    timer_t* entry;
-
-    list_for_every_entry (&percpu[cpu].timer_queue, entry, timer_t, node) {
-        if (entry->scheduled_time > latest_deadline) {
-            // New timer latest is earlier than the current timer.
-            // Just add upfront as is, without slack.
-            //
-            //   ---------t---)--e-------------------------------> time
-            //
-            timer->slack = 0ull;
-            list_add_before(&entry->node, &timer->node);
-            return;
-        }
-
-        if (entry->scheduled_time >= timer->scheduled_time) {
-            //  New timer slack overlaps and is to the left (or equal). We
-            //  coalesce with current by scheduling late.
-            //
-            //  --------(----t---e-)----------------------------> time
-            //
-            timer->slack = entry->scheduled_time - timer->scheduled_time;
-            timer->scheduled_time = entry->scheduled_time;
-            list_add_after(&entry->node, &timer->node);
-            return;
-        }
-
-        if (entry->scheduled_time < earliest_deadline) {
-            // new timer earliest is later than the current timer. This case
-            // is handled in a future iteration.
-            //
-            //   ----------------e--(---t-----------------------> time
-            //
-            continue;
-        }
+    timer_t* entry = timer_tree_last_before(percpu[cpu].timer_tree, timer->scheduled_time);
+    timer_t* next = entry ? list_next_type(&percpu[cpu].timer_queue, &entry->node, timer_t, node)
+                          : list_peek_head_type(&percpu[cpu].timer_queue, timer_t, node);
 
-        // New timer is to the right of current timer and there is overlap
-        // with the current timer, but could the next timer (if any) be
-        // a better fit?
+    if (entry != NULL && entry->scheduled_time >= earliest_deadline) {
+        // New timer is to the right of the previous timer and there is
+        // overlap with it, but could the next timer (if any) be a better fit?
         //
         //  -------------(--e---t-----?-------------------> time
         //
-
-        const timer_t* next =
-            list_next_type(&percpu[cpu].timer_queue, &entry->node, timer_t, node);
-
+        bool prefer_next = false;
         if (next != NULL) {
-            if (next->scheduled_time <= timer->scheduled_time) {
-                // The new timer is to the right of the next timer. There is no
-                // chance the current timer is a better fit.
-                //
-                //  -------------(--e---n---t----------------------> time
-                //
-                continue;
-            }
-
-            if (next->scheduled_time < latest_deadline) {
+            if (next->scheduled_time == timer->scheduled_time) {
+                // The next timer is exactly where we want to be.
+                prefer_next = true;
+            } else if (next->scheduled_time < latest_deadline) {
                 // There is slack overlap with the next timer, and also with the
-                // current timer. Which coalescing is a better match?
+                // previous timer. Which coalescing is a better match?
                 //
                 //  --------------(-e---t---n-)-----------------------> time
                 //
                 zx_duration_t delta_entry = timer->scheduled_time - entry->scheduled_time;
                 zx_duration_t delta_next = next->scheduled_time - timer->scheduled_time;
-                if (delta_next < delta_entry) {
-                    // New timer is closer to the next timer, handle it in the
-                    // next iteration.
-                    continue;
-                }
+                prefer_next = delta_next < delta_entry;
             }
         }
 
-        // Handles the remaining cases, note that there is overlap with
-        // the current timer.
+        if (!prefer_next) {
+            // Handles the remaining cases, note that there is overlap with
+            // the previous timer.
+            //
+            //  1- there is no next timer (next == NULL) or
+            //  2- there is no overlap with the next timer, or
+            //  3- there is overlap with both previous and next but
+            //     previous is closer.
+            //
+            //  So we coalesce by scheduling early.
+            //
+            timer->slack = entry->scheduled_time - timer->scheduled_time;
+            timer->scheduled_time = entry->scheduled_time;
+            timer_queue_add(cpu, timer);
+            return;
+        }
+    }
+
+    if (next != NULL && next->scheduled_time <= latest_deadline) {
+        //  New timer slack overlaps and is to the left (or equal). We
+        //  coalesce with next by scheduling late.
+        //
+        //  --------(----t---n-)----------------------------> time
         //
-        //  1- this is the last timer (next == NULL) or
-        //  2- there is no overlap with the next timer, or
-        //  3- there is overlap with both current and next but
-        //     current is closer.
+        timer->slack = next->scheduled_time - timer->scheduled_time;
+        timer->scheduled_time = next->scheduled_time;
+    } else {
+        // No slack overlap with any timer. Add as is, without slack.
         //
-        //  So we coalesce by scheduling early.
+        //   ----e---(----t---)--n-------------------------------> time
         //
-        timer->slack = entry->scheduled_time - timer->scheduled_time;
-        timer->scheduled_time = entry->scheduled_time;
-        list_add_after(&entry->node, &timer->node);
-        return;
+        timer->slack = 0ull;
     }
-
-    // Walked off the end of the list and there was no overlap.
-    timer->slack = 0ull;
-    list_add_tail(&percpu[cpu].timer_queue, &timer->node);
+    timer_queue_add(cpu, timer);
 }
 
 void timer_set(timer_t* timer, zx_time_t deadline,
@@ -253,7 +393,7 @@ void timer_reset_oneshot_local(timer_t* timer, zx_time_t deadline, timer_callbac
 
     /* remove it from the queue if it was present */
     if (list_in_list(&timer->node))
-        list_delete(&timer->node);
+        timer_queue_remove(timer);
 
     /* set up the structure */
     timer->scheduled_time = deadline;
@@ -312,7 +452,7 @@ bool timer_cancel(timer_t* timer) {
         timer_t* oldhead = list_peek_head_type(&percpu[cpu].timer_queue, timer_t, node);
 
         /* remove our timer from the queue */
-        list_delete(&timer->node);
+        timer_queue_remove(timer);
 
         /* TODO(cpu): if  after removing |timer| there is one other single timer with
            the same scheduled_time and slack non-zero then it is possible to return
@@ -377,7 +517,7 @@ enum handler_return timer_tick(zx_time_t now) {
         DEBUG_ASSERT_MSG(timer && timer->magic == TIMER_MAGIC,
                          "ASSERT: timer failed magic check: timer %p, magic 0x%x\n",
                          timer, (uint)timer->magic);
-        list_delete(&timer->node);
+        timer_queue_remove(timer);
 
         /* mark the timer busy */
         timer->active_cpu = cpu;
@@ -455,6 +595,8 @@ void timer_transition_off_cpu(uint old_cpu) {
         // TODO(cpu): figure how important this case is.
         insert_timer_in_queue(cpu, entry, 0u, 0u);
     }
+    /* every node of the old tree was relinked above */
+    percpu[old_cpu].timer_tree = NULL;
 
     timer_t* new_head = list_peek_head_type(&percpu[cpu].timer_queue, timer_t, node);
     if (new_head != NULL && new_head != old_head) {
@@ -485,6 +627,7 @@ void timer_queue_init(void) {
     timer_lock = SPIN_LOCK_INITIAL_VALUE;
     for (uint i = 0; i < SMP_MAX_CPUS; i++) {
         list_initialize(&percpu[i].timer_queue);
+        percpu[i].timer_tree = NULL;
     }
 }
 
@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <err.h>
+#include <inttypes.h>
 #include <list.h>
 #include <arch/ops.h>
 #include <kernel/spinlock.h>
@@ -38,6 +39,217 @@ static bool heap_trace = false;
 #define heap_trace (false)
 #endif
 
+// Per-CPU caches of small free blocks.  malloc() and free() of small sizes
+// are served from the current CPU's cache without taking the cmpctmalloc
+// lock; the caches are refilled from, and flushed back to, cmpctmalloc in
+// batches so that the lock is taken once per batch rather than once per call.
+//
+// Every cached block is an ordinary cmpctmalloc allocation, so realloc(),
+// memalign() and the usable size of a block are unaffected.  A freed block
+// goes into the largest class that it can hold.
+//
+// cmpctmalloc can't see that a cached block is free, so in debug builds the
+// first word of each block freed into a cache is tagged, and freeing a
+// block that carries the tag checks the caches for a double free.
+namespace {
+
+const size_t kHeapCacheSizes[] = {16, 32, 48, 64, 96, 128, 192, 256, 384, 512};
+constexpr size_t kHeapCacheClasses = countof(kHeapCacheSizes);
+constexpr size_t kHeapCacheMaxSize = 512;
+constexpr size_t kHeapCacheDepth = 32;
+constexpr size_t kHeapCacheBatch = 16;
+
+#if LK_DEBUGLEVEL > 1
+constexpr uintptr_t kHeapCacheFreeTag = static_cast<uintptr_t>(0xcac4edf7eeb10c5aULL);
+#endif
+
+struct HeapPcpuCache {
+    spin_lock_t lock;
+    size_t count[kHeapCacheClasses];
+    void *blocks[kHeapCacheClasses][kHeapCacheDepth];
+
+    // Statistics, reported by the "heap cache" console command.
+    uint64_t alloc_hits;
+    uint64_t alloc_misses;
+    uint64_t flushes;
+} __CPU_ALIGN;
+
+// Zero initialization leaves every lock unlocked and every cache empty, so
+// these are usable before global constructors have run.
+HeapPcpuCache heap_pcpu_cache[SMP_MAX_CPUS];
+
+// Returns the smallest class that can satisfy an allocation of |size|.
+size_t heap_cache_alloc_class(size_t size) {
+    size_t c = 0;
+    while (kHeapCacheSizes[c] < size) {
+        c++;
+    }
+    return c;
+}
+
+// Returns the largest class that a block of |usable| bytes can serve, or
+// kHeapCacheClasses if the block should go straight back to cmpctmalloc.
+size_t heap_cache_free_class(size_t usable) {
+    if (usable < kHeapCacheSizes[0] || usable > 2 * kHeapCacheMaxSize) {
+        return kHeapCacheClasses;
+    }
+    size_t c = kHeapCacheClasses - 1;
+    while (kHeapCacheSizes[c] > usable) {
+        c--;
+    }
+    // Don't tie up a much larger block serving a small class.
+    return (usable <= 2 * kHeapCacheSizes[c]) ? c : kHeapCacheClasses;
+}
+
+void *heap_cache_alloc(size_t size) {
+    const size_t c = heap_cache_alloc_class(size);
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    HeapPcpuCache *cache = &heap_pcpu_cache[arch_curr_cpu_num()];
+    spin_lock(&cache->lock);
+    void *ptr = nullptr;
+    if (cache->count[c] > 0) {
+        ptr = cache->blocks[c][--cache->count[c]];
+        cache->alloc_hits++;
+    } else {
+        cache->alloc_misses++;
+    }
+    spin_unlock_restore(&cache->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+    if (ptr) {
+#if LK_DEBUGLEVEL > 1
+        *static_cast<uintptr_t *>(ptr) = 0;
+#endif
+        return ptr;
+    }
+
+    // Refill with a batch.  We may have migrated to another CPU while
+    // allocating; that's fine, the blocks go to whichever cache we're on.
+    void *batch[kHeapCacheBatch];
+    size_t n = cmpct_alloc_batch(kHeapCacheSizes[c], batch, kHeapCacheBatch);
+    if (n == 0) {
+        return nullptr;
+    }
+    ptr = batch[--n];
+
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    cache = &heap_pcpu_cache[arch_curr_cpu_num()];
+    spin_lock(&cache->lock);
+    while (n > 0 && cache->count[c] < kHeapCacheDepth) {
+        cache->blocks[c][cache->count[c]++] = batch[--n];
+    }
+    spin_unlock_restore(&cache->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (n > 0) {
+        cmpct_free_batch(batch, n);
+    }
+    return ptr;
+}
+
+#if LK_DEBUGLEVEL > 1
+// Panics if |ptr| is sitting in any CPU's cache.
+void heap_cache_check_double_free(void *ptr) {
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        HeapPcpuCache *cache = &heap_pcpu_cache[i];
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&cache->lock, state);
+        for (size_t c = 0; c < kHeapCacheClasses; c++) {
+            for (size_t j = 0; j < cache->count[c]; j++) {
+                if (cache->blocks[c][j] == ptr) {
+                    spin_unlock_irqrestore(&cache->lock, state);
+                    panic("double free of %p (cached on cpu %u)\n", ptr, i);
+                }
+            }
+        }
+        spin_unlock_irqrestore(&cache->lock, state);
+    }
+}
+#endif
+
+void heap_cache_free(void *ptr) {
+    const size_t c = heap_cache_free_class(cmpct_usable_size(ptr));
+    if (c == kHeapCacheClasses) {
+        cmpct_free(ptr);
+        return;
+    }
+
+#if LK_DEBUGLEVEL > 1
+    // The tag may also be leftover data, so only a match in a cache counts.
+    uintptr_t *tag = static_cast<uintptr_t *>(ptr);
+    if (*tag == kHeapCacheFreeTag) {
+        heap_cache_check_double_free(ptr);
+    }
+    *tag = kHeapCacheFreeTag;
+#endif
+
+    void *evicted[kHeapCacheBatch];
+    size_t num_evicted = 0;
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    HeapPcpuCache *cache = &heap_pcpu_cache[arch_curr_cpu_num()];
+    spin_lock(&cache->lock);
+    void **blocks = cache->blocks[c];
+    if (cache->count[c] == kHeapCacheDepth) {
+        // Flush the bottom of the stack; the top is the most recently freed
+        // and hence the most likely to still be cache-hot.
+        num_evicted = kHeapCacheBatch;
+        memcpy(evicted, blocks, num_evicted * sizeof(void *));
+        memmove(blocks, blocks + num_evicted,
+                (kHeapCacheDepth - num_evicted) * sizeof(void *));
+        cache->count[c] -= num_evicted;
+        cache->flushes++;
+    }
+    blocks[cache->count[c]++] = ptr;
+    spin_unlock_restore(&cache->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (num_evicted > 0) {
+        cmpct_free_batch(evicted, num_evicted);
+    }
+}
+
+void *heap_alloc(size_t size) {
+    if (size == 0 || size > kHeapCacheMaxSize) {
+        return cmpct_alloc(size);
+    }
+    return heap_cache_alloc(size);
+}
+
+// Returns a lower bound on the bytes held in all of the caches.  Racy, but
+// only used for reporting.
+size_t heap_cache_bytes() {
+    size_t bytes = 0;
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        const HeapPcpuCache &cache = heap_pcpu_cache[i];
+        for (size_t c = 0; c < kHeapCacheClasses; c++) {
+            bytes += cache.count[c] * kHeapCacheSizes[c];
+        }
+    }
+    return bytes;
+}
+
+// Empty every CPU's cache back into cmpctmalloc.
+void heap_cache_drain() {
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        HeapPcpuCache *cache = &heap_pcpu_cache[i];
+        for (size_t c = 0; c < kHeapCacheClasses; c++) {
+            void *blocks[kHeapCacheDepth];
+            spin_lock_saved_state_t state;
+            spin_lock_irqsave(&cache->lock, state);
+            size_t n = cache->count[c];
+            memcpy(blocks, cache->blocks[c], n * sizeof(void *));
+            cache->count[c] = 0;
+            spin_unlock_irqrestore(&cache->lock, state);
+
+            if (n > 0) {
+                cmpct_free_batch(blocks, n);
+            }
+        }
+    }
+}
+
+} // namespace
+
 void heap_init(void)
 {
     cmpct_init();
@@ -45,6 +257,7 @@ void heap_init(void)
 
 void heap_trim(void)
 {
+    heap_cache_drain();
     cmpct_trim();
 }
 
@@ -54,7 +267,7 @@ void *malloc(size_t size)
 
     LTRACEF("size %zu\n", size);
 
-    void *ptr = cmpct_alloc(size);
+    void *ptr = heap_alloc(size);
     if (unlikely(heap_trace))
         printf("caller %p malloc %zu -> %p\n", __GET_CALLER(), size, ptr);
 
@@ -90,7 +303,7 @@ void *calloc(size_t count, size_t size)
 
     size_t realsize = count * size;
 
-    void *ptr = cmpct_alloc(realsize);
+    void *ptr = heap_alloc(realsize);
     if (likely(ptr))
         memset(ptr, 0, realsize);
     if (unlikely(heap_trace))
@@ -123,16 +336,21 @@ void free(void *ptr)
     if (unlikely(heap_trace))
         printf("caller %p free %p\n", __GET_CALLER(), ptr);
 
-    cmpct_free(ptr);
+    if (ptr)
+        heap_cache_free(ptr);
 }
 
 static void heap_dump(bool panic_time)
 {
     cmpct_dump(panic_time);
+    dprintf(INFO, "\tper-cpu caches hold %zu free bytes\n", heap_cache_bytes());
 }
 
 void heap_get_info(size_t *size_bytes, size_t *free_bytes) {
     cmpct_get_info(size_bytes, free_bytes);
+    // Blocks in the per-CPU caches are free, even though cmpctmalloc
+    // counts them as allocated.
+    *free_bytes += heap_cache_bytes();
 }
 
 static void heap_test(void)
@@ -178,6 +396,20 @@ STATIC_COMMAND_START
 STATIC_COMMAND_MASKED("heap", "heap debug commands", &cmd_heap, CMD_AVAIL_ALWAYS)
 STATIC_COMMAND_END(heap);
 
+static void heap_cache_dump() {
+    printf("cpu %10s %10s %10s cached\n", "hits", "misses", "flushes");
+    for (uint i = 0; i < arch_max_num_cpus(); i++) {
+        // Racy, but only used for reporting.
+        const HeapPcpuCache& cache = heap_pcpu_cache[i];
+        size_t cached_bytes = 0;
+        for (size_t c = 0; c < kHeapCacheClasses; c++) {
+            cached_bytes += cache.count[c] * kHeapCacheSizes[c];
+        }
+        printf("%3u %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %zu bytes\n", i,
+               cache.alloc_hits, cache.alloc_misses, cache.flushes, cached_bytes);
+    }
+}
+
 static int cmd_heap(int argc, const cmd_args *argv, uint32_t flags)
 {
     if (argc < 2) {
@@ -189,6 +421,7 @@ usage:
         if (!(flags & CMD_FLAG_PANIC)) {
             printf("\t%s trace\n", argv[0].str);
             printf("\t%s trim\n", argv[0].str);
+            printf("\t%s cache\n", argv[0].str);
             printf("\t%s alloc <size> [alignment]\n", argv[0].str);
             printf("\t%s realloc <ptr> <size>\n", argv[0].str);
             printf("\t%s free <address>\n", argv[0].str);
@@ -205,6 +438,8 @@ usage:
         printf("heap trace is now %s\n", heap_trace ? "on" : "off");
     } else if (!(flags & CMD_FLAG_PANIC) && strcmp(argv[1].str, "trim") == 0) {
         heap_trim();
+    } else if (!(flags & CMD_FLAG_PANIC) && strcmp(argv[1].str, "cache") == 0) {
+        heap_cache_dump();
     } else if (!(flags & CMD_FLAG_PANIC) && strcmp(argv[1].str, "alloc") == 0) {
         if (argc < 3) goto notenoughargs;
 
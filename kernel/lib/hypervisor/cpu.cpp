@@ -5,19 +5,19 @@
 // https://opensource.org/licenses/MIT
 
 #include <arch/ops.h>
-#include <fbl/atomic.h>
 #include <hypervisor/cpu.h>
 #include <kernel/cpu.h>
 #include <kernel/mp.h>
 #include <kernel/thread.h>
 
 struct percpu_state {
-    fbl::atomic<cpu_mask_t> cpu_mask;
+    // Only accessed with the cpu_mask_atomic_* routines.
+    cpu_mask_t cpu_mask;
     percpu_task_t task;
     void* context;
 
     percpu_state(percpu_task_t _task, void* _context)
-        : cpu_mask(0), task(_task), context(_context) {}
+        : cpu_mask(cpu_mask_none()), task(_task), context(_context) {}
 };
 
 static void percpu_task(void* arg) {
@@ -25,13 +25,13 @@ static void percpu_task(void* arg) {
     cpu_num_t cpu_num = arch_curr_cpu_num();
     zx_status_t status = state->task(state->context, cpu_num);
     if (status == ZX_OK)
-        state->cpu_mask.fetch_or(cpu_num_to_mask(cpu_num));
+        cpu_mask_atomic_add(&state->cpu_mask, cpu_num);
 }
 
 cpu_mask_t percpu_exec(percpu_task_t task, void* context) {
     percpu_state state(task, context);
-    mp_sync_exec(MP_IPI_TARGET_ALL, 0, percpu_task, &state);
-    return state.cpu_mask.load();
+    mp_sync_exec(MP_IPI_TARGET_ALL, cpu_mask_none(), percpu_task, &state);
+    return cpu_mask_atomic_load(&state.cpu_mask);
 }
 
 cpu_num_t cpu_of(uint16_t vpid) {
@@ -47,6 +47,6 @@ thread_t* pin_thread(uint16_t vpid) {
 bool check_pinned_cpu_invariant(uint16_t vpid, const thread_t* thread) {
     cpu_num_t cpu = cpu_of(vpid);
     return thread == get_current_thread() &&
-           thread->cpu_affinity & cpu_num_to_mask(cpu) &&
+           cpu_mask_contains(thread->cpu_affinity, cpu) &&
            arch_curr_cpu_num() == cpu;
 }
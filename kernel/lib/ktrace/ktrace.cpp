@@ -7,17 +7,23 @@
 #include <debug.h>
 #include <err.h>
 #include <platform.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <arch/ops.h>
 #include <arch/user_copy.h>
+#include <kernel/atomic.h>
 #include <kernel/cmdline.h>
+#include <kernel/spinlock.h>
 #include <vm/vm_aspace.h>
+#include <lib/counters.h>
 #include <lib/ktrace.h>
 #include <lk/init.h>
 #include <zircon/thread_annotations.h>
 #include <object/thread_dispatcher.h>
 
+#include "ktrace_priv.h"
+
 #define ktrace_timestamp() current_ticks();
 #define ktrace_ticks_per_ms() (ticks_per_second() / 1000)
 
@@ -76,40 +82,141 @@ static void ktrace_report_probes(void) {
     }
 }
 
-typedef struct ktrace_state {
-    // where the next record will be written
-    int offset;
+static ktrace_state_t KTRACE_STATE;
 
-    // mask of groups we allow, 0 == tracing disabled
-    int grpmask;
+// Serializes readers, which matters in streaming mode where reads consume.
+static fbl::Mutex read_lock;
 
-    // total size of the trace buffer
-    uint32_t bufsize;
+// Per-cpu [tail, head) snapshot taken by ktrace_read_user.  Kept off the
+// stack since it scales with SMP_MAX_CPUS.
+static uint64_t read_tail[SMP_MAX_CPUS] TA_GUARDED(read_lock);
+static uint64_t read_head[SMP_MAX_CPUS] TA_GUARDED(read_lock);
 
-    // offset where tracing was stopped, 0 if tracing active
-    uint32_t marker;
+KCOUNTER(ktrace_dropped, "kernel.ktrace.dropped");
+KCOUNTER(ktrace_overwritten, "kernel.ktrace.overwritten");
+KCOUNTER(ktrace_names_spilled, "kernel.ktrace.names_spilled");
+KCOUNTER(ktrace_names_dropped, "kernel.ktrace.names_dropped");
 
-    // raw trace buffer
-    uint8_t* buffer;
-} ktrace_state_t;
+// Names dropped since the last rewind, reported when tracing stops.
+static int ktrace_names_lost;
 
-static ktrace_state_t KTRACE_STATE;
+// Copies |len| bytes starting at ring position |pos| to the user buffer.
+static zx_status_t ktrace_copy_ring(uint8_t* ptr, const ktrace_cpu_buffer_t* cb,
+                                    uint64_t pos, uint32_t len) {
+    uint32_t off = (uint32_t)(pos % cb->size);
+    uint32_t first = MIN(len, cb->size - off);
+    if (arch_copy_to_user(ptr, cb->base + off, first) != ZX_OK) {
+        return ZX_ERR_INVALID_ARGS;
+    }
+    if (first < len && arch_copy_to_user(ptr + first, cb->base, len - first) != ZX_OK) {
+        return ZX_ERR_INVALID_ARGS;
+    }
+    return ZX_OK;
+}
 
-int ktrace_read_user(void* ptr, uint32_t off, uint32_t len) {
-    ktrace_state_t* ks = &KTRACE_STATE;
+// Loads a record's tag, ordered before any loads of the payload it covers.
+static inline uint32_t ktrace_load_tag(const uint8_t* rec) {
+    return __atomic_load_n((const uint32_t*)rec, __ATOMIC_ACQUIRE);
+}
 
-    // Buffer size is limited by the marker if set,
-    // otherwise limited by offset (last written point).
-    // Offset can end up pointing past the end, so clip
-    // it to the actual buffer size to be safe.
-    uint32_t max;
-    if (ks->marker) {
-        max = ks->marker;
-    } else {
-        max = ks->offset;
-        if (max > ks->bufsize) {
-            max = ks->bufsize;
+uint32_t ktrace_whole_records(const ktrace_cpu_buffer_t* cb, uint64_t pos,
+                              uint64_t end, uint32_t max) {
+    uint32_t n = 0;
+    while (pos < end) {
+        // Stop at the first record still being filled in; anything after it
+        // waits for the next read so records are returned in order.
+        uint32_t tag = ktrace_load_tag(cb->base + pos % cb->size);
+        uint32_t len = KTRACE_LEN(tag);
+        if (len == 0 || (tag & KTRACE_FLAG_OPEN) || n + len > max) {
+            break;
+        }
+        n += len;
+        pos += len;
+    }
+    return n;
+}
+
+uint32_t ktrace_meta_records(const ktrace_state_t* ks, uint32_t pos,
+                             uint32_t end, uint32_t max) {
+    uint32_t n = 0;
+    while (pos + n < end) {
+        uint32_t len = KTRACE_LEN(ktrace_load_tag(ks->meta + pos + n));
+        if (len == 0 || n + len > max) {
+            break;
+        }
+        n += len;
+    }
+    return n;
+}
+
+static void ktrace_cpu_snapshot(ktrace_cpu_buffer_t* cb, uint64_t* tail, uint64_t* head) {
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&cb->lock, state);
+    *tail = cb->tail;
+    *head = cb->head;
+    spin_unlock_irqrestore(&cb->lock, state);
+}
+
+// Reads consume records: metadata first, then each cpu's ring in turn.
+// Only whole records are returned.
+static int ktrace_read_streaming(ktrace_state_t* ks, uint8_t* ptr, uint32_t len)
+    TA_REQ(read_lock) {
+    uint32_t meta_end = atomic_load(&ks->meta_offset);
+    uint32_t n = ktrace_meta_records(ks, ks->meta_read, meta_end, len);
+    if (ptr != nullptr) {
+        if (arch_copy_to_user(ptr, ks->meta + ks->meta_read, n) != ZX_OK) {
+            return ZX_ERR_INVALID_ARGS;
+        }
+        ks->meta_read += n;
+    }
+    uint32_t total = n;
+
+    for (uint32_t i = 0; i < ks->num_cpus; i++) {
+        ktrace_cpu_buffer_t* cb = &ks->cpu[i];
+        uint64_t tail, head;
+        ktrace_cpu_snapshot(cb, &tail, &head);
+        if (ptr == nullptr) {
+            total += (uint32_t)(head - tail);
+            continue;
         }
+
+        // Writers never overwrite unread records in this mode, so
+        // [tail, head) stays put while it is copied out.  Records are
+        // only consumed once their writer has closed them.
+        n = ktrace_whole_records(cb, tail, head, len - total);
+        if (ktrace_copy_ring(ptr + total, cb, tail, n) != ZX_OK) {
+            return ZX_ERR_INVALID_ARGS;
+        }
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&cb->lock, state);
+        cb->tail += n;
+        spin_unlock_irqrestore(&cb->lock, state);
+        total += n;
+    }
+    return total;
+}
+
+int ktrace_read_user(void* _ptr, uint32_t off, uint32_t len) {
+    ktrace_state_t* ks = &KTRACE_STATE;
+    uint8_t* ptr = static_cast<uint8_t*>(_ptr);
+
+    fbl::AutoLock lock(&read_lock);
+    if (ks->mode == KTRACE_MODE_STREAMING) {
+        // a null read is a query for the amount of buffered data, and
+        // offsets are ignored since reads consume what they return
+        return ktrace_read_streaming(ks, ptr, ptr ? len : UINT32_MAX);
+    }
+
+    // The trace appears as the metadata followed by each cpu's records,
+    // oldest first.  Records within a cpu are in time order, but
+    // consumers must sort by timestamp to merge cpus.
+    uint64_t* tail = read_tail;
+    uint64_t* head = read_head;
+    const uint32_t meta_end = atomic_load(&ks->meta_offset);
+    uint32_t max = meta_end;
+    for (uint32_t i = 0; i < ks->num_cpus; i++) {
+        ktrace_cpu_snapshot(&ks->cpu[i], &tail[i], &head[i]);
+        max += (uint32_t)(head[i] - tail[i]);
     }
 
     // null read is a query for trace buffer size
@@ -125,10 +232,56 @@ int ktrace_read_user(void* ptr, uint32_t off, uint32_t len) {
         len = max - off;
     }
 
-    if (arch_copy_to_user(ptr, ks->buffer + off, len) != ZX_OK) {
-        return ZX_ERR_INVALID_ARGS;
+    uint32_t copied = 0;
+    uint32_t seg_len = meta_end;
+    if (off < seg_len) {
+        uint32_t n = MIN(len, seg_len - off);
+        if (arch_copy_to_user(ptr, ks->meta + off, n) != ZX_OK) {
+            return ZX_ERR_INVALID_ARGS;
+        }
+        copied += n;
+        off += n;
+    }
+    off -= seg_len;
+    for (uint32_t i = 0; i < ks->num_cpus && copied < len; i++) {
+        seg_len = (uint32_t)(head[i] - tail[i]);
+        if (off < seg_len) {
+            uint32_t n = MIN(len - copied, seg_len - off);
+            if (ktrace_copy_ring(ptr + copied, &ks->cpu[i], tail[i] + off, n) != ZX_OK) {
+                return ZX_ERR_INVALID_ARGS;
+            }
+            copied += n;
+            off += n;
+        }
+        off -= seg_len;
+    }
+    return copied;
+}
+
+static void ktrace_rewind(ktrace_state_t* ks) {
+    // Clear the names written since the last rewind so a streaming read
+    // can't mistake what they leave behind for a filled-in reservation.
+    int meta_end = atomic_load(&ks->meta_offset);
+    if (meta_end > KTRACE_RECSIZE * 2) {
+        memset(ks->meta + KTRACE_RECSIZE * 2, 0, meta_end - KTRACE_RECSIZE * 2);
+    }
+
+    // roll back to just after the metadata
+    atomic_store(&ks->meta_offset, KTRACE_RECSIZE * 2);
+    for (uint32_t i = 0; i < ks->num_cpus; i++) {
+        ktrace_cpu_buffer_t* cb = &ks->cpu[i];
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&cb->lock, state);
+        cb->head = cb->tail = 0;
+        spin_unlock_irqrestore(&cb->lock, state);
+    }
+    {
+        fbl::AutoLock lock(&read_lock);
+        ks->meta_read = 0;
     }
-    return len;
+    atomic_store(&ktrace_names_lost, 0);
+    ktrace_report_syscalls(kt_syscall_info);
+    ktrace_report_probes();
 }
 
 zx_status_t ktrace_control(uint32_t action, uint32_t options, void* ptr) {
@@ -136,26 +289,20 @@ zx_status_t ktrace_control(uint32_t action, uint32_t options, void* ptr) {
     switch (action) {
     case KTRACE_ACTION_START:
         options = KTRACE_GRP_TO_MASK(options);
-        ks->marker = 0;
         atomic_store(&ks->grpmask, options ? options : KTRACE_GRP_TO_MASK(KTRACE_GRP_ALL));
         ktrace_report_live_processes();
         ktrace_report_live_threads();
         break;
     case KTRACE_ACTION_STOP: {
         atomic_store(&ks->grpmask, 0);
-        uint32_t n = ks->offset;
-        if (n > ks->bufsize) {
-            ks->marker = ks->bufsize;
-        } else {
-            ks->marker = n;
+        int lost = atomic_load(&ktrace_names_lost);
+        if (lost > 0) {
+            dprintf(INFO, "ktrace: %d names dropped, some records can't be symbolized\n", lost);
         }
         break;
     }
     case KTRACE_ACTION_REWIND:
-        // roll back to just after the metadata
-        atomic_store(&ks->offset, KTRACE_RECSIZE * 2);
-        ktrace_report_syscalls(kt_syscall_info);
-        ktrace_report_probes();
+        ktrace_rewind(ks);
         break;
     case KTRACE_ACTION_NEW_PROBE: {
         fbl::AutoLock lock(&probe_list_lock);
@@ -172,6 +319,17 @@ zx_status_t ktrace_control(uint32_t action, uint32_t options, void* ptr) {
         ktrace_add_probe(probe);
         return probe->num;
     }
+    case KTRACE_ACTION_SET_MODE:
+        if (options > KTRACE_MODE_STREAMING) {
+            return ZX_ERR_INVALID_ARGS;
+        }
+        if (atomic_load(&ks->grpmask) != 0) {
+            return ZX_ERR_BAD_STATE;
+        }
+        // the old contents don't follow the rules of the new mode
+        ks->mode = options;
+        ktrace_rewind(ks);
+        break;
     default:
         return ZX_ERR_INVALID_ARGS;
     }
@@ -180,6 +338,18 @@ zx_status_t ktrace_control(uint32_t action, uint32_t options, void* ptr) {
 
 int trace_not_ready = 0;
 
+static uint32_t ktrace_parse_mode(const char* mode) {
+    if (mode == nullptr || !strcmp(mode, "linear")) {
+        return KTRACE_MODE_LINEAR;
+    } else if (!strcmp(mode, "circular")) {
+        return KTRACE_MODE_CIRCULAR;
+    } else if (!strcmp(mode, "streaming")) {
+        return KTRACE_MODE_STREAMING;
+    }
+    dprintf(INFO, "ktrace: unknown mode '%s', using linear\n", mode);
+    return KTRACE_MODE_LINEAR;
+}
+
 void ktrace_init(unsigned level) {
     ktrace_state_t* ks = &KTRACE_STATE;
 
@@ -194,18 +364,29 @@ void ktrace_init(unsigned level) {
     mb *= (1024*1024);
 
     zx_status_t status;
+    uint8_t* buffer;
     VmAspace* aspace = VmAspace::kernel_aspace();
-    if ((status = aspace->Alloc("ktrace", mb, (void**)&ks->buffer, 0, VmAspace::VMM_FLAG_COMMIT,
+    if ((status = aspace->Alloc("ktrace", mb, (void**)&buffer, 0, VmAspace::VMM_FLAG_COMMIT,
                                 ARCH_MMU_FLAG_PERM_READ | ARCH_MMU_FLAG_PERM_WRITE)) < 0) {
         dprintf(INFO, "ktrace: cannot alloc buffer %d\n", status);
         return;
     }
 
-    // The last packet written can overhang the end of the buffer,
-    // so we reduce the reported size by the max size of a record
-    ks->bufsize = mb - 256;
+    // Names are small and rare compared to events, so give them a
+    // sixteenth of the buffer and split the rest evenly between cpus.
+    ks->mode = ktrace_parse_mode(cmdline_get("ktrace.mode"));
+    ks->meta = buffer;
+    ks->meta_size = ROUNDDOWN(mb / 16, KTRACE_RECSIZE);
+    ks->num_cpus = arch_max_num_cpus();
+    uint32_t cpu_size = ROUNDDOWN((mb - ks->meta_size) / ks->num_cpus, KTRACE_RECSIZE);
+    for (uint32_t i = 0; i < ks->num_cpus; i++) {
+        ktrace_cpu_buffer_t* cb = &ks->cpu[i];
+        spin_lock_init(&cb->lock);
+        cb->base = buffer + ks->meta_size + i * cpu_size;
+        cb->size = cpu_size;
+    }
 
-    dprintf(INFO, "ktrace: buffer at %p (%u bytes)\n", ks->buffer, mb);
+    dprintf(INFO, "ktrace: buffer at %p (%u bytes, %u per cpu)\n", buffer, mb, cpu_size);
 
     // register all static probes
     {
@@ -219,7 +400,7 @@ void ktrace_init(unsigned level) {
 
     // write metadata to the first two event slots
     uint64_t n = ktrace_ticks_per_ms();
-    ktrace_rec_32b_t* rec = (ktrace_rec_32b_t*) ks->buffer;
+    ktrace_rec_32b_t* rec = (ktrace_rec_32b_t*) ks->meta;
     rec[0].tag = TAG_VERSION;
     rec[0].a = KTRACE_VERSION;
     rec[1].tag = TAG_TICKS_PER_MS;
@@ -227,7 +408,7 @@ void ktrace_init(unsigned level) {
     rec[1].b = (uint32_t)(n >> 32);
 
     // enable tracing
-    atomic_store(&ks->offset, KTRACE_RECSIZE * 2);
+    atomic_store(&ks->meta_offset, KTRACE_RECSIZE * 2);
     ktrace_report_syscalls(kt_syscall_info);
     ktrace_report_probes();
     atomic_store(&ks->grpmask, KTRACE_GRP_TO_MASK(grpmask));
@@ -242,20 +423,60 @@ void ktrace_init(unsigned level) {
     ktrace_probe0("ktrace_ready");
 }
 
+void* ktrace_ring_alloc(ktrace_state_t* ks, ktrace_cpu_buffer_t* cb, uint32_t len) {
+    uint32_t off = (uint32_t)(cb->head % cb->size);
+    uint32_t pad = (cb->size - off < len) ? cb->size - off : 0;
+    if (cb->head + pad + len - cb->tail > cb->size) {
+        if (ks->mode != KTRACE_MODE_CIRCULAR) {
+            return nullptr;
+        }
+        // discard the oldest records until the new one fits
+        while (cb->head + pad + len - cb->tail > cb->size) {
+            uint32_t old_tag = *(uint32_t*)(cb->base + cb->tail % cb->size);
+            if (KTRACE_GROUP(old_tag) != 0) {
+                kcounter_add(ktrace_overwritten, 1);
+            }
+            cb->tail += KTRACE_LEN(old_tag);
+        }
+    }
+    if (pad != 0) {
+        *(uint32_t*)(cb->base + off) = KTRACE_TAG_PAD(pad);
+        cb->head += pad;
+        off = 0;
+    }
+    cb->head += len;
+    return cb->base + off;
+}
+
+// Reserves space for a record in the current cpu's ring and fills in its
+// header.  Returns nullptr if the record was dropped.  If |tag| has
+// KTRACE_FLAG_OPEN set, streaming reads stop at the record until
+// ktrace_close() clears it.
+static ktrace_header_t* ktrace_reserve(ktrace_state_t* ks, uint32_t tag, uint32_t tid) {
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    ktrace_cpu_buffer_t* cb = &ks->cpu[arch_curr_cpu_num()];
+    spin_lock(&cb->lock);
+
+    ktrace_header_t* hdr = (ktrace_header_t*)ktrace_ring_alloc(ks, cb, KTRACE_LEN(tag));
+    if (hdr != nullptr) {
+        hdr->ts = ktrace_timestamp();
+        hdr->tag = tag;
+        hdr->tid = tid;
+    } else {
+        kcounter_add(ktrace_dropped, 1);
+    }
+
+    spin_unlock(&cb->lock);
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+    return hdr;
+}
+
 void ktrace_tiny(uint32_t tag, uint32_t arg) {
     ktrace_state_t* ks = &KTRACE_STATE;
     if (tag & atomic_load(&ks->grpmask)) {
         tag = (tag & 0xFFFFFFF0) | 2;
-        int off;
-        if ((off = atomic_add(&ks->offset, KTRACE_HDRSIZE)) >= (int)ks->bufsize) {
-            // if we arrive at the end, stop
-            atomic_store(&ks->grpmask, 0);
-        } else {
-            ktrace_header_t* hdr = (ktrace_header_t*) (ks->buffer + off);
-            hdr->ts = ktrace_timestamp();
-            hdr->tag = tag;
-            hdr->tid = arg;
-        }
+        ktrace_reserve(ks, tag, arg);
     }
 }
 
@@ -265,20 +486,54 @@ void* ktrace_open(uint32_t tag) {
         return nullptr;
     }
 
-    int off;
-    if ((off = atomic_add(&ks->offset, KTRACE_LEN(tag))) >= (int)ks->bufsize) {
-        // if we arrive at the end, stop
-        atomic_store(&ks->grpmask, 0);
+    ktrace_header_t* hdr = ktrace_reserve(ks, tag | KTRACE_FLAG_OPEN,
+                                          (uint32_t)get_current_thread()->user_tid);
+    if (hdr == nullptr) {
         return nullptr;
     }
-
-    ktrace_header_t* hdr = (ktrace_header_t*) (ks->buffer + off);
-    hdr->ts = ktrace_timestamp();
-    hdr->tag = tag;
-    hdr->tid = (uint32_t)get_current_thread()->user_tid;
     return hdr + 1;
 }
 
+void ktrace_close(void* payload) {
+    if (payload == nullptr) {
+        return;
+    }
+    // The release orders the payload stores before the tag that publishes
+    // them.  Only this writer changes the tag once it is reserved.
+    ktrace_header_t* hdr = static_cast<ktrace_header_t*>(payload) - 1;
+    __atomic_store_n(&hdr->tag, hdr->tag & ~KTRACE_FLAG_OPEN, __ATOMIC_RELEASE);
+}
+
+static void ktrace_fill_name(ktrace_rec_name_t* rec, uint32_t tag, uint32_t id, uint32_t arg,
+                             const char* name, uint32_t len) {
+    rec->id = id;
+    rec->arg = arg;
+    memcpy(rec->name, name, len);
+    rec->name[len] = 0;
+    // A metadata name is reserved before it is filled in, so the tag goes
+    // last: a streaming read stops at a name whose tag is still zero.
+    __atomic_store_n(&rec->tag, tag, __ATOMIC_RELEASE);
+}
+
+// Writes a name record into the current cpu's ring.  In circular mode it
+// ages out along with the records around it.
+static bool ktrace_spill_name(ktrace_state_t* ks, uint32_t tag, uint32_t id, uint32_t arg,
+                              const char* name, uint32_t len) {
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    ktrace_cpu_buffer_t* cb = &ks->cpu[arch_curr_cpu_num()];
+    spin_lock(&cb->lock);
+
+    auto rec = (ktrace_rec_name_t*)ktrace_ring_alloc(ks, cb, KTRACE_LEN(tag));
+    if (rec != nullptr) {
+        ktrace_fill_name(rec, tag, id, arg, name, len);
+    }
+
+    spin_unlock(&cb->lock);
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+    return rec != nullptr;
+}
+
 static void ktrace_name_etc(uint32_t tag, uint32_t id, uint32_t arg, const char* name, bool always) {
     ktrace_state_t* ks = &KTRACE_STATE;
     if ((tag & atomic_load(&ks->grpmask)) || always) {
@@ -287,18 +542,22 @@ static void ktrace_name_etc(uint32_t tag, uint32_t id, uint32_t arg, const char*
         // set size to: sizeof(hdr) + len + 1, round up to multiple of 8
         tag = (tag & 0xFFFFFFF0) | ((KTRACE_NAMESIZE + len + 1 + 7) >> 3);
 
-        int off;
-        if ((off = atomic_add(&ks->offset, KTRACE_LEN(tag))) >= (int)ks->bufsize) {
-            // if we arrive at the end, stop
-            atomic_store(&ks->grpmask, 0);
-        } else {
-            ktrace_rec_name_t* rec = (ktrace_rec_name_t*) (ks->buffer + off);
-            rec->tag = tag;
-            rec->id = id;
-            rec->arg = arg;
-            memcpy(rec->name, name, len);
-            rec->name[len] = 0;
-        }
+        int off = atomic_load(&ks->meta_offset);
+        do {
+            if (off + KTRACE_LEN(tag) > ks->meta_size) {
+                // The metadata is full; fall back to the rings so the name
+                // is still delivered (and consumed, in streaming mode).
+                if (ktrace_spill_name(ks, tag, id, arg, name, len)) {
+                    kcounter_add(ktrace_names_spilled, 1);
+                } else {
+                    kcounter_add(ktrace_names_dropped, 1);
+                    atomic_add(&ktrace_names_lost, 1);
+                }
+                return;
+            }
+        } while (!atomic_cmpxchg(&ks->meta_offset, &off, off + KTRACE_LEN(tag)));
+
+        ktrace_fill_name((ktrace_rec_name_t*) (ks->meta + off), tag, id, arg, name, len);
     }
 }
 
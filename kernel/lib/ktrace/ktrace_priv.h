@@ -0,0 +1,75 @@
+// Copyright 2018 The Fuchsia Authors
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+
+#pragma once
+
+#include <kernel/align.h>
+#include <kernel/spinlock.h>
+#include <stdint.h>
+#include <zircon/compiler.h>
+#include <zircon/ktrace.h>
+
+// Set in the tag of a record whose payload is still being written, from
+// ktrace_open() until ktrace_close().  Bits 4-7 of a tag are otherwise
+// unused, so the length, group and event read the same either way.
+#define KTRACE_FLAG_OPEN 0x10
+
+// Each cpu records into its own ring buffer, so tracing never contends on a
+// shared cache line.  Ring positions only ever increase; the offset into the
+// buffer is the position modulo its size.  A record never straddles the end
+// of a ring: the remaining space is filled with a padding record instead.
+typedef struct ktrace_cpu_buffer {
+    spin_lock_t lock;
+
+    // start and size of this cpu's ring
+    uint8_t* base;
+    uint32_t size;
+
+    // position where the next record will be written
+    uint64_t head;
+
+    // position of the oldest record that has not been overwritten or consumed
+    uint64_t tail;
+} __CPU_ALIGN ktrace_cpu_buffer_t;
+
+typedef struct ktrace_state {
+    // mask of groups we allow, 0 == tracing disabled
+    int grpmask;
+
+    // one of KTRACE_MODE_*, only changed while tracing is disabled
+    uint32_t mode;
+
+    // Metadata (version, names) lives in a separate append-only buffer so
+    // that circular mode can't overwrite the names that records refer to.
+    // Once it is full, names spill into the cpu rings like any other record.
+    uint8_t* meta;
+    uint32_t meta_size;
+
+    // where the next metadata record will be written
+    int meta_offset;
+
+    // in streaming mode, how much of the metadata has been read
+    uint32_t meta_read;
+
+    uint32_t num_cpus;
+    ktrace_cpu_buffer_t cpu[SMP_MAX_CPUS];
+} ktrace_state_t;
+
+// Makes room for a |len| byte record at the head of |cb| and advances the
+// head past it.  The caller must fill in at least the tag before dropping
+// the ring lock, so that circular mode can always find the length of the
+// oldest record.  Returns nullptr if there is no room.
+void* ktrace_ring_alloc(ktrace_state_t* ks, ktrace_cpu_buffer_t* cb, uint32_t len);
+
+// Returns the number of bytes of whole, committed records between |pos| and
+// |end| of the ring that fit in |max| bytes.
+uint32_t ktrace_whole_records(const ktrace_cpu_buffer_t* cb, uint64_t pos,
+                              uint64_t end, uint32_t max);
+
+// Same as ktrace_whole_records() for the metadata buffer, where a name whose
+// reservation hasn't been filled in yet reads as zero or open.
+uint32_t ktrace_meta_records(const ktrace_state_t* ks, uint32_t pos,
+                             uint32_t end, uint32_t max);
@@ -0,0 +1,145 @@
+// Copyright 2018 The Fuchsia Authors
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+
+#include <lib/ktrace.h>
+#include <string.h>
+#include <unittest.h>
+
+#include "ktrace_priv.h"
+
+// The tests build their own rings rather than touching the live trace.
+static ktrace_state_t test_state;
+static uint8_t test_buffer[KTRACE_RECSIZE * 4];
+
+static ktrace_cpu_buffer_t* init_test_ring(uint32_t mode, uint32_t size) {
+    memset(&test_state, 0, sizeof(test_state));
+    memset(test_buffer, 0, sizeof(test_buffer));
+    test_state.mode = mode;
+    test_state.meta = test_buffer;
+    test_state.meta_size = sizeof(test_buffer);
+    ktrace_cpu_buffer_t* cb = &test_state.cpu[0];
+    spin_lock_init(&cb->lock);
+    cb->base = test_buffer;
+    cb->size = size;
+    return cb;
+}
+
+// Allocates a record of |len| bytes and fills in its tag, as
+// ktrace_reserve() does under the ring lock.
+static uint32_t* alloc_record(ktrace_cpu_buffer_t* cb, uint32_t len, uint32_t event,
+                              bool open) {
+    uint32_t* rec = static_cast<uint32_t*>(ktrace_ring_alloc(&test_state, cb, len));
+    if (rec != nullptr) {
+        *rec = KTRACE_TAG(event, KTRACE_GRP_PROBE, len) | (open ? KTRACE_FLAG_OPEN : 0);
+    }
+    return rec;
+}
+
+static bool linear_ring_drops_when_full(void* context) {
+    BEGIN_TEST;
+    ktrace_cpu_buffer_t* cb = init_test_ring(KTRACE_MODE_LINEAR, sizeof(test_buffer));
+    for (uint32_t i = 0; i < 4; i++) {
+        EXPECT_EQ(test_buffer + i * KTRACE_RECSIZE,
+                  reinterpret_cast<uint8_t*>(alloc_record(cb, KTRACE_RECSIZE, i, false)), "");
+    }
+    EXPECT_NULL(alloc_record(cb, KTRACE_HDRSIZE, 4, false), "full ring should drop");
+    EXPECT_EQ(0u, cb->tail, "dropping must not move the tail");
+    EXPECT_EQ(sizeof(test_buffer), cb->head, "");
+    END_TEST;
+}
+
+static bool circular_ring_overwrites_oldest(void* context) {
+    BEGIN_TEST;
+    ktrace_cpu_buffer_t* cb = init_test_ring(KTRACE_MODE_CIRCULAR, sizeof(test_buffer));
+    for (uint32_t i = 0; i < 4; i++) {
+        alloc_record(cb, KTRACE_RECSIZE, i, false);
+    }
+    uint32_t* rec = alloc_record(cb, KTRACE_RECSIZE, 4, false);
+    EXPECT_EQ(test_buffer, reinterpret_cast<uint8_t*>(rec), "should wrap to the start");
+    EXPECT_EQ(static_cast<uint64_t>(KTRACE_RECSIZE), cb->tail, "oldest record discarded");
+    EXPECT_EQ(cb->size, cb->head - cb->tail, "");
+
+    // The oldest surviving record is now the second one written.
+    uint32_t tag = *reinterpret_cast<uint32_t*>(cb->base + cb->tail % cb->size);
+    EXPECT_EQ(1u, static_cast<uint32_t>(KTRACE_EVENT(tag)), "");
+    END_TEST;
+}
+
+static bool ring_pads_instead_of_straddling(void* context) {
+    BEGIN_TEST;
+    // 48 byte records in a 128 byte ring: the third can't fit in the 32
+    // bytes left at the end, so it starts over at the beginning.
+    ktrace_cpu_buffer_t* cb = init_test_ring(KTRACE_MODE_CIRCULAR, sizeof(test_buffer));
+    alloc_record(cb, 48, 0, false);
+    alloc_record(cb, 48, 1, false);
+    uint32_t* rec = alloc_record(cb, 48, 2, false);
+    EXPECT_EQ(test_buffer, reinterpret_cast<uint8_t*>(rec), "");
+    EXPECT_EQ(static_cast<uint32_t>(KTRACE_TAG_PAD(32)),
+              *reinterpret_cast<uint32_t*>(test_buffer + 96), "expected a padding record");
+    EXPECT_EQ(48u, cb->tail, "only the first record should be discarded");
+
+    // A streaming read from the tail sees the second record and the padding
+    // up to the end of the ring, then the record at the start.
+    EXPECT_EQ(48u + 32u + 48u, ktrace_whole_records(cb, cb->tail, cb->head, UINT32_MAX), "");
+    END_TEST;
+}
+
+static bool streaming_read_stops_at_open_record(void* context) {
+    BEGIN_TEST;
+    ktrace_cpu_buffer_t* cb = init_test_ring(KTRACE_MODE_STREAMING, sizeof(test_buffer));
+    alloc_record(cb, KTRACE_RECSIZE, 0, false);
+    uint32_t* open = alloc_record(cb, KTRACE_RECSIZE, 1, true);
+    alloc_record(cb, KTRACE_RECSIZE, 2, false);
+
+    EXPECT_EQ(static_cast<uint32_t>(KTRACE_RECSIZE),
+              ktrace_whole_records(cb, cb->tail, cb->head, UINT32_MAX),
+              "records from the open one on must wait");
+
+    ktrace_close(reinterpret_cast<ktrace_header_t*>(open) + 1);
+    EXPECT_EQ(0u, *open & KTRACE_FLAG_OPEN, "close should clear the flag");
+    EXPECT_EQ(1u, static_cast<uint32_t>(KTRACE_EVENT(*open)), "close must keep the tag");
+    EXPECT_EQ(static_cast<uint32_t>(KTRACE_RECSIZE * 3),
+              ktrace_whole_records(cb, cb->tail, cb->head, UINT32_MAX), "");
+    END_TEST;
+}
+
+static bool streaming_read_returns_whole_records(void* context) {
+    BEGIN_TEST;
+    ktrace_cpu_buffer_t* cb = init_test_ring(KTRACE_MODE_STREAMING, sizeof(test_buffer));
+    alloc_record(cb, KTRACE_RECSIZE, 0, false);
+    alloc_record(cb, KTRACE_RECSIZE, 1, false);
+
+    EXPECT_EQ(0u, ktrace_whole_records(cb, cb->tail, cb->head, KTRACE_RECSIZE - 1), "");
+    EXPECT_EQ(static_cast<uint32_t>(KTRACE_RECSIZE),
+              ktrace_whole_records(cb, cb->tail, cb->head, KTRACE_RECSIZE * 2 - 1), "");
+    EXPECT_EQ(static_cast<uint32_t>(KTRACE_RECSIZE),
+              ktrace_whole_records(cb, cb->tail + KTRACE_RECSIZE, cb->head, UINT32_MAX), "");
+    EXPECT_EQ(0u, ktrace_whole_records(cb, cb->head, cb->head, UINT32_MAX), "");
+    END_TEST;
+}
+
+static bool streaming_read_stops_at_unfilled_name(void* context) {
+    BEGIN_TEST;
+    init_test_ring(KTRACE_MODE_STREAMING, sizeof(test_buffer));
+    // A filled-in name followed by a reservation whose tag is still zero.
+    *reinterpret_cast<uint32_t*>(test_buffer) = KTRACE_TAG(0, KTRACE_GRP_META, 32);
+    EXPECT_EQ(32u, ktrace_meta_records(&test_state, 0, 64, UINT32_MAX), "");
+    EXPECT_EQ(0u, ktrace_meta_records(&test_state, 32, 64, UINT32_MAX), "");
+
+    *reinterpret_cast<uint32_t*>(test_buffer + 32) = KTRACE_TAG(1, KTRACE_GRP_META, 32);
+    EXPECT_EQ(64u, ktrace_meta_records(&test_state, 0, 64, UINT32_MAX), "");
+    EXPECT_EQ(32u, ktrace_meta_records(&test_state, 0, 64, 63), "");
+    END_TEST;
+}
+
+UNITTEST_START_TESTCASE(ktrace_tests)
+UNITTEST("linear ring drops when full", linear_ring_drops_when_full)
+UNITTEST("circular ring overwrites oldest", circular_ring_overwrites_oldest)
+UNITTEST("ring pads instead of straddling", ring_pads_instead_of_straddling)
+UNITTEST("streaming read stops at open record", streaming_read_stops_at_open_record)
+UNITTEST("streaming read returns whole records", streaming_read_returns_whole_records)
+UNITTEST("streaming read stops at unfilled name", streaming_read_stops_at_unfilled_name)
+UNITTEST_END_TESTCASE(ktrace_tests, "ktrace", "ktrace per-cpu ring tests", nullptr, nullptr);
@@ -71,6 +71,7 @@ ChannelDispatcher::~ChannelDispatcher() {
 
     messages_.clear();
     message_count_ = 0;
+    message_bytes_ = 0;
 }
 
 zx_status_t ChannelDispatcher::add_observer(StateObserver* observer) {
@@ -156,6 +157,7 @@ zx_status_t ChannelDispatcher::Read(uint32_t* msg_size,
 
     *msg = messages_.pop_front();
     message_count_--;
+    message_bytes_ -= (*msg)->buffer_size();
 
     if (messages_.is_empty())
         UpdateState(ZX_CHANNEL_READABLE, 0u);
@@ -163,6 +165,15 @@ zx_status_t ChannelDispatcher::Read(uint32_t* msg_size,
     return rv;
 }
 
+void ChannelDispatcher::GetQueueStats(uint64_t* message_count,
+                                      uint64_t* message_bytes) const {
+    canary_.Assert();
+
+    AutoLock lock(&lock_);
+    *message_count = message_count_;
+    *message_bytes = message_bytes_;
+}
+
 zx_status_t ChannelDispatcher::Write(fbl::unique_ptr<MessagePacket> msg) {
     canary_.Assert();
 
@@ -279,6 +290,7 @@ int ChannelDispatcher::WriteSelf(fbl::unique_ptr<MessagePacket> msg) {
             }
         }
     }
+    message_bytes_ += msg->buffer_size();
     messages_.push_back(fbl::move(msg));
     message_count_++;
 
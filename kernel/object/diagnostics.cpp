@@ -12,7 +12,10 @@
 
 #include <lib/console.h>
 #include <lib/ktrace.h>
+#include <fbl/alloc_checker.h>
 #include <fbl/auto_lock.h>
+#include <fbl/unique_ptr.h>
+#include <object/channel_dispatcher.h>
 #include <object/handle.h>
 #include <object/job_dispatcher.h>
 #include <object/port_dispatcher.h>
@@ -167,15 +170,60 @@ void DumpProcessHandles(zx_koid_t id) {
     printf("process [%" PRIu64 "] handles :\n", id);
     printf("handle       koid : type\n");
 
+    // Channel queue stats take the channel's lock, which must not nest
+    // inside the handle table lock, so snapshot the table and query the
+    // channels once the lock has been dropped.
+    struct HandleEntry {
+        zx_handle_t handle;
+        zx_koid_t koid;
+        zx_obj_type_t type;
+        fbl::RefPtr<const ChannelDispatcher> channel;
+    };
+
+    uint32_t count = 0;
+    pd->ForEachHandle([&](zx_handle_t, zx_rights_t, const Dispatcher*) {
+        ++count;
+        return ZX_OK;
+    });
+
+    // Leave some room for handles created between the two walks.
+    const uint32_t capacity = count + 16;
+    fbl::AllocChecker ac;
+    fbl::unique_ptr<HandleEntry[]> entries(new (&ac) HandleEntry[capacity]);
+    if (!ac.check()) {
+        printf("no memory to dump %u handles\n", count);
+        return;
+    }
+
     uint32_t total = 0;
-    pd->ForEachHandle([&](zx_handle_t handle, zx_rights_t rights,
-                          const Dispatcher* disp) {
-        printf("%9x %7" PRIu64 " : %s\n",
-            handle, disp->get_koid(), ObjectTypeToString(disp->get_type()));
-        ++total;
+    zx_status_t status = pd->ForEachHandle([&](zx_handle_t handle, zx_rights_t rights,
+                                               const Dispatcher* disp) {
+        if (total == capacity) {
+            return ZX_ERR_BUFFER_TOO_SMALL;
+        }
+        HandleEntry* e = &entries[total++];
+        e->handle = handle;
+        e->koid = disp->get_koid();
+        e->type = disp->get_type();
+        if (auto channel = DownCastDispatcher<const ChannelDispatcher>(disp)) {
+            // The handle keeps the channel alive while we hold the lock.
+            e->channel = fbl::WrapRefPtr(channel);
+        }
         return ZX_OK;
     });
-    printf("total: %u handles\n", total);
+
+    for (uint32_t i = 0; i < total; i++) {
+        const HandleEntry& e = entries[i];
+        printf("%9x %7" PRIu64 " : %s", e.handle, e.koid, ObjectTypeToString(e.type));
+        if (e.channel) {
+            uint64_t msgs, bytes;
+            e.channel->GetQueueStats(&msgs, &bytes);
+            printf(" (%" PRIu64 " msgs, %" PRIu64 " bytes)", msgs, bytes);
+        }
+        printf("\n");
+    }
+    printf("total: %u handles%s\n", total,
+           status != ZX_OK ? " (truncated)" : "");
 }
 
 void ktrace_report_live_processes() {
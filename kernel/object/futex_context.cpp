@@ -26,7 +26,19 @@ FutexContext::~FutexContext() {
 
     // All of the threads should have removed themselves from wait queues
     // by the time the process has exited.
-    DEBUG_ASSERT(futex_table_.is_empty());
+    for (auto& shard : shards_) {
+        AutoLock lock(&shard.lock);
+        DEBUG_ASSERT(shard.futex_table.is_empty());
+    }
+}
+
+FutexContext::Shard* FutexContext::ShardFor(uintptr_t futex_key) {
+    // Neighbouring futexes are often in the same structure, so mix the
+    // address bits (Fibonacci hashing) before picking a shard.  The top
+    // bits are used, which leaves the low bits for the per-shard table.
+    constexpr uint64_t kGoldenRatio = 0x9E3779B97F4A7C15ull;
+    uint64_t hash = (static_cast<uint64_t>(futex_key) >> 2) * kGoldenRatio;
+    return &shards_[hash >> (64 - kShardBits)];
 }
 
 zx_status_t FutexContext::FutexWait(user_in_ptr<const int> value_ptr, int current_value, zx_time_t deadline) {
@@ -37,6 +49,7 @@ zx_status_t FutexContext::FutexWait(user_in_ptr<const int> value_ptr, int curren
         return ZX_ERR_INVALID_ARGS;
 
     FutexNode* node;
+    Shard* shard = ShardFor(futex_key);
 
     // FutexWait() checks that the address value_ptr still contains
     // current_value, and if so it sleeps awaiting a FutexWake() on value_ptr.
@@ -44,16 +57,16 @@ zx_status_t FutexContext::FutexWait(user_in_ptr<const int> value_ptr, int curren
     // If a FutexWake() operation could occur between them, a userland mutex
     // operation built on top of futexes would have a race condition that
     // could miss wakeups.
-    lock_.Acquire();
+    shard->lock.Acquire();
 
     int value;
     zx_status_t result = value_ptr.copy_from_user(&value);
     if (result != ZX_OK) {
-        lock_.Release();
+        shard->lock.Release();
         return result;
     }
     if (value != current_value) {
-        lock_.Release();
+        shard->lock.Release();
         return ZX_ERR_BAD_STATE;
     }
 
@@ -62,10 +75,10 @@ zx_status_t FutexContext::FutexWait(user_in_ptr<const int> value_ptr, int curren
     node->set_hash_key(futex_key);
     node->SetAsSingletonList();
 
-    QueueNodesLocked(node);
+    QueueNodesLocked(shard, node);
 
-    // Block current thread.  This releases lock_ and does not reacquire it.
-    result = node->BlockThread(&lock_, deadline);
+    // Block current thread.  This releases the shard lock and does not reacquire it.
+    result = node->BlockThread(&shard->lock, deadline);
     if (result == ZX_OK) {
         DEBUG_ASSERT(!node->IsInQueue());
         // All the work necessary for removing us from the hash table was done by FutexWake()
@@ -78,8 +91,7 @@ zx_status_t FutexContext::FutexWait(user_in_ptr<const int> value_ptr, int curren
     //
     // We need to ensure that the thread's node is removed from the wait
     // queue, because FutexWake() probably didn't do that.
-    AutoLock lock(&lock_);
-    if (UnqueueNodeLocked(node)) {
+    if (UnqueueNode(node)) {
         return result;
     }
     // The current thread was not found on the wait queue.  This means
@@ -114,9 +126,10 @@ zx_status_t FutexContext::FutexWake(user_in_ptr<const int> value_ptr,
     if (futex_key % sizeof(int))
         return ZX_ERR_INVALID_ARGS;
 
-    AutoLock lock(&lock_);
+    Shard* shard = ShardFor(futex_key);
+    AutoLock lock(&shard->lock);
 
-    FutexNode* node = futex_table_.erase(futex_key);
+    FutexNode* node = shard->futex_table.erase(futex_key);
     if (!node) {
         // nothing blocked on this futex if we can't find it
         return ZX_OK;
@@ -129,7 +142,7 @@ zx_status_t FutexContext::FutexWake(user_in_ptr<const int> value_ptr,
 
     if (remaining_waiters) {
         DEBUG_ASSERT(remaining_waiters->GetKey() == futex_key);
-        futex_table_.insert(remaining_waiters);
+        shard->futex_table.insert(remaining_waiters);
     }
 
     if (any_woken) {
@@ -147,7 +160,41 @@ zx_status_t FutexContext::FutexRequeue(user_in_ptr<const int> wake_ptr, uint32_t
     if ((requeue_ptr.get() == nullptr) && requeue_count)
         return ZX_ERR_INVALID_ARGS;
 
-    AutoLock lock(&lock_);
+    uintptr_t wake_key = reinterpret_cast<uintptr_t>(wake_ptr.get());
+    uintptr_t requeue_key = reinterpret_cast<uintptr_t>(requeue_ptr.get());
+    Shard* wake_shard = ShardFor(wake_key);
+    Shard* requeue_shard = ShardFor(requeue_key);
+
+    zx_status_t result;
+    bool any_woken = false;
+    if (wake_shard == requeue_shard) {
+        AutoLock lock(&wake_shard->lock);
+        result = RequeueLocked(wake_shard, wake_ptr, wake_count, current_value,
+                               requeue_shard, requeue_ptr, requeue_count, &any_woken);
+    } else {
+        // Take both shard locks in address order so that two requeues in
+        // opposite directions can't deadlock.
+        Shard* first = (wake_shard < requeue_shard) ? wake_shard : requeue_shard;
+        Shard* second = (wake_shard < requeue_shard) ? requeue_shard : wake_shard;
+        AutoLock first_lock(&first->lock);
+        AutoLock second_lock(&second->lock);
+        result = RequeueLocked(wake_shard, wake_ptr, wake_count, current_value,
+                               requeue_shard, requeue_ptr, requeue_count, &any_woken);
+    }
+
+    if (any_woken) {
+        thread_reschedule();
+    }
+
+    return result;
+}
+
+zx_status_t FutexContext::RequeueLocked(Shard* wake_shard, user_in_ptr<const int> wake_ptr,
+                                        uint32_t wake_count, int current_value,
+                                        Shard* requeue_shard, user_in_ptr<const int> requeue_ptr,
+                                        uint32_t requeue_count, bool* any_woken) {
+    DEBUG_ASSERT(wake_shard->lock.IsHeld());
+    DEBUG_ASSERT(requeue_shard->lock.IsHeld());
 
     int value;
     zx_status_t result = wake_ptr.copy_from_user(&value);
@@ -161,17 +208,16 @@ zx_status_t FutexContext::FutexRequeue(user_in_ptr<const int> wake_ptr, uint32_t
         return ZX_ERR_INVALID_ARGS;
 
     // This must happen before RemoveFromHead() calls set_hash_key() on
-    // nodes below, because operations on futex_table_ look at the GetKey
+    // nodes below, because operations on futex_table look at the GetKey
     // field of the list head nodes for wake_key and requeue_key.
-    FutexNode* node = futex_table_.erase(wake_key);
+    FutexNode* node = wake_shard->futex_table.erase(wake_key);
     if (!node) {
         // nothing blocked on this futex if we can't find it
         return ZX_OK;
     }
 
-    bool any_woken = false;
     if (wake_count > 0) {
-        node = FutexNode::WakeThreads(node, wake_count, wake_key, &any_woken);
+        node = FutexNode::WakeThreads(node, wake_count, wake_key, any_woken);
     }
 
     // node is now the head of wake_ptr futex after possibly removing some threads to wake
@@ -184,42 +230,58 @@ zx_status_t FutexContext::FutexRequeue(user_in_ptr<const int> wake_ptr, uint32_t
 
             // now requeue our nodes to requeue_ptr mutex
             DEBUG_ASSERT(requeue_head->GetKey() == requeue_key);
-            QueueNodesLocked(requeue_head);
+            QueueNodesLocked(requeue_shard, requeue_head);
         }
     }
 
     // add any remaining nodes back to wake_key futex
     if (node != nullptr) {
         DEBUG_ASSERT(node->GetKey() == wake_key);
-        futex_table_.insert(node);
-    }
-
-    if (any_woken) {
-        lock.release();
-        thread_reschedule();
+        wake_shard->futex_table.insert(node);
     }
 
     return ZX_OK;
 }
 
-void FutexContext::QueueNodesLocked(FutexNode* head) {
-    DEBUG_ASSERT(lock_.IsHeld());
+void FutexContext::QueueNodesLocked(Shard* shard, FutexNode* head) {
+    DEBUG_ASSERT(shard->lock.IsHeld());
 
-    FutexNode::HashTable::iterator iter;
+    decltype(shard->futex_table)::iterator iter;
 
     // Attempt to insert this FutexNode into the hash table.  If the insert
     // succeeds, then the current thread is first to block on this futex and we
     // are finished.  If the insert fails, then there is already a thread
     // waiting on this futex.  Add ourselves to that thread's list.
-    if (!futex_table_.insert_or_find(head, &iter))
+    if (!shard->futex_table.insert_or_find(head, &iter))
         iter->AppendList(head);
 }
 
+// This locks the shard that |node| is queued in and unqueues it, returning
+// whether the node was still queued.
+bool FutexContext::UnqueueNode(FutexNode* node) {
+    // FutexRequeue() may have moved the node to a futex in another shard.
+    // It changes the node's key only while holding the locks of both
+    // shards, so once we hold the lock of the shard the key maps to, the
+    // key can't change under us.
+    Shard* shard;
+    for (;;) {
+        shard = ShardFor(node->GetKey());
+        shard->lock.Acquire();
+        if (ShardFor(node->GetKey()) == shard) {
+            break;
+        }
+        shard->lock.Release();
+    }
+    bool unqueued = UnqueueNodeLocked(shard, node);
+    shard->lock.Release();
+    return unqueued;
+}
+
 // This attempts to unqueue a thread (which may or may not be waiting on a
 // futex), given its FutexNode.  This returns whether the FutexNode was
 // found and removed from a futex wait queue.
-bool FutexContext::UnqueueNodeLocked(FutexNode* node) {
-    DEBUG_ASSERT(lock_.IsHeld());
+bool FutexContext::UnqueueNodeLocked(Shard* shard, FutexNode* node) {
+    DEBUG_ASSERT(shard->lock.IsHeld());
 
     if (!node->IsInQueue())
         return false;
@@ -230,10 +292,10 @@ bool FutexContext::UnqueueNodeLocked(FutexNode* node) {
     // FutexRequeue(), so we need to re-get the hash table key here.
     uintptr_t futex_key = node->GetKey();
 
-    FutexNode* old_head = futex_table_.erase(futex_key);
+    FutexNode* old_head = shard->futex_table.erase(futex_key);
     DEBUG_ASSERT(old_head);
     FutexNode* new_head = FutexNode::RemoveNodeFromList(old_head, node);
     if (new_head)
-        futex_table_.insert(new_head);
+        shard->futex_table.insert(new_head);
     return true;
 }
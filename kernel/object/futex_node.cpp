@@ -85,8 +85,8 @@ FutexNode* FutexNode::WakeThreads(FutexNode* node, uint32_t count,
     FutexNode* const list_end = node->queue_prev_;
     for (uint32_t i = 0; i < count; i++) {
         DEBUG_ASSERT(node->GetKey() == old_hash_key);
-        // Clear this field to avoid any possible confusion.
-        node->set_hash_key(0);
+        // The key is left alone: a FutexWait() that timed out concurrently
+        // uses it to find, and wait for, the lock we are holding.
 
         const bool is_last_node = (node == list_end);
         FutexNode* next = node->queue_next_;
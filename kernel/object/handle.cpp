@@ -6,12 +6,16 @@
 
 #include <object/handle.h>
 
+#include <arch/ops.h>
 #include <object/dispatcher.h>
 #include <fbl/arena.h>
 #include <fbl/auto_lock.h>
 #include <fbl/mutex.h>
+#include <kernel/align.h>
+#include <kernel/spinlock.h>
 #include <lib/counters.h>
 #include <pow2.h>
+#include <string.h>
 
 using fbl::AutoLock;
 
@@ -51,10 +55,37 @@ static_assert(((3 << 30) ^ kHandleGenerationMask ^ kHandleIndexMask) ==
                   0xffffffffu,
               "Masks do not agree");
 
+// The Handle that each cpu is reading in Handle::GetDispatcherLockless(),
+// if any. The reader has interrupts disabled while its entry is set, so the
+// entry stays with one cpu and is cleared promptly.
+struct LocklessReader {
+    fbl::atomic<uintptr_t> handle;
+} __CPU_ALIGN;
+
+LocklessReader lockless_readers[SMP_MAX_CPUS];
+
+// Per-cpu caches of free arena slots. Handles are created and destroyed
+// from the current cpu's cache, and Handle::mutex_ is only taken to move
+// a batch of slots between a cache and the arena. A cached slot is still
+// free as far as lookups are concerned; it holds only the base_value that
+// TearDown() stashed in it.
+constexpr size_t kSlotCacheDepth = 32;
+constexpr size_t kSlotCacheBatch = 16;
+
+struct SlotCache {
+    spin_lock_t lock;
+    size_t count;
+    void* slots[kSlotCacheDepth];
+} __CPU_ALIGN;
+
+// Zero initialization leaves every lock unlocked and every cache empty.
+SlotCache slot_cache[SMP_MAX_CPUS];
+
 }  // namespace
 
 fbl::Mutex Handle::mutex_;
 fbl::Arena Handle::arena_;
+fbl::atomic<uint32_t> Handle::index_limit_;
 
 void Handle::Init() TA_NO_THREAD_SAFETY_ANALYSIS {
     arena_.Init("handles", sizeof(Handle), kMaxHandleCount);
@@ -62,8 +93,9 @@ void Handle::Init() TA_NO_THREAD_SAFETY_ANALYSIS {
 
 // Returns a new |base_value| based on the value stored in the free
 // arena slot pointed to by |addr|. The new value will be different
-// from the last |base_value| used by this slot.
-uint32_t Handle::GetNewBaseValue(void* addr) TA_REQ(mutex_) {
+// from the last |base_value| used by this slot. The slot must not be
+// visible to anyone else yet, so no lock is needed.
+uint32_t Handle::GetNewBaseValue(void* addr) {
     // Get the index of this slot within the arena.
     uint32_t handle_index = HandleToIndex(reinterpret_cast<Handle*>(addr));
     DEBUG_ASSERT((handle_index & ~kHandleIndexMask) == 0);
@@ -81,35 +113,125 @@ uint32_t Handle::GetNewBaseValue(void* addr) TA_REQ(mutex_) {
     return (handle_index | new_gen);
 }
 
-// Allocate space for a Handle from the arena, but don't instantiate the
-// object.  |base_value| gets the value for Handle::base_value_.  |what|
-// says whether this is allocation or duplication, for the error message.
-void* Handle::Alloc(const fbl::RefPtr<Dispatcher>& dispatcher,
-                    const char* what, uint32_t* base_value) {
+void* Handle::AllocSlot() {
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    SlotCache* cache = &slot_cache[arch_curr_cpu_num()];
+    spin_lock(&cache->lock);
+    void* addr = (cache->count > 0) ? cache->slots[--cache->count] : nullptr;
+    spin_unlock_restore(&cache->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+    if (addr)
+        return addr;
+
+    // Refill with a batch from the arena.
+    void* batch[kSlotCacheBatch];
+    size_t n = 0;
     size_t outstanding_handles;
     {
         AutoLock lock(&mutex_);
-        void* addr = arena_.Alloc();
-        outstanding_handles = arena_.DiagnosticCount();
-        if (likely(addr)) {
-            if (outstanding_handles > kHighHandleCount) {
-                // TODO: Avoid calling this for every handle after
-                // kHighHandleCount; printfs are slow and we're
-                // holding the mutex.
-                printf("WARNING: High handle count: %zu handles\n",
-                       outstanding_handles);
+        while (n < kSlotCacheBatch) {
+            void* slot = arena_.Alloc();
+            if (!slot)
+                break;
+            uint32_t index = HandleToIndex(reinterpret_cast<Handle*>(slot));
+            if (index >= index_limit_.load(fbl::memory_order_relaxed)) {
+                index_limit_.store(index + 1, fbl::memory_order_release);
             }
-            dispatcher->increment_handle_count();
-            *base_value = GetNewBaseValue(addr);
-            return addr;
+            batch[n++] = slot;
         }
+        outstanding_handles = arena_.DiagnosticCount();
     }
 
-    printf("WARNING: Could not allocate %s handle (%zu outstanding)\n",
-           what, outstanding_handles);
+    if (unlikely(n == 0)) {
+        // The arena is exhausted, but other cpus may be holding on to
+        // free slots.
+        return StealCachedSlot();
+    }
+
+    if (outstanding_handles > kHighHandleCount) {
+        // TODO: Avoid calling this for every batch after kHighHandleCount;
+        // printfs are slow.
+        printf("WARNING: High handle count: %zu handles\n", outstanding_handles);
+    }
+
+    addr = batch[--n];
+
+    // We may have migrated to another cpu while refilling; that's fine, the
+    // slots go to whichever cache we're on.
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    cache = &slot_cache[arch_curr_cpu_num()];
+    spin_lock(&cache->lock);
+    while (n > 0 && cache->count < kSlotCacheDepth) {
+        cache->slots[cache->count++] = batch[--n];
+    }
+    spin_unlock_restore(&cache->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (n > 0)
+        FreeSlotsToArena(batch, n);
+    return addr;
+}
+
+void* Handle::StealCachedSlot() {
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        SlotCache* cache = &slot_cache[i];
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&cache->lock, state);
+        void* addr = (cache->count > 0) ? cache->slots[--cache->count] : nullptr;
+        spin_unlock_irqrestore(&cache->lock, state);
+        if (addr)
+            return addr;
+    }
     return nullptr;
 }
 
+void Handle::FreeSlot(void* addr) {
+    void* evicted[kSlotCacheBatch];
+    size_t num_evicted = 0;
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    SlotCache* cache = &slot_cache[arch_curr_cpu_num()];
+    spin_lock(&cache->lock);
+    if (cache->count == kSlotCacheDepth) {
+        // Return the bottom of the stack; the top is the most recently
+        // freed and hence the most likely to still be cache-hot.
+        num_evicted = kSlotCacheBatch;
+        memcpy(evicted, cache->slots, num_evicted * sizeof(void*));
+        memmove(cache->slots, cache->slots + num_evicted,
+                (kSlotCacheDepth - num_evicted) * sizeof(void*));
+        cache->count -= num_evicted;
+    }
+    cache->slots[cache->count++] = addr;
+    spin_unlock_restore(&cache->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (num_evicted > 0)
+        FreeSlotsToArena(evicted, num_evicted);
+}
+
+void Handle::FreeSlotsToArena(void* const* slots, size_t count) {
+    AutoLock lock(&mutex_);
+    for (size_t i = 0; i < count; i++) {
+        arena_.Free(slots[i]);
+    }
+}
+
+// Allocate space for a Handle from the arena, but don't instantiate the
+// object.  |base_value| gets the value for Handle::base_value_.  |what|
+// says whether this is allocation or duplication, for the error message.
+void* Handle::Alloc(const fbl::RefPtr<Dispatcher>& dispatcher,
+                    const char* what, uint32_t* base_value) {
+    void* addr = AllocSlot();
+    if (unlikely(!addr)) {
+        printf("WARNING: Could not allocate %s handle (%zu outstanding)\n",
+               what, diagnostics::OutstandingHandles());
+        return nullptr;
+    }
+
+    dispatcher->increment_handle_count();
+    *base_value = GetNewBaseValue(addr);
+    return addr;
+}
+
 HandleOwner Handle::Make(fbl::RefPtr<Dispatcher> dispatcher,
                          zx_rights_t rights) {
     uint32_t base_value;
@@ -173,20 +295,35 @@ void Handle::TearDown() TA_EXCL(mutex_) {
     DEBUG_ASSERT(process_id() == 0);
 }
 
+void Handle::WaitForLocklessReaders() {
+    // Clearing the owner first means that any reader which has not yet
+    // published this Handle will fail its ownership check. A reader that
+    // published it before the store is seen below. Both sides use seq_cst
+    // so that at least one of them observes the other.
+    process_id_.store(0u, fbl::memory_order_seq_cst);
+
+    const uintptr_t self = reinterpret_cast<uintptr_t>(this);
+    for (uint i = 0; i < arch_max_num_cpus(); i++) {
+        while (lockless_readers[i].handle.load(fbl::memory_order_seq_cst) == self) {
+            arch_spinloop_pause();
+        }
+    }
+}
+
 void Handle::Delete() {
     fbl::RefPtr<Dispatcher> disp = dispatcher();
 
     if (disp->has_state_tracker())
         disp->Cancel(this);
 
+    // GetDispatcherLockless() may be copying dispatcher_ out of this slot;
+    // let it finish before the slot is destroyed.
+    WaitForLocklessReaders();
+
     TearDown();
 
-    bool zero_handles = false;
-    {
-        AutoLock lock(&mutex_);
-        zero_handles = disp->decrement_handle_count();
-        arena_.Free(this);
-    }
+    bool zero_handles = disp->decrement_handle_count();
+    FreeSlot(this);
 
     if (zero_handles)
         disp->on_zero_handles();
@@ -197,27 +334,80 @@ void Handle::Delete() {
 }
 
 Handle* Handle::FromU32(uint32_t value) TA_NO_THREAD_SAFETY_ANALYSIS {
-    Handle* handle = IndexToHandle(value & kHandleIndexMask);
-    {
-        AutoLock lock(&mutex_);
-        if (unlikely(!arena_.in_range(handle)))
-            return nullptr;
-    }
+    uint32_t index = value & kHandleIndexMask;
+    if (unlikely(index >= index_limit_.load(fbl::memory_order_acquire)))
+        return nullptr;
+    Handle* handle = IndexToHandle(index);
     return likely(handle->base_value() == value) ? handle : nullptr;
 }
 
+bool Handle::GetDispatcherLockless(uint32_t value, zx_koid_t process_id,
+                                   fbl::RefPtr<Dispatcher>* dispatcher,
+                                   zx_rights_t* rights) {
+    DEBUG_ASSERT(process_id != 0u);
+
+    Handle* handle = FromU32(value);
+    if (!handle)
+        return false;
+
+    fbl::RefPtr<Dispatcher> disp;
+    zx_rights_t handle_rights = 0u;
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, ARCH_DEFAULT_SPIN_LOCK_FLAG_INTERRUPTS);
+
+    // Publish the slot before checking the owner; see WaitForLocklessReaders().
+    auto& reader = lockless_readers[arch_curr_cpu_num()].handle;
+    reader.store(reinterpret_cast<uintptr_t>(handle), fbl::memory_order_seq_cst);
+
+    // The slot can't be torn down while it is published with a matching
+    // owner, so if the owner matches, base_value_ tells us whether it is
+    // still the Handle we were asked about or a newer one in the same slot.
+    if (handle->process_id_.load(fbl::memory_order_seq_cst) == process_id &&
+        handle->base_value() == value) {
+        disp = handle->dispatcher_;
+        handle_rights = handle->rights_;
+    }
+
+    reader.store(0u, fbl::memory_order_release);
+    arch_interrupt_restore(state, ARCH_DEFAULT_SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (!disp)
+        return false;
+
+    *dispatcher = fbl::move(disp);
+    if (rights)
+        *rights = handle_rights;
+    return true;
+}
+
 uint32_t Handle::Count(const fbl::RefPtr<const Dispatcher>& dispatcher) {
-    // Handle::mutex_ also guards Dispatcher::handle_count_.
-    AutoLock lock(&mutex_);
     return dispatcher->current_handle_count();
 }
 
+// The number of free slots sitting in the per-cpu caches. Only a snapshot,
+// since the caches are not locked all at once.
+static size_t CachedSlotCount() {
+    size_t cached = 0;
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&slot_cache[i].lock, state);
+        cached += slot_cache[i].count;
+        spin_unlock_irqrestore(&slot_cache[i].lock, state);
+    }
+    return cached;
+}
+
 size_t Handle::diagnostics::OutstandingHandles() {
+    size_t cached = CachedSlotCount();
     AutoLock lock(&mutex_);
-    return arena_.DiagnosticCount();
+    size_t allocated = arena_.DiagnosticCount();
+    return (allocated > cached) ? allocated - cached : 0u;
 }
 
 void Handle::diagnostics::DumpTableInfo() {
+    size_t cached = CachedSlotCount();
     AutoLock lock(&mutex_);
     arena_.Dump();
+    printf("%zu free slots in per-cpu caches\n", cached);
 }
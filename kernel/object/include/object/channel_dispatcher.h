@@ -45,6 +45,10 @@ public:
                      fbl::unique_ptr<MessagePacket>* msg,
                      bool may_disard);
 
+    // Returns the number of messages queued on this endpoint and the bytes
+    // of kernel memory holding them.
+    void GetQueueStats(uint64_t* message_count, uint64_t* message_bytes) const;
+
     // Write to the opposing endpoint's message queue.
     zx_status_t Write(fbl::unique_ptr<MessagePacket> msg);
     zx_status_t Call(fbl::unique_ptr<MessagePacket> msg,
@@ -106,9 +110,10 @@ private:
 
     fbl::Canary<fbl::magic("CHAN")> canary_;
 
-    fbl::Mutex lock_;
+    mutable fbl::Mutex lock_;
     MessageList messages_ TA_GUARDED(lock_);
     uint64_t message_count_ TA_GUARDED(lock_) = 0;
+    uint64_t message_bytes_ TA_GUARDED(lock_) = 0;
     WaiterList waiters_ TA_GUARDED(lock_);
     fbl::RefPtr<ChannelDispatcher> other_ TA_GUARDED(lock_);
     zx_koid_t other_koid_ TA_GUARDED(lock_);
@@ -8,6 +8,8 @@
 
 #include <lib/user_copy/user_ptr.h>
 #include <zircon/types.h>
+#include <fbl/intrusive_hash_table.h>
+#include <fbl/intrusive_single_list.h>
 #include <fbl/mutex.h>
 #include <object/futex_node.h>
 
@@ -23,6 +25,8 @@
 // When the thread at the head of the futex's blocked thread list is resumed,
 // The FutexNode for the new head of the blocked thread list is set as the hash table value
 // for the futex.
+// The hash table is split into shards by futex address, each with its own lock, so that
+// operations on unrelated futexes in the same process don't serialize on one lock.
 class FutexContext {
 public:
     FutexContext();
@@ -51,14 +55,36 @@ private:
     FutexContext(const FutexContext&) = delete;
     FutexContext& operator=(const FutexContext&) = delete;
 
-    void QueueNodesLocked(FutexNode* head) TA_REQ(lock_);
+    static constexpr size_t kShardBits = 4;
+    static constexpr size_t kNumShards = 1u << kShardBits;
+    static constexpr size_t kBucketsPerShard = 8;
 
-    bool UnqueueNodeLocked(FutexNode* node) TA_REQ(lock_);
+    struct Shard {
+        // protects futex_table
+        fbl::Mutex lock;
 
-    // protects futex_table_
-    fbl::Mutex lock_;
+        // Hash table for the futexes in this shard.
+        // Key is futex address, value is the FutexNode for the head of futex's blocked thread
+        // list.
+        fbl::HashTable<uintptr_t, FutexNode*, fbl::SinglyLinkedList<FutexNode*>,
+                       size_t, kBucketsPerShard> futex_table TA_GUARDED(lock);
+    };
 
-    // Hash table for futexes in this context.
-    // Key is futex address, value is the FutexNode for the head of futex's blocked thread list.
-    FutexNode::HashTable futex_table_ TA_GUARDED(lock_);
+    Shard* ShardFor(uintptr_t futex_key);
+
+    // Does the work of FutexRequeue() once the locks of both shards are held;
+    // the two shards may be the same.
+    zx_status_t RequeueLocked(Shard* wake_shard, user_in_ptr<const int> wake_ptr,
+                              uint32_t wake_count, int current_value,
+                              Shard* requeue_shard, user_in_ptr<const int> requeue_ptr,
+                              uint32_t requeue_count, bool* any_woken)
+        TA_NO_THREAD_SAFETY_ANALYSIS;
+
+    static void QueueNodesLocked(Shard* shard, FutexNode* head) TA_REQ(shard->lock);
+
+    bool UnqueueNode(FutexNode* node) TA_NO_THREAD_SAFETY_ANALYSIS;
+
+    static bool UnqueueNodeLocked(Shard* shard, FutexNode* node) TA_REQ(shard->lock);
+
+    Shard shards_[kNumShards];
 };
@@ -116,6 +116,17 @@ public:
     // Maps an integer obtained by Handle::base_value() back to a Handle.
     static Handle* FromU32(uint32_t value);
 
+    // Finds the Handle whose base_value() is |value| and, if it is owned by
+    // the process |process_id|, returns a reference to its dispatcher and
+    // (if |rights| is non-null) its rights. The caller does not need to hold
+    // the owning process's handle table lock: the Handle may be removed and
+    // deleted concurrently, in which case either the lookup fails or the
+    // dispatcher is returned as it was before the removal.
+    // Returns false if no such Handle exists.
+    static bool GetDispatcherLockless(uint32_t value, zx_koid_t process_id,
+                                      fbl::RefPtr<Dispatcher>* dispatcher,
+                                      zx_rights_t* rights);
+
     // Get the number of outstanding handles for a given dispatcher.
     static uint32_t Count(const fbl::RefPtr<const Dispatcher>&);
 
@@ -147,12 +158,22 @@ private:
                        uint32_t* base_value);
     static uint32_t GetNewBaseValue(void* addr);
 
+    // Take a free arena slot from, or return one to, the per-cpu slot
+    // caches, which are refilled from and drained to |arena_| in batches.
+    static void* AllocSlot() TA_EXCL(mutex_);
+    static void FreeSlot(void* addr) TA_EXCL(mutex_);
+    static void FreeSlotsToArena(void* const* slots, size_t count) TA_EXCL(mutex_);
+    static void* StealCachedSlot();
+
     // Handle should never be destroyed by anything other than Delete,
     // which uses TearDown to do the actual destruction.
     ~Handle() = default;
     void TearDown() TA_EXCL(mutex_);
     void Delete();
 
+    // Waits until no GetDispatcherLockless() call is looking at this Handle.
+    void WaitForLocklessReaders();
+
     // Only HandleOwner is allowed to call Delete.
     friend class HandleOwner;
 
@@ -164,12 +185,18 @@ private:
     const zx_rights_t rights_;
     const uint32_t base_value_;
 
-    // The handle arena and its mutex; also guards Dispatcher::handle_count_.
+    // The handle arena and its mutex.
     static fbl::Mutex mutex_;
     static fbl::Arena TA_GUARDED(mutex_) arena_;
 
+    // One more than the highest arena index ever allocated. Slots below this
+    // are committed memory that always holds either a Handle or a stashed
+    // base_value, so they can be inspected without |mutex_|. Only written
+    // with |mutex_| held.
+    static fbl::atomic<uint32_t> index_limit_;
+
     // NOTE! This can return an invalid pointer.
-    // It must be checked against the arena bounds before being used.
+    // It must be checked against |index_limit_| before being used.
     static Handle* IndexToHandle(uint32_t index) TA_NO_THREAD_SAFETY_ANALYSIS {
         return reinterpret_cast<Handle*>(arena_.start()) + index;
     }
@@ -36,6 +36,10 @@ public:
 
     uint32_t data_size() const { return data_size_; }
 
+    // The number of bytes of kernel memory backing this packet, including
+    // the rounding up to its allocation size class.
+    uint32_t buffer_size() const;
+
     // Copies the packet's |data_size()| bytes to |buf|.
     // Returns an error if |buf| points to a bad user address.
     zx_status_t CopyDataTo(user_out_ptr<void> buf) const {
@@ -67,10 +71,9 @@ private:
     static zx_status_t NewPacket(uint32_t data_size, uint32_t num_handles,
                                  fbl::unique_ptr<MessagePacket>* msg);
 
-    // Create() uses malloc(), so we must delete using free().
-    static void operator delete(void* ptr) {
-        free(ptr);
-    }
+    // Create() allocates from the packet buffer caches, so we must return
+    // the memory to them as well.
+    static void operator delete(void* ptr);
     friend class fbl::unique_ptr<MessagePacket>;
 
     // Handles and data are stored in the same buffer: num_handles_ Handle*
@@ -8,11 +8,152 @@
 
 #include <err.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <arch/ops.h>
+#include <kernel/spinlock.h>
+#include <lib/counters.h>
 #include <zxcpp/new.h>
 #include <object/handle.h>
 
+// Packet buffers come in a handful of size classes.  Every CPU keeps a small
+// stack of free buffers of each class, so in the steady state writing a
+// message and reading it back out never touches the heap or its lock.  The
+// stacks are bounded; a free that finds its stack full returns the older half
+// of it to the heap.
+namespace {
+
+// Each buffer starts with this header, followed by the MessagePacket, its
+// Handle* array and the payload.  The header lets operator delete find the
+// size class once the MessagePacket is gone.
+struct PacketBufferHeader {
+    uint32_t size_class;
+    uint32_t reserved;
+};
+static_assert(sizeof(PacketBufferHeader) % alignof(MessagePacket) == 0, "");
+
+constexpr size_t kMaxPacketBufferSize =
+    sizeof(PacketBufferHeader) + sizeof(MessagePacket) +
+    kMaxMessageHandles * sizeof(Handle*) + kMaxMessageSize;
+
+KCOUNTER(packet_64_alloc,   "kernel.channel.packet.64.alloc");
+KCOUNTER(packet_64_free,    "kernel.channel.packet.64.free");
+KCOUNTER(packet_64_miss,    "kernel.channel.packet.64.miss");
+KCOUNTER(packet_256_alloc,  "kernel.channel.packet.256.alloc");
+KCOUNTER(packet_256_free,   "kernel.channel.packet.256.free");
+KCOUNTER(packet_256_miss,   "kernel.channel.packet.256.miss");
+KCOUNTER(packet_1k_alloc,   "kernel.channel.packet.1k.alloc");
+KCOUNTER(packet_1k_free,    "kernel.channel.packet.1k.free");
+KCOUNTER(packet_1k_miss,    "kernel.channel.packet.1k.miss");
+KCOUNTER(packet_4k_alloc,   "kernel.channel.packet.4k.alloc");
+KCOUNTER(packet_4k_free,    "kernel.channel.packet.4k.free");
+KCOUNTER(packet_4k_miss,    "kernel.channel.packet.4k.miss");
+KCOUNTER(packet_64k_alloc,  "kernel.channel.packet.64k.alloc");
+KCOUNTER(packet_64k_free,   "kernel.channel.packet.64k.free");
+KCOUNTER(packet_64k_miss,   "kernel.channel.packet.64k.miss");
+
+struct PacketSizeClass {
+    size_t size;
+    // The maximum number of free buffers each CPU holds on to.
+    size_t cache_depth;
+    const k_counter_desc* allocs;
+    const k_counter_desc* frees;
+    const k_counter_desc* misses;
+};
+
+// The last class holds the largest possible message.
+const PacketSizeClass kSizeClasses[] = {
+    {64u, 32u, packet_64_alloc, packet_64_free, packet_64_miss},
+    {256u, 32u, packet_256_alloc, packet_256_free, packet_256_miss},
+    {1024u, 16u, packet_1k_alloc, packet_1k_free, packet_1k_miss},
+    {4096u, 8u, packet_4k_alloc, packet_4k_free, packet_4k_miss},
+    {kMaxPacketBufferSize, 1u, packet_64k_alloc, packet_64k_free, packet_64k_miss},
+};
+
+constexpr size_t kNumSizeClasses = countof(kSizeClasses);
+constexpr size_t kMaxCacheDepth = 32;
+
+struct PacketBufferCache {
+    spin_lock_t lock;
+    size_t count[kNumSizeClasses];
+    void* buffers[kNumSizeClasses][kMaxCacheDepth];
+} __CPU_ALIGN;
+
+// Zero initialization leaves every lock unlocked and every stack empty.
+PacketBufferCache packet_buffer_cache[SMP_MAX_CPUS];
+
+uint32_t SizeClassFor(size_t size) {
+    uint32_t size_class = 0;
+    while (kSizeClasses[size_class].size < size) {
+        size_class++;
+    }
+    return size_class;
+}
+
+// Returns a buffer of at least |size| bytes, with its header filled in.
+PacketBufferHeader* PacketBufferAlloc(size_t size) {
+    DEBUG_ASSERT(size <= kMaxPacketBufferSize);
+    const uint32_t size_class = SizeClassFor(size);
+    const PacketSizeClass& sc = kSizeClasses[size_class];
+
+    void* buf = nullptr;
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    PacketBufferCache* cache = &packet_buffer_cache[arch_curr_cpu_num()];
+    spin_lock(&cache->lock);
+    if (cache->count[size_class] > 0) {
+        buf = cache->buffers[size_class][--cache->count[size_class]];
+    }
+    spin_unlock_restore(&cache->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (buf == nullptr) {
+        kcounter_add(sc.misses, 1u);
+        buf = malloc(sc.size);
+        if (buf == nullptr) {
+            return nullptr;
+        }
+    }
+    kcounter_add(sc.allocs, 1u);
+
+    auto header = static_cast<PacketBufferHeader*>(buf);
+    header->size_class = size_class;
+    return header;
+}
+
+void PacketBufferFree(PacketBufferHeader* header) {
+    const uint32_t size_class = header->size_class;
+    DEBUG_ASSERT(size_class < kNumSizeClasses);
+    const PacketSizeClass& sc = kSizeClasses[size_class];
+    kcounter_add(sc.frees, 1u);
+
+    void* evicted[kMaxCacheDepth];
+    size_t num_evicted = 0;
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    PacketBufferCache* cache = &packet_buffer_cache[arch_curr_cpu_num()];
+    spin_lock(&cache->lock);
+    void** stack = cache->buffers[size_class];
+    if (cache->count[size_class] == sc.cache_depth) {
+        // Evict the bottom of the stack; the top is the most recently freed
+        // and hence the most likely to still be cache-hot.
+        num_evicted = (sc.cache_depth + 1) / 2;
+        memcpy(evicted, stack, num_evicted * sizeof(void*));
+        memmove(stack, stack + num_evicted,
+                (sc.cache_depth - num_evicted) * sizeof(void*));
+        cache->count[size_class] -= num_evicted;
+    }
+    stack[cache->count[size_class]++] = header;
+    spin_unlock_restore(&cache->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    for (size_t i = 0; i < num_evicted; i++) {
+        free(evicted[i]);
+    }
+}
+
+} // namespace
+
 // static
 zx_status_t MessagePacket::NewPacket(uint32_t data_size, uint32_t num_handles,
                                      fbl::unique_ptr<MessagePacket>* msg) {
@@ -25,15 +166,14 @@ zx_status_t MessagePacket::NewPacket(uint32_t data_size, uint32_t num_handles,
 
     // Allocate space for the MessagePacket object followed by num_handles
     // Handle*s followed by data_size bytes.
-    // TODO(dbort): Use mbuf-style memory for data_size, ideally allocating from
-    // somewhere other than the heap. Lets us better track and isolate channel
-    // memory usage.
-    char* ptr = static_cast<char*>(malloc(sizeof(MessagePacket) +
-                                          num_handles * sizeof(Handle*) +
-                                          data_size));
-    if (ptr == nullptr) {
+    PacketBufferHeader* header = PacketBufferAlloc(sizeof(PacketBufferHeader) +
+                                                   sizeof(MessagePacket) +
+                                                   num_handles * sizeof(Handle*) +
+                                                   data_size);
+    if (header == nullptr) {
         return ZX_ERR_NO_MEMORY;
     }
+    char* ptr = reinterpret_cast<char*>(header + 1);
 
     // The storage space for the Handle*s is not initialized because
     // the only creators of MessagePackets (sys_channel_write and
@@ -76,6 +216,17 @@ zx_status_t MessagePacket::Create(const void* data, uint32_t data_size,
     return ZX_OK;
 }
 
+// static
+void MessagePacket::operator delete(void* ptr) {
+    PacketBufferFree(static_cast<PacketBufferHeader*>(ptr) - 1);
+}
+
+uint32_t MessagePacket::buffer_size() const {
+    const size_t size = sizeof(PacketBufferHeader) + sizeof(MessagePacket) +
+                        num_handles_ * sizeof(Handle*) + data_size_;
+    return static_cast<uint32_t>(kSizeClasses[SizeClassFor(size)].size);
+}
+
 MessagePacket::~MessagePacket() {
     if (owns_handles_) {
         for (size_t ix = 0; ix != num_handles_; ++ix) {
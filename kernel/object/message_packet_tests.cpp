@@ -0,0 +1,70 @@
+// Copyright 2017 The Fuchsia Authors
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+
+#include <object/message_packet.h>
+
+#include <fbl/unique_ptr.h>
+#include <unittest.h>
+
+namespace {
+
+bool buffer_sizes(void* context) {
+    BEGIN_TEST;
+
+    static const uint32_t kDataSizes[] = {
+        0u, 1u, 16u, 200u, 1000u, 4000u, 16384u, kMaxMessageSize,
+    };
+    static const uint32_t kHandleCounts[] = {0u, 1u, kMaxMessageHandles};
+    static uint8_t data[kMaxMessageSize];
+
+    for (uint32_t data_size : kDataSizes) {
+        for (uint32_t num_handles : kHandleCounts) {
+            fbl::unique_ptr<MessagePacket> msg;
+            REQUIRE_EQ(ZX_OK, MessagePacket::Create(data, data_size, num_handles, &msg), "");
+            EXPECT_EQ(data_size, msg->data_size(), "");
+            EXPECT_EQ(num_handles, msg->num_handles(), "");
+            EXPECT_GE(msg->buffer_size(),
+                      data_size + num_handles * sizeof(Handle*) + sizeof(MessagePacket), "");
+        }
+    }
+
+    fbl::unique_ptr<MessagePacket> msg;
+    EXPECT_EQ(ZX_ERR_OUT_OF_RANGE,
+              MessagePacket::Create(data, kMaxMessageSize + 1, 0u, &msg), "");
+    EXPECT_EQ(ZX_ERR_OUT_OF_RANGE,
+              MessagePacket::Create(data, 0u, kMaxMessageHandles + 1, &msg), "");
+
+    END_TEST;
+}
+
+// Holds more packets of one size than the per-CPU caches keep, so freeing
+// them has to hand some back to the heap.
+bool cache_overflow(void* context) {
+    BEGIN_TEST;
+
+    constexpr size_t kNumPackets = 100;
+    const zx_txid_t txid = 0x12345678;
+    fbl::unique_ptr<MessagePacket> msgs[kNumPackets];
+
+    for (int pass = 0; pass < 3; pass++) {
+        for (auto& msg : msgs) {
+            REQUIRE_EQ(ZX_OK, MessagePacket::Create(&txid, sizeof(txid), 0u, &msg), "");
+            EXPECT_EQ(txid, msg->get_txid(), "");
+        }
+        for (auto& msg : msgs) {
+            msg.reset();
+        }
+    }
+
+    END_TEST;
+}
+
+} // namespace
+
+UNITTEST_START_TESTCASE(message_packet_tests)
+UNITTEST("buffer sizes", buffer_sizes)
+UNITTEST("cache overflow", cache_overflow)
+UNITTEST_END_TESTCASE(message_packet_tests, "msgpacket", "MessagePacket tests", nullptr, nullptr);
@@ -51,9 +51,12 @@ static zx_handle_t map_handle_to_value(const Handle* handle, uint32_t mixer) {
     return static_cast<zx_handle_t>(mixer ^ handle_id);
 }
 
+static uint32_t map_value_to_base_value(zx_handle_t value, uint32_t mixer) {
+    return (static_cast<uint32_t>(value) ^ mixer) >> 1;
+}
+
 static Handle* map_value_to_handle(zx_handle_t value, uint32_t mixer) {
-    auto handle_id = (static_cast<uint32_t>(value) ^ mixer) >> 1;
-    return Handle::FromU32(handle_id);
+    return Handle::FromU32(map_value_to_base_value(value, mixer));
 }
 
 zx_status_t ProcessDispatcher::Create(
@@ -438,24 +441,24 @@ void ProcessDispatcher::UndoRemoveHandleLocked(zx_handle_t handle_value) {
 }
 
 zx_koid_t ProcessDispatcher::GetKoidForHandle(zx_handle_t handle_value) {
-    AutoLock lock(&handle_table_lock_);
-    Handle* handle = GetHandleLocked(handle_value);
-    if (!handle)
+    fbl::RefPtr<Dispatcher> dispatcher;
+    if (GetDispatcherInternal(handle_value, &dispatcher, nullptr) != ZX_OK)
         return ZX_KOID_INVALID;
-    return handle->dispatcher()->get_koid();
+    return dispatcher->get_koid();
 }
 
+// The lookups below don't take |handle_table_lock_|; see
+// Handle::GetDispatcherLockless(). They are equivalent to looking the handle
+// up under the lock and copying out its dispatcher before releasing it.
 zx_status_t ProcessDispatcher::GetDispatcherInternal(zx_handle_t handle_value,
                                                      fbl::RefPtr<Dispatcher>* dispatcher,
                                                      zx_rights_t* rights) {
-    AutoLock lock(&handle_table_lock_);
-    Handle* handle = GetHandleLocked(handle_value);
-    if (!handle)
+    if (!Handle::GetDispatcherLockless(map_value_to_base_value(handle_value, handle_rand_),
+                                       get_koid(), dispatcher, rights)) {
+        // Same policy check as a failed GetHandleLocked().
+        QueryPolicy(ZX_POL_BAD_HANDLE);
         return ZX_ERR_BAD_HANDLE;
-
-    *dispatcher = handle->dispatcher();
-    if (rights)
-        *rights = handle->rights();
+    }
     return ZX_OK;
 }
 
@@ -463,17 +466,18 @@ zx_status_t ProcessDispatcher::GetDispatcherWithRightsInternal(zx_handle_t handl
                                                                zx_rights_t desired_rights,
                                                                fbl::RefPtr<Dispatcher>* dispatcher_out,
                                                                zx_rights_t* out_rights) {
-    AutoLock lock(&handle_table_lock_);
-    Handle* handle = GetHandleLocked(handle_value);
-    if (!handle)
-        return ZX_ERR_BAD_HANDLE;
+    fbl::RefPtr<Dispatcher> dispatcher;
+    zx_rights_t rights;
+    zx_status_t status = GetDispatcherInternal(handle_value, &dispatcher, &rights);
+    if (status != ZX_OK)
+        return status;
 
-    if (!handle->HasRights(desired_rights))
+    if ((rights & desired_rights) != desired_rights)
         return ZX_ERR_ACCESS_DENIED;
 
-    *dispatcher_out = handle->dispatcher();
+    *dispatcher_out = fbl::move(dispatcher);
     if (out_rights)
-        *out_rights = handle->rights();
+        *out_rights = rights;
     return ZX_OK;
 }
 
@@ -776,6 +780,6 @@ const char* StateToString(ProcessDispatcher::State state) {
 }
 
 bool ProcessDispatcher::IsHandleValid(zx_handle_t handle_value) {
-    AutoLock lock(&handle_table_lock_);
-    return (GetHandleLocked(handle_value) != nullptr);
+    fbl::RefPtr<Dispatcher> dispatcher;
+    return GetDispatcherInternal(handle_value, &dispatcher, nullptr) == ZX_OK;
 }
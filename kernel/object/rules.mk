@@ -48,6 +48,7 @@ MODULE_SRCS := \
 
 # Tests
 MODULE_SRCS += \
+    $(LOCAL_DIR)/message_packet_tests.cpp \
     $(LOCAL_DIR)/state_tracker_tests.cpp \
 
 MODULE_DEPS := \
@@ -94,7 +94,7 @@ static void halt_other_cpus(void) {
     if (atomic_swap(&halted, 1) == 0) {
         // stop the other cpus
         printf("stopping other cpus\n");
-        arch_mp_send_ipi(MP_IPI_TARGET_ALL_BUT_LOCAL, 0, MP_IPI_HALT);
+        arch_mp_send_ipi(MP_IPI_TARGET_ALL_BUT_LOCAL, cpu_mask_none(), MP_IPI_HALT);
 
         // spin for a while
         // TODO: find a better way to spin at this low level
@@ -273,13 +273,15 @@ static int park_cpu_thread(void* arg) {
 void platform_halt_secondary_cpus(void) {
     // Make sure that the current thread is pinned to the boot cpu.
     const thread_t* current_thread = get_current_thread();
-    DEBUG_ASSERT(current_thread->cpu_affinity == (1 << BOOT_CPU_ID));
+    DEBUG_ASSERT(cpu_mask_equal(current_thread->cpu_affinity, cpu_num_to_mask(BOOT_CPU_ID)));
 
-    // Threads responsible for parking the cores.
-    thread_t* park_thread[SMP_MAX_CPUS];
+    // Threads responsible for parking the cores. Static rather than on the
+    // stack since they scale with SMP_MAX_CPUS; this only runs once, on the
+    // way out of the kernel.
+    static thread_t* park_thread[SMP_MAX_CPUS];
 
     // These are signalled when the CPU has almost shutdown.
-    event_t shutdown_cplt[SMP_MAX_CPUS];
+    static event_t shutdown_cplt[SMP_MAX_CPUS];
 
     for (uint i = 0; i < arch_max_num_cpus(); i++) {
         // The boot cpu is going to be performing the remainder of the mexec
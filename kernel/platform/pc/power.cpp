@@ -38,7 +38,7 @@ static void halt_other_cpus(void) {
     if (atomic_swap(&halted, 1) == 0) {
         // stop the other cpus
         printf("stopping other cpus\n");
-        arch_mp_send_ipi(MP_IPI_TARGET_ALL_BUT_LOCAL, 0, MP_IPI_HALT);
+        arch_mp_send_ipi(MP_IPI_TARGET_ALL_BUT_LOCAL, cpu_mask_none(), MP_IPI_HALT);
 
         // spin for a while
         // TODO: find a better way to spin at this low level
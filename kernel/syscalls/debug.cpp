@@ -152,6 +152,7 @@ zx_status_t sys_ktrace_write(zx_handle_t handle, uint32_t event_id, uint32_t arg
 
     args[0] = arg0;
     args[1] = arg1;
+    ktrace_close(args);
     return ZX_OK;
 }
 
@@ -371,12 +371,12 @@ zx_status_t sys_system_powerctl(zx_handle_t root_rsrc, uint32_t cmd,
 
     switch (cmd) {
         case ZX_SYSTEM_POWERCTL_ENABLE_ALL_CPUS: {
-            cpu_mask_t all_cpus = ((cpu_mask_t)1u << arch_max_num_cpus()) - 1;
-            return mp_hotplug_cpu_mask(~mp_get_online_mask() & all_cpus);
+            cpu_mask_t all_cpus = cpu_mask_first_n(arch_max_num_cpus());
+            return mp_hotplug_cpu_mask(cpu_mask_andnot(all_cpus, mp_get_online_mask()));
         }
         case ZX_SYSTEM_POWERCTL_DISABLE_ALL_CPUS_BUT_PRIMARY: {
             cpu_mask_t primary = cpu_num_to_mask(0);
-            return mp_unplug_cpu_mask(mp_get_online_mask() & ~primary);
+            return mp_unplug_cpu_mask(cpu_mask_andnot(mp_get_online_mask(), primary));
         }
         case ZX_SYSTEM_POWERCTL_ACPI_TRANSITION_S_STATE:
         case ZX_SYSTEM_POWERCTL_X86_SET_PKG_PL1: {
@@ -159,7 +159,7 @@ zx_status_t acpi_transition_s_state(const zx_system_powerctl_arg_t* arg) {
     }
 
     // If not a shutdown, ensure CPU 0 is the only cpu left running.
-    if (target_s_state != 5 && mp_get_online_mask() != cpu_num_to_mask(0)) {
+    if (target_s_state != 5 && !cpu_mask_equal(mp_get_online_mask(), cpu_num_to_mask(0))) {
         TRACEF("Too many CPUs running for state S%u\n", target_s_state);
         return ZX_ERR_BAD_STATE;
     }
@@ -10,10 +10,13 @@
 #include <arch/ops.h>
 #include <err.h>
 #include <inttypes.h>
+#include <kernel/event.h>
 #include <kernel/mp.h>
 #include <kernel/mutex.h>
+#include <kernel/percpu.h>
 #include <kernel/spinlock.h>
 #include <kernel/thread.h>
+#include <kernel/timer.h>
 #include <platform.h>
 #include <rand.h>
 #include <stdio.h>
@@ -235,6 +238,199 @@ __NO_INLINE static void bench_mutex() {
     printf("%" PRIu64 " cycles to acquire/release uncontended mutex %u times (%" PRIu64 " cycles per)\n", c, count, c / count);
 }
 
+struct bench_heap_args {
+    event_t* start;
+    size_t iterations;
+};
+
+static int bench_heap_thread(void* arg) {
+    auto args = static_cast<bench_heap_args*>(arg);
+    static const size_t sizes[] = {16, 24, 40, 64, 96, 128, 200, 256, 500};
+    void* live[64] = {};
+
+    event_wait(args->start);
+    for (size_t i = 0; i < args->iterations; i++) {
+        size_t slot = i % countof(live);
+        free(live[slot]);
+        live[slot] = malloc(sizes[i % countof(sizes)]);
+    }
+    for (void* ptr : live) {
+        free(ptr);
+    }
+    return 0;
+}
+
+// Measures small malloc/free throughput with one thread pinned to each of
+// an increasing number of cpus.
+__NO_INLINE static void bench_heap() {
+    static const size_t iterations = 1024 * 1024;
+
+    uint num_cpus = 0;
+    cpu_num_t cpus[SMP_MAX_CPUS];
+    for (cpu_num_t i = 0; i < arch_max_num_cpus(); i++) {
+        if (mp_is_cpu_online(i)) {
+            cpus[num_cpus++] = i;
+        }
+    }
+
+    for (uint n = 1; n <= num_cpus; n = (n == num_cpus) ? n + 1 : MIN(n * 2, num_cpus)) {
+        event_t start = EVENT_INITIAL_VALUE(start, false, 0);
+        bench_heap_args args = {&start, iterations};
+        thread_t* threads[SMP_MAX_CPUS];
+        for (uint i = 0; i < n; i++) {
+            threads[i] = thread_create("bench_heap", &bench_heap_thread, &args,
+                                       DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+            thread_set_cpu_affinity(threads[i], cpu_num_to_mask(cpus[i]));
+            thread_resume(threads[i]);
+        }
+
+        zx_time_t t = current_time();
+        event_signal(&start, true);
+        for (uint i = 0; i < n; i++) {
+            thread_join(threads[i], NULL, ZX_TIME_INFINITE);
+        }
+        t = current_time() - t;
+        event_destroy(&start);
+
+        uint64_t ops = 2 * iterations * n;
+        printf("%u cpus: %" PRIu64 " ns to malloc/free %" PRIu64 " times (%" PRIu64 " ops/sec)\n",
+               n, t, ops, ops * ZX_SEC(1) / (t ? t : 1));
+    }
+}
+
+struct bench_sched_args {
+    event_t* start;
+    uint chunks;
+};
+
+static int bench_sched_thread(void* arg) {
+    auto args = static_cast<bench_sched_args*>(arg);
+
+    event_wait(args->start);
+    for (uint i = 0; i < args->chunks; i++) {
+        // a slice of cpu bound work, with the occasional block and yield to keep
+        // threads coming and going from the run queues
+        for (volatile uint spin = 0; spin < 20000; spin++)
+            ;
+        if (i % 16 == 15) {
+            thread_sleep_relative(ZX_USEC(200));
+        } else if (i % 4 == 3) {
+            thread_yield();
+        }
+    }
+    return 0;
+}
+
+// Spreads a fixed amount of work over an increasing number of unpinned threads,
+// up to 4 per cpu, and reports throughput along with how often idle cpus had
+// to pull work from another cpu's run queue.
+__NO_INLINE static void bench_sched() {
+    static const uint total_chunks = 16384;
+
+    uint num_cpus = 0;
+    for (cpu_num_t i = 0; i < arch_max_num_cpus(); i++) {
+        if (mp_is_cpu_online(i)) {
+            num_cpus++;
+        }
+    }
+
+    for (uint n = 1; n <= num_cpus * 4; n *= 2) {
+        thread_t** threads = static_cast<thread_t**>(calloc(n, sizeof(thread_t*)));
+        if (!threads) {
+            return;
+        }
+
+        event_t start = EVENT_INITIAL_VALUE(start, false, 0);
+        bench_sched_args args = {&start, total_chunks / n};
+        for (uint i = 0; i < n; i++) {
+            threads[i] = thread_create("bench_sched", &bench_sched_thread, &args,
+                                       DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+            thread_resume(threads[i]);
+        }
+
+        ulong steals = 0;
+        for (cpu_num_t i = 0; i < arch_max_num_cpus(); i++) {
+            steals -= percpu[i].stats.steals;
+        }
+        zx_time_t t = current_time();
+        event_signal(&start, true);
+        for (uint i = 0; i < n; i++) {
+            thread_join(threads[i], NULL, ZX_TIME_INFINITE);
+        }
+        t = current_time() - t;
+        for (cpu_num_t i = 0; i < arch_max_num_cpus(); i++) {
+            steals += percpu[i].stats.steals;
+        }
+        event_destroy(&start);
+        free(threads);
+
+        uint64_t chunks = static_cast<uint64_t>(args.chunks) * n;
+        printf("%u threads on %u cpus: %" PRIu64 " ns for %" PRIu64 " work chunks "
+               "(%" PRIu64 " chunks/sec, %lu steals)\n",
+               n, num_cpus, t, chunks, chunks * ZX_SEC(1) / (t ? t : 1), steals);
+    }
+}
+
+static void bench_timer_cb(timer_t* timer, zx_time_t now, void* arg) {
+}
+
+// Measures the cost of setting and canceling timers on a cpu that already has
+// a large number of timers outstanding. The deadlines are far enough out that
+// none of them fire while the benchmark runs.
+__NO_INLINE static void bench_timer() {
+    static const uint num_timers = 10000;
+    static const uint iterations = 100000;
+
+    timer_t* timers = static_cast<timer_t*>(calloc(num_timers, sizeof(timer_t)));
+    if (!timers) {
+        return;
+    }
+
+    // keep every timer on the same cpu's queue
+    thread_t* self = get_current_thread();
+    cpu_mask_t old_affinity = self->cpu_affinity;
+    thread_set_cpu_affinity(self, cpu_num_to_mask(arch_curr_cpu_num()));
+
+    zx_time_t base = current_time() + ZX_SEC(3600);
+    for (uint slack_us = 0; slack_us <= 100; slack_us += 100) {
+        zx_duration_t slack = ZX_USEC(slack_us);
+
+        uint64_t c = arch_cycle_count();
+        for (uint i = 0; i < num_timers; i++) {
+            timer_init(&timers[i]);
+            timer_set(&timers[i], base + ZX_USEC(rand() % 1000000), TIMER_SLACK_CENTER, slack,
+                      bench_timer_cb, NULL);
+        }
+        c = arch_cycle_count() - c;
+        printf("slack %uus: %" PRIu64 " cycles to set %u timers (%" PRIu64 " cycles per)\n",
+               slack_us, c, num_timers, c / num_timers);
+
+        // steady state: cancel a random live timer and set it again
+        c = arch_cycle_count();
+        for (uint i = 0; i < iterations; i++) {
+            timer_t* t = &timers[rand() % num_timers];
+            timer_cancel(t);
+            timer_set(t, base + ZX_USEC(rand() % 1000000), TIMER_SLACK_CENTER, slack,
+                      bench_timer_cb, NULL);
+        }
+        c = arch_cycle_count() - c;
+        printf("slack %uus: %" PRIu64 " cycles to cancel/set %u times with %u live timers "
+               "(%" PRIu64 " cycles per)\n",
+               slack_us, c, iterations, num_timers, c / iterations);
+
+        c = arch_cycle_count();
+        for (uint i = 0; i < num_timers; i++) {
+            timer_cancel(&timers[i]);
+        }
+        c = arch_cycle_count() - c;
+        printf("slack %uus: %" PRIu64 " cycles to cancel %u timers (%" PRIu64 " cycles per)\n",
+               slack_us, c, num_timers, c / num_timers);
+    }
+
+    thread_set_cpu_affinity(self, old_affinity);
+    free(timers);
+}
+
 void benchmarks() {
     bench_set_overhead();
     bench_memcpy();
@@ -251,4 +447,8 @@ void benchmarks() {
 
     bench_spinlock();
     bench_mutex();
+
+    bench_heap();
+    bench_sched();
+    bench_timer();
 }
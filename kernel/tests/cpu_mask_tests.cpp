@@ -0,0 +1,103 @@
+// Copyright 2018 The Fuchsia Authors
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+
+#include "tests.h"
+
+#include <kernel/cpu.h>
+#include <unittest.h>
+
+static bool cpu_mask_basic_test(void* context) {
+    BEGIN_TEST;
+
+    cpu_mask_t mask = cpu_mask_none();
+    EXPECT_TRUE(cpu_mask_is_empty(mask), "");
+    EXPECT_EQ(0u, cpu_mask_count(mask), "");
+    EXPECT_EQ(INVALID_CPU, next_cpu_set(mask, 0), "");
+
+    cpu_mask_add(&mask, 0);
+    cpu_mask_add(&mask, SMP_MAX_CPUS - 1);
+    EXPECT_FALSE(cpu_mask_is_empty(mask), "");
+    EXPECT_EQ(2u, cpu_mask_count(mask), "");
+    EXPECT_TRUE(cpu_mask_contains(mask, 0), "");
+    EXPECT_TRUE(cpu_mask_contains(mask, SMP_MAX_CPUS - 1), "");
+    EXPECT_FALSE(cpu_mask_contains(mask, SMP_MAX_CPUS), "");
+    EXPECT_EQ(0u, lowest_cpu_set(mask), "");
+    EXPECT_EQ((cpu_num_t)SMP_MAX_CPUS - 1, highest_cpu_set(mask), "");
+
+    cpu_mask_remove(&mask, 0);
+    EXPECT_TRUE(cpu_mask_equal(mask, cpu_num_to_mask(SMP_MAX_CPUS - 1)), "");
+
+    // out of range cpus are ignored rather than corrupting the mask
+    EXPECT_TRUE(cpu_mask_is_empty(cpu_num_to_mask(SMP_MAX_CPUS)), "");
+    cpu_mask_add(&mask, INVALID_CPU);
+    EXPECT_EQ(1u, cpu_mask_count(mask), "");
+
+    END_TEST;
+}
+
+static bool cpu_mask_set_ops_test(void* context) {
+    BEGIN_TEST;
+
+    cpu_mask_t all = cpu_mask_all();
+    EXPECT_EQ((uint32_t)SMP_MAX_CPUS, cpu_mask_count(all), "");
+    EXPECT_TRUE(cpu_mask_equal(all, cpu_mask_first_n(SMP_MAX_CPUS)), "");
+
+    cpu_mask_t low = cpu_mask_first_n(SMP_MAX_CPUS / 2);
+    cpu_mask_t high = cpu_mask_andnot(all, low);
+    EXPECT_EQ((uint32_t)(SMP_MAX_CPUS - SMP_MAX_CPUS / 2), cpu_mask_count(high), "");
+    EXPECT_FALSE(cpu_mask_intersects(low, high), "");
+    EXPECT_TRUE(cpu_mask_equal(all, cpu_mask_or(low, high)), "");
+    EXPECT_TRUE(cpu_mask_is_empty(cpu_mask_and(low, high)), "");
+    EXPECT_EQ((cpu_num_t)SMP_MAX_CPUS / 2, lowest_cpu_set(high), "");
+    EXPECT_EQ((cpu_num_t)SMP_MAX_CPUS / 2 - 1, highest_cpu_set(low), "");
+
+    END_TEST;
+}
+
+static bool cpu_mask_iterate_test(void* context) {
+    BEGIN_TEST;
+
+    // every third cpu, so that masks over 64 cpus cross a word boundary
+    cpu_mask_t mask = cpu_mask_none();
+    for (cpu_num_t i = 0; i < SMP_MAX_CPUS; i += 3) {
+        cpu_mask_add(&mask, i);
+    }
+
+    cpu_num_t expected = 0;
+    cpu_num_t cpu;
+    cpu_mask_for_each(cpu, mask) {
+        EXPECT_EQ(expected, cpu, "");
+        expected += 3;
+    }
+    EXPECT_EQ((cpu_num_t)((SMP_MAX_CPUS + 2) / 3 * 3), expected, "");
+
+    END_TEST;
+}
+
+static bool cpu_mask_atomic_test(void* context) {
+    BEGIN_TEST;
+
+    cpu_mask_t mask = cpu_mask_none();
+    EXPECT_FALSE(cpu_mask_atomic_add(&mask, SMP_MAX_CPUS - 1), "");
+    EXPECT_TRUE(cpu_mask_atomic_add(&mask, SMP_MAX_CPUS - 1), "");
+    EXPECT_TRUE(cpu_mask_contains(cpu_mask_atomic_load(&mask), SMP_MAX_CPUS - 1), "");
+    EXPECT_TRUE(cpu_mask_atomic_remove(&mask, SMP_MAX_CPUS - 1), "");
+    EXPECT_FALSE(cpu_mask_atomic_remove(&mask, SMP_MAX_CPUS - 1), "");
+
+    cpu_mask_atomic_add(&mask, 1);
+    cpu_mask_t old = cpu_mask_atomic_exchange(&mask, cpu_mask_none());
+    EXPECT_TRUE(cpu_mask_equal(old, cpu_num_to_mask(1)), "");
+    EXPECT_TRUE(cpu_mask_is_empty(mask), "");
+
+    END_TEST;
+}
+
+UNITTEST_START_TESTCASE(cpu_mask_tests)
+UNITTEST("basic", cpu_mask_basic_test)
+UNITTEST("set operations", cpu_mask_set_ops_test)
+UNITTEST("iterate", cpu_mask_iterate_test)
+UNITTEST("atomic", cpu_mask_atomic_test)
+UNITTEST_END_TESTCASE(cpu_mask_tests, "cpu_mask", "cpu mask tests", nullptr, nullptr);
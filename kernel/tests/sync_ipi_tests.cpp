@@ -46,7 +46,7 @@ static int deadlock_test_thread(void* arg) {
 
     int counter = 0;
     arch_disable_ints();
-    mp_sync_exec(MP_IPI_TARGET_ALL_BUT_LOCAL, 0, counter_task, &counter);
+    mp_sync_exec(MP_IPI_TARGET_ALL_BUT_LOCAL, cpu_mask_none(), counter_task, &counter);
     arch_enable_ints();
     return 0;
 }
@@ -81,8 +81,8 @@ static bool sync_ipi_tests(void* context) {
     BEGIN_TEST;
 
     uint num_cpus = arch_max_num_cpus();
-    uint online = mp_get_online_mask();
-    if (online != (1U << num_cpus) - 1) {
+    cpu_mask_t online = mp_get_online_mask();
+    if (!cpu_mask_equal(online, cpu_mask_first_n(num_cpus))) {
         printf("Can only run test with all CPUs online\n");
         return true;
     }
@@ -94,7 +94,7 @@ static bool sync_ipi_tests(void* context) {
         LTRACEF("Sequential test\n");
         int inorder_counter = 0;
         for (uint i = 0; i < num_cpus; ++i) {
-            mp_sync_exec(MP_IPI_TARGET_MASK, 1u << i, inorder_count_task, &inorder_counter);
+            mp_sync_exec(MP_IPI_TARGET_MASK, cpu_num_to_mask(i), inorder_count_task, &inorder_counter);
             LTRACEF("  Finished signaling CPU %u\n", i);
         }
     }
@@ -107,7 +107,7 @@ static bool sync_ipi_tests(void* context) {
         spin_lock_saved_state_t irqstate;
         arch_interrupt_save(&irqstate, SPIN_LOCK_FLAG_INTERRUPTS);
 
-        mp_sync_exec(MP_IPI_TARGET_ALL_BUT_LOCAL, 0, counter_task, &counter);
+        mp_sync_exec(MP_IPI_TARGET_ALL_BUT_LOCAL, cpu_mask_none(), counter_task, &counter);
 
         arch_interrupt_restore(irqstate, SPIN_LOCK_FLAG_INTERRUPTS);
 
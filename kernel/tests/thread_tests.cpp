@@ -591,10 +591,15 @@ static int affinity_test_thread(void* arg) {
     while (!state->shutdown) {
         int which = rand() % countof(state->threads);
         switch (rand() % 5) {
-        case 0: // set affinity
+        case 0: { // set affinity
             //printf("%p set aff %p\n", t, state->threads[which]);
-            thread_set_cpu_affinity(state->threads[which], (cpu_mask_t)rand());
+            cpu_mask_t mask;
+            for (auto& word : mask.words) {
+                word = ((uint64_t)rand() << 32) | (uint32_t)rand();
+            }
+            thread_set_cpu_affinity(state->threads[which], mask);
             break;
+        }
         case 1: // sleep for a bit
             //printf("%p sleep\n", t);
             thread_sleep_relative(ZX_USEC(rand() % 100));
@@ -630,7 +635,7 @@ __NO_INLINE static void affinity_test() {
     printf("starting thread affinity test\n");
 
     cpu_mask_t online = mp_get_online_mask();
-    if (!online || ispow2(online)) {
+    if (cpu_mask_count(online) < 2) {
         printf("aborting test, not enough online cpus\n");
         return;
     }
@@ -113,10 +113,6 @@ public:
     fbl::RefPtr<VmAddressRegion> as_vm_address_region();
     fbl::RefPtr<VmMapping> as_vm_mapping();
 
-    // Page fault in an address within the region.  Recursively traverses
-    // the regions to find the target mapping, if it exists.
-    virtual zx_status_t PageFault(vaddr_t va, uint pf_flags) = 0;
-
     // WAVL tree key function
     vaddr_t GetKey() const { return base(); }
 
@@ -235,7 +231,10 @@ public:
     bool is_mapping() const override { return false; }
 
     void Dump(uint depth, bool verbose) const override;
-    zx_status_t PageFault(vaddr_t va, uint pf_flags) override;
+
+    // Recursively traverses the regions to find the mapping that contains
+    // |va|, if there is one.
+    fbl::RefPtr<VmMapping> FindMappingLocked(vaddr_t va);
 
 protected:
     // constructor for use in creating a VmAddressRegionDummy
@@ -368,12 +367,6 @@ public:
         return;
     }
 
-    zx_status_t PageFault(vaddr_t va, uint pf_flags) override {
-        // We should never be trying to page fault on this...
-        ASSERT(false);
-        return ZX_ERR_BAD_STATE;
-    }
-
     size_t AllocatedPages() const override {
         return 0;
     }
@@ -432,7 +425,12 @@ public:
     bool is_mapping() const override { return true; }
 
     void Dump(uint depth, bool verbose) const override;
-    zx_status_t PageFault(vaddr_t va, uint pf_flags) override;
+
+    // Page fault in an address within the mapping. Must be called with the
+    // lock of the mapped vmo held, after checking that |va| is still within
+    // the mapping; the aspace lock is not needed, since every change to the
+    // mapping also takes the vmo lock.
+    zx_status_t PageFaultLocked(vaddr_t va, uint pf_flags);
 
 protected:
     ~VmMapping() override;
@@ -477,6 +475,19 @@ private:
     // in Clang around capability aliasing, we need to relax the analysis.
     void ActivateLocked();
 
+    // Maps the large page containing |va| with a single entry if the mapping
+    // covers it and |object_| backs it with one contiguous run of pages.
+    zx_status_t MapLargePageLocked(vaddr_t va);
+
+    // Breaks up large page mappings that the range [base, base + len) only
+    // partly covers, before that range is unmapped or protected.
+    void DemoteLargePagesLocked(vaddr_t base, size_t len) const;
+
+    // Maps pages of |object_| that are already resident in the window around
+    // the faulting page |va|, so that nearby accesses don't each take a fault.
+    // Called from PageFaultLocked() with the object lock held.
+    void FaultAroundLocked(vaddr_t va, uint pf_flags);
+
     // pointer and region of the object we are mapping
     fbl::RefPtr<VmObject> object_;
     uint64_t object_offset_ = 0;
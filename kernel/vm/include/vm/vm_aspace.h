@@ -9,6 +9,7 @@
 #include <arch/aspace.h>
 #include <arch/mmu.h>
 #include <assert.h>
+#include <fbl/atomic.h>
 #include <fbl/canary.h>
 #include <fbl/intrusive_double_list.h>
 #include <fbl/intrusive_wavl_tree.h>
@@ -53,6 +54,13 @@ public:
     bool is_user() const { return (flags_ & TYPE_MASK) == TYPE_USER; }
     bool is_aslr_enabled() const { return aslr_enabled_; }
 
+    // number of pages, including the faulting one, that a page fault may map
+    // in one go; 1 means fault-around is disabled
+    size_t fault_around_pages() const { return fault_around_pages_; }
+
+    // record |pages| extra pages mapped by fault-around
+    void AddFaultAroundPages(size_t pages) { fault_around_mapped_.fetch_add(pages); }
+
     // Get the root VMAR (briefly acquires the aspace lock)
     fbl::RefPtr<VmAddressRegion> RootVmar();
 
@@ -176,6 +184,7 @@ private:
                                                     fbl::RefPtr<VmAspace> aspace);
 
     void InitializeAslr();
+    void InitializeFaultAround();
 
     // magic
     fbl::Canary<fbl::magic("VMAS")> canary_;
@@ -187,9 +196,14 @@ private:
     char name_[32];
     bool aspace_destroyed_ = false;
     bool aslr_enabled_ = false;
+    size_t fault_around_pages_ = 1;
 
     mutable mutex_t lock_ = MUTEX_INITIAL_VALUE(lock_);
 
+    // page fault statistics, updated without lock_ held
+    fbl::atomic<uint64_t> page_faults_{0};
+    fbl::atomic<uint64_t> fault_around_mapped_{0};
+
     // root of virtual address space
     // Access to this reference is guarded by lock_.
     fbl::RefPtr<VmAddressRegion> root_vmar_;
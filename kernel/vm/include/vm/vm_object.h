@@ -44,6 +44,15 @@ public:
     // Returns true if the object is backed by RAM.
     virtual bool is_paged() const { return false; }
 
+    // Size of the physically contiguous runs of pages that can be mapped with
+    // a single large page table entry.
+    static const uint8_t kLargePageShift = 21;
+    static const uint64_t kLargePageSize = 1ull << kLargePageShift;
+
+    // Returns true if the object tries to commit memory in large pages, and
+    // so would like to be mapped at large page aligned addresses.
+    virtual bool prefers_large_pages() const { return false; }
+
     // Returns the number of physical pages currently allocated to the
     // object where (offset <= page_offset < offset+len).
     // |offset| and |len| are in bytes.
@@ -175,6 +184,18 @@ public:
         return ZX_ERR_NOT_SUPPORTED;
     }
 
+    // Back the large page at |offset| with one physically contiguous, aligned
+    // run of pages. Only done if none of the pages in the range are committed.
+    virtual zx_status_t CommitLargePageLocked(uint64_t offset) TA_REQ(lock_) {
+        return ZX_ERR_NOT_SUPPORTED;
+    }
+
+    // If the large page at |offset| is fully committed by this object to one
+    // physically contiguous, aligned run of pages, return its start in |pa|.
+    virtual zx_status_t GetLargePageLocked(uint64_t offset, paddr_t* pa) TA_REQ(lock_) {
+        return ZX_ERR_NOT_SUPPORTED;
+    }
+
     fbl::Mutex* lock() TA_RET_CAP(lock_) { return &lock_; }
     fbl::Mutex& lock_ref() TA_RET_CAP(lock_) { return lock_; }
 
@@ -27,7 +27,14 @@
 // the main VM object type, holding a list of pages
 class VmObjectPaged final : public VmObject {
 public:
+    // Create() options
+    // Commit memory in physically contiguous large pages where possible.
+    static const uint32_t kLargePages = (1u << 0);
+
+    // Uses kLargePages if large pages are enabled on the kernel command line.
     static zx_status_t Create(uint32_t pmm_alloc_flags, uint64_t size, fbl::RefPtr<VmObject>* vmo);
+    static zx_status_t Create(uint32_t pmm_alloc_flags, uint32_t options, uint64_t size,
+                              fbl::RefPtr<VmObject>* vmo);
 
     static zx_status_t CreateFromROData(const void* data, size_t size, fbl::RefPtr<VmObject>* vmo);
 
@@ -38,6 +45,7 @@ public:
         // any deadlocks.
         TA_NO_THREAD_SAFETY_ANALYSIS { return size_; }
     bool is_paged() const override { return true; }
+    bool prefers_large_pages() const override { return large_pages_; }
 
     size_t AllocatedPagesInRange(uint64_t offset, uint64_t len) const override;
 
@@ -74,6 +82,9 @@ public:
         // Calls a Locked method of the parent, which confuses analysis.
         TA_NO_THREAD_SAFETY_ANALYSIS;
 
+    zx_status_t CommitLargePageLocked(uint64_t offset) override TA_REQ(lock_);
+    zx_status_t GetLargePageLocked(uint64_t offset, paddr_t* pa) override TA_REQ(lock_);
+
     zx_status_t CloneCOW(uint64_t offset, uint64_t size, bool copy_name,
                          fbl::RefPtr<VmObject>* clone_vmo) override
         // Calls a Locked method of the child, which confuses analysis.
@@ -129,6 +140,9 @@ private:
     uint64_t parent_offset_ TA_GUARDED(lock_) = 0;
     uint32_t pmm_alloc_flags_ TA_GUARDED(lock_) = PMM_ALLOC_FLAG_ANY;
 
+    // set at creation, never for clones
+    bool large_pages_ = false;
+
     // a tree of pages
     VmPageList page_list_ TA_GUARDED(lock_);
 };
@@ -11,6 +11,7 @@
 #include <err.h>
 #include <inttypes.h>
 #include <kernel/mp.h>
+#include <kernel/spinlock.h>
 #include <kernel/timer.h>
 #include <lib/console.h>
 #include <lk/init.h>
@@ -42,6 +43,39 @@ static fbl::Mutex arena_lock;
 static fbl::DoublyLinkedList<PmmArena*> arena_list TA_GUARDED(arena_lock);
 static size_t arena_cumulative_size TA_GUARDED(arena_lock);
 
+// Per-CPU caches of free pages.  Single page allocations and small frees are
+// served out of the current CPU's cache without touching arena_lock; the
+// caches are refilled from, and drained back to, the arenas in batches.
+// Refills happen with arena_lock held, so draining the caches under the lock
+// returns every free page that isn't in an arena.
+//
+// Only pages from KMAP arenas are cached, so a cached page satisfies any
+// allocation flags.  While a page sits in a cache it stays in the ALLOC state
+// as far as its arena is concerned, which keeps pmm_alloc_range() and
+// pmm_alloc_contiguous() from handing it out a second time.
+namespace {
+
+constexpr size_t kPcpuCacheSize = 64;
+constexpr size_t kPcpuCacheBatch = 16;
+
+struct PmmPcpuCache {
+    spin_lock_t lock;
+    size_t count;
+    vm_page_t* pages[kPcpuCacheSize];
+
+    // Statistics, reported by the "pmm cache" console command.
+    uint64_t alloc_hits;
+    uint64_t alloc_misses;
+    uint64_t frees;
+    uint64_t drains;
+} __CPU_ALIGN;
+
+// Zero initialization leaves every lock unlocked and every cache empty, so
+// these are usable before global constructors have run.
+PmmPcpuCache pcpu_cache[SMP_MAX_CPUS];
+
+} // namespace
+
 #if PMM_ENABLE_FREE_FILL
 static void pmm_enforce_fill(uint level) {
     for (auto& a : arena_list) {
@@ -83,7 +117,7 @@ zx_status_t pmm_add_arena(const pmm_arena_info_t* info) TA_NO_THREAD_SAFETY_ANAL
 
     // Make sure we're in early boot (ints disabled and no active CPUs according
     // to the scheduler).
-    DEBUG_ASSERT(mp_get_active_mask() == 0);
+    DEBUG_ASSERT(cpu_mask_is_empty(mp_get_active_mask()));
     DEBUG_ASSERT(arch_ints_disabled());
 
     DEBUG_ASSERT(IS_PAGE_ALIGNED(info->base));
@@ -119,9 +153,164 @@ done_add:
     return ZX_OK;
 }
 
-vm_page_t* pmm_alloc_page(uint alloc_flags, paddr_t* pa) {
-    AutoLock al(&arena_lock);
+// We don't need to hold the arena lock while executing this, since it is
+// only accesses values that are set once during system initialization.
+static bool page_is_cacheable(const vm_page_t* page) TA_NO_THREAD_SAFETY_ANALYSIS {
+    for (const auto& a : arena_list) {
+        if (a.page_belongs_to_arena(page)) {
+            return (a.flags() & PMM_ARENA_FLAG_KMAP) != 0;
+        }
+    }
+    return false;
+}
+
+// Pop a page off the current CPU's cache, or return nullptr if it is empty.
+static vm_page_t* pcpu_cache_alloc() {
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    PmmPcpuCache* cache = &pcpu_cache[arch_curr_cpu_num()];
+    spin_lock(&cache->lock);
+
+    vm_page_t* page = nullptr;
+    if (cache->count > 0) {
+        page = cache->pages[--cache->count];
+        cache->alloc_hits++;
+    } else {
+        cache->alloc_misses++;
+    }
+
+    spin_unlock_restore(&cache->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+    return page;
+}
+
+// Move as many pages from |list| into the current CPU's cache as will fit.
+// If |is_free| the pages are being returned by a caller; if the cache is
+// already full, its oldest pages are moved to |list| to make room.  Returns
+// the number of pages taken from |list|.
+static size_t pcpu_cache_fill(list_node* list, bool is_free) {
+    list_node keep = LIST_INITIAL_VALUE(keep);
+    size_t taken = 0;
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    PmmPcpuCache* cache = &pcpu_cache[arch_curr_cpu_num()];
+    spin_lock(&cache->lock);
+
+    if (is_free && cache->count == kPcpuCacheSize) {
+        // Drain the bottom of the stack; the top is the most recently freed
+        // and hence the most likely to still be cache-hot.
+        for (size_t i = 0; i < kPcpuCacheBatch; i++) {
+            list_add_tail(&keep, &cache->pages[i]->free.node);
+        }
+        memmove(&cache->pages[0], &cache->pages[kPcpuCacheBatch],
+                (kPcpuCacheSize - kPcpuCacheBatch) * sizeof(cache->pages[0]));
+        cache->count -= kPcpuCacheBatch;
+        cache->drains++;
+    }
+
+    vm_page_t* page;
+    while (cache->count < kPcpuCacheSize &&
+           (page = list_remove_head_type(list, vm_page_t, free.node)) != nullptr) {
+        if (is_free) {
+            DEBUG_ASSERT_MSG(!page_is_free(page), "page %p state %u\n", page, page->state);
+            DEBUG_ASSERT(page->state != VM_PAGE_STATE_OBJECT || page->object.pin_count == 0);
+            if (!page_is_cacheable(page)) {
+                list_add_tail(&keep, &page->free.node);
+                continue;
+            }
+            page->state = VM_PAGE_STATE_ALLOC;
+            cache->frees++;
+        }
+        cache->pages[cache->count++] = page;
+        taken++;
+    }
+
+    spin_unlock_restore(&cache->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    // Hand back whatever we didn't keep.
+    list_node* node;
+    while ((node = list_remove_tail(&keep)) != nullptr) {
+        list_add_head(list, node);
+    }
+    return taken;
+}
+
+// Return pages to their arenas.  Any page not belonging to an arena is left
+// on |list|.
+static size_t pmm_free_locked(list_node* list) TA_REQ(arena_lock) {
+    list_node orphans = LIST_INITIAL_VALUE(orphans);
+    size_t count = 0;
+    while (!list_is_empty(list)) {
+        vm_page_t* page = list_remove_head_type(list, vm_page_t, free.node);
+
+        DEBUG_ASSERT_MSG(!page_is_free(page), "page %p state %u\n", page, page->state);
+
+        /* see which arena this page belongs to and add it */
+        bool found = false;
+        for (auto& a : arena_list) {
+            if (a.FreePage(page) >= 0) {
+                count++;
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            list_add_tail(&orphans, &page->free.node);
+        }
+    }
+    list_move(&orphans, list);
+    return count;
+}
+
+// Empty every CPU's cache into |list|.  The cache spinlocks nest inside
+// arena_lock, so this may be called with or without it held.
+static void pmm_take_pcpu_caches(list_node* list) {
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        PmmPcpuCache* cache = &pcpu_cache[i];
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&cache->lock, state);
+        for (size_t j = 0; j < cache->count; j++) {
+            list_add_tail(list, &cache->pages[j]->free.node);
+        }
+        if (cache->count > 0) {
+            cache->drains++;
+        }
+        cache->count = 0;
+        spin_unlock_irqrestore(&cache->lock, state);
+    }
+}
+
+// Empty every CPU's cache back into the arenas.  Returns true if any pages
+// were returned.
+static bool pmm_drain_pcpu_caches_locked() TA_REQ(arena_lock) {
+    list_node list = LIST_INITIAL_VALUE(list);
+    pmm_take_pcpu_caches(&list);
+    if (list_is_empty(&list)) {
+        return false;
+    }
+    pmm_free_locked(&list);
+    return true;
+}
+
+static void pmm_drain_pcpu_caches() {
+    list_node list = LIST_INITIAL_VALUE(list);
+    pmm_take_pcpu_caches(&list);
+    if (!list_is_empty(&list)) {
+        AutoLock al(&arena_lock);
+        pmm_free_locked(&list);
+    }
+}
+
+static size_t pmm_count_cached_pages() {
+    size_t cached = 0;
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        // Racy, but only used for reporting.
+        cached += pcpu_cache[i].count;
+    }
+    return cached;
+}
 
+static vm_page_t* pmm_alloc_page_locked(uint alloc_flags, paddr_t* pa) TA_REQ(arena_lock) {
     /* walk the arenas in order until we find one with a free page */
     for (auto& a : arena_list) {
         /* skip the arena if it's not KMAP and the KMAP only allocation flag was passed */
@@ -140,6 +329,48 @@ vm_page_t* pmm_alloc_page(uint alloc_flags, paddr_t* pa) {
     return nullptr;
 }
 
+vm_page_t* pmm_alloc_page(uint alloc_flags, paddr_t* pa) {
+    vm_page_t* page = pcpu_cache_alloc();
+    if (page) {
+        if (pa) {
+            *pa = vm_page_to_paddr(page);
+        }
+        return page;
+    }
+
+    list_node batch = LIST_INITIAL_VALUE(batch);
+    {
+        AutoLock al(&arena_lock);
+        page = pmm_alloc_page_locked(alloc_flags, pa);
+        if (!page) {
+            // The arenas are empty, but other CPUs' caches may not be.  Pull
+            // their pages back and try once more before failing.
+            if (!pmm_drain_pcpu_caches_locked()) {
+                return nullptr;
+            }
+            page = pmm_alloc_page_locked(alloc_flags, pa);
+            if (!page) {
+                return nullptr;
+            }
+        }
+
+        // Refill the cache while we have the lock anyway.  The pages go into
+        // the cache before the lock is dropped, so that a drain under the lock
+        // always finds every page that has left the arenas for a cache.
+        for (auto& a : arena_list) {
+            if (a.flags() & PMM_ARENA_FLAG_KMAP) {
+                if (a.AllocPages(kPcpuCacheBatch, &batch) > 0) {
+                    break;
+                }
+            }
+        }
+        pcpu_cache_fill(&batch, false);
+        // We may have migrated to a CPU whose cache was already topped up.
+        pmm_free_locked(&batch);
+    }
+    return page;
+}
+
 size_t pmm_alloc_pages(size_t count, uint alloc_flags, struct list_node* list) {
     LTRACEF("count %zu\n", count);
 
@@ -151,22 +382,31 @@ size_t pmm_alloc_pages(size_t count, uint alloc_flags, struct list_node* list) {
 
     AutoLock al(&arena_lock);
 
-    /* walk the arenas in order, allocating as many pages as we can from each */
     size_t allocated = 0;
-    for (auto& a : arena_list) {
-        DEBUG_ASSERT(count > allocated);
-
-        /* skip the arena if it's not KMAP and the KMAP only allocation flag was passed */
-        if (alloc_flags & PMM_ALLOC_FLAG_KMAP) {
-            if ((a.flags() & PMM_ARENA_FLAG_KMAP) == 0)
-                continue;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (attempt > 0) {
+            // The arenas ran dry; pages sitting in the per-CPU caches may
+            // still cover the rest of the request.
+            if (!pmm_drain_pcpu_caches_locked())
+                break;
         }
 
-        // ask the arena to allocate some pages
-        allocated += a.AllocPages(count - allocated, list);
-        DEBUG_ASSERT(allocated <= count);
-        if (allocated == count)
-            break;
+        /* walk the arenas in order, allocating as many pages as we can from each */
+        for (auto& a : arena_list) {
+            DEBUG_ASSERT(count > allocated);
+
+            /* skip the arena if it's not KMAP and the KMAP only allocation flag was passed */
+            if (alloc_flags & PMM_ALLOC_FLAG_KMAP) {
+                if ((a.flags() & PMM_ARENA_FLAG_KMAP) == 0)
+                    continue;
+            }
+
+            // ask the arena to allocate some pages
+            allocated += a.AllocPages(count - allocated, list);
+            DEBUG_ASSERT(allocated <= count);
+            if (allocated == count)
+                return allocated;
+        }
     }
 
     return allocated;
@@ -183,6 +423,11 @@ size_t pmm_alloc_range(paddr_t address, size_t count, struct list_node* list) {
 
     AutoLock al(&arena_lock);
 
+    // The requested pages may be sitting in a per-CPU cache.  Caches are only
+    // refilled under arena_lock, so they can't be taken again before the
+    // lookup below.
+    pmm_drain_pcpu_caches_locked();
+
     /* walk through the arenas, looking to see if the physical page belongs to it */
     for (auto& a : arena_list) {
         while (allocated < count && a.address_in_arena(address)) {
@@ -225,17 +470,26 @@ size_t pmm_alloc_contiguous(size_t count, uint alloc_flags, uint8_t alignment_lo
 
     AutoLock al(&arena_lock);
 
-    for (auto& a : arena_list) {
-        /* skip the arena if it's not KMAP and the KMAP only allocation flag was passed */
-        if (alloc_flags & PMM_ALLOC_FLAG_KMAP) {
-            if ((a.flags() & PMM_ARENA_FLAG_KMAP) == 0)
-                continue;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (attempt > 0) {
+            // Pages held in the per-CPU caches may be what's breaking up the
+            // run we need; give them back and look again.
+            if (!pmm_drain_pcpu_caches_locked())
+                break;
         }
 
-        size_t allocated = a.AllocContiguous(count, alignment_log2, pa, list);
-        if (allocated > 0) {
-            DEBUG_ASSERT(allocated == count);
-            return allocated;
+        for (auto& a : arena_list) {
+            /* skip the arena if it's not KMAP and the KMAP only allocation flag was passed */
+            if (alloc_flags & PMM_ALLOC_FLAG_KMAP) {
+                if ((a.flags() & PMM_ARENA_FLAG_KMAP) == 0)
+                    continue;
+            }
+
+            size_t allocated = a.AllocContiguous(count, alignment_log2, pa, list);
+            if (allocated > 0) {
+                DEBUG_ASSERT(allocated == count);
+                return allocated;
+            }
         }
     }
 
@@ -317,24 +571,18 @@ size_t pmm_free(struct list_node* list) {
 
     DEBUG_ASSERT(list);
 
-    AutoLock al(&arena_lock);
-
-    uint count = 0;
-    while (!list_is_empty(list)) {
-        vm_page_t* page = list_remove_head_type(list, vm_page_t, free.node);
-
-        DEBUG_ASSERT_MSG(!page_is_free(page), "page %p state %u\n", page, page->state);
+    // Give the current CPU's cache first pick; anything it doesn't want
+    // (including whatever it evicted to make room) goes back to the arenas.
+    size_t count = pcpu_cache_fill(list, true);
 
-        /* see which arena this page belongs to and add it */
-        for (auto& a : arena_list) {
-            if (a.FreePage(page) >= 0) {
-                count++;
-                break;
-            }
-        }
+    if (!list_is_empty(list)) {
+        AutoLock al(&arena_lock);
+        count += pmm_free_locked(list);
+        // Pages that don't belong to any arena are dropped, as before.
+        list_initialize(list);
     }
 
-    LTRACEF("returning count %u\n", count);
+    LTRACEF("returning count %zu\n", count);
 
     return count;
 }
@@ -358,11 +606,11 @@ static size_t pmm_count_free_pages_locked() TA_REQ(arena_lock) {
 
 size_t pmm_count_free_pages() {
     AutoLock al(&arena_lock);
-    return pmm_count_free_pages_locked();
+    return pmm_count_free_pages_locked() + pmm_count_cached_pages();
 }
 
 static void pmm_dump_free() TA_REQ(arena_lock) {
-    auto megabytes_free = pmm_count_free_pages_locked() / 256u;
+    auto megabytes_free = (pmm_count_free_pages_locked() + pmm_count_cached_pages()) / 256u;
     printf(" %zu free MBs\n", megabytes_free);
 }
 
@@ -382,6 +630,12 @@ void pmm_count_total_states(size_t state_count[_VM_PAGE_STATE_COUNT]) {
     for (auto& a : arena_list) {
         a.CountStates(state_count);
     }
+
+    // Pages in the per-CPU caches look allocated to their arenas.
+    size_t cached = pmm_count_cached_pages();
+    cached = MIN(cached, state_count[VM_PAGE_STATE_ALLOC]);
+    state_count[VM_PAGE_STATE_ALLOC] -= cached;
+    state_count[VM_PAGE_STATE_FREE] += cached;
 }
 
 static void pmm_dump_timer(timer_t* t, zx_time_t now, void*) TA_REQ(arena_lock) {
@@ -402,6 +656,24 @@ static void arena_dump(bool is_panic) TA_NO_THREAD_SAFETY_ANALYSIS {
     }
 }
 
+// No lock analysis here; the statistics are only approximate anyway.
+static void pcpu_cache_dump() {
+    uint64_t total_hits = 0;
+    uint64_t total_misses = 0;
+    for (uint i = 0; i < arch_max_num_cpus(); i++) {
+        const PmmPcpuCache& c = pcpu_cache[i];
+        uint64_t allocs = c.alloc_hits + c.alloc_misses;
+        printf("cpu %2u: %3zu cached, %" PRIu64 " allocs (%" PRIu64 "%% hit), %" PRIu64
+               " frees, %" PRIu64 " drains\n",
+               i, c.count, allocs, allocs ? c.alloc_hits * 100 / allocs : 0, c.frees, c.drains);
+        total_hits += c.alloc_hits;
+        total_misses += c.alloc_misses;
+    }
+    uint64_t total = total_hits + total_misses;
+    printf("total: %zu cached, %" PRIu64 " allocs (%" PRIu64 "%% hit)\n",
+           pmm_count_cached_pages(), total, total ? total_hits * 100 / total : 0);
+}
+
 static int cmd_pmm(int argc, const cmd_args* argv, uint32_t flags) {
     bool is_panic = flags & CMD_FLAG_PANIC;
 
@@ -419,6 +691,8 @@ static int cmd_pmm(int argc, const cmd_args* argv, uint32_t flags) {
             printf("%s dump_alloced\n", argv[0].str);
             printf("%s free_alloced\n", argv[0].str);
             printf("%s free\n", argv[0].str);
+            printf("%s cache\n", argv[0].str);
+            printf("%s drain\n", argv[0].str);
         }
         return ZX_ERR_INTERNAL;
     }
@@ -525,6 +799,11 @@ static int cmd_pmm(int argc, const cmd_args* argv, uint32_t flags) {
         while ((node = list_remove_head(&list))) {
             list_add_tail(&allocated, node);
         }
+    } else if (!strcmp(argv[1].str, "cache")) {
+        pcpu_cache_dump();
+    } else if (!strcmp(argv[1].str, "drain")) {
+        pmm_drain_pcpu_caches();
+        pcpu_cache_dump();
     } else if (!strcmp(argv[1].str, "free_alloced")) {
         size_t err = pmm_free(&allocated);
         printf("pmm_free returns %zu\n", err);
@@ -267,10 +267,20 @@ zx_status_t VmAddressRegion::CreateVmMapping(size_t mapping_offset, size_t size,
         vmar_flags |= VMAR_FLAG_CAN_MAP_EXECUTE;
     }
 
+    // Line the mapping up with the object's large pages when we get to pick
+    // the address, but don't fail the mapping if the aligned placement doesn't fit.
     fbl::RefPtr<VmAddressRegionOrMapping> res;
-    zx_status_t status =
-        CreateSubVmarInternal(mapping_offset, size, align_pow2, vmar_flags, fbl::move(vmo),
-                              vmo_offset, arch_mmu_flags, name, &res);
+    zx_status_t status = ZX_ERR_NO_MEMORY;
+    if (!(vmar_flags & (VMAR_FLAG_SPECIFIC | VMAR_FLAG_SPECIFIC_OVERWRITE)) &&
+        align_pow2 < VmObject::kLargePageShift && size >= VmObject::kLargePageSize &&
+        IS_ALIGNED(vmo_offset, VmObject::kLargePageSize) && vmo->prefers_large_pages()) {
+        status = CreateSubVmarInternal(mapping_offset, size, VmObject::kLargePageShift,
+                                       vmar_flags, vmo, vmo_offset, arch_mmu_flags, name, &res);
+    }
+    if (status == ZX_ERR_NO_MEMORY) {
+        status = CreateSubVmarInternal(mapping_offset, size, align_pow2, vmar_flags,
+                                       fbl::move(vmo), vmo_offset, arch_mmu_flags, name, &res);
+    }
     if (status != ZX_OK) {
         return status;
     }
@@ -380,7 +390,7 @@ size_t VmAddressRegion::AllocatedPagesLocked() const {
     return sum;
 }
 
-zx_status_t VmAddressRegion::PageFault(vaddr_t va, uint pf_flags) {
+fbl::RefPtr<VmMapping> VmAddressRegion::FindMappingLocked(vaddr_t va) {
     canary_.Assert();
     DEBUG_ASSERT(is_mutex_held(aspace_->lock()));
 
@@ -388,10 +398,10 @@ zx_status_t VmAddressRegion::PageFault(vaddr_t va, uint pf_flags) {
          auto next = vmar->FindRegionLocked(va);
          vmar = next->as_vm_address_region()) {
         if (next->is_mapping())
-            return next->PageFault(va, pf_flags);
+            return next->as_vm_mapping();
     }
 
-    return ZX_ERR_NOT_FOUND;
+    return nullptr;
 }
 
 bool VmAddressRegion::IsRangeAvailableLocked(vaddr_t base, size_t size) {
@@ -20,6 +20,7 @@
 #include <kernel/thread.h>
 #include <lib/crypto/global_prng.h>
 #include <lib/crypto/prng.h>
+#include <pow2.h>
 #include <safeint/safe_math.h>
 #include <stdlib.h>
 #include <string.h>
@@ -43,6 +44,10 @@ using fbl::AutoLock;
 #define GUEST_PHYSICAL_ASPACE_BASE 0UL
 #define GUEST_PHYSICAL_ASPACE_SIZE (1UL << MMU_GUEST_SIZE_SHIFT)
 
+// default and largest page fault window, in pages
+static const uint32_t kDefaultFaultAroundPages = 16;
+static const uint32_t kMaxFaultAroundPages = 256;
+
 // pointer to a singleton kernel address space
 VmAspace* VmAspace::kernel_aspace_ = nullptr;
 
@@ -158,6 +163,7 @@ zx_status_t VmAspace::Init() {
     }
 
     InitializeAslr();
+    InitializeFaultAround();
 
     if (likely(!root_vmar_)) {
         return VmAddressRegion::CreateRoot(*this, VMAR_FLAG_CAN_MAP_SPECIFIC, &root_vmar_);
@@ -544,12 +550,32 @@ zx_status_t VmAspace::PageFault(vaddr_t va, uint flags) {
         flags |= VMM_PF_FLAG_GUEST;
     }
 
-    // for now, hold the aspace lock across the page fault operation,
-    // which stops any other operations on the address space from moving
-    // the region out from underneath it
-    AutoLock a(&lock_);
+    page_faults_.fetch_add(1);
+
+    // The aspace lock is only held to find the mapping, the fault itself runs
+    // under the lock of the mapped vmo. Anything that changes a mapping's
+    // range, permissions or lifetime holds that vmo lock as well, so faults
+    // on mappings of different vmos proceed in parallel. The mapping may have
+    // changed between dropping one lock and taking the other, in which case
+    // look it up again.
+    for (;;) {
+        fbl::RefPtr<VmMapping> mapping;
+        fbl::RefPtr<VmObject> vmo;
+        {
+            AutoLock a(&lock_);
+            mapping = root_vmar_->FindMappingLocked(va);
+            if (!mapping) {
+                return ZX_ERR_NOT_FOUND;
+            }
+            vmo = mapping->vmo();
+        }
 
-    return root_vmar_->PageFault(va, flags);
+        AutoLock al(vmo->lock());
+        if (va - mapping->base() >= mapping->size()) {
+            continue;
+        }
+        return mapping->PageFaultLocked(va, flags);
+    }
 }
 
 void VmAspace::Dump(bool verbose) const {
@@ -557,6 +583,9 @@ void VmAspace::Dump(bool verbose) const {
     printf("as %p [%#" PRIxPTR " %#" PRIxPTR "] sz %#zx fl %#x ref %d '%s'\n", this,
            base_, base_ + size_ - 1, size_, flags_, ref_count_debug(), name_);
 
+    printf("\tfaults %" PRIu64 " fault-around pages %" PRIu64 " window %zu\n",
+           page_faults_.load(), fault_around_mapped_.load(), fault_around_pages_);
+
     AutoLock a(&lock_);
 
     if (verbose)
@@ -610,6 +639,20 @@ void VmAspace::InitializeAslr() {
     aslr_prng_.AddEntropy(aslr_seed_, sizeof(aslr_seed_));
 }
 
+void VmAspace::InitializeFaultAround() {
+    // only user address spaces fault around; the kernel maps its own memory up front
+    if (!is_user()) {
+        fault_around_pages_ = 1;
+        return;
+    }
+
+    // the window is aligned to its own size, so round it down to a power of two
+    uint32_t pages = cmdline_get_uint32("kernel.vm.fault-around-pages",
+                                        kDefaultFaultAroundPages);
+    pages = MIN(pages, kMaxFaultAroundPages);
+    fault_around_pages_ = (pages > 1) ? (1u << log2_uint_floor(pages)) : 1;
+}
+
 #if WITH_LIB_VDSO
 uintptr_t VmAspace::vdso_base_address() const {
     AutoLock a(&lock_);
@@ -13,6 +13,7 @@
 #include <fbl/auto_call.h>
 #include <fbl/auto_lock.h>
 #include <inttypes.h>
+#include <lib/counters.h>
 #include <safeint/safe_math.h>
 #include <trace.h>
 #include <vm/fault.h>
@@ -25,6 +26,9 @@ using fbl::AutoLock;
 
 #define LOCAL_TRACE MAX(VM_GLOBAL_TRACE, 0)
 
+KCOUNTER(vm_fault_around_pages, "kernel.vm.fault_around.pages");
+KCOUNTER(vm_large_page_maps, "kernel.vm.large_page.maps");
+
 VmMapping::VmMapping(VmAddressRegion& parent, vaddr_t base, size_t size, uint32_t vmar_flags,
                      fbl::RefPtr<VmObject> vmo, uint64_t vmo_offset, uint arch_mmu_flags)
     : VmAddressRegionOrMapping(base, size, vmar_flags,
@@ -138,6 +142,8 @@ zx_status_t VmMapping::ProtectLocked(vaddr_t base, size_t size, uint new_arch_mm
 
     // TODO(teisenbe): deal with error mapping on arch_mmu_protect fail
 
+    DemoteLargePagesLocked(base, size);
+
     // If we're changing the whole mapping, just make the change.
     if (base_ == base && size_ == size) {
         zx_status_t status = ProtectOrUnmap(aspace_, base, size, new_arch_mmu_flags);
@@ -270,6 +276,8 @@ zx_status_t VmMapping::UnmapLocked(vaddr_t base, size_t size) {
     DEBUG_ASSERT(object_);
     AutoLock al(object_->lock());
 
+    DemoteLargePagesLocked(base, size);
+
     // Check if unmapping from one of the ends
     if (base_ == base || base + size == base_ + size_) {
         LTRACEF("unmapping base %#lx size %#zx\n", base, size);
@@ -378,6 +386,8 @@ zx_status_t VmMapping::UnmapVmoRangeLocked(uint64_t offset, uint64_t len) const
     LTRACEF("going to unmap %#" PRIxPTR ", len %#" PRIx64 " aspace %p\n",
             unmap_base.ValueOrDie(), len_new, aspace_.get());
 
+    DemoteLargePagesLocked(unmap_base.ValueOrDie(), static_cast<size_t>(len_new));
+
     zx_status_t status = aspace_->arch_aspace().Unmap(unmap_base.ValueOrDie(),
                                                       static_cast<size_t>(len_new) / PAGE_SIZE, nullptr);
     if (status < 0)
@@ -386,11 +396,78 @@ zx_status_t VmMapping::UnmapVmoRangeLocked(uint64_t offset, uint64_t len) const
     return ZX_OK;
 }
 
+void VmMapping::DemoteLargePagesLocked(vaddr_t base, size_t len) const {
+    DEBUG_ASSERT(object_->lock()->IsHeld());
+
+    if (!object_->prefers_large_pages()) {
+        return;
+    }
+
+#if ARCH_ARM64
+    // The arm64 page tables apply a partial unmap or protect to a whole block
+    // mapping rather than splitting it, so drop any large page the range only
+    // partly covers. Its pages fault back in one at a time. The x86 page
+    // tables split large pages themselves.
+    const vaddr_t edges[] = {base, base + len};
+    for (vaddr_t edge : edges) {
+        if (IS_ALIGNED(edge, VmObject::kLargePageSize)) {
+            continue;
+        }
+        const vaddr_t chunk = ROUNDDOWN(edge, VmObject::kLargePageSize);
+        if (chunk < base_ || chunk + VmObject::kLargePageSize - 1 > base_ + size_ - 1) {
+            // can't have been mapped as a large page
+            continue;
+        }
+        aspace_->arch_aspace().Unmap(chunk, VmObject::kLargePageSize / PAGE_SIZE, nullptr);
+    }
+#endif
+}
+
+zx_status_t VmMapping::MapLargePageLocked(vaddr_t va) {
+    DEBUG_ASSERT(object_->lock()->IsHeld());
+
+    const vaddr_t chunk = ROUNDDOWN(va, VmObject::kLargePageSize);
+    if (chunk < base_ || chunk + VmObject::kLargePageSize - 1 > base_ + size_ - 1) {
+        return ZX_ERR_OUT_OF_RANGE;
+    }
+    const uint64_t vmo_offset = chunk - base_ + object_offset_;
+    if (!IS_ALIGNED(vmo_offset, VmObject::kLargePageSize)) {
+        return ZX_ERR_NOT_SUPPORTED;
+    }
+
+    paddr_t pa;
+    zx_status_t status = object_->GetLargePageLocked(vmo_offset, &pa);
+    if (status != ZX_OK) {
+        return status;
+    }
+
+    // The pages belong to the object itself, never to a copy-on-write parent
+    // or the zero page, so they can be mapped with the full permissions. Drop
+    // any individual pages that are already mapped first.
+    const size_t count = VmObject::kLargePageSize / PAGE_SIZE;
+    status = aspace_->arch_aspace().Unmap(chunk, count, nullptr);
+    if (status != ZX_OK) {
+        return status;
+    }
+    size_t mapped;
+    status = aspace_->arch_aspace().MapContiguous(chunk, pa, count, arch_mmu_flags_, &mapped);
+    if (status != ZX_OK) {
+        return status;
+    }
+    DEBUG_ASSERT(mapped == count);
+
+    LTRACEF("mapped large page pa %#" PRIxPTR " at va %#" PRIxPTR "\n", pa, chunk);
+    kcounter_add(vm_large_page_maps, 1);
+    return ZX_OK;
+}
+
 namespace {
 
 class VmMappingCoalescer {
 public:
     VmMappingCoalescer(VmMapping* mapping, vaddr_t base);
+    // Map the pages with |mmu_flags| instead of the mapping's own flags.
+    VmMappingCoalescer(VmMapping* mapping, vaddr_t base, uint mmu_flags);
     ~VmMappingCoalescer();
 
     // Add a page to the mapping run.  If this fails, the VmMappingCoalescer is
@@ -424,13 +501,17 @@ private:
 
     VmMapping* mapping_;
     vaddr_t base_;
+    uint mmu_flags_;
     paddr_t phys_[16];
     size_t count_;
     bool aborted_;
 };
 
 VmMappingCoalescer::VmMappingCoalescer(VmMapping* mapping, vaddr_t base)
-    : mapping_(mapping), base_(base), count_(0), aborted_(false) { }
+    : VmMappingCoalescer(mapping, base, mapping->arch_mmu_flags()) { }
+
+VmMappingCoalescer::VmMappingCoalescer(VmMapping* mapping, vaddr_t base, uint mmu_flags)
+    : mapping_(mapping), base_(base), mmu_flags_(mmu_flags), count_(0), aborted_(false) { }
 
 VmMappingCoalescer::~VmMappingCoalescer() {
     // Make sure we've flushed or aborted
@@ -442,7 +523,7 @@ zx_status_t VmMappingCoalescer::Flush() {
         return ZX_OK;
     }
 
-    uint flags = mapping_->arch_mmu_flags();
+    uint flags = mmu_flags_;
     if (flags & ARCH_MMU_FLAG_PERM_RWX_MASK) {
         size_t mapped;
         zx_status_t ret = mapping_->aspace()->arch_aspace().Map(base_, phys_, count_, flags,
@@ -503,6 +584,25 @@ zx_status_t VmMapping::MapRange(size_t offset, size_t len, bool commit) {
         uint64_t vmo_offset = object_offset_ + o;
 
         zx_status_t status;
+
+        // map whole large pages in one go where the object has them
+        if (object_->prefers_large_pages() &&
+            IS_ALIGNED(base_ + o, VmObject::kLargePageSize) &&
+            offset + len - o >= VmObject::kLargePageSize &&
+            IS_ALIGNED(vmo_offset, VmObject::kLargePageSize)) {
+            if (commit) {
+                object_->CommitLargePageLocked(vmo_offset);
+            }
+            status = coalescer.Flush();
+            if (status != ZX_OK) {
+                return status;
+            }
+            if (MapLargePageLocked(base_ + o) == ZX_OK) {
+                o += VmObject::kLargePageSize - PAGE_SIZE;
+                continue;
+            }
+        }
+
         paddr_t pa;
         status = object_->GetPageLocked(vmo_offset, pf_flags, nullptr, nullptr, &pa);
         if (status < 0) {
@@ -595,9 +695,9 @@ zx_status_t VmMapping::DestroyLocked() {
     return ZX_OK;
 }
 
-zx_status_t VmMapping::PageFault(vaddr_t va, const uint pf_flags) {
+zx_status_t VmMapping::PageFaultLocked(vaddr_t va, const uint pf_flags) {
     canary_.Assert();
-    DEBUG_ASSERT(is_mutex_held(aspace_->lock()));
+    DEBUG_ASSERT(object_->lock()->IsHeld());
 
     DEBUG_ASSERT(va >= base_ && va <= base_ + size_ - 1);
 
@@ -631,8 +731,18 @@ zx_status_t VmMapping::PageFault(vaddr_t va, const uint pf_flags) {
         return ZX_ERR_ACCESS_DENIED;
     }
 
-    // grab the lock for the vmo
-    AutoLock al(object_->lock());
+    // A write to an empty large page of an object that prefers them commits
+    // the whole large page. This happens before currently_faulting_ is set so
+    // that any zero pages we have mapped in the range are removed as well.
+    const bool large_pages = object_->prefers_large_pages() && !(pf_flags & VMM_PF_FLAG_GUEST);
+    if (large_pages && (pf_flags & VMM_PF_FLAG_WRITE)) {
+        const vaddr_t chunk = ROUNDDOWN(va, VmObject::kLargePageSize);
+        const uint64_t chunk_offset = chunk - base_ + object_offset_;
+        if (chunk >= base_ && chunk + VmObject::kLargePageSize - 1 <= base_ + size_ - 1 &&
+            IS_ALIGNED(chunk_offset, VmObject::kLargePageSize)) {
+            object_->CommitLargePageLocked(chunk_offset);
+        }
+    }
 
     // set the currently faulting flag for any recursive calls the vmo may make back into us
     // The specific path we're avoiding is if the VMO calls back into us during vmo->GetPageLocked()
@@ -652,6 +762,16 @@ zx_status_t VmMapping::PageFault(vaddr_t va, const uint pf_flags) {
         return status;
     }
 
+    if (large_pages && MapLargePageLocked(va) == ZX_OK) {
+#if ARCH_ARM64
+        if (arch_mmu_flags_ & ARCH_MMU_FLAG_PERM_EXECUTE) {
+            arch_sync_cache_range(ROUNDDOWN(va, VmObject::kLargePageSize),
+                                  VmObject::kLargePageSize);
+        }
+#endif
+        return ZX_OK;
+    }
+
     // if we read faulted, make sure we map or modify the page without any write permissions
     // this ensures we will fault again if a write is attempted so we can potentially
     // replace this page with a copy or a new one
@@ -726,6 +846,8 @@ zx_status_t VmMapping::PageFault(vaddr_t va, const uint pf_flags) {
             return ZX_ERR_NO_MEMORY;
         }
         DEBUG_ASSERT(mapped == 1);
+
+        FaultAroundLocked(va, pf_flags);
     }
 
 // TODO: figure out what to do with this
@@ -739,6 +861,69 @@ zx_status_t VmMapping::PageFault(vaddr_t va, const uint pf_flags) {
     return ZX_OK;
 }
 
+void VmMapping::FaultAroundLocked(vaddr_t va, uint pf_flags) {
+    DEBUG_ASSERT(object_->lock()->IsHeld());
+
+    const size_t window_pages = aspace_->fault_around_pages();
+    if (window_pages <= 1 || (pf_flags & VMM_PF_FLAG_GUEST)) {
+        return;
+    }
+#if ARCH_ARM64
+    // pages mapped here would need the same instruction cache maintenance as the
+    // faulting page, and that is only safe to do on addresses that are mapped
+    if (arch_mmu_flags_ & ARCH_MMU_FLAG_PERM_EXECUTE) {
+        return;
+    }
+#endif
+
+    // use the window aligned to its own size that contains va, clipped to the mapping
+    const size_t window_size = window_pages * PAGE_SIZE;
+    const vaddr_t start = MAX(ROUNDDOWN(va, window_size), base_);
+    const vaddr_t end = start + MIN(window_size, base_ + size_ - start);
+
+    // Never grant write permission to a page the fault did not ask for: a later
+    // write still faults so that copy-on-write and dirty tracking keep working,
+    // and the permission upgrade path above handles it without a page lookup.
+    const uint mmu_flags = arch_mmu_flags_ & ~ARCH_MMU_FLAG_PERM_WRITE;
+    if (!(mmu_flags & ARCH_MMU_FLAG_PERM_RWX_MASK)) {
+        return;
+    }
+
+    VmMappingCoalescer coalescer(this, start, mmu_flags);
+    size_t mapped = 0;
+    for (vaddr_t addr = start; addr < end; addr += PAGE_SIZE) {
+        if (addr == va) {
+            continue;
+        }
+
+        // leave alone anything that is already mapped
+        paddr_t pa;
+        uint page_flags;
+        if (aspace_->arch_aspace().Query(addr, &pa, &page_flags) >= 0) {
+            continue;
+        }
+
+        // with no fault flags this only returns pages that already exist in the
+        // object or one of its parents, and never the zero page
+        uint64_t vmo_offset = addr - base_ + object_offset_;
+        if (object_->GetPageLocked(vmo_offset, 0, nullptr, nullptr, &pa) != ZX_OK) {
+            continue;
+        }
+
+        if (coalescer.Append(addr, pa) != ZX_OK) {
+            return;
+        }
+        mapped++;
+    }
+    if (coalescer.Flush() != ZX_OK) {
+        return;
+    }
+
+    LTRACEF("mapped %zu pages around va %#" PRIxPTR "\n", mapped, va);
+    aspace_->AddFaultAroundPages(mapped);
+    kcounter_add(vm_fault_around_pages, mapped);
+}
+
 // We disable thread safety analysis here because one of the common uses of this
 // function is for splitting one mapping object into several that will be backed
 // by the same VmObject.  In that case, object_->lock() gets aliased across all
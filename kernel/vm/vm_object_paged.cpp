@@ -14,7 +14,10 @@
 #include <fbl/alloc_checker.h>
 #include <fbl/auto_lock.h>
 #include <inttypes.h>
+#include <kernel/cmdline.h>
 #include <lib/console.h>
+#include <lib/counters.h>
+#include <lk/init.h>
 #include <safeint/safe_math.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,8 +32,14 @@ using fbl::AutoLock;
 
 #define LOCAL_TRACE MAX(VM_GLOBAL_TRACE, 0)
 
+KCOUNTER(vm_large_page_commits, "kernel.vm.large_page.commits");
+KCOUNTER(vm_large_page_commit_failures, "kernel.vm.large_page.commit_failures");
+
 namespace {
 
+// whether VmObjectPaged::Create() without options uses kLargePages
+bool large_pages_enabled = false;
+
 void ZeroPage(paddr_t pa) {
     void* ptr = paddr_to_physmap(pa);
     DEBUG_ASSERT(ptr);
@@ -65,6 +74,11 @@ zx_status_t RoundSize(uint64_t size, uint64_t* out_size) {
 
 } // namespace
 
+static void vm_object_paged_init(uint level) {
+    large_pages_enabled = cmdline_get_bool("kernel.vm.large-pages", false);
+}
+LK_INIT_HOOK(vm_object_paged, &vm_object_paged_init, LK_INIT_LEVEL_VM);
+
 VmObjectPaged::VmObjectPaged(uint32_t pmm_alloc_flags, uint64_t size, fbl::RefPtr<VmObject> parent)
     : VmObject(fbl::move(parent)), size_(size), pmm_alloc_flags_(pmm_alloc_flags) {
     LTRACEF("%p\n", this);
@@ -91,16 +105,26 @@ VmObjectPaged::~VmObjectPaged() {
 }
 
 zx_status_t VmObjectPaged::Create(uint32_t pmm_alloc_flags, uint64_t size, fbl::RefPtr<VmObject>* obj) {
+    return Create(pmm_alloc_flags, large_pages_enabled ? kLargePages : 0u, size, obj);
+}
+
+zx_status_t VmObjectPaged::Create(uint32_t pmm_alloc_flags, uint32_t options, uint64_t size,
+                                  fbl::RefPtr<VmObject>* obj) {
+    if (options & ~kLargePages)
+        return ZX_ERR_INVALID_ARGS;
+
     // make sure size is page aligned
     zx_status_t status = RoundSize(size, &size);
     if (status != ZX_OK)
         return status;
 
     fbl::AllocChecker ac;
-    auto vmo = fbl::AdoptRef<VmObject>(new (&ac) VmObjectPaged(pmm_alloc_flags, size, nullptr));
+    auto vmo = fbl::AdoptRef<VmObjectPaged>(new (&ac) VmObjectPaged(pmm_alloc_flags, size, nullptr));
     if (!ac.check())
         return ZX_ERR_NO_MEMORY;
 
+    vmo->large_pages_ = (options & kLargePages) != 0;
+
     *obj = fbl::move(vmo);
 
     return ZX_OK;
@@ -440,6 +464,20 @@ zx_status_t VmObjectPaged::CommitRange(uint64_t offset, uint64_t len, uint64_t*
     DEBUG_ASSERT(end > offset);
     offset = ROUNDDOWN(offset, PAGE_SIZE);
 
+    // back any large pages the range fully covers with contiguous runs first,
+    // the single page path below fills in whatever is left
+    uint64_t large_committed = 0;
+    if (large_pages_) {
+        for (uint64_t o = ROUNDUP(offset, kLargePageSize); o < end && end - o >= kLargePageSize;
+             o += kLargePageSize) {
+            if (CommitLargePageLocked(o) == ZX_OK) {
+                large_committed += kLargePageSize;
+            }
+        }
+        if (committed)
+            *committed = large_committed;
+    }
+
     // make a pass through the list, counting the number of pages we need to allocate
     size_t count = 0;
     uint64_t expected_next_off = offset;
@@ -496,7 +534,7 @@ zx_status_t VmObjectPaged::CommitRange(uint64_t offset, uint64_t len, uint64_t*
     DEBUG_ASSERT(list_is_empty(&page_list));
 
     // for now we only support committing as much as we were asked for
-    DEBUG_ASSERT(!committed || *committed == count * PAGE_SIZE);
+    DEBUG_ASSERT(!committed || *committed == large_committed + count * PAGE_SIZE);
 
     return ZX_OK;
 }
@@ -585,6 +623,104 @@ zx_status_t VmObjectPaged::CommitRangeContiguous(uint64_t offset, uint64_t len,
     return ZX_OK;
 }
 
+zx_status_t VmObjectPaged::CommitLargePageLocked(uint64_t offset) {
+    canary_.Assert();
+    DEBUG_ASSERT(IS_ALIGNED(offset, kLargePageSize));
+
+    // clones get their pages one at a time through copy-on-write
+    if (!large_pages_ || parent_) {
+        return ZX_ERR_NOT_SUPPORTED;
+    }
+    if (offset >= size_ || size_ - offset < kLargePageSize) {
+        return ZX_ERR_OUT_OF_RANGE;
+    }
+
+    // only a completely empty range can be replaced by a single run
+    bool empty = true;
+    page_list_.ForEveryPageInRange(
+        [&empty](const auto p, uint64_t off) {
+            empty = false;
+            return ZX_ERR_STOP;
+        },
+        offset, offset + kLargePageSize);
+    if (!empty) {
+        return ZX_ERR_ALREADY_EXISTS;
+    }
+
+    const size_t count = kLargePageSize / PAGE_SIZE;
+    list_node page_list;
+    list_initialize(&page_list);
+
+    size_t allocated = pmm_alloc_contiguous(count, pmm_alloc_flags_, kLargePageShift, nullptr,
+                                            &page_list);
+    if (allocated < count) {
+        LTRACEF("failed to allocate a large page at offset %#" PRIx64 "\n", offset);
+        pmm_free(&page_list);
+        kcounter_add(vm_large_page_commit_failures, 1);
+        return ZX_ERR_NO_MEMORY;
+    }
+
+    // unmap all of the pages in this range on all the mapping regions, some
+    // of them may have the zero page mapped
+    RangeChangeUpdateLocked(offset, kLargePageSize);
+
+    for (uint64_t o = offset; o < offset + kLargePageSize; o += PAGE_SIZE) {
+        vm_page_t* p = list_remove_head_type(&page_list, vm_page_t, free.node);
+        ASSERT(p);
+
+        InitializeVmPage(p);
+
+        // TODO: remove once pmm returns zeroed pages
+        ZeroPage(p);
+
+        auto status = page_list_.AddPage(p, o);
+        DEBUG_ASSERT(status == ZX_OK);
+    }
+
+    kcounter_add(vm_large_page_commits, 1);
+    return ZX_OK;
+}
+
+zx_status_t VmObjectPaged::GetLargePageLocked(uint64_t offset, paddr_t* pa) {
+    canary_.Assert();
+    DEBUG_ASSERT(IS_ALIGNED(offset, kLargePageSize));
+
+    if (offset >= size_ || size_ - offset < kLargePageSize) {
+        return ZX_ERR_OUT_OF_RANGE;
+    }
+
+    vm_page_t* first = page_list_.GetPage(offset);
+    if (!first) {
+        return ZX_ERR_NOT_FOUND;
+    }
+    const paddr_t base = vm_page_to_paddr(first);
+    if (!IS_ALIGNED(base, kLargePageSize)) {
+        return ZX_ERR_NOT_FOUND;
+    }
+
+    // A physically contiguous run comes from a single arena, so its page
+    // structures are contiguous too. Compare those rather than translating
+    // every page to a physical address.
+    uint64_t expected = offset;
+    page_list_.ForEveryPageInRange(
+        [first, offset, &expected](const auto p, uint64_t off) {
+            if (off != expected || p != first + (off - offset) / PAGE_SIZE) {
+                return ZX_ERR_STOP;
+            }
+            expected += PAGE_SIZE;
+            return ZX_ERR_NEXT;
+        },
+        offset, offset + kLargePageSize);
+    if (expected != offset + kLargePageSize ||
+        vm_page_to_paddr(first + (kLargePageSize / PAGE_SIZE - 1)) !=
+            base + kLargePageSize - PAGE_SIZE) {
+        return ZX_ERR_NOT_FOUND;
+    }
+
+    *pa = base;
+    return ZX_OK;
+}
+
 zx_status_t VmObjectPaged::DecommitRange(uint64_t offset, uint64_t len, uint64_t* decommitted) {
     canary_.Assert();
     LTRACEF("offset %#" PRIx64 ", len %#" PRIx64 "\n", offset, len);
@@ -8,6 +8,8 @@
 #include <err.h>
 #include <fbl/alloc_checker.h>
 #include <fbl/array.h>
+#include <fbl/auto_lock.h>
+#include <pow2.h>
 #include <unittest.h>
 #include <vm/vm.h>
 #include <vm/vm_address_region.h>
@@ -53,6 +55,27 @@ static bool pmm_large_alloc_test(void* context) {
     END_TEST;
 }
 
+// Allocates and frees enough single pages, one at a time, to push the
+// per-CPU page caches through several refills and drains.
+static bool pmm_single_page_churn_test(void* context) {
+    BEGIN_TEST;
+    static const size_t alloc_count = 512;
+    vm_page_t* pages[alloc_count];
+
+    for (size_t i = 0; i < alloc_count; i++) {
+        paddr_t pa;
+        pages[i] = pmm_alloc_page(0, &pa);
+        REQUIRE_NE(nullptr, pages[i], "pmm_alloc single page");
+        EXPECT_EQ(pages[i], paddr_to_vm_page(pa), "paddr matches page");
+        EXPECT_FALSE(page_is_free(pages[i]), "allocated page not free");
+    }
+
+    for (size_t i = 0; i < alloc_count; i++) {
+        EXPECT_EQ(1u, pmm_free_page(pages[i]), "pmm_free_page on single page");
+    }
+    END_TEST;
+}
+
 // Allocates too many pages and makes sure it fails nicely.
 static bool pmm_oversized_alloc_test(void* context) {
     BEGIN_TEST;
@@ -537,6 +560,260 @@ static bool vmo_demand_paged_map_test(void* context) {
     END_TEST;
 }
 
+// Creates a vm object that prefers large pages, maps it demand paged and
+// checks that decommitting part of a large page splits it.
+static bool vmo_large_page_map_test(void* context) {
+    BEGIN_TEST;
+    static const size_t alloc_size = VmObject::kLargePageSize * 2;
+    fbl::RefPtr<VmObject> vmo;
+    zx_status_t status = VmObjectPaged::Create(PMM_ALLOC_FLAG_ANY, VmObjectPaged::kLargePages,
+                                               alloc_size, &vmo);
+    REQUIRE_EQ(status, ZX_OK, "vmobject creation\n");
+    REQUIRE_TRUE(vmo, "vmobject creation\n");
+    EXPECT_TRUE(vmo->prefers_large_pages(), "vmobject creation\n");
+
+    auto ka = VmAspace::kernel_aspace();
+    void* ptr;
+    auto ret = ka->MapObjectInternal(vmo, "test", 0, alloc_size, &ptr,
+                                     VmObject::kLargePageShift, 0, kArchRwFlags);
+    REQUIRE_EQ(ZX_OK, ret, "mapping object");
+
+    if (!fill_and_test(ptr, alloc_size))
+        all_ok = false;
+
+    // physical memory may be too fragmented for a large page, so only check
+    // the layout if we got one
+    paddr_t pa;
+    {
+        fbl::AutoLock al(vmo->lock());
+        status = vmo->GetLargePageLocked(0, &pa);
+    }
+    if (status == ZX_OK) {
+        EXPECT_TRUE(IS_ALIGNED(pa, VmObject::kLargePageSize), "large page alignment");
+        EXPECT_EQ(alloc_size / PAGE_SIZE, vmo->AllocatedPagesInRange(0, alloc_size),
+                  "large page commit");
+    }
+
+    uint64_t n;
+    status = vmo->DecommitRange(PAGE_SIZE, PAGE_SIZE, &n);
+    EXPECT_EQ(ZX_OK, status, "decommit part of a large page");
+    {
+        fbl::AutoLock al(vmo->lock());
+        status = vmo->GetLargePageLocked(0, &pa);
+    }
+    EXPECT_EQ(ZX_ERR_NOT_FOUND, status, "decommitted large page");
+
+    // the rest of the split page must still be mapped correctly
+    if (!fill_and_test(ptr, alloc_size))
+        all_ok = false;
+
+    auto err = ka->FreeRegion((vaddr_t)ptr);
+    EXPECT_EQ(ZX_OK, err, "unmapping object");
+    END_TEST;
+}
+
+// Returns the physical page backing |offset| in |vmo|, or 0 if it has none.
+static paddr_t fault_around_vmo_page(VmObject* vmo, uint64_t offset) {
+    paddr_t pa;
+    fbl::AutoLock al(vmo->lock());
+    if (vmo->GetPageLocked(offset, 0, nullptr, nullptr, &pa) != ZX_OK) {
+        return 0;
+    }
+    return pa;
+}
+
+// Returns true if |va| is mapped in |aspace|, setting |*pa| and |*flags|.
+static bool fault_around_mapped(VmAspace* aspace, vaddr_t va, paddr_t* pa, uint* flags) {
+    return aspace->arch_aspace().Query(va, pa, flags) == ZX_OK;
+}
+
+// Faults in |va| the way VmAspace::PageFault does: under the lock of the vmo
+// backing the innermost mapping covering it.
+static zx_status_t fault_around_fault(VmAspace* aspace, vaddr_t va) {
+    fbl::RefPtr<VmAddressRegionOrMapping> region = aspace->FindRegion(va);
+    while (region && !region->is_mapping()) {
+        region = region->as_vm_address_region()->FindRegion(va);
+    }
+    if (!region) {
+        return ZX_ERR_NOT_FOUND;
+    }
+    fbl::RefPtr<VmMapping> mapping = region->as_vm_mapping();
+    fbl::RefPtr<VmObject> vmo = mapping->vmo();
+    fbl::AutoLock al(vmo->lock());
+    return mapping->PageFaultLocked(va, 0);
+}
+
+// Faults in one page of a mapping of resident pages, and checks that the rest
+// of the aligned window around it is mapped read-only, and nothing beyond it.
+static bool vmo_fault_around_test(void* context) {
+    BEGIN_TEST;
+    auto aspace = VmAspace::Create(0, "test fault-around");
+    REQUIRE_NONNULL(aspace, "VmAspace::Create");
+    const size_t window = aspace->fault_around_pages();
+    if (window <= 1) {
+        unittest_printf("fault-around is disabled, skipping\n");
+        aspace->Destroy();
+        END_TEST;
+    }
+
+    const size_t window_size = window * PAGE_SIZE;
+    const uint8_t align_pow2 =
+        static_cast<uint8_t>(log2_uint_floor(static_cast<uint>(window_size)));
+    fbl::RefPtr<VmObject> vmo;
+    zx_status_t status = VmObjectPaged::Create(PMM_ALLOC_FLAG_ANY, 2 * window_size, &vmo);
+    REQUIRE_EQ(ZX_OK, status, "vmobject creation");
+    uint64_t committed;
+    REQUIRE_EQ(ZX_OK, vmo->CommitRange(0, 2 * window_size, &committed), "commit");
+
+    void* ptr;
+    status = aspace->MapObjectInternal(vmo, "test", 0, 2 * window_size, &ptr,
+                                       align_pow2, 0, kArchRwFlags);
+    REQUIRE_EQ(ZX_OK, status, "mapping object");
+    const vaddr_t base = reinterpret_cast<vaddr_t>(ptr);
+
+    paddr_t pa;
+    uint flags;
+    EXPECT_FALSE(fault_around_mapped(aspace.get(), base, &pa, &flags), "mapped before fault");
+
+    const size_t fault_page = window / 2 + 1;
+    EXPECT_EQ(ZX_OK, fault_around_fault(aspace.get(), base + fault_page * PAGE_SIZE), "page fault");
+
+    for (size_t i = 0; i < 2 * window; i++) {
+        bool mapped = fault_around_mapped(aspace.get(), base + i * PAGE_SIZE, &pa, &flags);
+        if (i >= window) {
+            EXPECT_FALSE(mapped, "mapped outside the fault-around window");
+            continue;
+        }
+        EXPECT_TRUE(mapped, "neighbour not mapped");
+        if (mapped) {
+            EXPECT_EQ(fault_around_vmo_page(vmo.get(), i * PAGE_SIZE), pa, "wrong page");
+            if (i != fault_page) {
+                EXPECT_FALSE(flags & ARCH_MMU_FLAG_PERM_WRITE, "neighbour mapped writable");
+            }
+        }
+    }
+
+    aspace->Destroy();
+    END_TEST;
+}
+
+// Fault-around only maps pages the VMO already has: it never commits pages.
+static bool vmo_fault_around_resident_only_test(void* context) {
+    BEGIN_TEST;
+    auto aspace = VmAspace::Create(0, "test fault-around resident");
+    REQUIRE_NONNULL(aspace, "VmAspace::Create");
+    const size_t window = aspace->fault_around_pages();
+    if (window <= 1) {
+        unittest_printf("fault-around is disabled, skipping\n");
+        aspace->Destroy();
+        END_TEST;
+    }
+
+    const size_t window_size = window * PAGE_SIZE;
+    const uint8_t align_pow2 =
+        static_cast<uint8_t>(log2_uint_floor(static_cast<uint>(window_size)));
+    fbl::RefPtr<VmObject> vmo;
+    zx_status_t status = VmObjectPaged::Create(PMM_ALLOC_FLAG_ANY, window_size, &vmo);
+    REQUIRE_EQ(ZX_OK, status, "vmobject creation");
+    uint64_t committed;
+    for (size_t i = 0; i < window; i += 2) {
+        REQUIRE_EQ(ZX_OK, vmo->CommitRange(i * PAGE_SIZE, PAGE_SIZE, &committed), "commit");
+    }
+
+    void* ptr;
+    status = aspace->MapObjectInternal(vmo, "test", 0, window_size, &ptr,
+                                       align_pow2, 0, kArchRwFlags);
+    REQUIRE_EQ(ZX_OK, status, "mapping object");
+    const vaddr_t base = reinterpret_cast<vaddr_t>(ptr);
+
+    EXPECT_EQ(ZX_OK, fault_around_fault(aspace.get(), base), "page fault");
+    EXPECT_EQ(window / 2, vmo->AllocatedPages(), "fault-around committed pages");
+    for (size_t i = 0; i < window; i++) {
+        paddr_t pa;
+        uint flags;
+        EXPECT_EQ(i % 2 == 0, fault_around_mapped(aspace.get(), base + i * PAGE_SIZE, &pa, &flags),
+                  "only resident pages are mapped");
+    }
+
+    aspace->Destroy();
+    END_TEST;
+}
+
+// Fault-around stays within the faulting mapping, and within the VMO when the
+// mapping extends past its end.
+static bool vmo_fault_around_bounds_test(void* context) {
+    BEGIN_TEST;
+    auto aspace = VmAspace::Create(0, "test fault-around bounds");
+    REQUIRE_NONNULL(aspace, "VmAspace::Create");
+    const size_t window = aspace->fault_around_pages();
+    if (window < 8) {
+        unittest_printf("fault-around window too small, skipping\n");
+        aspace->Destroy();
+        END_TEST;
+    }
+
+    const size_t window_size = window * PAGE_SIZE;
+    const uint8_t align_pow2 =
+        static_cast<uint8_t>(log2_uint_floor(static_cast<uint>(window_size)));
+    fbl::RefPtr<VmObject> vmo;
+    zx_status_t status = VmObjectPaged::Create(PMM_ALLOC_FLAG_ANY, 2 * window_size, &vmo);
+    REQUIRE_EQ(ZX_OK, status, "vmobject creation");
+    uint64_t committed;
+    REQUIRE_EQ(ZX_OK, vmo->CommitRange(0, 2 * window_size, &committed), "commit");
+
+    // A window-aligned vmar holding two mappings of the VMO: pages [2, 5) map
+    // VMO pages [3, 6), and pages [5, 8) map VMO pages [window, window + 3).
+    fbl::RefPtr<VmAddressRegion> vmar;
+    status = aspace->RootVmar()->CreateSubVmar(
+        0, window_size, align_pow2,
+        VMAR_FLAG_CAN_MAP_SPECIFIC | VMAR_FLAG_CAN_MAP_READ | VMAR_FLAG_CAN_MAP_WRITE,
+        "test fault-around vmar", &vmar);
+    REQUIRE_EQ(ZX_OK, status, "vmar creation");
+    fbl::RefPtr<VmMapping> mapping;
+    status = vmar->CreateVmMapping(2 * PAGE_SIZE, 3 * PAGE_SIZE, 0, VMAR_FLAG_SPECIFIC, vmo,
+                                   3 * PAGE_SIZE, kArchRwFlags, "test", &mapping);
+    REQUIRE_EQ(ZX_OK, status, "mapping object");
+    fbl::RefPtr<VmMapping> other;
+    status = vmar->CreateVmMapping(5 * PAGE_SIZE, 3 * PAGE_SIZE, 0, VMAR_FLAG_SPECIFIC, vmo,
+                                   window_size, kArchRwFlags, "test other", &other);
+    REQUIRE_EQ(ZX_OK, status, "mapping object");
+    const vaddr_t base = vmar->base();
+
+    EXPECT_EQ(ZX_OK, fault_around_fault(aspace.get(), base + 3 * PAGE_SIZE), "page fault");
+    for (size_t i = 0; i < window; i++) {
+        paddr_t pa;
+        uint flags;
+        bool mapped = fault_around_mapped(aspace.get(), base + i * PAGE_SIZE, &pa, &flags);
+        if (i < 2 || i >= 5) {
+            EXPECT_FALSE(mapped, "mapped outside the faulting mapping");
+            continue;
+        }
+        EXPECT_TRUE(mapped, "neighbour not mapped");
+        if (mapped) {
+            EXPECT_EQ(fault_around_vmo_page(vmo.get(), (i + 1) * PAGE_SIZE), pa, "wrong page");
+        }
+    }
+
+    // Shrink the VMO under a mapping which covers all of it: pages past the
+    // new end no longer exist and must not be mapped.
+    void* ptr;
+    status = aspace->MapObjectInternal(vmo, "test whole", 0, 2 * window_size, &ptr,
+                                       align_pow2, 0, kArchRwFlags);
+    REQUIRE_EQ(ZX_OK, status, "mapping object");
+    const vaddr_t whole = reinterpret_cast<vaddr_t>(ptr);
+    REQUIRE_EQ(ZX_OK, vmo->Resize(3 * PAGE_SIZE), "resize");
+    EXPECT_EQ(ZX_OK, fault_around_fault(aspace.get(), whole + PAGE_SIZE), "page fault");
+    for (size_t i = 0; i < window; i++) {
+        paddr_t pa;
+        uint flags;
+        EXPECT_EQ(i < 3, fault_around_mapped(aspace.get(), whole + i * PAGE_SIZE, &pa, &flags),
+                  "fault-around past the end of the VMO");
+    }
+
+    aspace->Destroy();
+    END_TEST;
+}
+
 // Creates a vm object, maps it, drops ref before unmapping.
 static bool vmo_dropped_ref_test(void* context) {
     BEGIN_TEST;
@@ -970,6 +1247,7 @@ static bool arch_noncontiguous_map(void* context) {
 UNITTEST_START_TESTCASE(vm_tests)
 VM_UNITTEST(pmm_smoke_test)
 VM_UNITTEST(pmm_large_alloc_test)
+VM_UNITTEST(pmm_single_page_churn_test)
 VM_UNITTEST(pmm_oversized_alloc_test)
 VM_UNITTEST(vmm_alloc_smoke_test)
 VM_UNITTEST(vmm_alloc_contiguous_smoke_test)
@@ -988,6 +1266,10 @@ VM_UNITTEST(vmo_odd_size_commit_test)
 VM_UNITTEST(vmo_contiguous_commit_test)
 VM_UNITTEST(vmo_precommitted_map_test)
 VM_UNITTEST(vmo_demand_paged_map_test)
+VM_UNITTEST(vmo_large_page_map_test)
+VM_UNITTEST(vmo_fault_around_test)
+VM_UNITTEST(vmo_fault_around_resident_only_test)
+VM_UNITTEST(vmo_fault_around_bounds_test)
 VM_UNITTEST(vmo_dropped_ref_test)
 VM_UNITTEST(vmo_remap_test)
 VM_UNITTEST(vmo_double_remap_test)
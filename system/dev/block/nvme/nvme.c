@@ -4,6 +4,7 @@
 
 #include <assert.h>
 #include <limits.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -53,8 +54,6 @@ typedef struct {
     uint32_t reserved1;
 } nvme_utxn_t;
 
-#define UTXN_COUNT 63
-
 // There's no system constant for this.  Ensure it matches reality.
 #define PAGE_SHIFT 12
 static_assert(PAGE_SIZE == (1 << PAGE_SHIFT), "");
@@ -66,36 +65,61 @@ static_assert(PAGE_SIZE == (1 << PAGE_SHIFT), "");
 #define MAX_XFER (1024*1024)
 
 // Maximum submission and completion queue item counts, for
-// queues that are a single page in size.
+// queues that are a single page in size (the admin queues).
 #define SQMAX (PAGE_SIZE / sizeof(nvme_cmd_t))
 #define CQMAX (PAGE_SIZE / sizeof(nvme_cpl_t))
 
-// global driver state bits
+// Maximum number of io queue pairs.  We create one per cpu, limited
+// by this, the number of irq vectors, and what the controller allows.
+#define IOQ_MAX 16
+
+// Maximum entries in an io submission or completion queue.  The
+// actual depth is also limited by the controller (CAP.MQES) and is
+// always a power of two.
+#define IOQ_DEPTH_MAX 128
+
+// A full submission queue holds one less than its depth in commands,
+// which bounds the number of utxns each io queue needs.
+#define UTXN_MAX (IOQ_DEPTH_MAX - 1)
+#define UTXN_WORDS ((UTXN_MAX + 63) / 64)
+
+// driver and io queue state bits
 #define FLAG_IRQ_THREAD_STARTED  0x0001
 #define FLAG_IO_THREAD_STARTED   0x0002
 #define FLAG_SHUTDOWN            0x0004
 
 #define FLAG_HAS_VWC             0x0100
 
+typedef struct nvme_device nvme_device_t;
+
+// An io submission queue, the completion queue it is paired with,
+// and everything needed to drive them.  Each io queue has its own
+// irq vector (when MSI-X allows) and its own irq and io threads.
 typedef struct {
-    void* io;
-    zx_handle_t irqh;
+    nvme_device_t* nvme;
+    uint16_t id;            // queue id (1..n), the irq vector is id - 1
+    uint16_t depth;         // entries in the sq and in the cq
     uint32_t flags;
+    zx_handle_t irqh;
     mtx_t lock;
 
-    // io queue doorbell registers
-    void* io_sq_tail_db;
-    void* io_cq_head_db;
+    // doorbell registers
+    void* sq_tail_db;
+    void* cq_head_db;
 
-    nvme_cpl_t* io_cq;
-    nvme_cmd_t* io_sq;
-    uint32_t io_nsid;
-    uint16_t io_cq_head;
-    uint16_t io_cq_toggle;
-    uint16_t io_sq_tail;
-    uint16_t io_sq_head;
+    nvme_cpl_t* cq;
+    nvme_cmd_t* sq;
+    uint16_t cq_head;
+    uint16_t cq_toggle;
+    uint16_t sq_tail;
+    uint16_t sq_head;
 
-    uint64_t utxn_avail;   // bitmask of available utxns
+    uint16_t utxn_count;
+    uint64_t utxn_avail[UTXN_WORDS];   // bitmask of available utxns
+
+    // txns queued to this queue and not yet completed, used to
+    // steer new txns to the least busy queue
+    atomic_uint txn_count;
 
     // The pending list is txns that have been received
     // via nvme_queue() and are waiting for io to start.
@@ -113,6 +137,33 @@ typedef struct {
     // it has work to do.
     completion_t io_signal;
 
+    // physically contiguous sq and cq, and one scatter
+    // list page per utxn
+    io_buffer_t qbuf;
+    io_buffer_t prpbuf;
+
+    thrd_t irqthread;
+    thrd_t iothread;
+
+#if WITH_STATS
+    size_t stat_concur;
+    size_t stat_pending;
+    size_t stat_max_concur;
+    size_t stat_max_pending;
+    size_t stat_total_ops;
+    size_t stat_total_blocks;
+#endif
+
+    // pool of utxns
+    nvme_utxn_t utxn[UTXN_MAX];
+} nvme_ioq_t;
+
+struct nvme_device {
+    void* io;
+    uint32_t flags;
+
+    uint32_t io_nsid;
+
     uint32_t max_xfer;
     block_info_t info;
 
@@ -140,33 +191,25 @@ typedef struct {
     size_t iosz;
     zx_handle_t ioh;
 
-    // source of physical pages for queues and admin commands
+    // source of physical pages for admin queues and commands
     io_buffer_t iob;
 
-    thrd_t irqthread;
-    thrd_t iothread;
-
-#if WITH_STATS
-    size_t stat_concur;
-    size_t stat_pending;
-    size_t stat_max_concur;
-    size_t stat_max_pending;
-    size_t stat_total_ops;
-    size_t stat_total_blocks;
-#endif
-
-    // pool of utxns
-    nvme_utxn_t utxn[UTXN_COUNT];
-} nvme_device_t;
+    // irq vectors mapped (one per io queue we may create) and
+    // io queues actually created.  The admin queue shares the
+    // first vector with the first io queue.
+    uint32_t irq_count;
+    uint32_t ioq_count;
+    nvme_ioq_t ioq[IOQ_MAX];
+};
 
 #if WITH_STATS
-#define STAT_INC(name) do { nvme->stat_##name++; } while (0)
-#define STAT_DEC(name) do { nvme->stat_##name--; } while (0)
-#define STAT_DEC_IF(name, c) do { if (c) nvme->stat_##name--; } while (0)
-#define STAT_ADD(name, num) do { nvme->stat_##name += num; } while (0)
+#define STAT_INC(name) do { q->stat_##name++; } while (0)
+#define STAT_DEC(name) do { q->stat_##name--; } while (0)
+#define STAT_DEC_IF(name, c) do { if (c) q->stat_##name--; } while (0)
+#define STAT_ADD(name, num) do { q->stat_##name += num; } while (0)
 #define STAT_INC_MAX(name) do { \
-    if (++nvme->stat_##name > nvme->stat_max_##name) { \
-        nvme->stat_max_##name = nvme->stat_##name; \
+    if (++q->stat_##name > q->stat_max_##name) { \
+        q->stat_max_##name = q->stat_##name; \
     }} while (0)
 #else
 #define STAT_INC(name) do { } while (0)
@@ -181,30 +224,34 @@ typedef struct {
 // based on the transfer limits of the controller, etc.  Each utxn has an
 // id associated with it, which is used as the command id for the command
 // queued to the NVME device.  This id is the same as its index into the
-// pool of utxns and the bitmask of free txns, to simplify management.
+// io queue's pool of utxns and the bitmask of free txns, to simplify
+// management.
 //
-// We maintain a pool of 63 of these, which is the number of commands
-// that can be submitted to NVME via a single page submit queue.
+// Each io queue has a pool of depth - 1 of these, which is the number of
+// commands that can be outstanding on its submit queue.
 //
 // The utxns are not protected by locks.  Instead, after initialization,
-// they may only be touched by the io thread, which is responsible for
-// queueing commands and dequeuing completion messages.
-
-static nvme_utxn_t* utxn_get(nvme_device_t* nvme) {
-    uint64_t n = __builtin_ffsll(nvme->utxn_avail);
-    if (n == 0) {
-        return NULL;
-    }
-    n--;
-    nvme->utxn_avail &= ~(1ULL << n);
-    STAT_INC_MAX(concur);
-    return nvme->utxn + n;
+// they may only be touched by the io queue's io thread, which is responsible
+// for queueing commands and dequeuing completion messages.
+
+static nvme_utxn_t* utxn_get(nvme_ioq_t* q) {
+    for (unsigned w = 0; w < UTXN_WORDS; w++) {
+        uint64_t n = __builtin_ffsll(q->utxn_avail[w]);
+        if (n == 0) {
+            continue;
+        }
+        n--;
+        q->utxn_avail[w] &= ~(1ULL << n);
+        STAT_INC_MAX(concur);
+        return q->utxn + w * 64 + n;
+    }
+    return NULL;
 }
 
-static void utxn_put(nvme_device_t* nvme, nvme_utxn_t* utxn) {
+static void utxn_put(nvme_ioq_t* q, nvme_utxn_t* utxn) {
     uint64_t n = utxn->id;
     STAT_DEC(concur);
-    nvme->utxn_avail |= (1ULL << n);
+    q->utxn_avail[n / 64] |= (1ULL << (n % 64));
 }
 
 static zx_status_t nvme_admin_cq_get(nvme_device_t* nvme, nvme_cpl_t* cpl) {
@@ -243,61 +290,65 @@ static zx_status_t nvme_admin_sq_put(nvme_device_t* nvme, nvme_cmd_t* cmd) {
     return ZX_OK;
 }
 
-static zx_status_t nvme_io_cq_get(nvme_device_t* nvme, nvme_cpl_t* cpl) {
-    if ((readw(&nvme->io_cq[nvme->io_cq_head].status) & 1) != nvme->io_cq_toggle) {
+static zx_status_t nvme_io_cq_get(nvme_ioq_t* q, nvme_cpl_t* cpl) {
+    if ((readw(&q->cq[q->cq_head].status) & 1) != q->cq_toggle) {
         return ZX_ERR_SHOULD_WAIT;
     }
-    *cpl = nvme->io_cq[nvme->io_cq_head];
+    *cpl = q->cq[q->cq_head];
 
     // advance the head pointer, wrapping and inverting toggle at max
-    uint16_t next = (nvme->io_cq_head + 1) & (CQMAX - 1);
-    if ((nvme->io_cq_head = next) == 0) {
-        nvme->io_cq_toggle ^= 1;
+    uint16_t next = (q->cq_head + 1) & (q->depth - 1);
+    if ((q->cq_head = next) == 0) {
+        q->cq_toggle ^= 1;
     }
 
     // note the new sq head reported by hw
-    nvme->io_sq_head = cpl->sq_head;
+    q->sq_head = cpl->sq_head;
     return ZX_OK;
 }
 
-static void nvme_io_cq_ack(nvme_device_t* nvme) {
+static void nvme_io_cq_ack(nvme_ioq_t* q) {
     // ring the doorbell
-    writel(nvme->io_cq_head, nvme->io_cq_head_db);
+    writel(q->cq_head, q->cq_head_db);
 }
 
-static zx_status_t nvme_io_sq_put(nvme_device_t* nvme, nvme_cmd_t* cmd) {
-    uint16_t next = (nvme->io_sq_tail + 1) & (SQMAX - 1);
+static zx_status_t nvme_io_sq_put(nvme_ioq_t* q, nvme_cmd_t* cmd) {
+    uint16_t next = (q->sq_tail + 1) & (q->depth - 1);
 
     // if head+1 == tail: queue is full
-    if (next == nvme->io_sq_head) {
+    if (next == q->sq_head) {
         return ZX_ERR_SHOULD_WAIT;
     }
 
-    nvme->io_sq[nvme->io_sq_tail] = *cmd;
-    nvme->io_sq_tail = next;
+    q->sq[q->sq_tail] = *cmd;
+    q->sq_tail = next;
 
     // ring the doorbell
-    writel(next, nvme->io_sq_tail_db);
+    writel(next, q->sq_tail_db);
     return ZX_OK;
 }
 
 static int irq_thread(void* arg) {
-    nvme_device_t* nvme = arg;
+    nvme_ioq_t* q = arg;
+    nvme_device_t* nvme = q->nvme;
     for (;;) {
         zx_status_t r;
         uint64_t slots;
-        if ((r = zx_interrupt_wait(nvme->irqh, &slots)) != ZX_OK) {
+        if ((r = zx_interrupt_wait(q->irqh, &slots)) != ZX_OK) {
             zxlogf(ERROR, "nvme: irq wait failed: %d\n", r);
             break;
         }
 
-        nvme_cpl_t cpl;
-        if (nvme_admin_cq_get(nvme, &cpl) == ZX_OK) {
-            nvme->admin_result = cpl;
-            completion_signal(&nvme->admin_signal);
+        // the admin completion queue always uses the first vector
+        if (q == nvme->ioq) {
+            nvme_cpl_t cpl;
+            if (nvme_admin_cq_get(nvme, &cpl) == ZX_OK) {
+                nvme->admin_result = cpl;
+                completion_signal(&nvme->admin_signal);
+            }
         }
 
-        completion_signal(&nvme->io_signal);
+        completion_signal(&q->io_signal);
     }
     return 0;
 }
@@ -331,10 +382,17 @@ static inline void txn_complete(nvme_txn_t* txn, zx_status_t status) {
     txn->op.completion_cb(&txn->op, status);
 }
 
+// Complete a txn that was queued to io queue q
+static inline void ioq_txn_complete(nvme_ioq_t* q, nvme_txn_t* txn, zx_status_t status) {
+    atomic_fetch_sub(&q->txn_count, 1);
+    txn_complete(txn, status);
+}
+
 // Attempt to generate utxns and queue nvme commands for a txn
 // Returns true if this could not be completed due to temporary
 // lack of resources or false if either it succeeded or errored out.
-static bool io_process_txn(nvme_device_t* nvme, nvme_txn_t* txn) {
+static bool io_process_txn(nvme_ioq_t* q, nvme_txn_t* txn) {
+    nvme_device_t* nvme = q->nvme;
     zx_handle_t vmo = txn->op.rw.vmo;
     nvme_utxn_t* utxn;
     zx_status_t r;
@@ -342,7 +400,7 @@ static bool io_process_txn(nvme_device_t* nvme, nvme_txn_t* txn) {
     for (;;) {
         // If there are no available utxns, we can't proceed
         // and we tell the caller to retain the txn (true)
-        if ((utxn = utxn_get(nvme)) == NULL) {
+        if ((utxn = utxn_get(q)) == NULL) {
             return true;
         }
 
@@ -387,13 +445,13 @@ static bool io_process_txn(nvme_device_t* nvme, nvme_txn_t* txn) {
             cmd.dptr.prp[1] = utxn->phys + sizeof(uint64_t);
         }
 
-        zxlogf(TRACE, "nvme: txn=%p utxn id=%u pages=%zu op=%s\n", txn, utxn->id, pagecount,
-               txn->opcode == NVME_OP_WRITE ? "WR" : "RD");
+        zxlogf(TRACE, "nvme: txn=%p ioq=%u utxn id=%u pages=%zu op=%s\n", txn, q->id, utxn->id,
+               pagecount, txn->opcode == NVME_OP_WRITE ? "WR" : "RD");
         zxlogf(SPEW, "nvme: prp[0]=%016zx prp[1]=%016zx\n", cmd.dptr.prp[0], cmd.dptr.prp[1]);
         zxlogf(SPEW, "nvme: pages[] = { %016zx, %016zx, %016zx, %016zx, ... }\n",
                pages[0], pages[1], pages[2], pages[3]);
 
-        if ((r = nvme_io_sq_put(nvme, &cmd)) != ZX_OK) {
+        if ((r = nvme_io_sq_put(q, &cmd)) != ZX_OK) {
             zxlogf(ERROR, "nvme: could not submit cmd (txn=%p id=%u)\n", txn, utxn->id);
             break;
         }
@@ -410,70 +468,70 @@ static bool io_process_txn(nvme_device_t* nvme, nvme_txn_t* txn) {
         // move this txn to the active list and tell the
         // caller not to retain the txn (false)
         if (txn->op.rw.length == 0) {
-            mtx_lock(&nvme->lock);
-            list_add_tail(&nvme->active_txns, &txn->node);
-            mtx_unlock(&nvme->lock);
+            mtx_lock(&q->lock);
+            list_add_tail(&q->active_txns, &txn->node);
+            mtx_unlock(&q->lock);
             return false;
         }
     }
 
     // failure
-    utxn_put(nvme, utxn);
+    utxn_put(q, utxn);
 
-    mtx_lock(&nvme->lock);
+    mtx_lock(&q->lock);
     txn->flags |= TXN_FLAG_FAILED;
     if (txn->pending_utxns) {
         // if there are earlier uncompleted IOs we become active now
         // and will finish erroring out when they complete
-        list_add_tail(&nvme->active_txns, &txn->node);
+        list_add_tail(&q->active_txns, &txn->node);
         txn = NULL;
     }
-    mtx_unlock(&nvme->lock);
+    mtx_unlock(&q->lock);
 
     if (txn != NULL) {
-        txn_complete(txn, ZX_ERR_INTERNAL);
+        ioq_txn_complete(q, txn, ZX_ERR_INTERNAL);
     }
 
     // Either way we tell the caller not to retain the txn (false)
     return false;
 }
 
-static void io_process_txns(nvme_device_t* nvme) {
+static void io_process_txns(nvme_ioq_t* q) {
     nvme_txn_t* txn;
 
     for (;;) {
-        mtx_lock(&nvme->lock);
-        txn = list_remove_head_type(&nvme->pending_txns, nvme_txn_t, node);
+        mtx_lock(&q->lock);
+        txn = list_remove_head_type(&q->pending_txns, nvme_txn_t, node);
         STAT_DEC_IF(pending, txn != NULL);
-        mtx_unlock(&nvme->lock);
+        mtx_unlock(&q->lock);
 
         if (txn == NULL) {
             return;
         }
 
-        if (io_process_txn(nvme, txn)) {
+        if (io_process_txn(q, txn)) {
             // put txn back at front of queue for further processing later
-            mtx_lock(&nvme->lock);
-            list_add_head(&nvme->pending_txns, &txn->node);
+            mtx_lock(&q->lock);
+            list_add_head(&q->pending_txns, &txn->node);
             STAT_INC_MAX(pending);
-            mtx_unlock(&nvme->lock);
+            mtx_unlock(&q->lock);
             return;
         }
     }
 }
 
-static void io_process_cpls(nvme_device_t* nvme) {
+static void io_process_cpls(nvme_ioq_t* q) {
     bool ring_doorbell = false;
     nvme_cpl_t cpl;
 
-    while (nvme_io_cq_get(nvme, &cpl) == ZX_OK) {
+    while (nvme_io_cq_get(q, &cpl) == ZX_OK) {
         ring_doorbell = true;
 
-        if (cpl.cmd_id >= UTXN_COUNT) {
+        if (cpl.cmd_id >= q->utxn_count) {
             zxlogf(ERROR, "nvme: unexpected cmd id %u\n", cpl.cmd_id);
             continue;
         }
-        nvme_utxn_t* utxn = nvme->utxn + cpl.cmd_id;
+        nvme_utxn_t* utxn = q->utxn + cpl.cmd_id;
         nvme_txn_t* txn = utxn->txn;
 
         if (txn == NULL) {
@@ -495,48 +553,76 @@ static void io_process_cpls(nvme_device_t* nvme) {
 
         // release the microtransaction
         utxn->txn = NULL;
-        utxn_put(nvme, utxn);
+        utxn_put(q, utxn);
 
         txn->pending_utxns--;
         if ((txn->pending_utxns == 0) && (txn->op.rw.length == 0)) {
             // remove from either pending or active list
-            mtx_lock(&nvme->lock);
+            mtx_lock(&q->lock);
             list_delete(&txn->node);
-            mtx_unlock(&nvme->lock);
+            mtx_unlock(&q->lock);
             zxlogf(TRACE, "nvme: txn %p %s\n", txn, txn->flags & TXN_FLAG_FAILED ? "error" : "okay");
-            txn_complete(txn, txn->flags & TXN_FLAG_FAILED ? ZX_ERR_IO : ZX_OK);
+            ioq_txn_complete(q, txn, txn->flags & TXN_FLAG_FAILED ? ZX_ERR_IO : ZX_OK);
         }
     }
 
     if (ring_doorbell) {
-        nvme_io_cq_ack(nvme);
+        nvme_io_cq_ack(q);
     }
 }
 
 static int io_thread(void* arg) {
-    nvme_device_t* nvme = arg;
+    nvme_ioq_t* q = arg;
     for (;;) {
-        if (completion_wait(&nvme->io_signal, ZX_TIME_INFINITE)) {
+        if (completion_wait(&q->io_signal, ZX_TIME_INFINITE)) {
             break;
         }
-        if (nvme->flags & FLAG_SHUTDOWN) {
+        if (q->nvme->flags & FLAG_SHUTDOWN) {
             //TODO: cancel out pending IO
             zxlogf(INFO, "nvme: io thread exiting\n");
             break;
         }
 
-        completion_reset(&nvme->io_signal);
+        completion_reset(&q->io_signal);
 
         // process completion messages
-        io_process_cpls(nvme);
+        io_process_cpls(q);
 
         // process work queue
-        io_process_txns(nvme);
+        io_process_txns(q);
 
     }
     return 0;
 }
 
+// There is no way to ask which cpu we are running on from userspace, so
+// each submitting thread is given a home queue the first time it queues a
+// txn instead.  Every txn goes to the queue with the fewest txns
+// outstanding, starting the search at the home queue so that it wins
+// ties.  A single submitter (such as the block fifo server) thus spreads
+// its txns over every queue as soon as more than one is in flight, while
+// an idle device keeps each thread on its own queue.
+static atomic_uint next_thread_slot;
+static thread_local unsigned thread_slot = UINT_MAX;
+
+static nvme_ioq_t* nvme_pick_ioq(nvme_device_t* nvme) {
+    if (thread_slot == UINT_MAX) {
+        thread_slot = atomic_fetch_add(&next_thread_slot, 1);
+    }
+    unsigned home = thread_slot % nvme->ioq_count;
+    nvme_ioq_t* q = nvme->ioq + home;
+    unsigned min_count = atomic_load(&q->txn_count);
+    for (unsigned n = 1; (n < nvme->ioq_count) && (min_count > 0); n++) {
+        nvme_ioq_t* next = nvme->ioq + ((home + n) % nvme->ioq_count);
+        unsigned count = atomic_load(&next->txn_count);
+        if (count < min_count) {
+            min_count = count;
+            q = next;
+        }
+    }
+    return q;
+}
+
 static void nvme_queue(void* ctx, block_op_t* op) {
     nvme_device_t* nvme = ctx;
     nvme_txn_t* txn = containerof(op, nvme_txn_t, op);
@@ -574,19 +660,21 @@ static void nvme_queue(void* ctx, block_op_t* op) {
     txn->pending_utxns = 0;
     txn->flags = 0;
 
-    zxlogf(SPEW, "nvme: io: %s: %ublks @ blk#%zu\n",
+    nvme_ioq_t* q = nvme_pick_ioq(nvme);
+    atomic_fetch_add(&q->txn_count, 1);
+
+    zxlogf(SPEW, "nvme: io: %s: %ublks @ blk#%zu ioq=%u\n",
            txn->opcode == NVME_OP_WRITE ? "wr" : "rd",
-           txn->op.rw.length + 1U, txn->op.rw.offset_dev);
+           txn->op.rw.length + 1U, txn->op.rw.offset_dev, q->id);
 
+    mtx_lock(&q->lock);
     STAT_INC(total_ops);
     STAT_ADD(total_blocks, txn->op.rw.length);
-
-    mtx_lock(&nvme->lock);
-    list_add_tail(&nvme->pending_txns, &txn->node);
+    list_add_tail(&q->pending_txns, &txn->node);
     STAT_INC_MAX(pending);
-    mtx_unlock(&nvme->lock);
+    mtx_unlock(&q->lock);
 
-    completion_signal(&nvme->io_signal);
+    completion_signal(&q->io_signal);
 }
 
 static void nvme_query(void* ctx, block_info_t* info_out, size_t* block_op_size_out) {
@@ -594,10 +682,14 @@ static void nvme_query(void* ctx, block_info_t* info_out, size_t* block_op_size_
     *info_out = nvme->info;
     *block_op_size_out = sizeof(nvme_txn_t);
 #if WITH_STATS
-    zxlogf(INFO, "nvme: stats: max concurrent utxns:   %zu\n", nvme->stat_max_concur);
-    zxlogf(INFO, "nvme: stats: max pending txns:       %zu\n", nvme->stat_max_pending);
-    zxlogf(INFO, "nvme: stats: total submitted txns:   %zu\n", nvme->stat_total_ops);
-    zxlogf(INFO, "nvme: stats: total submitted blocks:  %zu\n", nvme->stat_total_blocks);
+    for (unsigned n = 0; n < nvme->ioq_count; n++) {
+        nvme_ioq_t* q = nvme->ioq + n;
+        zxlogf(INFO, "nvme: stats: ioq %u:\n", q->id);
+        zxlogf(INFO, "nvme: stats: max concurrent utxns:   %zu\n", q->stat_max_concur);
+        zxlogf(INFO, "nvme: stats: max pending txns:       %zu\n", q->stat_max_pending);
+        zxlogf(INFO, "nvme: stats: total submitted txns:   %zu\n", q->stat_total_ops);
+        zxlogf(INFO, "nvme: stats: total submitted blocks:  %zu\n", q->stat_total_blocks);
+    }
 #endif
 }
 
@@ -650,26 +742,34 @@ static void nvme_release(void* ctx) {
         zx_handle_close(nvme->ioh);
         // TODO: risks a handle use-after-close, will be resolved by IRQ api
         // changes coming soon
-        zx_handle_close(nvme->irqh);
-    }
-    if (nvme->flags & FLAG_IRQ_THREAD_STARTED) {
-        thrd_join(nvme->irqthread, &r);
-    }
-    if (nvme->flags & FLAG_IO_THREAD_STARTED) {
-        completion_signal(&nvme->io_signal);
-        thrd_join(nvme->iothread, &r);
+        for (unsigned n = 0; n < nvme->irq_count; n++) {
+            zx_handle_close(nvme->ioq[n].irqh);
+        }
     }
+    for (unsigned n = 0; n < IOQ_MAX; n++) {
+        nvme_ioq_t* q = nvme->ioq + n;
+        if (q->flags & FLAG_IRQ_THREAD_STARTED) {
+            thrd_join(q->irqthread, &r);
+        }
+        if (q->flags & FLAG_IO_THREAD_STARTED) {
+            completion_signal(&q->io_signal);
+            thrd_join(q->iothread, &r);
+        }
 
-    // error out any pending txns
-    mtx_lock(&nvme->lock);
-    nvme_txn_t* txn;
-    while ((txn = list_remove_head_type(&nvme->active_txns, nvme_txn_t, node)) != NULL) {
-        txn_complete(txn, ZX_ERR_PEER_CLOSED);
-    }
-    while ((txn = list_remove_head_type(&nvme->pending_txns, nvme_txn_t, node)) != NULL) {
-        txn_complete(txn, ZX_ERR_PEER_CLOSED);
+        // error out any pending txns
+        mtx_lock(&q->lock);
+        nvme_txn_t* txn;
+        while ((txn = list_remove_head_type(&q->active_txns, nvme_txn_t, node)) != NULL) {
+            txn_complete(txn, ZX_ERR_PEER_CLOSED);
+        }
+        while ((txn = list_remove_head_type(&q->pending_txns, nvme_txn_t, node)) != NULL) {
+            txn_complete(txn, ZX_ERR_PEER_CLOSED);
+        }
+        mtx_unlock(&q->lock);
+
+        io_buffer_release(&q->qbuf);
+        io_buffer_release(&q->prpbuf);
     }
-    mtx_unlock(&nvme->lock);
 
     io_buffer_release(&nvme->iob);
     free(nvme);
@@ -720,12 +820,9 @@ static void infostring(const char* prefix, uint8_t* str, size_t len) {
 // dedicated pages from the page pool
 #define IDX_ADMIN_SQ   0
 #define IDX_ADMIN_CQ   1
-#define IDX_IO_SQ      2
-#define IDX_IO_CQ      3
-#define IDX_SCRATCH    4
-#define IDX_UTXN_POOL  5 // this must always be last
+#define IDX_SCRATCH    2
 
-#define IO_PAGE_COUNT  (IDX_UTXN_POOL + UTXN_COUNT)
+#define IO_PAGE_COUNT  3
 
 static inline uint64_t U64(uint8_t* x) {
     return *((uint64_t*) (void*) x);
@@ -739,6 +836,96 @@ static inline uint32_t U16(uint8_t* x) {
 
 #define WAIT_MS 5000
 
+static zx_status_t nvme_ioq_start_irq_thread(nvme_ioq_t* q) {
+    if (q->flags & FLAG_IRQ_THREAD_STARTED) {
+        return ZX_OK;
+    }
+    if (thrd_create_with_name(&q->irqthread, irq_thread, q, "nvme-irq-thread")) {
+        zxlogf(ERROR, "nvme; cannot create irq thread\n");
+        return ZX_ERR_INTERNAL;
+    }
+    q->flags |= FLAG_IRQ_THREAD_STARTED;
+    return ZX_OK;
+}
+
+// Allocate io queue pair |id| with |depth| entries, have the
+// controller create it, and start its threads.
+static zx_status_t nvme_ioq_create(nvme_device_t* nvme, nvme_ioq_t* q, uint16_t id,
+                                   uint16_t depth, uint64_t cap) {
+    size_t sq_bytes = (depth * sizeof(nvme_cmd_t) + PAGE_MASK) & ~PAGE_MASK;
+    size_t cq_bytes = (depth * sizeof(nvme_cpl_t) + PAGE_MASK) & ~PAGE_MASK;
+
+    // the queues are created physically contiguous, the utxn
+    // scatter lists are one page each
+    if (io_buffer_init(&q->qbuf, sq_bytes + cq_bytes, IO_BUFFER_RW | IO_BUFFER_CONTIG) ||
+        io_buffer_physmap(&q->qbuf) ||
+        io_buffer_init(&q->prpbuf, PAGE_SIZE * (depth - 1), IO_BUFFER_RW) ||
+        io_buffer_physmap(&q->prpbuf)) {
+        zxlogf(ERROR, "nvme: could not allocate io queue %u buffers\n", id);
+        return ZX_ERR_NO_MEMORY;
+    }
+
+    q->id = id;
+    q->depth = depth;
+
+    // initialize the microtransaction pool
+    q->utxn_count = depth - 1;
+    for (unsigned n = 0; n < q->utxn_count; n++) {
+        q->utxn[n].id = n;
+        q->utxn[n].phys = q->prpbuf.phys_list[n];
+        q->utxn[n].virt = io_buffer_virt(&q->prpbuf) + n * PAGE_SIZE;
+        q->utxn_avail[n / 64] |= 1ULL << (n % 64);
+    }
+
+    // registers and buffers for the queues
+    q->sq_tail_db = nvme->io + NVME_REG_SQnTDBL(id, cap);
+    q->cq_head_db = nvme->io + NVME_REG_CQnHDBL(id, cap);
+
+    q->sq = io_buffer_virt(&q->qbuf);
+    q->sq_head = 0;
+    q->sq_tail = 0;
+
+    q->cq = io_buffer_virt(&q->qbuf) + sq_bytes;
+    q->cq_head = 0;
+    q->cq_toggle = 1;
+
+    // create the IO completion queue
+    nvme_cmd_t cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.cmd = NVME_CMD_CID(0) | NVME_CMD_PRP | NVME_CMD_NORMAL | NVME_CMD_OPC(NVME_ADMIN_OP_CREATE_IOCQ);
+    cmd.dptr.prp[0] = io_buffer_phys(&q->qbuf) + sq_bytes;
+    cmd.u.raw[0] = ((depth - 1) << 16) | id; // queue size, queue id
+    cmd.u.raw[1] = ((id - 1) << 16) | 2 | 1; // irq vector, irq enable, phys contig
+
+    if (nvme_admin_txn(nvme, &cmd, NULL) != ZX_OK) {
+        zxlogf(ERROR, "nvme: completion queue %u creation op failed\n", id);
+        return ZX_ERR_INTERNAL;
+    }
+
+    // create the IO submit queue
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.cmd = NVME_CMD_CID(0) | NVME_CMD_PRP | NVME_CMD_NORMAL | NVME_CMD_OPC(NVME_ADMIN_OP_CREATE_IOSQ);
+    cmd.dptr.prp[0] = io_buffer_phys(&q->qbuf);
+    cmd.u.raw[0] = ((depth - 1) << 16) | id; // queue size, queue id
+    cmd.u.raw[1] = (id << 16) | 0 | 1; // cqid, qprio, phys contig
+
+    if (nvme_admin_txn(nvme, &cmd, NULL) != ZX_OK) {
+        zxlogf(ERROR, "nvme: submit queue %u creation op failed\n", id);
+        return ZX_ERR_INTERNAL;
+    }
+
+    zx_status_t r;
+    if ((r = nvme_ioq_start_irq_thread(q)) != ZX_OK) {
+        return r;
+    }
+    if (thrd_create_with_name(&q->iothread, io_thread, q, "nvme-io-thread")) {
+        zxlogf(ERROR, "nvme; cannot create io thread\n");
+        return ZX_ERR_INTERNAL;
+    }
+    q->flags |= FLAG_IO_THREAD_STARTED;
+    return ZX_OK;
+}
+
 static zx_status_t nvme_init(nvme_device_t* nvme) {
     uint32_t n = rd32(VS);
     uint64_t cap = rd64(CAP);
@@ -761,21 +948,13 @@ static zx_status_t nvme_init(nvme_device_t* nvme) {
         zxlogf(ERROR, "nvme: minimum page size larger than platform page size\n");
         return ZX_ERR_NOT_SUPPORTED;
     }
-    // allocate pages for various queues and the utxn scatter lists
+    // allocate pages for the admin queues and admin commands
     if (io_buffer_init(&nvme->iob, PAGE_SIZE * IO_PAGE_COUNT, IO_BUFFER_RW) ||
         io_buffer_physmap(&nvme->iob)) {
         zxlogf(ERROR, "nvme: could not allocate io buffers\n");
         return ZX_ERR_NO_MEMORY;
     }
 
-    // initialize the microtransaction pool
-    nvme->utxn_avail = 0x7FFFFFFFFFFFFFFFULL;
-    for (unsigned n = 0; n < UTXN_COUNT; n++) {
-        nvme->utxn[n].id = n;
-        nvme->utxn[n].phys = nvme->iob.phys_list[IDX_UTXN_POOL + n];
-        nvme->utxn[n].virt = nvme->iob.virt + (IDX_UTXN_POOL + n) * PAGE_SIZE;
-    }
-
     if (rd32(CSTS) & NVME_CSTS_RDY) {
         zxlogf(INFO, "nvme: controller is active. resetting...\n");
         wr32(rd32(CC) & ~NVME_CC_EN, CC); // disable
@@ -825,32 +1004,15 @@ static zx_status_t nvme_init(nvme_device_t* nvme) {
     nvme->admin_cq_head = 0;
     nvme->admin_cq_toggle = 1;
 
-    // registers and buffers for IO queues
-    nvme->io_sq_tail_db = nvme->io + NVME_REG_SQnTDBL(1, cap);
-    nvme->io_cq_head_db = nvme->io + NVME_REG_CQnHDBL(1, cap);
-
-    nvme->io_sq = nvme->iob.virt + PAGE_SIZE * IDX_IO_SQ;
-    nvme->io_sq_head = 0;
-    nvme->io_sq_tail = 0;
-
-    nvme->io_cq = nvme->iob.virt + PAGE_SIZE * IDX_IO_CQ;
-    nvme->io_cq_head = 0;
-    nvme->io_cq_toggle = 1;
-
     // scratch page for admin ops
     void* scratch = nvme->iob.virt + PAGE_SIZE * IDX_SCRATCH;
 
-    if (thrd_create_with_name(&nvme->irqthread, irq_thread, nvme, "nvme-irq-thread")) {
-        zxlogf(ERROR, "nvme; cannot create irq thread\n");
-        return ZX_ERR_INTERNAL;
-    }
-    nvme->flags |= FLAG_IRQ_THREAD_STARTED;
-
-    if (thrd_create_with_name(&nvme->iothread, io_thread, nvme, "nvme-io-thread")) {
-        zxlogf(ERROR, "nvme; cannot create io thread\n");
-        return ZX_ERR_INTERNAL;
+    // admin completions arrive on the first vector, which is
+    // later shared with the first io queue
+    zx_status_t r;
+    if ((r = nvme_ioq_start_irq_thread(nvme->ioq)) != ZX_OK) {
+        return r;
     }
-    nvme->flags |= FLAG_IO_THREAD_STARTED;
 
     nvme_cmd_t cmd;
 
@@ -928,41 +1090,47 @@ static zx_status_t nvme_init(nvme_device_t* nvme) {
     FEATURE(ONCS, WRITE_UNCORRECTABLE);
     FEATURE(ONCS, COMPARE);
 
-    // set feature (number of queues) to 1 iosq and 1 iocq
+    // set feature (number of queues), asking for one iosq and iocq
+    // per irq vector we have
     memset(&cmd, 0, sizeof(cmd));
     cmd.cmd = NVME_CMD_CID(0) | NVME_CMD_PRP | NVME_CMD_NORMAL | NVME_CMD_OPC(NVME_ADMIN_OP_SET_FEATURE);
     cmd.u.raw[0] = NVME_FEATURE_NUMBER_OF_QUEUES;
-    cmd.u.raw[1] = 0;
+    cmd.u.raw[1] = ((nvme->irq_count - 1) << 16) | (nvme->irq_count - 1);
 
     nvme_cpl_t cpl;
     if (nvme_admin_txn(nvme, &cmd, &cpl) != ZX_OK) {
         zxlogf(ERROR, "nvme: set feature (number queues) op failed\n");
         return ZX_ERR_INTERNAL;
     }
-    zxlogf(INFO,"cpl.cmd %08x\n", cpl.cmd);
-
-    // create the IO completion queue
-    memset(&cmd, 0, sizeof(cmd));
-    cmd.cmd = NVME_CMD_CID(0) | NVME_CMD_PRP | NVME_CMD_NORMAL | NVME_CMD_OPC(NVME_ADMIN_OP_CREATE_IOCQ);
-    cmd.dptr.prp[0] = nvme->iob.phys_list[IDX_IO_CQ];
-    cmd.u.raw[0] = ((CQMAX - 1) << 16) | 1; // queue size, queue id
-    cmd.u.raw[1] = (0 << 16) | 2 | 1; // irq vector, irq enable, phys contig
 
-    if (nvme_admin_txn(nvme, &cmd, NULL) != ZX_OK) {
-        zxlogf(ERROR, "nvme: completion queue creation op failed\n");
-        return ZX_ERR_INTERNAL;
+    // the controller reports how many queues it allocated,
+    // which may be fewer (or more) than we asked for
+    uint32_t nsqa = (cpl.cmd & 0xFFFF) + 1;
+    uint32_t ncqa = (cpl.cmd >> 16) + 1;
+    nvme->ioq_count = nvme->irq_count;
+    if (nvme->ioq_count > nsqa) {
+        nvme->ioq_count = nsqa;
+    }
+    if (nvme->ioq_count > ncqa) {
+        nvme->ioq_count = ncqa;
     }
 
-    // create the IO submit queue
-    memset(&cmd, 0, sizeof(cmd));
-    cmd.cmd = NVME_CMD_CID(0) | NVME_CMD_PRP | NVME_CMD_NORMAL | NVME_CMD_OPC(NVME_ADMIN_OP_CREATE_IOSQ);
-    cmd.dptr.prp[0] = nvme->iob.phys_list[IDX_IO_SQ];
-    cmd.u.raw[0] = ((SQMAX - 1) << 16) | 1; // queue size, queue id
-    cmd.u.raw[1] = (1 << 16) | 0 | 1; // cqid, qprio, phys contig
+    // queue ring indexes wrap using a mask, so the depth
+    // must be a power of two
+    uint32_t depth = NVME_CAP_MQES(cap) + 1;
+    if (depth > IOQ_DEPTH_MAX) {
+        depth = IOQ_DEPTH_MAX;
+    }
+    while (depth & (depth - 1)) {
+        depth &= depth - 1;
+    }
+    zxlogf(INFO, "nvme: io queues: %u (allocated %u/%u), depth %u\n",
+           nvme->ioq_count, nsqa, ncqa, depth);
 
-    if (nvme_admin_txn(nvme, &cmd, NULL) != ZX_OK) {
-        zxlogf(ERROR, "nvme: submit queue creation op failed\n");
-        return ZX_ERR_INTERNAL;
+    for (unsigned n = 0; n < nvme->ioq_count; n++) {
+        if ((r = nvme_ioq_create(nvme, nvme->ioq + n, n + 1, depth, cap)) != ZX_OK) {
+            return r;
+        }
     }
 
     // identify namespace 1
@@ -1046,9 +1214,13 @@ static zx_status_t nvme_bind(void* ctx, zx_device_t* dev) {
     if ((nvme = calloc(1, sizeof(nvme_device_t))) == NULL) {
         return ZX_ERR_NO_MEMORY;
     }
-    list_initialize(&nvme->pending_txns);
-    list_initialize(&nvme->active_txns);
-    mtx_init(&nvme->lock, mtx_plain);
+    for (unsigned n = 0; n < IOQ_MAX; n++) {
+        nvme_ioq_t* q = nvme->ioq + n;
+        q->nvme = nvme;
+        list_initialize(&q->pending_txns);
+        list_initialize(&q->active_txns);
+        mtx_init(&q->lock, mtx_plain);
+    }
     mtx_init(&nvme->admin_lock, mtx_plain);
 
     if (device_get_protocol(dev, ZX_PROTOCOL_PCI, &nvme->pci)) {
@@ -1064,11 +1236,28 @@ static zx_status_t nvme_bind(void* ctx, zx_device_t* dev) {
     uint32_t modes[3] = {
         ZX_PCIE_IRQ_MODE_MSI_X, ZX_PCIE_IRQ_MODE_MSI, ZX_PCIE_IRQ_MODE_LEGACY,
     };
+    // With MSI-X we ask for a vector per cpu, one for each io queue
+    // we'd like to create.  Otherwise a single vector is shared by
+    // the admin queue and a single io queue.
+    uint32_t want = zx_system_get_num_cpus();
+    if (want > IOQ_MAX) {
+        want = IOQ_MAX;
+    }
     uint32_t nirq = 0;
     for (unsigned n = 0; n < countof(modes); n++) {
-        if ((pci_query_irq_mode(&nvme->pci, modes[n], &nirq) == ZX_OK) &&
-            (pci_set_irq_mode(&nvme->pci, modes[n], 1) == ZX_OK)) {
-            zxlogf(INFO, "nvme: irq mode %u, irq count %u (#%u)\n", modes[n], nirq, n);
+        if (pci_query_irq_mode(&nvme->pci, modes[n], &nirq) != ZX_OK) {
+            continue;
+        }
+        uint32_t count = 1;
+        if ((modes[n] == ZX_PCIE_IRQ_MODE_MSI_X) && (nirq > 1)) {
+            count = (nirq < want) ? nirq : want;
+            if ((count > 1) && (pci_set_irq_mode(&nvme->pci, modes[n], count) != ZX_OK)) {
+                count = 1;
+            }
+        }
+        if ((count > 1) || (pci_set_irq_mode(&nvme->pci, modes[n], 1) == ZX_OK)) {
+            zxlogf(INFO, "nvme: irq mode %u, irq count %u of %u (#%u)\n", modes[n], count, nirq, n);
+            nvme->irq_count = count;
             goto irq_configured;
         }
     }
@@ -1076,9 +1265,11 @@ static zx_status_t nvme_bind(void* ctx, zx_device_t* dev) {
     goto fail;
 
 irq_configured:
-    if (pci_map_interrupt(&nvme->pci, 0, &nvme->irqh) != ZX_OK) {
-        zxlogf(ERROR, "nvme: could not map irq\n");
-        goto fail;
+    for (unsigned n = 0; n < nvme->irq_count; n++) {
+        if (pci_map_interrupt(&nvme->pci, n, &nvme->ioq[n].irqh) != ZX_OK) {
+            zxlogf(ERROR, "nvme: could not map irq %u\n", n);
+            goto fail;
+        }
     }
     if (pci_enable_bus_master(&nvme->pci, true)) {
         zxlogf(ERROR, "nvme: cannot enable bus mastering\n");
@@ -82,6 +82,11 @@ public:
     // I/O callback invoked by the parent device.  Stored in |block->completion_cb| by |BlockQueue|.
     static void BlockComplete(block_op_t* block, zx_status_t rc) __TA_EXCLUDES(mtx_);
 
+    // Called by a worker when it has encrypted or decrypted a piece of |block|, with the result in
+    // |rc|.  Once all pieces are done, the block is sent to the parent device if it is a write, or
+    // completed if it is a read or if any piece failed.
+    void BlockTransformed(block_op_t* block, zx_status_t rc) __TA_EXCLUDES(mtx_);
+
     // Completes a |block| returning from the parent device stored in |txn->cookie| and returns it
     // to the caller of |DdkIotxnQueue|.
     void BlockRelease(block_op_t* block, zx_status_t rc) __TA_EXCLUDES(mtx_);
@@ -93,9 +98,12 @@ public:
 private:
     DISALLOW_COPY_ASSIGN_AND_MOVE(Device);
 
-    // TODO(aarongreen): Investigate performance impact of changing this.
-    // Number of encrypting/decrypting workers
-    static const size_t kNumWorkers = 2;
+    // Maximum number of encrypting/decrypting workers.  One is started per CPU, up to this limit.
+    static const size_t kMaxWorkers = 16;
+
+    // Requests are only split between workers into pieces of at least this many bytes; smaller
+    // pieces cost more in queuing than they gain in parallelism.
+    static const uint32_t kMinPieceLen = 64 * 1024;
 
 #ifdef IOTXN_LEGACY_SUPPORT
     // Indicates the number of "adapter" |iotxn_t|s and |block_op_t|s available in the pools below
@@ -127,6 +135,10 @@ private:
     // and send it to a worker.
     void ProcessBlock(block_op_t* block, uint64_t offset) __TA_EXCLUDES(mtx_);
 
+    // Splits the cryptographic transformation of |block| into pieces and sends them to the
+    // workers.
+    void SendToWorkers(block_op_t* block) __TA_EXCLUDES(mtx_);
+
     // Defer this |block| request until later, due to insufficient memory for cryptographic
     // transformations.
     void EnqueueBlock(block_op_t* block) __TA_EXCLUDES(mtx_);
@@ -198,7 +210,9 @@ private:
     // The |Init| thread, used to configure and add the device.
     thrd_t init_;
     // Threads that performs encryption/decryption.
-    Worker workers_[kNumWorkers];
+    Worker workers_[kMaxWorkers];
+    // Number of workers started by |Init|.
+    size_t num_workers_;
     // Port used to send write/read operations to be encrypted/decrypted.
     zx::port port_;
     // Primary lock for accessing the fields below
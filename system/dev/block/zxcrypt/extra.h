@@ -5,6 +5,7 @@
 #pragma once
 
 #include <ddk/protocol/block.h>
+#include <fbl/atomic.h>
 #include <zircon/listnode.h>
 #include <zircon/syscalls/port.h>
 #include <zircon/types.h>
@@ -25,6 +26,10 @@ struct extra_op_t {
     uint64_t off;    // VMO offset in BYTES
     zx_handle_t vmo; // VMO of the requester
 
+    // The cryptographic transformation may be split into pieces done by different workers.
+    fbl::atomic<uint32_t> pending; // Pieces not yet transformed
+    fbl::atomic<zx_status_t> rc;   // First error reported for any piece
+
     void (*completion_cb)(block_op_t* block, zx_status_t status);
     void* cookie;
 };
@@ -12,6 +12,7 @@
 #include <zircon/listnode.h>
 #include <zircon/status.h>
 #include <zircon/types.h>
+#include <zx/time.h>
 #include <zxcrypt/volume.h>
 
 #include "device.h"
@@ -61,39 +62,44 @@ zx_status_t Worker::Start(Device* device, const Volume& volume, const zx::port&
 }
 
 zx_status_t Worker::Loop() {
-    zx_status_t rc;
     ZX_DEBUG_ASSERT(device_);
     zx_port_packet_t packet;
+    // Take one piece at a time so that the pieces of a split request are spread across workers.
     while (port_.wait(zx::time::infinite(), &packet, 1) == ZX_OK && packet.status == ZX_ERR_NEXT) {
         block_op_t* block = reinterpret_cast<block_op_t*>(packet.user.u64[0]);
-        extra_op_t* ex = device_->BlockToExtra(block);
-        size_t actual;
-        switch (block->command) {
-        case BLOCK_OP_WRITE:
-            if ((rc = zx_vmo_read(ex->vmo, ex->buf, ex->off, ex->len, &actual)) != ZX_OK ||
-                (rc = encrypt_.Encrypt(ex->buf, ex->num, ex->len, ex->buf) != ZX_OK)) {
-                device_->BlockRelease(block, rc);
-                break;
-            }
-            device_->BlockForward(block);
-            break;
-
-        case BLOCK_OP_READ:
-            if ((rc = decrypt_.Decrypt(ex->buf, ex->num, ex->len, ex->buf)) != ZX_OK ||
-                (rc = zx_vmo_write(ex->vmo, ex->buf, ex->off, ex->len, &actual)) != ZX_OK) {
-                device_->BlockRelease(block, rc);
-                break;
-            }
-            device_->BlockRelease(block, ZX_OK);
-            break;
-
-        default:
-            device_->BlockRelease(block, ZX_ERR_NOT_SUPPORTED);
-        }
+        device_->BlockTransformed(block, Transform(packet));
     }
     return ZX_OK;
 }
 
+zx_status_t Worker::Transform(const zx_port_packet_t& packet) {
+    zx_status_t rc;
+    block_op_t* block = reinterpret_cast<block_op_t*>(packet.user.u64[0]);
+    uint64_t off = packet.user.u64[1];
+    uint64_t len = packet.user.u64[2];
+    extra_op_t* ex = device_->BlockToExtra(block);
+    uint8_t* buf = ex->buf + off;
+    size_t actual;
+    switch (block->command) {
+    case BLOCK_OP_WRITE:
+        if ((rc = zx_vmo_read(ex->vmo, buf, ex->off + off, len, &actual)) != ZX_OK ||
+            (rc = encrypt_.Encrypt(buf, ex->num + off, len, buf)) != ZX_OK) {
+            return rc;
+        }
+        return ZX_OK;
+
+    case BLOCK_OP_READ:
+        if ((rc = decrypt_.Decrypt(buf, ex->num + off, len, buf)) != ZX_OK ||
+            (rc = zx_vmo_write(ex->vmo, buf, ex->off + off, len, &actual)) != ZX_OK) {
+            return rc;
+        }
+        return ZX_OK;
+
+    default:
+        return ZX_ERR_NOT_SUPPORTED;
+    }
+}
+
 zx_status_t Worker::Stop() {
     zx_status_t rc;
 
@@ -34,9 +34,9 @@ public:
     // |volume|.
     zx_status_t Start(Device* device, const Volume& volume, const zx::port& port);
 
-    // Thread body. Encrypts write requests and and forwards them to the parent device using
-    // Device::BlockForward.  Decrypts read responses and completes them back to the requester using
-    // Device::BlockRelease.  This method should not be called directly; use |Start| instead.
+    // Thread body. Encrypts pieces of write requests and decrypts pieces of read responses, and
+    // reports them to the device using |Device::BlockTransformed|.  This method should not be called
+    // directly; use |Start| instead.
     zx_status_t Loop();
 
     // Asks the worker to stop.  This call blocks until the worker has finished processing the
@@ -46,6 +46,9 @@ public:
 private:
     DISALLOW_COPY_ASSIGN_AND_MOVE(Worker);
 
+    // Encrypts or decrypts the piece of a block request described by |packet|.
+    zx_status_t Transform(const zx_port_packet_t& packet);
+
     // The cipher objects used to perform cryptographic.  See notes on "random access" in
     // crypto/cipher.h.
     crypto::Cipher encrypt_;
@@ -12,7 +12,9 @@
 #include <sys/resource.h>
 #include <sys/stat.h>
 #include <unistd.h>
-#include <future>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 #include <blobstore/fsck.h>
@@ -30,20 +32,82 @@ namespace {
 
 #define MIN_ARGS 3
 
+// The number of blobs each thread may hash ahead of the blob being added.
+#define PENDING_BLOBS_PER_JOB 4
+
 typedef struct {
     bool readonly = false;
+    unsigned jobs = 0; // One per CPU
     uint64_t data_blocks = blobstore::kStartBlockMinimum; // Account for reserved blocks
     fbl::Vector<fbl::String> blob_list;
 } blob_options_t;
 
-int do_blobstore_add_blob(blobstore::Blobstore* bs, const char* blob_name) {
+// Blobs are hashed by a pool of threads, but added to the image one at a time
+// in the order they were listed so that the image does not depend on which
+// blob happened to finish hashing first.
+typedef struct {
+    std::mutex lock;
+    std::condition_variable cvar;
+    const blob_options_t* options;
+    std::vector<fbl::unique_ptr<blobstore::BlobInfo>> blobs;
+    std::vector<zx_status_t> status;
+    std::vector<bool> ready;
+    size_t next_prepare = 0;
+    size_t next_add = 0;
+    size_t max_pending = 0;
+    bool stop = false;
+} blob_ingest_t;
+
+zx_status_t do_blobstore_prepare_blob(const char* blob_name,
+                                      fbl::unique_ptr<blobstore::BlobInfo>* out) {
     fbl::unique_fd data_fd(open(blob_name, O_RDONLY, 0644));
     if (!data_fd) {
+        return ZX_ERR_IO;
+    }
+    return blobstore::BlobInfo::Create(data_fd.get(), out);
+}
+
+void do_blobstore_prepare_blobs(blob_ingest_t* ingest) {
+    std::unique_lock<std::mutex> lock(ingest->lock);
+    const size_t count = ingest->options->blob_list.size();
+    for (;;) {
+        ingest->cvar.wait(lock, [ingest, count] {
+            return ingest->stop || ingest->next_prepare >= count ||
+                   ingest->next_prepare < ingest->next_add + ingest->max_pending;
+        });
+        if (ingest->stop || ingest->next_prepare >= count) {
+            return;
+        }
+        size_t i = ingest->next_prepare++;
+        lock.unlock();
+        fbl::unique_ptr<blobstore::BlobInfo> info;
+        zx_status_t status =
+            do_blobstore_prepare_blob(ingest->options->blob_list[i].c_str(), &info);
+        lock.lock();
+        ingest->blobs[i] = fbl::move(info);
+        ingest->status[i] = status;
+        ingest->ready[i] = true;
+        ingest->cvar.notify_all();
+    }
+}
+
+int do_blobstore_add_blob(blobstore::Blobstore* bs, blob_ingest_t* ingest, size_t i) {
+    const char* blob_name = ingest->options->blob_list[i].c_str();
+    fbl::unique_ptr<blobstore::BlobInfo> info;
+    zx_status_t r;
+    {
+        std::unique_lock<std::mutex> lock(ingest->lock);
+        ingest->cvar.wait(lock, [ingest, i] { return ingest->ready[i]; });
+        info = fbl::move(ingest->blobs[i]);
+        r = ingest->status[i];
+        ingest->next_add = i + 1;
+        ingest->cvar.notify_all();
+    }
+    if (r == ZX_ERR_IO) {
         fprintf(stderr, "error: cannot open '%s'\n", blob_name);
         return -1;
     }
-    int r;
-    if ((r = blobstore::blobstore_add_blob(bs, data_fd.get())) != 0) {
+    if (r != ZX_OK || (r = blobstore::blobstore_add_blob_info(bs, *info)) != ZX_OK) {
         if (r != ZX_ERR_ALREADY_EXISTS) {
             fprintf(stderr, "blobstore: Failed to add blob '%s': %d\n", blob_name, r);
             return -1;
@@ -80,22 +144,47 @@ int do_blobstore_add_blobs(fbl::unique_fd fd, const blob_options_t& options) {
         }
     }
 
-    std::vector<std::future<int>> futures;
+    const size_t count = options.blob_list.size();
+    unsigned jobs = options.jobs;
+    if (jobs == 0) {
+        jobs = fbl::max(std::thread::hardware_concurrency(), 1u);
+    }
 
-    for (unsigned i = 0; i < options.blob_list.size(); i++) {
-        const char *filename = options.blob_list[i].c_str();
-        futures.push_back(std::async(std::launch::async, [bs, filename] {
-            return do_blobstore_add_blob(bs.get(), filename);
-        }));
+    blob_ingest_t ingest;
+    ingest.options = &options;
+    ingest.blobs.resize(count);
+    ingest.status.resize(count, ZX_OK);
+    ingest.ready.resize(count, false);
+    ingest.max_pending = jobs * PENDING_BLOBS_PER_JOB;
+
+    // With a single job, each blob is hashed on this thread just before it is
+    // added.
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; jobs > 1 && i < jobs; i++) {
+        threads.push_back(std::thread(do_blobstore_prepare_blobs, &ingest));
     }
 
-    for (unsigned i = 0; i < options.blob_list.size(); i++) {
-        if (futures[i].get() < 0) {
-            return -1;
+    int r = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (threads.empty()) {
+            ingest.status[i] = do_blobstore_prepare_blob(options.blob_list[i].c_str(),
+                                                         &ingest.blobs[i]);
+            ingest.ready[i] = true;
+        }
+        if ((r = do_blobstore_add_blob(bs.get(), &ingest, i)) < 0) {
+            break;
         }
     }
 
-    return 0;
+    {
+        std::lock_guard<std::mutex> lock(ingest.lock);
+        ingest.stop = true;
+        ingest.cvar.notify_all();
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return r;
 }
 
 int do_blobstore_mkfs(fbl::unique_fd fd, const blob_options_t& options) {
@@ -228,7 +317,11 @@ struct {
 
 int usage() {
     fprintf(stderr,
-            "usage: blobstore <file-or-device>[@<size>] <command> [ <arg>* ]\n"
+            "usage: blobstore [ <option>* ] <file-or-device>[@<size>] <command> [ <arg>* ]\n"
+            "\n"
+            "options:  --readonly       Mount filesystem read-only\n"
+            "          --jobs <count>   Number of threads used to hash blobs (default: one\n"
+            "                           per CPU)\n"
             "\n");
     for (unsigned n = 0; n < (sizeof(CMDS) / sizeof(CMDS[0])); n++) {
         fprintf(stderr, "%9s %-10s %s\n", n ? "" : "commands:",
@@ -255,6 +348,15 @@ int process_args(int argc, char** argv, CommandFunction* func, blob_options_t* o
     while (argc > 1) {
         if (!strcmp(argv[0], "--readonly")) {
             options->readonly = true;
+        } else if (!strcmp(argv[0], "--jobs") && argc > 2) {
+            char* end;
+            options->jobs = static_cast<unsigned>(strtoul(argv[1], &end, 10));
+            if (end == argv[1] || end[0]) {
+                fprintf(stderr, "blobstore: bad job count: %s\n", argv[1]);
+                return usage();
+            }
+            argc--;
+            argv++;
         } else {
             break;
         }
@@ -55,7 +55,12 @@ SparseContainer::SparseContainer(const char* path, uint64_t slice_size, compress
             return;
         }
 
-        if (image_.flags & fvm::kSparseFlagLz4) {
+        if (image_.flags & ~fvm::kSparseFlagAllValid) {
+            fprintf(stderr, "SparseContainer: Unknown flags 0x%x\n", image_.flags);
+            return;
+        }
+
+        if (image_.flags & (fvm::kSparseFlagLz4 | fvm::kSparseFlagLz4Chunks)) {
             return;
         }
 
@@ -94,7 +99,17 @@ zx_status_t SparseContainer::Init() {
     image_.slice_size = slice_size_;
     image_.partition_count = 0;
     image_.header_length = sizeof(fvm::sparse_image_t);
-    image_.flags = compress_ == LZ4 ? fvm::kSparseFlagLz4 : 0;
+    switch (compress_) {
+    case LZ4:
+        image_.flags = fvm::kSparseFlagLz4;
+        break;
+    case LZ4_CHUNKED:
+        image_.flags = fvm::kSparseFlagLz4Chunks;
+        break;
+    default:
+        image_.flags = 0;
+        break;
+    }
     partitions_.reset();
     dirty_ = true;
     valid_ = true;
@@ -169,6 +184,15 @@ zx_status_t SparseContainer::Commit() {
         return ZX_ERR_IO;
     }
 
+    // The chunk index of a chunked image is part of the header
+    fvm::sparse_image_t image = image_;
+    uint64_t chunk_count = 0;
+    if (compress_ == LZ4_CHUNKED) {
+        chunk_count = (extent_size_ + fvm::kSparseChunkSize - 1) / fvm::kSparseChunkSize;
+        image.header_length += sizeof(fvm::chunk_index_t) +
+                               chunk_count * sizeof(fvm::chunk_descriptor_t);
+    }
+
     // Recalculate and verify header length
     uint64_t header_length = 0;
 
@@ -178,7 +202,7 @@ zx_status_t SparseContainer::Commit() {
     }
 
     header_length += sizeof(fvm::sparse_image_t);
-    if (write(fd_.get(), &image_, sizeof(fvm::sparse_image_t)) != sizeof(fvm::sparse_image_t)) {
+    if (write(fd_.get(), &image, sizeof(fvm::sparse_image_t)) != sizeof(fvm::sparse_image_t)) {
         fprintf(stderr, "Write sparse image header failed\n");
         return ZX_ERR_IO;
     }
@@ -204,17 +228,21 @@ zx_status_t SparseContainer::Commit() {
         }
     }
 
-    if (header_length != image_.header_length) {
-        fprintf(stderr, "Header length does not match!\n");
-        return ZX_ERR_INTERNAL;
-    }
-
     zx_status_t status;
     compression_t comp;
-    if ((status = SetupCompression(&comp, extent_size_)) != ZX_OK) {
+    if ((status = SetupCompression(&comp, chunk_count)) != ZX_OK) {
         return status;
     }
 
+    if (compress_ == LZ4_CHUNKED) {
+        header_length += sizeof(fvm::chunk_index_t) + chunk_count * sizeof(fvm::chunk_descriptor_t);
+    }
+
+    if (header_length != image.header_length) {
+        fprintf(stderr, "Header length does not match!\n");
+        return ZX_ERR_INTERNAL;
+    }
+
     // Write each partition out to sparse file
     for (unsigned i = 0; i < image_.partition_count; i++) {
         fvm::partition_descriptor_t partition = partitions_[i].descriptor;
@@ -347,69 +375,162 @@ zx_status_t SparseContainer::AllocateExtent(uint32_t part_index, uint64_t slice_
     return ZX_OK;
 }
 
-zx_status_t SparseContainer::SetupCompression(compression_t* comp, size_t max_len) {
-    if (!compress_) {
+zx_status_t SparseContainer::SetupCompression(compression_t* comp, uint64_t chunk_count) {
+    if (compress_ == NONE) {
         return ZX_OK;
     }
 
-    LZ4F_errorCode_t errc = LZ4F_createCompressionContext(&comp->cctx, LZ4F_VERSION);
-    if (LZ4F_isError(errc)) {
-        fprintf(stderr, "Could not create compression context: %s\n", LZ4F_getErrorName(errc));
-        return ZX_ERR_INTERNAL;
+    // Either way data is compressed at most kSparseChunkSize bytes at a time,
+    // so a frame-sized buffer holds any single piece of output.
+    fbl::AllocChecker ac;
+    comp->frame_size = LZ4F_compressFrameBound(fvm::kSparseChunkSize, &lz4_prefs);
+    comp->frame.reset(new (&ac) uint8_t[comp->frame_size]);
+    if (!ac.check()) {
+        return ZX_ERR_NO_MEMORY;
+    }
+
+    if (compress_ == LZ4) {
+        LZ4F_errorCode_t errc = LZ4F_createCompressionContext(&comp->cctx, LZ4F_VERSION);
+        if (LZ4F_isError(errc)) {
+            fprintf(stderr, "Could not create compression context: %s\n",
+                    LZ4F_getErrorName(errc));
+            comp->cctx = nullptr;
+            return ZX_ERR_INTERNAL;
+        }
+
+        size_t r = LZ4F_compressBegin(comp->cctx, comp->frame.get(), comp->frame_size,
+                                      &lz4_prefs);
+        if (LZ4F_isError(r)) {
+            fprintf(stderr, "Could not begin compression: %s\n", LZ4F_getErrorName(r));
+            return ZX_ERR_INTERNAL;
+        }
+
+        if (write(fd_.get(), comp->frame.get(), r) != static_cast<ssize_t>(r)) {
+            return ZX_ERR_IO;
+        }
+        return ZX_OK;
     }
 
-    size_t max = LZ4F_compressBound(max_len, &lz4_prefs);
-    if (!comp->reset(max)) {
+    comp->chunk.reset(new (&ac) uint8_t[fvm::kSparseChunkSize]);
+    if (!ac.check()) {
         return ZX_ERR_NO_MEMORY;
     }
 
-    size_t r = LZ4F_compressBegin(comp->cctx, comp->buf(), comp->size(), &lz4_prefs);
-    if (LZ4F_isError(r)) {
-        fprintf(stderr, "Could not begin compression: %s\n", LZ4F_getErrorName(r));
-        return ZX_ERR_INTERNAL;
+    comp->chunks.reserve(chunk_count, &ac);
+    if (!ac.check()) {
+        return ZX_ERR_NO_MEMORY;
+    }
+
+    // Skip over the chunk index for now, it is filled in by FinishCompression
+    // once the compressed length of every chunk is known.
+    comp->chunk_count = chunk_count;
+    comp->index_offset = lseek(fd_.get(), 0, SEEK_CUR);
+    size_t index_length = sizeof(fvm::chunk_index_t) + chunk_count * sizeof(fvm::chunk_descriptor_t);
+    if (comp->index_offset < 0 || lseek(fd_.get(), index_length, SEEK_CUR) < 0) {
+        fprintf(stderr, "Seek past chunk index failed\n");
+        return ZX_ERR_IO;
     }
 
-    comp->offset += r;
     return ZX_OK;
 }
 
 zx_status_t SparseContainer::WriteData(const void* data, size_t length, compression_t* comp) {
-    if (compress_) {
-        size_t r = LZ4F_compressUpdate(comp->cctx, comp->buf(), comp->size(), data, length, NULL);
-        if (LZ4F_isError(r)) {
-            fprintf(stderr, "Could not compress data: %s\n", LZ4F_getErrorName(r));
-            return ZX_ERR_INTERNAL;
+    const uint8_t* src = static_cast<const uint8_t*>(data);
+    if (compress_ == LZ4) {
+        while (length > 0) {
+            size_t cp = fbl::min(length, fvm::kSparseChunkSize);
+            size_t r = LZ4F_compressUpdate(comp->cctx, comp->frame.get(), comp->frame_size,
+                                           src, cp, NULL);
+            if (LZ4F_isError(r)) {
+                fprintf(stderr, "Could not compress data: %s\n", LZ4F_getErrorName(r));
+                return ZX_ERR_INTERNAL;
+            }
+
+            if (write(fd_.get(), comp->frame.get(), r) != static_cast<ssize_t>(r)) {
+                return ZX_ERR_IO;
+            }
+            src += cp;
+            length -= cp;
         }
+    } else if (compress_ == LZ4_CHUNKED) {
+        while (length > 0) {
+            size_t cp = fbl::min(length, fvm::kSparseChunkSize - comp->chunk_length);
+            memcpy(comp->chunk.get() + comp->chunk_length, src, cp);
+            comp->chunk_length += cp;
+            src += cp;
+            length -= cp;
+
+            zx_status_t status;
+            if (comp->chunk_length == fvm::kSparseChunkSize &&
+                (status = WriteChunk(comp)) != ZX_OK) {
+                return status;
+            }
+        }
+    } else if (write(fd_.get(), data, length) != static_cast<ssize_t>(length)) {
+        return ZX_ERR_IO;
+    }
+
+    return ZX_OK;
+}
+
+zx_status_t SparseContainer::WriteChunk(compression_t* comp) {
+    size_t r = LZ4F_compressFrame(comp->frame.get(), comp->frame_size, comp->chunk.get(),
+                                  comp->chunk_length, &lz4_prefs);
+    if (LZ4F_isError(r)) {
+        fprintf(stderr, "Could not compress data: %s\n", LZ4F_getErrorName(r));
+        return ZX_ERR_INTERNAL;
+    }
 
-        comp->offset += r;
-    } else if (write(fd_.get(), data, length) != length) {
+    if (write(fd_.get(), comp->frame.get(), r) != static_cast<ssize_t>(r)) {
         return ZX_ERR_IO;
     }
 
+    fvm::chunk_descriptor_t chunk;
+    chunk.compressed_length = r;
+    comp->chunks.push_back(chunk);
+    comp->chunk_length = 0;
     return ZX_OK;
 }
 
 zx_status_t SparseContainer::FinishCompression(compression_t* comp) {
-    if (!compress_) {
+    if (compress_ == NONE) {
         return ZX_OK;
     }
 
-    size_t r = LZ4F_compressEnd(comp->cctx, comp->buf(), comp->size(), NULL);
-    if (LZ4F_isError(r)) {
-        fprintf(stderr, "Could not finish compression: %s\n", LZ4F_getErrorName(r));
-        return ZX_ERR_INTERNAL;
+    if (compress_ == LZ4) {
+        size_t r = LZ4F_compressEnd(comp->cctx, comp->frame.get(), comp->frame_size, NULL);
+        if (LZ4F_isError(r)) {
+            fprintf(stderr, "Could not finish compression: %s\n", LZ4F_getErrorName(r));
+            return ZX_ERR_INTERNAL;
+        }
+
+        if (write(fd_.get(), comp->frame.get(), r) != static_cast<ssize_t>(r)) {
+            return ZX_ERR_IO;
+        }
+        return ZX_OK;
     }
 
-    comp->offset += r;
-    if (write(fd_.get(), comp->data.get(), comp->offset) != comp->offset) {
-        return ZX_ERR_IO;
+    zx_status_t status;
+    if (comp->chunk_length > 0 && (status = WriteChunk(comp)) != ZX_OK) {
+        return status;
     }
 
-    LZ4F_errorCode_t errc = LZ4F_freeCompressionContext(comp->cctx);
-    if (LZ4F_isError(errc)) {
-        fprintf(stderr, "Could not free compression context: %s\n", LZ4F_getErrorName(errc));
+    if (comp->chunks.size() != comp->chunk_count) {
+        fprintf(stderr, "Unexpected number of chunks\n");
         return ZX_ERR_INTERNAL;
     }
 
+    fvm::chunk_index_t index;
+    index.magic = fvm::kChunkIndexMagic;
+    index.chunk_size = fvm::kSparseChunkSize;
+    index.chunk_count = comp->chunk_count;
+    size_t chunks_length = comp->chunk_count * sizeof(fvm::chunk_descriptor_t);
+    if (pwrite(fd_.get(), &index, sizeof(index), comp->index_offset) != sizeof(index) ||
+        pwrite(fd_.get(), comp->chunks.get(), chunks_length, comp->index_offset + sizeof(index))
+        != static_cast<ssize_t>(chunks_length)) {
+        fprintf(stderr, "Write chunk index failed\n");
+        return ZX_ERR_IO;
+    }
+
     return ZX_OK;
-}
\ No newline at end of file
+}
@@ -13,7 +13,10 @@
 
 typedef enum {
     NONE,
+    // A single LZ4 frame (kSparseFlagLz4), readable by every paver
     LZ4,
+    // Independently compressed chunks (kSparseFlagLz4Chunks)
+    LZ4_CHUNKED,
 } compress_type_t;
 
 // A Container represents a method of storing multiple file system partitions in an
@@ -143,29 +146,32 @@ private:
     zx_status_t AllocateExtent(uint32_t part_index, uint64_t slice_start, uint64_t slice_count,
                                uint64_t extent_length);
 
-    typedef struct {
-        LZ4F_compressionContext_t cctx;
-        size_t data_size = 0;
-        size_t offset = 0;
-        fbl::unique_ptr<uint8_t[]> data;
-
-        size_t size() {
-            return data_size;
+    // State for writing a compressed data section, either as one LZ4 frame or
+    // as independently compressed chunks.
+    typedef struct compression {
+        ~compression() {
+            if (cctx != nullptr) {
+                LZ4F_freeCompressionContext(cctx);
+            }
         }
 
-        void* buf() {
-            return data.get() + offset;
-        }
-
-        bool reset(size_t size) {
-            data_size = size;
-            fbl::AllocChecker ac;
-            data.reset(new (&ac) uint8_t[size]);
-            return ac.check();
-        }
+        // Context of the single frame (LZ4 only)
+        LZ4F_compressionContext_t cctx = nullptr;
+        // Decompressed data of the chunk being filled (LZ4_CHUNKED only)
+        fbl::unique_ptr<uint8_t[]> chunk;
+        size_t chunk_length = 0;
+        // Buffer the frame or chunk is compressed into
+        fbl::unique_ptr<uint8_t[]> frame;
+        size_t frame_size = 0;
+        // Location of the chunk index within the header, and the descriptors
+        // of the chunks written so far
+        off_t index_offset = 0;
+        uint64_t chunk_count = 0;
+        fbl::Vector<fvm::chunk_descriptor_t> chunks;
     } compression_t;
 
-    zx_status_t SetupCompression(compression_t* comp, size_t max_len);
+    zx_status_t SetupCompression(compression_t* comp, uint64_t chunk_count);
     zx_status_t WriteData(const void* data, size_t length, compression_t* comp);
+    zx_status_t WriteChunk(compression_t* comp);
     zx_status_t FinishCompression(compression_t* comp);
 };
@@ -19,7 +19,9 @@ int usage(void) {
     fprintf(stderr, "Flags (neither or both of offset/length must be specified):\n");
     fprintf(stderr, " --offset [bytes] - offset at which container begins (fvm only)\n");
     fprintf(stderr, " --length [bytes] - length of container within file (fvm only)\n");
-    fprintf(stderr, " --compress - specify that file should be compressed (sparse only)\n");
+    fprintf(stderr, " --compress [type] - specify that file should be compressed (sparse only)\n");
+    fprintf(stderr, "     lz4 - a single LZ4 stream, readable by all pavers\n");
+    fprintf(stderr, "     lz4-chunked - independent LZ4 chunks, decompressed in parallel\n");
     fprintf(stderr, "Input options:\n");
     fprintf(stderr, " --blobstore [path] - Add path as blobstore type (must be blobstore)\n");
     fprintf(stderr, " --data [path] - Add path as data type (must be minfs)\n");
@@ -64,9 +66,11 @@ int main(int argc, char** argv) {
             offset = atoll(argv[++i]);
         } else if (!strcmp(argv[i], "--length") && i + 1 < argc) {
             length = atoll(argv[++i]);
-        } else if (!strcmp(argv[i], "--compress")) {
+        } else if (!strcmp(argv[i], "--compress") && i + 1 < argc) {
             if (!strcmp(argv[++i], "lz4")) {
                 compress = LZ4;
+            } else if (!strcmp(argv[i], "lz4-chunked")) {
+                compress = LZ4_CHUNKED;
             } else {
                 fprintf(stderr, "Invalid compression type\n");
                 return -1;
@@ -69,7 +69,7 @@ int main(int argc, char** argv) {
             return 1;
         }
         zx_status_t rc =
-            MerkleTree::Create(data, info.st_size, tree.get(), len, &digest);
+            MerkleTree::CreateParallel(data, info.st_size, tree.get(), len, &digest);
         if (info.st_size != 0 && munmap(data, info.st_size) != 0) {
             perror("munmap");
             fprintf(stderr, "[-] Failed to munmap '%s.\n", arg);
@@ -15,7 +15,13 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
 
+#include <fbl/alloc_checker.h>
+#include <fbl/string.h>
 #include <fbl/unique_free_ptr.h>
 #include <fbl/unique_ptr.h>
 #include <minfs/fsck.h>
@@ -27,6 +33,20 @@
 
 namespace {
 
+// Size of the writes used to copy a file into the image.
+#define COPY_BUFFER_SIZE (256 * 1024)
+
+// The number of files each thread may read ahead of the file being copied,
+// and the most file data read ahead in total before threads wait for it to
+// be copied.  The file being copied next is always read.  Files larger than
+// COPY_BUFFER_SIZE are never read ahead, but copied with |cp_file|.
+#define PENDING_FILES_PER_JOB 4
+#define MAX_PENDING_BYTES (256 * 1024 * 1024)
+
+// Number of threads used to read files for the manifest command.  0 means
+// one per CPU.
+unsigned jobs = 0;
+
 int do_minfs_check(fbl::unique_ptr<minfs::Bcache> bc, int argc, char** argv) {
     return minfs_check(fbl::move(bc));
 }
@@ -59,7 +79,7 @@ int cp_file(const char* src_path, const char* dst_path) {
         return -1;
     }
 
-    char buffer[256 * 1024];
+    char buffer[COPY_BUFFER_SIZE];
     ssize_t r;
     for (;;) {
         if ((r = src.Read(buffer, sizeof(buffer))) < 0) {
@@ -176,9 +196,177 @@ void get_emu_path(const char* path, char* out) {
     strncat(out, path, remaining);
 }
 
-// Process line in |manifest|, add directories as needed and copy src file to dst
+// A file to copy into the image, read into memory ahead of time so that
+// several source files may be read at once.  If |stream| is set, the file is
+// not read ahead, and is copied straight from |src| instead.
+typedef struct {
+    fbl::String src;
+    fbl::String dst;
+    fbl::unique_ptr<uint8_t[]> data;
+    size_t length = 0;
+    zx_status_t status = ZX_OK;
+    bool stream = false;
+    bool ready = false;
+} manifest_entry_t;
+
+// Files are read by a pool of threads, but copied into the image one at a
+// time in manifest order, so the image is the same as if each file had been
+// copied with |cp_file|.
+typedef struct {
+    std::mutex lock;
+    std::condition_variable cvar;
+    std::vector<manifest_entry_t> entries;
+    size_t next_read = 0;
+    size_t next_copy = 0;
+    size_t max_pending = 0;
+    size_t pending_bytes = 0;
+    bool stop = false;
+} manifest_ingest_t;
+
+// Reads the whole of |entry->src| into |entry->data|, unless it is too large
+// to be read ahead.
+zx_status_t read_manifest_file(manifest_entry_t* entry) {
+    fbl::unique_fd fd(open(entry->src.c_str(), O_RDONLY, 0));
+    struct stat s;
+    if (!fd || fstat(fd.get(), &s) < 0) {
+        return ZX_ERR_NOT_FOUND;
+    }
+    size_t length = s.st_size;
+    if (length > COPY_BUFFER_SIZE) {
+        entry->stream = true;
+        return ZX_OK;
+    }
+    fbl::AllocChecker ac;
+    fbl::unique_ptr<uint8_t[]> data(new (&ac) uint8_t[length]);
+    if (!ac.check()) {
+        return ZX_ERR_NO_MEMORY;
+    }
+    for (size_t off = 0; off < length;) {
+        ssize_t r = read(fd.get(), data.get() + off, length - off);
+        if (r <= 0) {
+            return ZX_ERR_IO;
+        }
+        off += r;
+    }
+    entry->data = fbl::move(data);
+    entry->length = length;
+    return ZX_OK;
+}
+
+void read_manifest_files(manifest_ingest_t* ingest) {
+    std::unique_lock<std::mutex> lock(ingest->lock);
+    const size_t count = ingest->entries.size();
+    for (;;) {
+        ingest->cvar.wait(lock, [ingest, count] {
+            return ingest->stop || ingest->next_read >= count ||
+                   ingest->next_read == ingest->next_copy ||
+                   (ingest->next_read < ingest->next_copy + ingest->max_pending &&
+                    ingest->pending_bytes < MAX_PENDING_BYTES);
+        });
+        if (ingest->stop || ingest->next_read >= count) {
+            return;
+        }
+        manifest_entry_t* entry = &ingest->entries[ingest->next_read++];
+        lock.unlock();
+        zx_status_t status = read_manifest_file(entry);
+        lock.lock();
+        entry->status = status;
+        entry->ready = true;
+        ingest->pending_bytes += entry->length;
+        ingest->cvar.notify_all();
+    }
+}
+
+// Creates each missing parent directory of |dst| in the image.
+zx_status_t make_parent_dirs(const char* dst_path) {
+    char dst[PATH_MAX];
+    strncpy(dst, dst_path, PATH_MAX);
+    dst[PATH_MAX - 1] = '\0';
+    char* sl_ptr = strchr(dst, '/');
+    while (sl_ptr != nullptr) {
+        *sl_ptr = '\0';
+
+        char emu_dir[PATH_MAX];
+        get_emu_path(dst, emu_dir);
+
+        DIR* d = emu_opendir(emu_dir);
+
+        if (d) {
+            emu_closedir(d);
+        } else if (emu_mkdir(emu_dir, 0) < 0) {
+            fprintf(stderr, "Failed to create directory %s\n", emu_dir);
+            return ZX_ERR_INTERNAL;
+        }
+
+        *sl_ptr = '/';
+        sl_ptr = strchr(sl_ptr + 1, '/');
+    }
+    return ZX_OK;
+}
+
+// Waits for entry |i| of |ingest| to be read, then copies it into the image.
+// The data is written in the same sized pieces as |cp_file| writes, so that
+// the blocks are allocated identically.
+zx_status_t copy_manifest_file(manifest_ingest_t* ingest, size_t i) {
+    manifest_entry_t* entry = &ingest->entries[i];
+    fbl::unique_ptr<uint8_t[]> data;
+    {
+        std::unique_lock<std::mutex> lock(ingest->lock);
+        ingest->cvar.wait(lock, [entry] { return entry->ready; });
+        data = fbl::move(entry->data);
+        ingest->pending_bytes -= entry->length;
+        ingest->next_copy = i + 1;
+        ingest->cvar.notify_all();
+    }
+
+    zx_status_t status;
+    if ((status = make_parent_dirs(entry->dst.c_str())) != ZX_OK) {
+        return status;
+    }
+
+    char emu_dst[PATH_MAX];
+    get_emu_path(entry->dst.c_str(), emu_dst);
+    if (entry->status != ZX_OK) {
+        fprintf(stderr, "error: cannot read '%s'\n", entry->src.c_str());
+        fprintf(stderr, "Failed to copy %s to %s\n", entry->src.c_str(), emu_dst);
+        return ZX_ERR_IO;
+    }
+
+    if (entry->stream) {
+        if (cp_file(entry->src.c_str(), emu_dst) < 0) {
+            fprintf(stderr, "Failed to copy %s to %s\n", entry->src.c_str(), emu_dst);
+            return ZX_ERR_IO;
+        }
+        return ZX_OK;
+    }
+
+    FileWrapper dst;
+    if (FileWrapper::Open(emu_dst, O_WRONLY | O_CREAT | O_EXCL, 0644, &dst) < 0) {
+        fprintf(stderr, "error: cannot open '%s'\n", emu_dst);
+        fprintf(stderr, "Failed to copy %s to %s\n", entry->src.c_str(), emu_dst);
+        return ZX_ERR_IO;
+    }
+    size_t off = 0;
+    while (off < entry->length) {
+        size_t len = fbl::min(entry->length - off, static_cast<size_t>(COPY_BUFFER_SIZE));
+        while (len > 0) {
+            ssize_t r;
+            if ((r = dst.Write(data.get() + off, len)) < 0) {
+                fprintf(stderr, "error: writing to '%s'\n", emu_dst);
+                fprintf(stderr, "Failed to copy %s to %s\n", entry->src.c_str(), emu_dst);
+                return ZX_ERR_IO;
+            }
+            off += r;
+            len -= r;
+        }
+    }
+    return ZX_OK;
+}
+
+// Parses a line in |manifest| and appends the dst/src pair to |entries|.
 // Returns "ZX_ERR_OUT_OF_RANGE" when manifest has reached EOF.
-zx_status_t process_manifest_line(FILE* manifest, const char* dir_path) {
+zx_status_t process_manifest_line(FILE* manifest, const char* dir_path,
+                                  std::vector<manifest_entry_t>* entries) {
     size_t size = 0;
     char* line = nullptr;
 
@@ -220,35 +408,9 @@ zx_status_t process_manifest_line(FILE* manifest, const char* dir_path) {
     strncat(src, "/", PATH_MAX - strlen(src));
     strncat(src, eq_ptr + 1, PATH_MAX - strlen(src));
 
-    // Create directories if they don't exist
-    char* sl_ptr = strchr(dst, '/');
-    while (sl_ptr != nullptr) {
-        *sl_ptr = '\0';
-
-        char emu_dir[PATH_MAX];
-        get_emu_path(dst, emu_dir);
-
-        DIR* d = emu_opendir(emu_dir);
-
-        if (d) {
-            emu_closedir(d);
-        } else if (emu_mkdir(emu_dir, 0) < 0) {
-            fprintf(stderr, "Failed to create directory %s\n", emu_dir);
-            return ZX_ERR_INTERNAL;
-        }
-
-        *sl_ptr = '/';
-        sl_ptr = strchr(sl_ptr + 1, '/');
-    }
-
-    // Copy src to dst
-    char emu_dst[PATH_MAX];
-    get_emu_path(dst, emu_dst);
-    if (cp_file(src, emu_dst) < 0) {
-        fprintf(stderr, "Failed to copy %s to %s\n", src, emu_dst);
-        return ZX_ERR_IO;
-    }
-
+    entries->emplace_back();
+    entries->back().src = src;
+    entries->back().dst = dst;
     return ZX_OK;
 }
 
@@ -273,16 +435,52 @@ int do_add_manifest(fbl::unique_ptr<minfs::Bcache> bc, int argc, char** argv) {
     strncpy(dir_path, dirname(argv[0]), PATH_MAX);
     FILE* manifest = fdopen(fd.release(), "r");
 
+    manifest_ingest_t ingest;
     while (true) {
-        zx_status_t status = process_manifest_line(manifest, dir_path);
+        zx_status_t status = process_manifest_line(manifest, dir_path, &ingest.entries);
         if (status == ZX_ERR_OUT_OF_RANGE) {
             fclose(manifest);
-            return 0;
+            break;
         } else if (status != ZX_OK) {
             fclose(manifest);
             return -1;
         }
     }
+
+    unsigned num_threads = jobs;
+    if (num_threads == 0) {
+        num_threads = fbl::max(std::thread::hardware_concurrency(), 1u);
+    }
+    ingest.max_pending = num_threads * PENDING_FILES_PER_JOB;
+
+    // With a single job, each file is copied with |cp_file|, as the files of
+    // a directory are.
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; num_threads > 1 && i < num_threads; i++) {
+        threads.push_back(std::thread(read_manifest_files, &ingest));
+    }
+
+    int r = 0;
+    for (size_t i = 0; i < ingest.entries.size(); i++) {
+        if (threads.empty()) {
+            ingest.entries[i].stream = true;
+            ingest.entries[i].ready = true;
+        }
+        if (copy_manifest_file(&ingest, i) != ZX_OK) {
+            r = -1;
+            break;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(ingest.lock);
+        ingest.stop = true;
+        ingest.cvar.notify_all();
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return r;
 }
 
 int do_mkdir(fbl::unique_ptr<minfs::Bcache> bc, int argc, char** argv) {
@@ -386,6 +584,8 @@ int usage() {
             "          --offset [bytes] Byte offset at which minfs partition starts (default 0)\n"
             "          --length [bytes] Length in bytes of minfs partition (default to "
                                         "remaining length)\n"
+            "          --jobs [count]   Number of threads used to read files for the manifest "
+                                        "command (default: one per CPU)\n"
             "\n");
     for (unsigned n = 0; n < fbl::count_of(CMDS); n++) {
         fprintf(stderr, "%9s %-10s %s\n", n ? "" : "commands:",
@@ -430,6 +630,13 @@ int main(int argc, char** argv) {
             length = atoi(argv[2]);
             argc--;
             argv++;
+        } else if (!strcmp(argv[1], "--jobs")) {
+            if (argc < 2) {
+                return usage();
+            }
+            jobs = atoi(argv[2]);
+            argc--;
+            argv++;
         } else {
             break;
         }
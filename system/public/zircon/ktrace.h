@@ -49,6 +49,10 @@ __BEGIN_CDECLS
 
 #define KTRACE_GRP_TO_MASK(grp)   ((grp) << 20)
 
+// Records with no group carry no data and only pad out the trace buffer.
+// Readers skip them using KTRACE_LEN(), like any other unknown record.
+#define KTRACE_TAG_PAD(siz)       KTRACE_TAG(0,0,siz)
+
 typedef struct ktrace_header {
     uint32_t tag;
     uint32_t tid;
@@ -88,5 +92,11 @@ enum {
 #define KTRACE_ACTION_STOP      2 // options ignored
 #define KTRACE_ACTION_REWIND    3 // options ignored
 #define KTRACE_ACTION_NEW_PROBE 4 // options ignored, ptr = name
+#define KTRACE_ACTION_SET_MODE  5 // options = KTRACE_MODE_*, tracing must be stopped
+
+// Buffer modes for KTRACE_ACTION_SET_MODE
+#define KTRACE_MODE_LINEAR      0 // drop new records once a cpu's buffer fills
+#define KTRACE_MODE_CIRCULAR    1 // overwrite the oldest records (flight recorder)
+#define KTRACE_MODE_STREAMING   2 // reads consume records while tracing continues
 
 __END_CDECLS
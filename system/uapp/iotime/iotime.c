@@ -165,17 +165,151 @@ static zx_time_t iotime_fifo(char* dev, int is_read, int fd, size_t total, size_
     return t1 - t0;
 }
 
+// Keeps |depth| requests of |bufsz| bytes in flight at once, each on its own
+// txn, so that devices with several hardware queues can be kept busy from a
+// single thread.  Reports the rate of completed requests as well.
+static zx_time_t iotime_iops(char* dev, int is_read, int fd, size_t total, size_t bufsz,
+                             size_t depth) {
+    if ((depth == 0) || (depth > BLOCK_FIFO_MAX_DEPTH)) {
+        fprintf(stderr, "error: depth must be between 1 and %zu\n", BLOCK_FIFO_MAX_DEPTH);
+        return ZX_TIME_INFINITE;
+    }
+
+    zx_status_t r;
+    zx_handle_t vmo;
+    if ((r = zx_vmo_create(bufsz * depth, 0, &vmo)) != ZX_OK) {
+        fprintf(stderr, "error: out of memory %d\n", r);
+        return ZX_TIME_INFINITE;
+    }
+
+    block_info_t info;
+    if (ioctl_block_get_info(fd, &info) < 0) {
+        fprintf(stderr, "error: cannot get info for '%s'\n", dev);
+        return ZX_TIME_INFINITE;
+    }
+    if ((bufsz % info.block_size) || (total / bufsz == 0)) {
+        fprintf(stderr, "error: bad buffer size for block size %u\n", info.block_size);
+        return ZX_TIME_INFINITE;
+    }
+    size_t span = info.block_count * info.block_size;
+    if (span < bufsz) {
+        fprintf(stderr, "error: device '%s' is too small\n", dev);
+        return ZX_TIME_INFINITE;
+    }
+
+    zx_handle_t fifo;
+    if (ioctl_block_get_fifos(fd, &fifo) != sizeof(fifo)) {
+        fprintf(stderr, "error: cannot get fifo for '%s'\n", dev);
+        return ZX_TIME_INFINITE;
+    }
+
+    zx_handle_t dup;
+    if ((r = zx_handle_duplicate(vmo, ZX_RIGHT_SAME_RIGHTS, &dup)) != ZX_OK) {
+        fprintf(stderr, "error: cannot duplicate handle %d\n", r);
+        return ZX_TIME_INFINITE;
+    }
+
+    vmoid_t vmoid;
+    if (ioctl_block_attach_vmo(fd, &dup, &vmoid) != sizeof(vmoid)) {
+        fprintf(stderr, "error: cannot attach vmo for '%s'\n", dev);
+        return ZX_TIME_INFINITE;
+    }
+
+    // requests are spread over the device (up to |total| bytes of it) in
+    // |bufsz| units, in a scattered order so consecutive requests don't
+    // merge into sequential io
+    size_t slots = ((span < total) ? span : total) / bufsz;
+    size_t count = total / bufsz;
+    size_t issued = 0;
+    size_t done = 0;
+    uint32_t actual;
+
+    // each txn owns one |bufsz| slice of the vmo
+    uint64_t vmo_slice[MAX_TXN_COUNT];
+
+    block_fifo_request_t request;
+    memset(&request, 0, sizeof(request));
+    request.vmoid = vmoid;
+    request.opcode = (is_read ? BLOCKIO_READ : BLOCKIO_WRITE) | BLOCKIO_TXN_END;
+    request.length = bufsz / info.block_size;
+
+    zx_time_t t0 = zx_clock_get(ZX_CLOCK_MONOTONIC);
+    for (size_t n = 0; (n < depth) && (issued < count); n++) {
+        txnid_t txnid;
+        if (ioctl_block_alloc_txn(fd, &txnid) != sizeof(txnid)) {
+            fprintf(stderr, "error: cannot allocate txn for '%s'\n", dev);
+            return ZX_TIME_INFINITE;
+        }
+        vmo_slice[txnid] = n * request.length;
+        request.txnid = txnid;
+        request.vmo_offset = vmo_slice[txnid];
+        request.dev_offset = ((issued * 7919) % slots) * request.length;
+        if ((r = zx_fifo_write(fifo, &request, sizeof(request), &actual)) != ZX_OK) {
+            fprintf(stderr, "error: fifo write error %d\n", r);
+            return ZX_TIME_INFINITE;
+        }
+        issued++;
+    }
+    while (done < count) {
+        block_fifo_response_t response[BLOCK_FIFO_MAX_DEPTH];
+        r = zx_fifo_read(fifo, response, sizeof(response[0]) * depth, &actual);
+        if (r == ZX_ERR_SHOULD_WAIT) {
+            zx_signals_t signals;
+            if ((r = zx_object_wait_one(fifo, ZX_FIFO_READABLE | ZX_FIFO_PEER_CLOSED,
+                                        ZX_TIME_INFINITE, &signals)) != ZX_OK) {
+                fprintf(stderr, "error: fifo wait error %d\n", r);
+                return ZX_TIME_INFINITE;
+            }
+            if (signals & ZX_FIFO_PEER_CLOSED) {
+                fprintf(stderr, "error: fifo closed\n");
+                return ZX_TIME_INFINITE;
+            }
+            continue;
+        } else if (r != ZX_OK) {
+            fprintf(stderr, "error: fifo read error %d\n", r);
+            return ZX_TIME_INFINITE;
+        }
+        uint32_t nresponses = actual;
+        for (uint32_t i = 0; i < nresponses; i++) {
+            if (response[i].status != ZX_OK) {
+                fprintf(stderr, "error: io error %d\n", response[i].status);
+                return ZX_TIME_INFINITE;
+            }
+            done++;
+            if (issued < count) {
+                // reuse the txn (and its slice of the vmo) that just completed
+                request.txnid = response[i].txnid;
+                request.vmo_offset = vmo_slice[response[i].txnid];
+                request.dev_offset = ((issued * 7919) % slots) * request.length;
+                if ((r = zx_fifo_write(fifo, &request, sizeof(request), &actual)) != ZX_OK) {
+                    fprintf(stderr, "error: fifo write error %d\n", r);
+                    return ZX_TIME_INFINITE;
+                }
+                issued++;
+            }
+        }
+    }
+    zx_time_t t1 = zx_clock_get(ZX_CLOCK_MONOTONIC);
+
+    double s = ((double)(t1 - t0)) / ((double)1000000000);
+    fprintf(stderr, "%zu requests of %zu bytes, depth %zu: %g IOPS\n",
+            count, bufsz, depth, ((double)count) / s);
+    return t1 - t0;
+}
+
 static int usage(void) {
     fprintf(stderr,
-            "usage: iotime <read|write> <posix|block|fifo> <device|--ramdisk> <bytes> <bufsize>\n\n"
+            "usage: iotime <read|write> <posix|block|fifo> <device|--ramdisk> <bytes> <bufsize>\n"
+            "       iotime <read|write> iops <device> <bytes> <bufsize> [<depth>]\n\n"
             "        <bytes> and <bufsize> must be a multiple of 4k for block mode\n"
-            "        --ramdisk only supported for block mode\n");
+            "        --ramdisk only supported for block mode\n"
+            "        iops mode keeps <depth> (default 32) requests in flight\n");
     return -1;
 }
 
 
 int main(int argc, char** argv) {
-    if (argc != 6) {
+    if ((argc != 6) && !((argc == 7) && !strcmp(argv[2], "iops"))) {
         return usage();
     }
 
@@ -207,6 +341,9 @@ int main(int argc, char** argv) {
         res = iotime_block(is_read, fd, total, bufsz);
     } else if (!strcmp(argv[2], "fifo")) {
         res = iotime_fifo(argv[3], is_read, fd, total, bufsz);
+    } else if (!strcmp(argv[2], "iops")) {
+        size_t depth = (argc == 7) ? number(argv[6]) : 32;
+        res = iotime_iops(argv[3], is_read, fd, total, bufsz, depth);
     } else {
         fprintf(stderr, "error: unknown mode '%s'\n", argv[2]);
         return -1;
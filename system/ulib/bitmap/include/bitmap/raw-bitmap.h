@@ -14,6 +14,7 @@
 #include <zircon/assert.h>
 #include <zircon/types.h>
 #include <fbl/algorithm.h>
+#include <fbl/array.h>
 #include <fbl/macros.h>
 #include <fbl/type_support.h>
 
@@ -162,4 +163,169 @@ private:
     Storage bits_;
 };
 
+// Per-word summaries of a raw bitmap, kept as two trees of bits: one marks the
+// words with any bit set, the other the words with any bit clear. Each level
+// above the first marks the non-zero words of the level below it, so a scan
+// can step over a long run of full (or empty) words by looking at a handful
+// of summary words instead of every word in between.
+class BitmapSummary {
+public:
+    // Sizes the summary for a bitmap of |words| words. The summary is not
+    // valid until Update has been called over every word.
+    zx_status_t Reset(size_t words);
+
+    // Recomputes the summary of the words [first_idx, last_idx] of |data|.
+    void Update(const size_t* data, size_t first_idx, size_t last_idx);
+
+    // Same as RawBitmapBase::Scan, over a bitmap of at least |bitmax| bits
+    // whose summary is up to date.
+    size_t Scan(const size_t* data, size_t bitoff, size_t bitmax, bool is_set) const;
+
+private:
+    // Returns the first word at or after |idx| marked in the tree |tree|,
+    // or words_ if there is none.
+    size_t NextWord(const size_t* tree, size_t idx) const;
+
+    // Enough levels for 2^48 words when size_t has 64 bits.
+    static constexpr size_t kMaxLevels = 8;
+
+    size_t words_ = 0;
+    size_t levels_ = 0;
+    // The number of words in, and the position in the trees of, each level.
+    size_t count_[kMaxLevels] = {};
+    size_t offset_[kMaxLevels] = {};
+    // Words with at least one bit set.
+    fbl::Array<size_t> any_set_;
+    // Words with at least one bit clear.
+    fbl::Array<size_t> any_clear_;
+};
+
+// A bitmap with the same interface as RawBitmapGeneric which also maintains a
+// BitmapSummary, making Scan and Find proportional to the number of words
+// that differ from what is being skipped rather than to the distance covered.
+// Set and Clear pay for this by updating the summary.
+//
+// Callers which modify the storage directly (through StorageUnsafe) must call
+// UpdateSummary afterwards.
+template <typename Storage>
+class SummaryBitmapGeneric final : public Bitmap {
+public:
+    SummaryBitmapGeneric() = default;
+    virtual ~SummaryBitmapGeneric() = default;
+    SummaryBitmapGeneric(SummaryBitmapGeneric&& rhs) = default;
+    SummaryBitmapGeneric& operator=(SummaryBitmapGeneric&& rhs) = default;
+    DISALLOW_COPY_AND_ASSIGN_ALLOW_MOVE(SummaryBitmapGeneric);
+
+    size_t size() const { return bitmap_.size(); }
+
+    zx_status_t Shrink(size_t size) { return bitmap_.Shrink(size); }
+
+    size_t Scan(size_t bitoff, size_t bitmax, bool is_set) const {
+        bitmax = fbl::min(bitmax, size());
+        if (bitoff >= bitmax) {
+            return bitmax;
+        }
+        return summary_.Scan(data(), bitoff, bitmax, is_set);
+    }
+
+    zx_status_t Find(bool is_set, size_t bitoff, size_t bitmax, size_t run_len,
+                     size_t* out) const {
+        if (!out || bitmax <= bitoff) {
+            return ZX_ERR_INVALID_ARGS;
+        }
+        size_t start = bitoff;
+        while (bitoff - start < run_len && bitoff < bitmax) {
+            start = Scan(bitoff, bitmax, !is_set);
+            if (bitmax - start < run_len) {
+                *out = bitmax;
+                return ZX_ERR_NO_RESOURCES;
+            }
+            bitoff = Scan(start, start + run_len, is_set);
+        }
+        *out = start;
+        return ZX_OK;
+    }
+
+    bool Get(size_t bitoff, size_t bitmax, size_t* first_unset = nullptr) const override {
+        bitmax = fbl::min(bitmax, size());
+        size_t result = Scan(bitoff, bitmax, true);
+        if (first_unset) {
+            *first_unset = result;
+        }
+        return result == bitmax;
+    }
+
+    zx_status_t Set(size_t bitoff, size_t bitmax) override {
+        zx_status_t status = bitmap_.Set(bitoff, bitmax);
+        if (status == ZX_OK && bitoff != bitmax) {
+            summary_.Update(data(), bitoff / kBits, LastIdx(bitmax));
+        }
+        return status;
+    }
+
+    zx_status_t Clear(size_t bitoff, size_t bitmax) override {
+        zx_status_t status = bitmap_.Clear(bitoff, bitmax);
+        if (status == ZX_OK && bitoff != bitmax) {
+            summary_.Update(data(), bitoff / kBits, LastIdx(bitmax));
+        }
+        return status;
+    }
+
+    void ClearAll() override {
+        bitmap_.ClearAll();
+        UpdateSummary();
+    }
+
+    template <typename U = Storage>
+    typename fbl::enable_if<internal::has_grow<U>::value, zx_status_t>::type
+    Grow(size_t size) {
+        zx_status_t status = bitmap_.Grow(size);
+        if (status != ZX_OK) {
+            return status;
+        }
+        return ResetSummary();
+    }
+
+    template <typename U = Storage>
+    typename fbl::enable_if<!internal::has_grow<U>::value, zx_status_t>::type
+    Grow(size_t size) {
+        return ZX_ERR_NO_RESOURCES;
+    }
+
+    zx_status_t Reset(size_t size) {
+        zx_status_t status = bitmap_.Reset(size);
+        if (status != ZX_OK) {
+            return status;
+        }
+        return ResetSummary();
+    }
+
+    // Recomputes the whole summary from the underlying storage.
+    void UpdateSummary() {
+        if (size() != 0) {
+            summary_.Update(data(), 0, LastIdx(size()));
+        }
+    }
+
+    // See RawBitmapGeneric::StorageUnsafe.
+    const Storage* StorageUnsafe() const { return bitmap_.StorageUnsafe(); }
+
+private:
+    const size_t* data() const {
+        return static_cast<const size_t*>(bitmap_.StorageUnsafe()->GetData());
+    }
+
+    zx_status_t ResetSummary() {
+        zx_status_t status = summary_.Reset(size() == 0 ? 0 : LastIdx(size()) + 1);
+        if (status != ZX_OK) {
+            return status;
+        }
+        UpdateSummary();
+        return ZX_OK;
+    }
+
+    RawBitmapGeneric<Storage> bitmap_;
+    BitmapSummary summary_;
+};
+
 } // namespace bitmap
@@ -10,8 +10,18 @@
 
 #include <zircon/types.h>
 #include <fbl/algorithm.h>
+#include <fbl/alloc_checker.h>
 #include <fbl/macros.h>
 
+// The kernel builds this library without vector registers.
+#if !defined(_KERNEL) && defined(__SSE2__)
+#include <emmintrin.h>
+#define BITMAP_SKIP_SSE2 1
+#elif !defined(_KERNEL) && defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define BITMAP_SKIP_NEON 1
+#endif
+
 namespace {
 
 // Translates a bit offset into a starting index in the bitmap array.
@@ -55,8 +65,77 @@ size_t GetMask(bool first, bool last, size_t off, size_t max) {
 size_t CountZeros(size_t idx, size_t value) {
     return idx * bitmap::kBits + CTZ(value);
 }
+
+// Returns the index of the first word in [idx, end) of |data| which is not
+// |skip|, or |end| if they all are. |skip| must be all zeros or all ones, so
+// every byte of it is the same. 32 bytes are compared per iteration, with
+// SSE2 or NEON where available and four words at a time otherwise.
+size_t SkipWords(const size_t* data, size_t idx, size_t end, size_t skip) {
+#if BITMAP_SKIP_SSE2 || BITMAP_SKIP_NEON
+    constexpr size_t kStep = 32 / sizeof(size_t);
+#if BITMAP_SKIP_SSE2
+    const __m128i pattern = _mm_set1_epi8(static_cast<char>(skip));
+    for (; idx + kStep <= end; idx += kStep) {
+        const __m128i* p = reinterpret_cast<const __m128i*>(data + idx);
+        __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(p), pattern),
+                                   _mm_cmpeq_epi8(_mm_loadu_si128(p + 1), pattern));
+        if (_mm_movemask_epi8(eq) != 0xffff) {
+            break;
+        }
+    }
+#else
+    const uint8x16_t pattern = vdupq_n_u8(static_cast<uint8_t>(skip));
+    for (; idx + kStep <= end; idx += kStep) {
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(data + idx);
+        uint8x16_t diff = vorrq_u8(veorq_u8(vld1q_u8(p), pattern),
+                                   veorq_u8(vld1q_u8(p + 16), pattern));
+        if (vmaxvq_u8(diff) != 0) {
+            break;
+        }
+    }
+#endif
+#else
+    for (; idx + 4 <= end; idx += 4) {
+        size_t diff = (data[idx] ^ skip) | (data[idx + 1] ^ skip) |
+                      (data[idx + 2] ^ skip) | (data[idx + 3] ^ skip);
+        if (diff != 0) {
+            break;
+        }
+    }
+#endif
+    while (idx < end && data[idx] == skip) {
+        ++idx;
+    }
+    return idx;
+}
+
+// Returns the first bit at or after |bitoff| in |word| which doesn't match
+// *is_set*, as a bitmap index, or the lesser of bitmax and the end of the word.
+size_t ScanWord(size_t idx, size_t word, bool first, bool last, size_t bitoff,
+                size_t bitmax, bool is_set) {
+    size_t value = GetMask(first, last, bitoff, bitmax);
+    if (is_set) {
+        // If is_set=true, invert the mask, OR it with the value, and invert
+        // it again to hopefully get all zeros.
+        value = ~(~value | word);
+    } else {
+        // If is_set=false, just AND the mask with the value to hopefully
+        // get all zeros.
+        value &= word;
+    }
+    return fbl::min(bitmax, CountZeros(idx, value));
+}
 #undef CTZ
 
+void SetSummaryBit(size_t* level, size_t bit, bool value) {
+    size_t mask = static_cast<size_t>(1) << (bit % bitmap::kBits);
+    if (value) {
+        level[bit / bitmap::kBits] |= mask;
+    } else {
+        level[bit / bitmap::kBits] &= ~mask;
+    }
+}
+
 } // namespace
 
 namespace bitmap {
@@ -76,24 +155,17 @@ size_t RawBitmapBase::Scan(size_t bitoff, size_t bitmax, bool is_set) const {
     }
     size_t first_idx = FirstIdx(bitoff);
     size_t last_idx = LastIdx(bitmax);
+    size_t skip = is_set ? ~static_cast<size_t>(0) : 0;
     size_t i = first_idx;
-    size_t value = 0;
-    for (i = first_idx; i <= last_idx; ++i) {
-        value = GetMask(i == first_idx, i == last_idx, bitoff, bitmax);
-        if (is_set) {
-            // If is_set=true, invert the mask, OR it with the value, and invert
-            // it again to hopefully get all zeros.
-            value = ~(~value | data_[i]);
-        } else {
-            // If is_set=false, just AND the mask with the value to hopefully
-            // get all zeros.
-            value &= data_[i];
-        }
-        if (value != 0) {
-            break;
+    for (;;) {
+        size_t result = ScanWord(i, data_[i], i == first_idx, i == last_idx,
+                                 bitoff, bitmax, is_set);
+        if (result < (i + 1) * kBits || i == last_idx) {
+            return result;
         }
+        // Only the first and last words are partially covered by the range.
+        i = SkipWords(data_, i + 1, last_idx, skip);
     }
-    return fbl::min(bitmax, CountZeros(i, value));
 }
 
 zx_status_t RawBitmapBase::Find(bool is_set, size_t bitoff, size_t bitmax,
@@ -165,4 +237,102 @@ void RawBitmapBase::ClearAll() {
     }
 }
 
+zx_status_t BitmapSummary::Reset(size_t words) {
+    words_ = words;
+    levels_ = 0;
+    any_set_.reset();
+    any_clear_.reset();
+    if (words == 0) {
+        return ZX_OK;
+    }
+    size_t total = 0;
+    size_t count = words;
+    do {
+        ZX_ASSERT(levels_ < kMaxLevels);
+        count = (count + kBits - 1) / kBits;
+        count_[levels_] = count;
+        offset_[levels_] = total;
+        total += count;
+        levels_++;
+    } while (count > 1);
+
+    fbl::AllocChecker ac;
+    any_set_.reset(new (&ac) size_t[total](), total);
+    if (!ac.check()) {
+        return ZX_ERR_NO_MEMORY;
+    }
+    any_clear_.reset(new (&ac) size_t[total](), total);
+    if (!ac.check()) {
+        any_set_.reset();
+        return ZX_ERR_NO_MEMORY;
+    }
+    return ZX_OK;
+}
+
+void BitmapSummary::Update(const size_t* data, size_t first_idx, size_t last_idx) {
+    ZX_DEBUG_ASSERT(first_idx <= last_idx && last_idx < words_);
+    size_t* any_set = any_set_.get();
+    size_t* any_clear = any_clear_.get();
+    for (size_t i = first_idx; i <= last_idx; ++i) {
+        SetSummaryBit(any_set, i, data[i] != 0);
+        SetSummaryBit(any_clear, i, data[i] != ~static_cast<size_t>(0));
+    }
+    for (size_t level = 1; level < levels_; ++level) {
+        first_idx /= kBits;
+        last_idx /= kBits;
+        const size_t* below = &any_set[offset_[level - 1]];
+        const size_t* below_clear = &any_clear[offset_[level - 1]];
+        for (size_t i = first_idx; i <= last_idx; ++i) {
+            SetSummaryBit(&any_set[offset_[level]], i, below[i] != 0);
+            SetSummaryBit(&any_clear[offset_[level]], i, below_clear[i] != 0);
+        }
+    }
+}
+
+size_t BitmapSummary::NextWord(const size_t* tree, size_t idx) const {
+    // Climb until a level has a marked bit at or after the one covering
+    // |idx|, then descend along the lowest marked bits.
+    size_t level = 0;
+    size_t bit = idx;
+    for (;;) {
+        size_t word = bit / kBits;
+        if (level == levels_ || word >= count_[level]) {
+            return words_;
+        }
+        size_t marked = tree[offset_[level] + word] & (~static_cast<size_t>(0) << (bit % kBits));
+        if (marked != 0) {
+            bit = CountZeros(word, marked);
+            while (level > 0) {
+                level--;
+                bit = CountZeros(bit, tree[offset_[level] + bit]);
+            }
+            return bit;
+        }
+        bit = word + 1;
+        level++;
+    }
+}
+
+size_t BitmapSummary::Scan(const size_t* data, size_t bitoff, size_t bitmax,
+                           bool is_set) const {
+    ZX_DEBUG_ASSERT(bitoff < bitmax && LastIdx(bitmax) < words_);
+    size_t first_idx = FirstIdx(bitoff);
+    size_t last_idx = LastIdx(bitmax);
+    // Looking for a clear bit skips full words, and looking for a set bit
+    // skips empty ones.
+    const size_t* tree = is_set ? any_clear_.get() : any_set_.get();
+    size_t i = first_idx;
+    for (;;) {
+        size_t result = ScanWord(i, data[i], i == first_idx, i == last_idx,
+                                 bitoff, bitmax, is_set);
+        if (result < (i + 1) * kBits || i == last_idx) {
+            return result;
+        }
+        i = NextWord(tree, i + 1);
+        if (i > last_idx) {
+            return bitmax;
+        }
+    }
+}
+
 } // namespace bitmap
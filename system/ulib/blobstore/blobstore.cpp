@@ -3,6 +3,7 @@
 // found in the LICENSE file.
 
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -53,6 +54,9 @@ zx_status_t vmo_write_exact(zx_handle_t h, const void* data, uint64_t offset, si
     return ZX_OK;
 }
 
+// Number of data blocks which on-demand verification rounds reads up to.
+constexpr uint64_t kReadAheadBlocks = 16;
+
 zx_status_t CheckFvmConsistency(const blobstore_info_t* info, int block_fd) {
     if ((info->flags & kBlobstoreFlagFVM) == 0) {
         return ZX_OK;
@@ -118,15 +122,71 @@ zx_status_t VnodeBlob::Verify() const {
     ZX_DEBUG_ASSERT(blob_ != nullptr);
 
     const blobstore_inode_t* inode = blobstore_->GetNode(map_index_);
-    // TODO(smklein): We could lazily verify more of the VMO if
-    // we could fault in pages on-demand.
-    //
-    // For now, we aggressively verify the entire VMO up front.
     Digest d;
     d = reinterpret_cast<const uint8_t*>(&digest_[0]);
-    return MerkleTree::Verify(GetData(), inode->blob_size, GetMerkle(),
-                              MerkleTree::GetTreeLength(inode->blob_size), 0,
-                              inode->blob_size, d);
+    return MerkleTree::VerifyParallel(GetData(), inode->blob_size, GetMerkle(),
+                                      MerkleTree::GetTreeLength(inode->blob_size), 0,
+                                      inode->blob_size, d);
+}
+
+zx_status_t VnodeBlob::VerifyRange(uint64_t off, uint64_t len) {
+    TRACE_DURATION("blobstore", "Blobstore::VerifyRange", "off", off, "len", len);
+    ZX_DEBUG_ASSERT(blob_ != nullptr);
+
+    if (len == 0) {
+        return ZX_OK;
+    }
+
+    const blobstore_inode_t* inode = blobstore_->GetNode(map_index_);
+    ZX_DEBUG_ASSERT(off + len <= inode->blob_size);
+    const uint64_t data_blocks = BlobDataBlocks(*inode);
+    uint64_t start = off / kBlobstoreBlockSize;
+    uint64_t end = fbl::round_up(off + len, kBlobstoreBlockSize) / kBlobstoreBlockSize;
+
+    size_t first_unset;
+    if (verified_blocks_.Get(start, end, &first_unset)) {
+        return ZX_OK;
+    }
+
+    // Sequential readers tend to come back for the following blocks, so read
+    // ahead to keep the number of transactions and tree walks down.
+    start = first_unset;
+    end = fbl::min(fbl::round_up(end, kReadAheadBlocks), data_blocks);
+
+    // Read every unverified run of blocks in [start, end) in one transaction.
+    const uint64_t merkle_blocks = MerkleTreeBlocks(*inode);
+    const uint64_t dev_start = inode->start_block + DataStartBlock(blobstore_->info_) +
+                               merkle_blocks;
+    ReadTxn txn(blobstore_.get());
+    for (uint64_t run = verified_blocks_.Scan(start, end, true); run < end;) {
+        uint64_t run_end = verified_blocks_.Scan(run, end, false);
+        txn.Enqueue(vmoid_, merkle_blocks + run, dev_start + run, run_end - run);
+        run = verified_blocks_.Scan(run_end, end, true);
+    }
+    zx_status_t status;
+    if ((status = txn.Flush()) != ZX_OK) {
+        return status;
+    }
+
+    // Only the Merkle subtrees covering each run are hashed; the upper levels
+    // of the tree are already resident from InitVmos().
+    Digest d;
+    d = reinterpret_cast<const uint8_t*>(&digest_[0]);
+    const size_t merkle_size = MerkleTree::GetTreeLength(inode->blob_size);
+    for (uint64_t run = verified_blocks_.Scan(start, end, true); run < end;) {
+        uint64_t run_end = verified_blocks_.Scan(run, end, false);
+        uint64_t run_off = run * kBlobstoreBlockSize;
+        uint64_t run_len = fbl::min(run_end * kBlobstoreBlockSize, inode->blob_size) - run_off;
+        if ((status = MerkleTree::Verify(GetData(), inode->blob_size, GetMerkle(), merkle_size,
+                                         run_off, run_len, d)) != ZX_OK) {
+            FS_TRACE_ERROR("blobstore: Failed to verify blocks [%" PRIu64 ", %" PRIu64 "): %d\n",
+                           run, run_end, status);
+            return status;
+        }
+        verified_blocks_.Set(run, run_end);
+        run = verified_blocks_.Scan(run_end, end, true);
+    }
+    return ZX_OK;
 }
 
 zx_status_t VnodeBlob::InitVmos() {
@@ -139,6 +199,10 @@ zx_status_t VnodeBlob::InitVmos() {
     zx_status_t status;
     const blobstore_inode_t* inode = blobstore_->GetNode(map_index_);
 
+    if ((status = verified_blocks_.Reset(BlobDataBlocks(*inode))) != ZX_OK) {
+        return status;
+    }
+
     uint64_t num_blocks = BlobDataBlocks(*inode) + MerkleTreeBlocks(*inode);
     if ((status = MappedVmo::Create(num_blocks * kBlobstoreBlockSize, "blob", &blob_)) != ZX_OK) {
         FS_TRACE_ERROR("Failed to initialize vmo; error: %d\n", status);
@@ -151,14 +215,15 @@ zx_status_t VnodeBlob::InitVmos() {
         return status;
     }
 
+    // The Merkle tree is small relative to the data, and every verification
+    // needs the path up to the root, so read all of it now.
+    if (MerkleTreeBlocks(*inode) == 0) {
+        return ZX_OK;
+    }
     ReadTxn txn(blobstore_.get());
     txn.Enqueue(vmoid_, 0, inode->start_block + DataStartBlock(blobstore_->info_),
-                BlobDataBlocks(*inode) + MerkleTreeBlocks(*inode));
-    if ((status = txn.Flush()) != ZX_OK) {
-        return status;
-    }
-
-    return Verify();
+                MerkleTreeBlocks(*inode));
+    return txn.Flush();
 }
 
 uint64_t VnodeBlob::SizeData() const {
@@ -213,6 +278,9 @@ zx_status_t VnodeBlob::SpaceAllocate(uint64_t size_data) {
     if ((status = blobstore_->AttachVmo(blob_->GetVmo(), &vmoid_)) != ZX_OK) {
         goto fail;
     }
+    if ((status = verified_blocks_.Reset(BlobDataBlocks(*inode))) != ZX_OK) {
+        goto fail;
+    }
 
     // Allocate space for the blob
     if ((status = blobstore_->AllocateBlocks(inode->num_blocks, &inode->start_block)) != ZX_OK) {
@@ -256,7 +324,9 @@ zx_status_t VnodeBlob::WriteMetadata() {
 
     assert(GetState() == kBlobStateDataWrite);
 
-    // All data has been written to the containing VMO
+    // All data has been written to the containing VMO, and was verified
+    // against the digest as the Merkle tree was built.
+    verified_blocks_.Set(0, verified_blocks_.size());
     SetState(kBlobStateReadable);
     if (readable_event_.is_valid()) {
         zx_status_t status = readable_event_.signal(0u, ZX_USER_SIGNAL_0);
@@ -339,8 +409,8 @@ zx_status_t VnodeBlob::WriteInternal(const void* data, size_t len, size_t* actua
             Digest digest;
             void* merkle_data = GetMerkle();
             const void* blob_data = GetData();
-            if (MerkleTree::Create(blob_data, inode->blob_size, merkle_data,
-                                   merkle_size, &digest) != ZX_OK) {
+            if (MerkleTree::CreateParallel(blob_data, inode->blob_size, merkle_data,
+                                           merkle_size, &digest) != ZX_OK) {
                 SetState(kBlobStateError);
                 return status;
             } else if (digest != digest_) {
@@ -405,6 +475,9 @@ zx_status_t VnodeBlob::CopyVmo(zx_rights_t rights, zx_handle_t* out) {
     auto inode = blobstore_->GetNode(map_index_);
     // TODO(smklein): Only clone / verify the part of the vmo that
     // was requested.
+    if ((status = VerifyRange(0, inode->blob_size)) != ZX_OK) {
+        return status;
+    }
     const size_t data_start = MerkleTreeBlocks(*inode) * kBlobstoreBlockSize;
     zx_handle_t clone;
     if ((status = zx_vmo_clone(blob_->GetVmo(), ZX_VMO_CLONE_COPY_ON_WRITE,
@@ -431,8 +504,6 @@ zx_status_t VnodeBlob::ReadInternal(void* data, size_t len, size_t off, size_t*
         return status;
     }
 
-    Digest d;
-    d = reinterpret_cast<const uint8_t*>(&digest_[0]);
     auto inode = blobstore_->GetNode(map_index_);
     if (off >= inode->blob_size) {
         *actual = 0;
@@ -441,6 +512,9 @@ zx_status_t VnodeBlob::ReadInternal(void* data, size_t len, size_t off, size_t*
     if (len > (inode->blob_size - off)) {
         len = inode->blob_size - off;
     }
+    if ((status = VerifyRange(off, len)) != ZX_OK) {
+        return status;
+    }
 
     const size_t data_start = MerkleTreeBlocks(*inode) * kBlobstoreBlockSize;
     return zx_vmo_read(blob_->GetVmo(), data, data_start + off, len, actual);
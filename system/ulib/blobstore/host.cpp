@@ -16,7 +16,6 @@
 #include <digest/merkle-tree.h>
 #include <fs/block-txn.h>
 #include <fbl/algorithm.h>
-#include <fbl/auto_call.h>
 #include <fbl/new.h>
 #include <fbl/unique_ptr.h>
 #include <fdio/debug.h>
@@ -147,38 +146,64 @@ zx_status_t blobstore_create_sparse(fbl::RefPtr<Blobstore>* out, fbl::unique_fd
     return ZX_OK;
 }
 
-std::mutex add_blob_mutex_;
+zx_status_t BlobInfo::Create(int data_fd, fbl::unique_ptr<BlobInfo>* out) {
+    fbl::AllocChecker ac;
+    fbl::unique_ptr<BlobInfo> info(new (&ac) BlobInfo());
+    if (!ac.check()) {
+        return ZX_ERR_NO_MEMORY;
+    }
 
-zx_status_t blobstore_add_blob(Blobstore* bs, int data_fd) {
     // Mmap user-provided file, create the corresponding merkle tree
     struct stat s;
     if (fstat(data_fd, &s) < 0) {
         return ZX_ERR_BAD_STATE;
     }
-    void* blob_data = mmap(nullptr, s.st_size, PROT_READ, MAP_PRIVATE, data_fd, 0);
-    if (blob_data == nullptr) {
-        return ZX_ERR_BAD_STATE;
+    if (s.st_size > 0) {
+        void* blob_data = mmap(nullptr, s.st_size, PROT_READ, MAP_PRIVATE, data_fd, 0);
+        if (blob_data == MAP_FAILED) {
+            return ZX_ERR_BAD_STATE;
+        }
+        info->data_ = blob_data;
+        info->size_ = s.st_size;
     }
 
-    auto auto_unmap = fbl::MakeAutoCall([blob_data, s]() {
-        munmap(blob_data, s.st_size);
-    });
-
     zx_status_t status;
-    digest::Digest digest;
-    fbl::AllocChecker ac;
-    size_t merkle_size = MerkleTree::GetTreeLength(s.st_size);
-    auto merkle_tree = fbl::unique_ptr<uint8_t[]>(new (&ac) uint8_t[merkle_size]);
+    size_t merkle_size = MerkleTree::GetTreeLength(info->size_);
+    info->merkle_.reset(new (&ac) uint8_t[merkle_size]);
     if (!ac.check()) {
         return ZX_ERR_NO_MEMORY;
-    } else if ((status = MerkleTree::Create(blob_data, s.st_size, merkle_tree.get(),
-                                  merkle_size, &digest)) != ZX_OK) {
+    } else if ((status = MerkleTree::Create(info->data_, info->size_, info->merkle_.get(),
+                                            merkle_size, &info->digest_)) != ZX_OK) {
+        return status;
+    }
+
+    *out = fbl::move(info);
+    return ZX_OK;
+}
+
+BlobInfo::~BlobInfo() {
+    if (data_ != nullptr) {
+        munmap(data_, size_);
+    }
+}
+
+std::mutex add_blob_mutex_;
+
+zx_status_t blobstore_add_blob(Blobstore* bs, int data_fd) {
+    zx_status_t status;
+    fbl::unique_ptr<BlobInfo> info;
+    if ((status = BlobInfo::Create(data_fd, &info)) != ZX_OK) {
         return status;
     }
 
     std::lock_guard<std::mutex> lock(add_blob_mutex_);
+    return blobstore_add_blob_info(bs, *info);
+}
+
+zx_status_t blobstore_add_blob_info(Blobstore* bs, const BlobInfo& info) {
+    zx_status_t status;
     fbl::unique_ptr<InodeBlock> inode_block;
-    if ((status = bs->NewBlob(digest, &inode_block)) < 0) {
+    if ((status = bs->NewBlob(info.GetDigest(), &inode_block)) < 0) {
         return status;
     }
     if (inode_block == nullptr) {
@@ -186,14 +211,14 @@ zx_status_t blobstore_add_blob(Blobstore* bs, int data_fd) {
         return ZX_ERR_NO_RESOURCES;
     }
 
-    inode_block->SetSize(s.st_size);
+    inode_block->SetSize(info.GetSize());
     blobstore_inode_t* inode = inode_block->GetInode();
 
     if ((status = bs->AllocateBlocks(inode->num_blocks,
                                      reinterpret_cast<size_t*>(&inode->start_block))) != ZX_OK) {
         fprintf(stderr, "error: No blocks available\n");
         return status;
-    } else if ((status = bs->WriteData(inode, merkle_tree.get(), blob_data)) != ZX_OK) {
+    } else if ((status = bs->WriteData(inode, info.GetMerkle(), info.GetData())) != ZX_OK) {
         return status;
     } else if ((status = bs->WriteBitmap(inode->num_blocks, inode->start_block)) != ZX_OK) {
         return status;
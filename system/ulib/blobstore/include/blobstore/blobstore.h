@@ -12,6 +12,7 @@
 #endif
 
 #include <bitmap/raw-bitmap.h>
+#include <bitmap/storage.h>
 #include <digest/digest.h>
 #include <fbl/algorithm.h>
 #include <fbl/intrusive_double_list.h>
@@ -163,18 +164,24 @@ private:
     zx_status_t Mmap(int flags, size_t len, size_t* off, zx_handle_t* out) final;
     void Sync(SyncCallback closure) final;
 
-    // Read both VMOs into memory, if we haven't already.
+    // Allocate the blob VMO and read the Merkle tree into it, if we haven't
+    // already. Data blocks are read and verified on demand by VerifyRange().
     //
     // TODO(ZX-1481): When we have can register the Blob Store as a pager
     // service, and it can properly handle pages faults on a vnode's contents,
-    // then we can avoid reading the entire blob up-front. Until then, read
-    // the contents of a VMO into memory when it is opened.
+    // then we can also avoid reading the entire blob up-front for VMO clones.
     zx_status_t InitVmos();
 
-    // Verify the integrity of the in-memory Blob.
-    // InitVmos() must have already been called for this blob.
+    // Verify the integrity of the entire in-memory Blob.
+    // All data blocks must already be present in the VMO.
     zx_status_t Verify() const;
 
+    // Ensure the data blocks covering [off, off + len) have been read from
+    // disk and verified against the Merkle tree. Blocks which have already
+    // been verified are not read or hashed again.
+    // InitVmos() must have already been called for this blob.
+    zx_status_t VerifyRange(uint64_t off, uint64_t len);
+
     zx_status_t WriteShared(WriteTxn* txn, size_t start, size_t len, uint64_t start_block);
     // Called by Blob once the last write has completed, updating the
     // on-disk metadata.
@@ -195,6 +202,10 @@ private:
     fbl::unique_ptr<MappedVmo> blob_{};
     vmoid_t vmoid_{};
 
+    // One bit per data block of the blob, set once the block has been read
+    // into |blob_| and verified against the Merkle tree.
+    bitmap::RawBitmapGeneric<bitmap::DefaultStorage> verified_blocks_{};
+
     zx::event readable_event_{};
     uint64_t bytes_written_{};
     uint8_t digest_[Digest::kLength]{};
@@ -19,6 +19,7 @@
 #include <fbl/ref_ptr.h>
 #include <fbl/unique_fd.h>
 #include <fbl/unique_free_ptr.h>
+#include <fbl/unique_ptr.h>
 #include <fbl/vector.h>
 #include <zircon/types.h>
 
@@ -62,6 +63,42 @@ private:
     blobstore_inode_t* inode_;
 };
 
+// A blob's contents and Merkle tree, computed before the blob is added to an
+// image so that several blobs may be hashed at once.
+class BlobInfo {
+public:
+    DISALLOW_COPY_ASSIGN_AND_MOVE(BlobInfo);
+
+    // Maps the file at |data_fd| and creates its Merkle tree.
+    static zx_status_t Create(int data_fd, fbl::unique_ptr<BlobInfo>* out);
+
+    ~BlobInfo();
+
+    const Digest& GetDigest() const {
+        return digest_;
+    }
+
+    size_t GetSize() const {
+        return size_;
+    }
+
+    void* GetData() const {
+        return data_;
+    }
+
+    void* GetMerkle() const {
+        return merkle_.get();
+    }
+
+private:
+    BlobInfo() : data_(nullptr), size_(0) {}
+
+    void* data_;
+    size_t size_;
+    fbl::unique_ptr<uint8_t[]> merkle_;
+    Digest digest_;
+};
+
 class Blobstore : public fbl::RefCounted<Blobstore> {
 public:
     DISALLOW_COPY_ASSIGN_AND_MOVE(Blobstore);
@@ -138,6 +175,12 @@ zx_status_t blobstore_create(fbl::RefPtr<Blobstore>* out, fbl::unique_fd blockfd
 // blobstore_add_blob may be called by multiple threads to gain concurrent
 // merkle tree generation. No other methods are thread safe.
 zx_status_t blobstore_add_blob(Blobstore* bs, int data_fd);
+
+// Adds a blob prepared by |BlobInfo::Create| to |bs|.  Unlike
+// |blobstore_add_blob|, the caller must serialize calls, which lets it choose
+// the order in which blobs are laid out independently of how long each took
+// to hash.
+zx_status_t blobstore_add_blob_info(Blobstore* bs, const BlobInfo& info);
 zx_status_t blobstore_fsck(fbl::unique_fd fd, off_t start, off_t end,
                            const fbl::Vector<size_t>& extent_lengths);
 
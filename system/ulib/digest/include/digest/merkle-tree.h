@@ -67,6 +67,21 @@ public:
                               const void* tree, size_t tree_len, size_t offset,
                               size_t length, const Digest& digest);
 
+    // Like |Create|, but hashes the nodes of each level of the tree on up to
+    // |num_threads| threads, or one per CPU if |num_threads| is 0.  The tree
+    // and root digest are identical to those written by |Create|.  Data too
+    // small to be worth splitting is hashed on the calling thread.
+    static zx_status_t CreateParallel(const void* data, size_t data_len, void* tree,
+                                      size_t tree_len, Digest* digest,
+                                      uint32_t num_threads = 0);
+
+    // Like |Verify|, but checks the nodes of each level of the tree on up to
+    // |num_threads| threads, or one per CPU if |num_threads| is 0.
+    static zx_status_t VerifyParallel(const void* data, size_t data_len,
+                                      const void* tree, size_t tree_len, size_t offset,
+                                      size_t length, const Digest& digest,
+                                      uint32_t num_threads = 0);
+
     // The stateful instance methods below are only needed when creating a
     // Merkle tree using the Init/Update/Final methods.
     MerkleTree();
@@ -98,14 +113,23 @@ private:
     static zx_status_t VerifyRoot(const void* data, size_t data_len,
                                   uint64_t level, const Digest& root);
 
+    // Implements |Verify| and |VerifyParallel|, checking each level on up to
+    // |num_threads| threads.
+    static zx_status_t VerifyInternal(const void* data, size_t data_len,
+                                      const void* tree, size_t tree_len, size_t offset,
+                                      size_t length, const Digest& digest,
+                                      uint32_t num_threads);
+
     // Checks the integrity of portion of a Merkle tree level given by the
     // offset and length.  It checks integrity using next level up of the given
     // Merkle tree. |tree_len| must be at least as much as returned by
     // |GetTreeLength(data_len)|.  |offset| and |length| must describe a range
-    // wholly within |data_len|.
+    // wholly within |data_len|.  The nodes are split across up to
+    // |num_threads| threads.
     static zx_status_t VerifyLevel(const void* data, size_t data_len,
                                    const void* tree, size_t offset,
-                                   size_t length, uint64_t level);
+                                   size_t length, uint64_t level,
+                                   uint32_t num_threads);
 
     // See CreateFinal.  This implements that method, with an extra parameter to
     // allow levels other than the bottommost to be padded.
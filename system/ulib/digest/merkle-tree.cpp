@@ -6,6 +6,8 @@
 
 #include <stdint.h>
 #include <string.h>
+#include <threads.h>
+#include <unistd.h>
 
 #include <digest/digest.h>
 #include <fbl/algorithm.h>
@@ -14,6 +16,10 @@
 #include <zircon/assert.h>
 #include <zircon/errors.h>
 
+#ifdef __Fuchsia__
+#include <zircon/syscalls.h>
+#endif
+
 namespace digest {
 
 // Size of a node in bytes.  Defined in tree.h.
@@ -94,6 +100,110 @@ size_t NextAligned(size_t length) {
     return fbl::round_up(NextLength(length), MerkleTree::kNodeSize);
 }
 
+////////
+// Helper functions for hashing the nodes of a level on several threads.
+
+// The fewest nodes worth handing to a thread of their own.  Hashing 256K of
+// data takes long enough to amortize creating and joining the thread.
+const size_t kMinNodesPerThread = 32;
+
+// The most threads used to hash a single level.
+const uint32_t kMaxThreads = 16;
+
+// A run of nodes from a single level of the tree.  The digest of each node is
+// either written to |out| or compared against those in |expected|, both of
+// which are indexed from the start of the level.
+struct NodeRange {
+    const uint8_t* data;
+    size_t data_len;
+    uint64_t level;
+    size_t first;
+    size_t last;
+    uint8_t* out;
+    const uint8_t* expected;
+    zx_status_t rc;
+};
+
+// Returns the number of threads to use for |num_nodes| nodes when asked for
+// |num_threads|, where 0 means one per CPU.
+uint32_t GetNumThreads(uint32_t num_threads, size_t num_nodes) {
+    if (num_threads == 0) {
+#ifdef __Fuchsia__
+        num_threads = zx_system_get_num_cpus();
+#else
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = (cpus > 0 ? static_cast<uint32_t>(cpus) : 1);
+#endif
+    }
+    size_t max_threads = fbl::max(num_nodes / kMinNodesPerThread, static_cast<size_t>(1));
+    max_threads = fbl::min(max_threads, static_cast<size_t>(kMaxThreads));
+    return static_cast<uint32_t>(fbl::min(static_cast<size_t>(num_threads), max_threads));
+}
+
+// Thread entry point that hashes each node in the |NodeRange| given by |arg|.
+int HashNodes(void* arg) {
+    NodeRange* range = static_cast<NodeRange*>(arg);
+    Digest digest;
+    for (size_t i = range->first; i < range->last; ++i) {
+        size_t offset = i * MerkleTree::kNodeSize;
+        size_t length = range->data_len - offset;
+        if ((range->rc = DigestInit(&digest, offset | range->level, length)) != ZX_OK) {
+            break;
+        }
+        size_t chunk = DigestUpdate(&digest, range->data + offset, offset, length);
+        DigestFinal(&digest, offset + chunk);
+        if (range->out) {
+            digest.CopyTo(range->out + (i * Digest::kLength), Digest::kLength);
+        } else if (digest != range->expected + (i * Digest::kLength)) {
+            range->rc = ZX_ERR_IO_DATA_INTEGRITY;
+            break;
+        }
+    }
+    return 0;
+}
+
+// Hashes nodes |first| through |last| of the level holding |data_len| bytes of
+// |data|, split evenly across |num_threads| threads.  The calling thread takes
+// the first share.  Returns the error from the lowest failing node, if any.
+zx_status_t HashLevel(const uint8_t* data, size_t data_len, uint64_t level, size_t first,
+                      size_t last, uint8_t* out, const uint8_t* expected, uint32_t num_threads) {
+    ZX_DEBUG_ASSERT(num_threads > 0 && num_threads <= kMaxThreads);
+    NodeRange ranges[kMaxThreads];
+    thrd_t threads[kMaxThreads];
+    bool started[kMaxThreads];
+    size_t num_nodes = last - first;
+    for (uint32_t i = 0; i < num_threads; ++i) {
+        ranges[i].data = data;
+        ranges[i].data_len = data_len;
+        ranges[i].level = level;
+        ranges[i].first = first + (num_nodes * i) / num_threads;
+        ranges[i].last = first + (num_nodes * (i + 1)) / num_threads;
+        ranges[i].out = out;
+        ranges[i].expected = expected;
+        ranges[i].rc = ZX_OK;
+    }
+    // If a thread can't be created, its share is hashed on this one instead.
+    started[0] = false;
+    for (uint32_t i = 1; i < num_threads; ++i) {
+        started[i] = (thrd_create(&threads[i], HashNodes, &ranges[i]) == thrd_success);
+    }
+    for (uint32_t i = 0; i < num_threads; ++i) {
+        if (!started[i]) {
+            HashNodes(&ranges[i]);
+        }
+    }
+    zx_status_t rc = ZX_OK;
+    for (uint32_t i = 0; i < num_threads; ++i) {
+        if (started[i]) {
+            thrd_join(threads[i], nullptr);
+        }
+        if (rc == ZX_OK) {
+            rc = ranges[i].rc;
+        }
+    }
+    return rc;
+}
+
 } // namespace
 
 ////////
@@ -116,6 +226,48 @@ zx_status_t MerkleTree::Create(const void* data, size_t data_len, void* tree, si
     return ZX_OK;
 }
 
+zx_status_t MerkleTree::CreateParallel(const void* data, size_t data_len, void* tree,
+                                       size_t tree_len, Digest* digest, uint32_t num_threads) {
+    size_t num_nodes = fbl::round_up(data_len, kNodeSize) / kNodeSize;
+    if ((num_threads = GetNumThreads(num_threads, num_nodes)) <= 1) {
+        return Create(data, data_len, tree, tree_len, digest);
+    }
+    // Must have room for the whole tree.  Having more than one thread means
+    // there is more than one node, so there must be data to read, a tree to
+    // fill and a root to write.
+    if (tree_len < GetTreeLength(data_len)) {
+        return ZX_ERR_BUFFER_TOO_SMALL;
+    }
+    if (!data || !tree || !digest) {
+        return ZX_ERR_INVALID_ARGS;
+    }
+    // Hash each level into the next one up until a single node remains.
+    zx_status_t rc;
+    const uint8_t* in = static_cast<const uint8_t*>(data);
+    uint8_t* out = static_cast<uint8_t*>(tree);
+    uint64_t level = 0;
+    while (data_len > kNodeSize) {
+        num_nodes = fbl::round_up(data_len, kNodeSize) / kNodeSize;
+        if ((rc = HashLevel(in, data_len, level, 0, num_nodes, out, nullptr,
+                            GetNumThreads(num_threads, num_nodes))) != ZX_OK) {
+            return rc;
+        }
+        // Zero the rest of the last node, as |CreateUpdate| does.
+        size_t next_len = NextLength(data_len);
+        data_len = NextAligned(data_len);
+        memset(out + next_len, 0, data_len - next_len);
+        in = out;
+        out += data_len;
+        ++level;
+    }
+    if ((rc = DigestInit(digest, level, data_len)) != ZX_OK) {
+        return rc;
+    }
+    DigestUpdate(digest, in, 0, data_len);
+    DigestFinal(digest, data_len);
+    return ZX_OK;
+}
+
 MerkleTree::MerkleTree() : initialized_(false), next_(nullptr), level_(0), offset_(0), length_(0) {}
 
 MerkleTree::~MerkleTree() {}
@@ -246,12 +398,26 @@ zx_status_t MerkleTree::CreateFinalInternal(const void* data, void* tree, Digest
 
 zx_status_t MerkleTree::Verify(const void* data, size_t data_len, const void* tree, size_t tree_len,
                                size_t offset, size_t length, const Digest& root) {
+    return VerifyInternal(data, data_len, tree, tree_len, offset, length, root, 1);
+}
+
+zx_status_t MerkleTree::VerifyParallel(const void* data, size_t data_len, const void* tree,
+                                       size_t tree_len, size_t offset, size_t length,
+                                       const Digest& root, uint32_t num_threads) {
+    num_threads = GetNumThreads(num_threads, fbl::round_up(length, kNodeSize) / kNodeSize);
+    return VerifyInternal(data, data_len, tree, tree_len, offset, length, root, num_threads);
+}
+
+zx_status_t MerkleTree::VerifyInternal(const void* data, size_t data_len, const void* tree,
+                                       size_t tree_len, size_t offset, size_t length,
+                                       const Digest& root, uint32_t num_threads) {
     uint64_t level = 0;
     size_t root_len = data_len;
     while (data_len > kNodeSize) {
         zx_status_t rc;
         // Verify the data in this level.
-        if ((rc = VerifyLevel(data, data_len, tree, offset, length, level)) != ZX_OK) {
+        if ((rc = VerifyLevel(data, data_len, tree, offset, length, level, num_threads)) !=
+            ZX_OK) {
             return rc;
         }
         // Ascend to the next level up.
@@ -263,8 +429,12 @@ zx_status_t MerkleTree::Verify(const void* data, size_t data_len, const void* tr
             return ZX_ERR_BUFFER_TOO_SMALL;
         }
         tree_len -= data_len;
-        offset /= kDigestsPerNode;
-        length /= kDigestsPerNode;
+        // Round the range out to whole nodes before ascending, so that every
+        // node holding a digest of the range is checked, however short the
+        // range is.
+        size_t finish = fbl::round_up(offset + length, kNodeSize) / kDigestsPerNode;
+        offset = (offset - offset % kNodeSize) / kDigestsPerNode;
+        length = finish - offset;
         ++level;
     }
     return VerifyRoot(data, root_len, level, root);
@@ -289,8 +459,8 @@ zx_status_t MerkleTree::VerifyRoot(const void* data, size_t root_len, uint64_t l
 }
 
 zx_status_t MerkleTree::VerifyLevel(const void* data, size_t data_len, const void* tree,
-                                    size_t offset, size_t length, uint64_t level) {
-    zx_status_t rc;
+                                    size_t offset, size_t length, uint64_t level,
+                                    uint32_t num_threads) {
     ZX_DEBUG_ASSERT(offset + length >= offset);
     // Must have more than one node of data and digests to check against.
     if (!data || data_len <= kNodeSize || !tree) {
@@ -303,27 +473,12 @@ zx_status_t MerkleTree::VerifyLevel(const void* data, size_t data_len, const voi
     // Align parameters to node boundaries, but don't exceed data_len
     offset -= offset % kNodeSize;
     size_t finish = fbl::round_up(offset + length, kNodeSize);
-    length = fbl::min(finish, data_len) - offset;
-    const uint8_t* in = static_cast<const uint8_t*>(data) + offset;
-    // The digests are in the next level up.
-    Digest actual;
-    const uint8_t* expected = static_cast<const uint8_t*>(tree) + (offset / kDigestsPerNode);
-    // Check the data of this level against the digests.
-    while (length > 0) {
-        if ((rc = DigestInit(&actual, offset | level, data_len - offset)) != ZX_OK) {
-            return rc;
-        }
-        size_t chunk = DigestUpdate(&actual, in, offset, length);
-        in += chunk;
-        offset += chunk;
-        length -= chunk;
-        DigestFinal(&actual, offset);
-        if (actual != expected) {
-            return ZX_ERR_IO_DATA_INTEGRITY;
-        }
-        expected += Digest::kLength;
-    }
-    return ZX_OK;
+    finish = fbl::min(finish, data_len);
+    // Check the data of this level against the digests in the next level up.
+    size_t first = offset / kNodeSize;
+    size_t last = fbl::round_up(finish, kNodeSize) / kNodeSize;
+    return HashLevel(static_cast<const uint8_t*>(data), data_len, level, first, last, nullptr,
+                     static_cast<const uint8_t*>(tree), GetNumThreads(num_threads, last - first));
 }
 
 } // namespace digest
@@ -21,7 +21,13 @@ zx_status_t SparseReader::Create(fbl::unique_fd fd, fbl::unique_ptr<SparseReader
     return ZX_OK;
 }
 
-SparseReader::SparseReader(fbl::unique_fd fd) : compressed_(false), fd_(fbl::move(fd)) {}
+SparseReader::SparseReader(fbl::unique_fd fd)
+    : compressed_(false), fd_(fbl::move(fd)), chunked_(false), chunk_index_(nullptr),
+      chunks_(nullptr), data_length_(0), next_chunk_(0), cur_chunk_(0), cur_offset_(0),
+      stop_(false), worker_count_(0) {
+    cnd_init(&slot_free_cvar_);
+    cnd_init(&chunk_ready_cvar_);
+}
 
 zx_status_t SparseReader::ReadMetadata() {
     // Read sparse image
@@ -31,6 +37,20 @@ zx_status_t SparseReader::ReadMetadata() {
         return ZX_ERR_IO;
     }
 
+    if (image.header_length < sizeof(fvm::sparse_image_t)) {
+        fprintf(stderr, "SparseReader: header length %" PRIu64 " is too short\n",
+                image.header_length);
+        return ZX_ERR_IO_DATA_INTEGRITY;
+    } else if (image.flags & ~fvm::kSparseFlagAllValid) {
+        // An unknown flag may change the layout of the data, so nothing past
+        // the header can be trusted to mean what this reader thinks it means.
+        fprintf(stderr, "SparseReader: unknown flags 0x%x\n", image.flags);
+        return ZX_ERR_NOT_SUPPORTED;
+    } else if ((image.flags & fvm::kSparseFlagLz4) && (image.flags & fvm::kSparseFlagLz4Chunks)) {
+        fprintf(stderr, "SparseReader: conflicting compression flags\n");
+        return ZX_ERR_IO_DATA_INTEGRITY;
+    }
+
     fbl::AllocChecker ac;
     metadata_.reset(new (&ac) uint8_t[image.header_length]);
     if (!ac.check()) {
@@ -43,7 +63,7 @@ zx_status_t SparseReader::ReadMetadata() {
     size_t off = sizeof(image);
     while (off < image.header_length) {
         ssize_t r = read(fd_.get(), &metadata_[off], image.header_length - off);
-        if (r < 0) {
+        if (r <= 0) {
             fprintf(stderr, "SparseReader: Failed to read metadata\n");
             return ZX_ERR_IO;
         }
@@ -51,7 +71,12 @@ zx_status_t SparseReader::ReadMetadata() {
     }
 
     // If image is compressed, additional setup is required
-    if (image.flags & fvm::kSparseFlagLz4) {
+    if (image.flags & fvm::kSparseFlagLz4Chunks) {
+        printf("Found compressed file (chunked)\n");
+        compressed_ = true;
+        chunked_ = true;
+        return StartChunkWorkers();
+    } else if (image.flags & fvm::kSparseFlagLz4) {
         printf("Found compressed file\n");
         compressed_ = true;
         // Initialize decompression context
@@ -122,12 +147,284 @@ zx_status_t SparseReader::InitializeBuffer(size_t size, buffer_t* out_buf) {
     return ZX_OK;
 }
 
+zx_status_t SparseReader::StartChunkWorkers() {
+    fvm::sparse_image_t* image = Image();
+    const size_t header_length = image->header_length;
+
+    // The chunk index follows the last extent descriptor
+    size_t off = sizeof(fvm::sparse_image_t);
+    for (size_t p = 0; p < image->partition_count; p++) {
+        if (header_length - off < sizeof(fvm::partition_descriptor_t)) {
+            fprintf(stderr, "SparseReader: partition descriptors exceed header\n");
+            return ZX_ERR_IO_DATA_INTEGRITY;
+        }
+        auto part = reinterpret_cast<fvm::partition_descriptor_t*>(&metadata_[off]);
+        off += sizeof(fvm::partition_descriptor_t);
+        if ((header_length - off) / sizeof(fvm::extent_descriptor_t) < part->extent_count) {
+            fprintf(stderr, "SparseReader: extent descriptors exceed header\n");
+            return ZX_ERR_IO_DATA_INTEGRITY;
+        }
+        for (size_t e = 0; e < part->extent_count; e++) {
+            auto ext = reinterpret_cast<fvm::extent_descriptor_t*>(&metadata_[off]);
+            data_length_ += ext->extent_length;
+            off += sizeof(fvm::extent_descriptor_t);
+        }
+    }
+
+    if (header_length - off < sizeof(fvm::chunk_index_t)) {
+        fprintf(stderr, "SparseReader: missing chunk index\n");
+        return ZX_ERR_IO_DATA_INTEGRITY;
+    }
+    chunk_index_ = reinterpret_cast<fvm::chunk_index_t*>(&metadata_[off]);
+    off += sizeof(fvm::chunk_index_t);
+    chunks_ = reinterpret_cast<fvm::chunk_descriptor_t*>(&metadata_[off]);
+
+    const uint64_t chunk_size = chunk_index_->chunk_size;
+    const uint64_t chunk_count = chunk_index_->chunk_count;
+    if (chunk_index_->magic != fvm::kChunkIndexMagic) {
+        fprintf(stderr, "SparseReader: bad chunk index magic\n");
+        return ZX_ERR_IO_DATA_INTEGRITY;
+    } else if (chunk_size == 0 || chunk_size > fvm::kSparseChunkSizeMax) {
+        fprintf(stderr, "SparseReader: bad chunk size %" PRIu64 "\n", chunk_size);
+        return ZX_ERR_IO_DATA_INTEGRITY;
+    } else if (chunk_count != (data_length_ + chunk_size - 1) / chunk_size) {
+        fprintf(stderr, "SparseReader: %" PRIu64 " chunks cannot hold %" PRIu64 " bytes\n",
+                chunk_count, data_length_);
+        return ZX_ERR_IO_DATA_INTEGRITY;
+    } else if ((header_length - off) / sizeof(fvm::chunk_descriptor_t) != chunk_count ||
+               (header_length - off) % sizeof(fvm::chunk_descriptor_t) != 0) {
+        fprintf(stderr, "SparseReader: chunk index does not match header length\n");
+        return ZX_ERR_IO_DATA_INTEGRITY;
+    }
+
+    // When the image is a file rather than a stream, every chunk must also
+    // lie within it.
+    uint64_t image_length = UINT64_MAX;
+    struct stat s;
+    if (fstat(fd_.get(), &s) == 0 && S_ISREG(s.st_mode)) {
+        image_length = s.st_size;
+    }
+
+    const size_t max_compressed = LZ4F_compressFrameBound(chunk_size, nullptr);
+    uint64_t chunk_end = header_length;
+    for (uint64_t n = 0; n < chunk_count; n++) {
+        if (chunks_[n].compressed_length == 0 || chunks_[n].compressed_length > max_compressed) {
+            fprintf(stderr, "SparseReader: bad compressed length for chunk %" PRIu64 "\n", n);
+            return ZX_ERR_IO_DATA_INTEGRITY;
+        }
+        chunk_end += chunks_[n].compressed_length;
+        if (chunk_end > image_length) {
+            fprintf(stderr, "SparseReader: chunk %" PRIu64 " ends past the end of the image\n",
+                    n);
+            return ZX_ERR_IO_DATA_INTEGRITY;
+        }
+    }
+
+    if (chunk_count == 0) {
+        return ZX_OK;
+    }
+
+#ifdef __Fuchsia__
+    uint64_t workers = zx_system_get_num_cpus();
+#else
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t workers = cpus > 0 ? cpus : 1;
+#endif
+    workers = fbl::min(workers, fbl::min(chunk_count, static_cast<uint64_t>(LZ4_MAX_CHUNK_WORKERS)));
+
+    // Two slots per worker lets each worker decompress a chunk while the
+    // previous one is still being consumed.
+    const size_t slot_count = static_cast<size_t>(fbl::min(chunk_count, 2 * workers));
+    fbl::AllocChecker ac;
+    slots_.reset(new (&ac) chunk_slot_t[slot_count], slot_count);
+    if (!ac.check()) {
+        return ZX_ERR_NO_MEMORY;
+    }
+    for (size_t n = 0; n < slot_count; n++) {
+        slots_[n].compressed.reset(new (&ac) uint8_t[max_compressed]);
+        if (!ac.check()) {
+            return ZX_ERR_NO_MEMORY;
+        }
+        slots_[n].data.reset(new (&ac) uint8_t[chunk_size]);
+        if (!ac.check()) {
+            return ZX_ERR_NO_MEMORY;
+        }
+        slots_[n].size = 0;
+        slots_[n].status = ZX_OK;
+        slots_[n].ready = false;
+    }
+
+    for (uint32_t n = 0; n < workers; n++) {
+        if (thrd_create(&workers_[n], ChunkWorker, this) != thrd_success) {
+            break;
+        }
+        worker_count_++;
+    }
+    if (worker_count_ == 0) {
+        fprintf(stderr, "SparseReader: could not start decompression threads\n");
+        return ZX_ERR_NO_RESOURCES;
+    }
+    return ZX_OK;
+}
+
+void SparseReader::StopChunkWorkers() {
+    {
+        fbl::AutoLock lock(&lock_);
+        stop_ = true;
+        cnd_broadcast(&slot_free_cvar_);
+    }
+    for (uint32_t n = 0; n < worker_count_; n++) {
+        thrd_join(workers_[n], nullptr);
+    }
+    worker_count_ = 0;
+}
+
+int SparseReader::ChunkWorker(void* arg) {
+    static_cast<SparseReader*>(arg)->DecompressChunks();
+    return 0;
+}
+
+void SparseReader::DecompressChunks() {
+    LZ4F_decompressionContext_t dctx;
+    LZ4F_errorCode_t errc = LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
+    zx_status_t init_status = ZX_OK;
+    if (LZ4F_isError(errc)) {
+        fprintf(stderr, "SparseReader: could not initialize decompression: %s\n",
+                LZ4F_getErrorName(errc));
+        init_status = ZX_ERR_INTERNAL;
+    }
+
+    for (;;) {
+        uint64_t chunk;
+        chunk_slot_t* slot;
+        zx_status_t status = init_status;
+        {
+            // Claim the next chunk and read it while holding |read_lock_|, so the
+            // fd is read sequentially even if it is a pipe.
+            fbl::AutoLock read_lock(&read_lock_);
+            {
+                fbl::AutoLock lock(&lock_);
+                while (!stop_ && next_chunk_ < chunk_index_->chunk_count &&
+                       next_chunk_ >= cur_chunk_ + slots_.size()) {
+                    cnd_wait(&slot_free_cvar_, lock_.GetInternal());
+                }
+                if (stop_ || next_chunk_ == chunk_index_->chunk_count) {
+                    break;
+                }
+                chunk = next_chunk_++;
+            }
+
+            slot = &slots_[chunk % slots_.size()];
+            size_t actual = 0;
+            if (status == ZX_OK &&
+                (status = ReadRaw(slot->compressed.get(), chunks_[chunk].compressed_length,
+                                  &actual)) == ZX_OK &&
+                actual != chunks_[chunk].compressed_length) {
+                fprintf(stderr, "SparseReader: truncated chunk %" PRIu64 "\n", chunk);
+                status = ZX_ERR_IO;
+            }
+        }
+
+        if (status == ZX_OK) {
+            status = DecompressChunk(dctx, chunk, slot);
+        }
+
+        fbl::AutoLock lock(&lock_);
+        slot->status = status;
+        slot->ready = true;
+        cnd_broadcast(&chunk_ready_cvar_);
+        if (status != ZX_OK) {
+            // ReadData will report the failure once it reaches this chunk
+            break;
+        }
+    }
+
+    if (init_status == ZX_OK) {
+        LZ4F_freeDecompressionContext(dctx);
+    }
+}
+
+zx_status_t SparseReader::DecompressChunk(LZ4F_decompressionContext_t dctx, uint64_t chunk,
+                                          chunk_slot_t* slot) {
+    const uint64_t chunk_size = chunk_index_->chunk_size;
+    const size_t expected = static_cast<size_t>(fbl::min(chunk_size,
+                                                         data_length_ - chunk * chunk_size));
+    const size_t in_length = chunks_[chunk].compressed_length;
+    size_t in_offset = 0;
+    size_t out_offset = 0;
+    size_t next;
+    do {
+        size_t src_sz = in_length - in_offset;
+        size_t dst_sz = chunk_size - out_offset;
+        next = LZ4F_decompress(dctx, slot->data.get() + out_offset, &dst_sz,
+                               slot->compressed.get() + in_offset, &src_sz, NULL);
+        if (LZ4F_isError(next)) {
+            fprintf(stderr, "could not decompress chunk %" PRIu64 ": %s\n", chunk,
+                    LZ4F_getErrorName(next));
+            return ZX_ERR_IO_DATA_INTEGRITY;
+        } else if (src_sz == 0 && dst_sz == 0) {
+            break;
+        }
+        in_offset += src_sz;
+        out_offset += dst_sz;
+    } while (next != 0 && in_offset < in_length);
+
+    if (next != 0 || in_offset != in_length || out_offset != expected) {
+        fprintf(stderr, "chunk %" PRIu64 " decompressed to %zu bytes, expected %zu\n", chunk,
+                out_offset, expected);
+        return ZX_ERR_IO_DATA_INTEGRITY;
+    }
+    slot->size = out_offset;
+    return ZX_OK;
+}
+
+zx_status_t SparseReader::ReadChunks(uint8_t* data, size_t length, size_t* actual) {
+    if (cur_chunk_ == chunk_index_->chunk_count) {
+        // There is no more to read
+        return ZX_ERR_OUT_OF_RANGE;
+    }
+
+    size_t total_size = 0;
+    while (total_size < length && cur_chunk_ < chunk_index_->chunk_count) {
+        chunk_slot_t* slot = &slots_[cur_chunk_ % slots_.size()];
+        {
+            fbl::AutoLock lock(&lock_);
+            while (!slot->ready) {
+                cnd_wait(&chunk_ready_cvar_, lock_.GetInternal());
+            }
+        }
+        if (slot->status != ZX_OK) {
+            return slot->status;
+        }
+
+        size_t cp = fbl::min(length - total_size, slot->size - cur_offset_);
+        memcpy(data + total_size, slot->data.get() + cur_offset_, cp);
+        total_size += cp;
+        cur_offset_ += cp;
+
+        if (cur_offset_ == slot->size) {
+            // Hand the slot back to the workers
+            fbl::AutoLock lock(&lock_);
+            slot->ready = false;
+            cur_chunk_++;
+            cur_offset_ = 0;
+            cnd_broadcast(&slot_free_cvar_);
+        }
+    }
+
+    *actual = total_size;
+    return ZX_OK;
+}
+
 SparseReader::~SparseReader() {
     PrintStats();
+    StopChunkWorkers();
 
-    if (compressed_) {
+    if (compressed_ && !chunked_) {
         LZ4F_freeDecompressionContext(dctx_);
     }
+    cnd_destroy(&slot_free_cvar_);
+    cnd_destroy(&chunk_ready_cvar_);
 }
 
 fvm::sparse_image_t* SparseReader::Image() {
@@ -145,7 +442,13 @@ zx_status_t SparseReader::ReadData(uint8_t* data, size_t length, size_t* actual)
     zx_time_t start = zx_ticks_get();
 #endif
     size_t total_size = 0;
-    if (compressed_) {
+    if (chunked_) {
+        zx_status_t status = ReadChunks(data, length, &total_size);
+
+        if (status != ZX_OK) {
+            return status;
+        }
+    } else if (compressed_) {
         if (to_read_ == 0) {
             // There is no more to read
             return ZX_ERR_OUT_OF_RANGE;
@@ -250,7 +553,12 @@ zx_status_t SparseReader::WriteDecompressed(fbl::unique_fd outfd) {
 
     // Update metadata and write to new file.
     fvm::sparse_image_t* image = Image();
-    image->flags &= ~fvm::kSparseFlagLz4;
+    image->flags &= ~(fvm::kSparseFlagLz4 | fvm::kSparseFlagLz4Chunks);
+    if (chunked_) {
+        // The chunk index ends the header, and only describes compressed data.
+        image->header_length -= sizeof(fvm::chunk_index_t) +
+                                chunk_index_->chunk_count * sizeof(fvm::chunk_descriptor_t);
+    }
 
     if (write(outfd.get(), metadata_.get(), image->header_length)
         != static_cast<ssize_t>(image->header_length)) {
@@ -280,8 +588,13 @@ zx_status_t SparseReader::WriteDecompressed(fbl::unique_fd outfd) {
 
 void SparseReader::PrintStats() const {
     printf("Reading FVM from compressed file: %s\n", compressed_ ? "true" : "false");
-    printf("Remaining bytes read into compression buffer:    %lu\n", in_buf_.size);
-    printf("Remaining bytes written to decompression buffer: %lu\n", out_buf_.size);
+    if (chunked_) {
+        printf("Chunks decompressed by %u threads:       %lu of %lu\n", worker_count_,
+               cur_chunk_, chunk_index_ ? chunk_index_->chunk_count : 0);
+    } else if (compressed_) {
+        printf("Remaining bytes read into compression buffer:    %lu\n", in_buf_.size);
+        printf("Remaining bytes written to decompression buffer: %lu\n", out_buf_.size);
+    }
 #ifdef __Fuchsia__
     printf("Time reading bytes from sparse FVM file:   %lu (%lu s)\n", read_time_,
            read_time_ / zx_ticks_per_second());
@@ -5,6 +5,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -12,10 +13,14 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <threads.h>
 #include <unistd.h>
 
 #include <lz4/lz4frame.h>
+#include <fbl/array.h>
 #include <fbl/auto_call.h>
+#include <fbl/auto_lock.h>
+#include <fbl/mutex.h>
 #include <fbl/unique_fd.h>
 #include "fvm/fvm-sparse.h"
 
@@ -25,6 +30,9 @@
 
 #define LZ4_MAX_BLOCK_SIZE 65536
 
+// Maximum number of threads decompressing the chunks of a chunked image.
+#define LZ4_MAX_CHUNK_WORKERS 4
+
 namespace fvm {
 
 class SparseReader {
@@ -85,9 +93,31 @@ private:
         size_t max_size;
     } buffer_t;
 
+    // A decompressed chunk of a chunked image, or one being read and decompressed.
+    typedef struct chunk_slot {
+        fbl::unique_ptr<uint8_t[]> compressed;
+        fbl::unique_ptr<uint8_t[]> data;
+        // Decompressed bytes in |data|
+        size_t size;
+        zx_status_t status;
+        // Set once |data| holds the chunk (or |status| the failure)
+        bool ready;
+    } chunk_slot_t;
+
     SparseReader(fbl::unique_fd fd);
     // Read in header data, prepare buffers and decompression context if necessary
     zx_status_t ReadMetadata();
+    // Validate the chunk index of a chunked image and start decompressing chunks
+    zx_status_t StartChunkWorkers();
+    // Stop decompressing chunks and join the worker threads
+    void StopChunkWorkers();
+    // Copy up to |length| bytes of decompressed chunks into |data|
+    zx_status_t ReadChunks(uint8_t* data, size_t length, size_t* actual);
+    // Worker thread: read chunks in order from the fd, decompress them into free slots
+    static int ChunkWorker(void* arg);
+    void DecompressChunks();
+    zx_status_t DecompressChunk(LZ4F_decompressionContext_t dctx, uint64_t chunk,
+                                chunk_slot_t* slot);
     // Initialize buffer with a given |size|
     static zx_status_t InitializeBuffer(size_t size, buffer_t* out_buf);
     // Read |length| bytes of raw data from file directly into |data|. Return |actual| bytes read.
@@ -111,6 +141,33 @@ private:
     // Buffer for decompressed data
     buffer_t out_buf_;
 
+    // True if the sparse file is compressed as independent chunks
+    bool chunked_;
+    fvm::chunk_index_t* chunk_index_;
+    fvm::chunk_descriptor_t* chunks_;
+    // Total decompressed length of the data
+    uint64_t data_length_;
+
+    // Chunks are read from the fd in order by whichever worker claims them next;
+    // |read_lock_| keeps the reads in claim order. Chunk |n| is decompressed
+    // into slot |n % slots_.size()| once the chunk which last used that slot
+    // has been consumed by ReadData.
+    fbl::Mutex read_lock_;
+    fbl::Mutex lock_;
+    // Signalled when a slot is freed or the workers should stop
+    cnd_t slot_free_cvar_;
+    // Signalled when a chunk is ready
+    cnd_t chunk_ready_cvar_;
+    fbl::Array<chunk_slot_t> slots_;
+    // Next chunk to be claimed by a worker
+    uint64_t next_chunk_;
+    // Chunk currently being consumed by ReadData, and how much of it has been
+    uint64_t cur_chunk_;
+    size_t cur_offset_;
+    bool stop_;
+    thrd_t workers_[LZ4_MAX_CHUNK_WORKERS];
+    uint32_t worker_count_;
+
 #ifdef __Fuchsia__
     // Total time spent reading/decompressing data
     zx_time_t total_time_ = 0;
@@ -41,11 +41,32 @@ namespace fvm {
 //   P0, Extent 2
 //   P1, Extent 0
 //   P2, Extent 0
+//
+// The DATA section may be compressed. With kSparseFlagLz4 it is a single
+// LZ4 frame. With kSparseFlagLz4Chunks it is split into chunks of
+// |chunk_size| bytes (the last may be shorter), each compressed as an
+// independent LZ4 frame, so that chunks may be decompressed in parallel.
+// The compressed length of each chunk is recorded in an index at the end of
+// the HEADER:
+//
+// HEADER:
+//   sparse_image_t
+//      Partition and extent descriptors, as above
+//   chunk_index_t, followed by |chunk_count| entries of...
+//      chunk_descriptor_t
+// DATA:
+//   Chunk 0
+//   Chunk 1
+//   ...
 
 constexpr uint64_t kSparseFormatMagic = (0x53525053204d5646ull); // 'FVM SPRS'
 constexpr uint64_t kSparseFormatVersion = 0x2;
 
 constexpr uint32_t kSparseFlagLz4 = 0x1;
+constexpr uint32_t kSparseFlagLz4Chunks = 0x2;
+// Readers must reject images with any other flag set, since they cannot know
+// how such an image lays out its DATA section.
+constexpr uint32_t kSparseFlagAllValid = kSparseFlagLz4 | kSparseFlagLz4Chunks;
 
 typedef struct sparse_image {
     uint64_t magic;
@@ -75,4 +96,21 @@ typedef struct extent_descriptor {
     uint64_t extent_length; // Unit: bytes. Must be <= slice_count * slice_size.
 } __attribute__((packed)) extent_descriptor_t;
 
+constexpr uint64_t kChunkIndexMagic = (0x4b4e484353505346ull); // 'FSPSCHNK'
+
+// Decompressed size of the chunks written by the host tools when chunked
+// compression is requested, and the largest chunk size accepted by readers.
+constexpr uint64_t kSparseChunkSize = (1lu << 18);
+constexpr uint64_t kSparseChunkSizeMax = (1lu << 24);
+
+typedef struct chunk_index {
+    uint64_t magic;
+    uint64_t chunk_size; // Unit: bytes, before compression
+    uint64_t chunk_count;
+} __attribute__((packed)) chunk_index_t;
+
+typedef struct chunk_descriptor {
+    uint64_t compressed_length; // Unit: bytes
+} __attribute__((packed)) chunk_descriptor_t;
+
 } // namespace fvm
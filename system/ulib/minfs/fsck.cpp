@@ -50,6 +50,8 @@ private:
                                ino_t parent, uint32_t flags);
     const char* CheckDataBlock(blk_t bno);
     zx_status_t CheckFile(minfs_inode_t* inode, ino_t ino);
+    zx_status_t CheckExtents(minfs_inode_t* inode, ino_t ino);
+    zx_status_t CheckDirIndex(minfs_inode_t* inode, ino_t ino);
 
     fbl::RefPtr<Minfs> fs_;
     RawBitmap checked_inodes_;
@@ -87,7 +89,8 @@ zx_status_t MinfsChecker::GetInode(minfs_inode_t* inode, ino_t ino) {
     uintptr_t iaddr = reinterpret_cast<uintptr_t>(data + off_of_ino);
 #endif
     memcpy(inode, reinterpret_cast<void*>(iaddr), kMinfsInodeSize);
-    if ((inode->magic != kMinfsMagicFile) && (inode->magic != kMinfsMagicDir)) {
+    if ((inode->magic != kMinfsMagicFile) && (inode->magic != kMinfsMagicDir) &&
+        (inode->magic != kMinfsMagicDirIndex)) {
         FS_TRACE_ERROR("check: ino %u has bad magic %#x\n", ino, inode->magic);
         return ZX_ERR_IO_DATA_INTEGRITY;
     }
@@ -308,7 +311,86 @@ const char* MinfsChecker::CheckDataBlock(blk_t bno) {
     return nullptr;
 }
 
+zx_status_t MinfsChecker::CheckExtents(minfs_inode_t* inode, ino_t ino) {
+    if (fs_->info_.version <= kMinfsVersionBlockMap) {
+        FS_TRACE_WARN("check: ino#%u: extent-mapped inode on version %u volume\n",
+                      ino, fs_->info_.version);
+        conforming_ = false;
+    }
+
+    // Load (and structurally validate) the extent list exactly as the filesystem would.
+    zx_status_t status;
+    fbl::RefPtr<VnodeMinfs> vn;
+    if ((status = VnodeMinfs::Recreate(fs_.get(), ino, inode, &vn)) != ZX_OK) {
+        return status;
+    }
+    if ((status = vn->LoadExtents()) != ZX_OK) {
+        FS_TRACE_ERROR("check: ino#%u: bad extent chain (%u extents)\n",
+                       ino, inode->extent_count);
+        return ZX_ERR_IO_DATA_INTEGRITY;
+    }
+
+    uint32_t block_count = 0;
+    const char* msg;
+    for (size_t n = 0; n < vn->extent_blocks_.size(); n++) {
+        if ((msg = CheckDataBlock(vn->extent_blocks_[n])) != nullptr) {
+            FS_TRACE_WARN("check: ino#%u: extent block %zu(@%u): %s\n",
+                          ino, n, vn->extent_blocks_[n], msg);
+            conforming_ = false;
+        }
+        block_count++;
+    }
+
+    blk_t next_blk = 0;
+    for (size_t n = 0; n < vn->extents_.size(); n++) {
+        const minfs_extent_t& e = vn->extents_[n];
+        xprintf("ino#%u: extent %zu: [%u, %u) @%u\n", ino, n, e.start, e.start + e.count, e.bno);
+        if (e.count == 0 || e.start < next_blk || e.count > kMinfsMaxFileBlock ||
+            e.start > kMinfsMaxFileBlock - e.count) {
+            FS_TRACE_ERROR("check: ino#%u: extent %zu [%u, +%u) unsorted, overlapping or "
+                           "out of range\n", ino, n, e.start, e.count);
+            return ZX_ERR_IO_DATA_INTEGRITY;
+        }
+        if (e.bno >= fs_->info_.block_count || e.count > fs_->info_.block_count - e.bno) {
+            FS_TRACE_ERROR("check: ino#%u: extent %zu @%u+%u out of range\n",
+                           ino, n, e.bno, e.count);
+            return ZX_ERR_IO_DATA_INTEGRITY;
+        }
+        for (uint32_t m = 0; m < e.count; m++) {
+            if ((msg = CheckDataBlock(e.bno + m)) != nullptr) {
+                FS_TRACE_WARN("check: ino#%u: block %u(@%u): %s\n",
+                              ino, e.start + m, e.bno + m, msg);
+                conforming_ = false;
+            }
+        }
+        block_count += e.count;
+        next_blk = e.start + e.count;
+    }
+
+    if (next_blk) {
+        unsigned max_blocks = fbl::round_up(inode->size, kMinfsBlockSize) / kMinfsBlockSize;
+        if (next_blk > max_blocks) {
+            FS_TRACE_WARN("check: ino#%u: filesize too small\n", ino);
+            conforming_ = false;
+        }
+    }
+    if (block_count != inode->block_count) {
+        FS_TRACE_WARN("check: ino#%u: block count %u, actual blocks %u\n",
+             ino, inode->block_count, block_count);
+        conforming_ = false;
+    }
+    return ZX_OK;
+}
+
 zx_status_t MinfsChecker::CheckFile(minfs_inode_t* inode, ino_t ino) {
+    if (inode->flags & ~kMinfsInodeFlagExtents) {
+        FS_TRACE_WARN("check: ino#%u: unknown inode flags %#x\n", ino, inode->flags);
+        conforming_ = false;
+    }
+    if (inode->flags & kMinfsInodeFlagExtents) {
+        return CheckExtents(inode, ino);
+    }
+
     xprintf("Direct blocks: \n");
     for (unsigned n = 0; n < kMinfsDirect; n++) {
         xprintf(" %d,", inode->dnum[n]);
@@ -408,6 +490,125 @@ zx_status_t MinfsChecker::CheckFile(minfs_inode_t* inode, ino_t ino) {
     return ZX_OK;
 }
 
+zx_status_t MinfsChecker::CheckDirIndex(minfs_inode_t* inode, ino_t ino) {
+    if (fs_->info_.version <= kMinfsVersionNoDirIndex) {
+        FS_TRACE_WARN("check: ino#%u: indexed directory on version %u volume\n",
+                      ino, fs_->info_.version);
+        conforming_ = false;
+    }
+
+    // The index is owned by its directory rather than linked from a dirent.
+    const ino_t index_ino = inode->dir_index;
+    minfs_inode_t index_inode;
+    zx_status_t status;
+    if ((status = GetInode(&index_inode, index_ino)) < 0) {
+        FS_TRACE_ERROR("check: ino#%u: dir index ino#%u not readable\n", ino, index_ino);
+        return status;
+    }
+    if (index_inode.magic != kMinfsMagicDirIndex) {
+        FS_TRACE_ERROR("check: ino#%u: dir index ino#%u has bad magic %#x\n",
+                       ino, index_ino, index_inode.magic);
+        return ZX_ERR_IO_DATA_INTEGRITY;
+    }
+    if (checked_inodes_.Get(index_ino, index_ino + 1)) {
+        FS_TRACE_ERROR("check: ino#%u: dir index ino#%u is shared\n", ino, index_ino);
+        return ZX_ERR_IO_DATA_INTEGRITY;
+    }
+    links_[index_ino - 1] += 1 - index_inode.link_count;
+    checked_inodes_.Set(index_ino, index_ino + 1);
+    alloc_inodes_++;
+    if (!fs_->inode_map_.Get(index_ino, index_ino + 1)) {
+        FS_TRACE_WARN("check: ino#%u: not marked in-use\n", index_ino);
+        conforming_ = false;
+    }
+    xprintf("ino#%u: DIR INDEX of ino#%u blks=%u size=%u\n", index_ino, ino,
+            index_inode.block_count, index_inode.size);
+    if ((status = CheckFile(&index_inode, index_ino)) < 0) {
+        return status;
+    }
+
+    fbl::RefPtr<VnodeMinfs> vn;
+    fbl::RefPtr<VnodeMinfs> index;
+    if (((status = VnodeMinfs::Recreate(fs_.get(), ino, inode, &vn)) != ZX_OK) ||
+        ((status = VnodeMinfs::Recreate(fs_.get(), index_ino, &index_inode, &index)) != ZX_OK)) {
+        return status;
+    }
+    minfs_dir_index_header_t hdr;
+    if ((status = index->ReadExactInternal(&hdr, sizeof(hdr), 0)) != ZX_OK) {
+        FS_TRACE_ERROR("check: ino#%u: cannot read dir index header\n", ino);
+        return status;
+    }
+    if (hdr.seq_num != inode->seq_num) {
+        // Not an error: the filesystem rebuilds it on the next modification.
+        FS_TRACE_WARN("check: ino#%u: dir index is stale\n", ino);
+        return ZX_OK;
+    }
+    if ((hdr.magic != kMinfsMagicDirIndex) || (hdr.slot_count == 0) ||
+        (hdr.slot_count & (hdr.slot_count - 1)) || (hdr.entry_count >= hdr.slot_count) ||
+        (index_inode.size < DirIndexSize(hdr.slot_count))) {
+        FS_TRACE_ERROR("check: ino#%u: bad dir index header\n", ino);
+        return ZX_ERR_IO_DATA_INTEGRITY;
+    }
+    fbl::AllocChecker ac;
+    fbl::Array<minfs_dir_index_slot_t> slots(new (&ac) minfs_dir_index_slot_t[hdr.slot_count],
+                                             hdr.slot_count);
+    if (!ac.check()) {
+        return ZX_ERR_NO_MEMORY;
+    }
+    if ((status = index->ReadExactInternal(slots.get(), hdr.slot_count * sizeof(slots[0]),
+                                           DirIndexSize(0))) != ZX_OK) {
+        return status;
+    }
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < hdr.slot_count; i++) {
+        used += (slots[i].loc != 0);
+    }
+
+    // CheckDirectory has already validated the dirents themselves. Each live
+    // one must be reachable by probing from its home slot.
+    const uint32_t mask = hdr.slot_count - 1;
+    uint32_t live = 0;
+    size_t off = 0;
+    while (true) {
+        uint32_t data[DirentSize(NAME_MAX)];
+        size_t actual;
+        if ((status = vn->ReadInternal(data, sizeof(data), off, &actual)) != ZX_OK) {
+            return status;
+        }
+        minfs_dirent_t* de = reinterpret_cast<minfs_dirent_t*>(data);
+        if (de->ino != 0) {
+            uint32_t hash = DirIndexHash(de->name, de->namelen);
+            uint32_t i = hash & mask;
+            uint32_t probes = 0;
+            while ((probes < hdr.slot_count) && (slots[i].loc != 0) &&
+                   ((slots[i].loc != off + 1) || (slots[i].hash != hash))) {
+                probes++;
+                i = (i + 1) & mask;
+            }
+            if ((probes == hdr.slot_count) || (slots[i].loc == 0)) {
+                FS_TRACE_ERROR("check: ino#%u: '%.*s' missing from dir index\n",
+                               ino, de->namelen, de->name);
+                return ZX_ERR_IO_DATA_INTEGRITY;
+            }
+            live++;
+        }
+        if (de->reclen & kMinfsReclenLast) {
+            break;
+        }
+        off += MinfsReclen(de, off);
+    }
+    if (hdr.tail != off) {
+        FS_TRACE_ERROR("check: ino#%u: dir index tail %u != %zu (actual)\n", ino, hdr.tail, off);
+        return ZX_ERR_IO_DATA_INTEGRITY;
+    }
+    if ((used != live) || (hdr.entry_count != live)) {
+        FS_TRACE_ERROR("check: ino#%u: dir index holds %u (claims %u) of %u entries\n",
+                       ino, used, hdr.entry_count, live);
+        return ZX_ERR_IO_DATA_INTEGRITY;
+    }
+    return ZX_OK;
+}
+
 zx_status_t MinfsChecker::CheckInode(ino_t ino, ino_t parent, bool dot_or_dotdot) {
     minfs_inode_t inode;
     zx_status_t status;
@@ -417,6 +618,11 @@ zx_status_t MinfsChecker::CheckInode(ino_t ino, ino_t parent, bool dot_or_dotdot
         return status;
     }
 
+    if (inode.magic == kMinfsMagicDirIndex) {
+        FS_TRACE_ERROR("check: ino#%u: dir index linked into a directory\n", ino);
+        return ZX_ERR_IO_DATA_INTEGRITY;
+    }
+
     bool prev_checked = checked_inodes_.Get(ino, ino + 1);
 
     if (inode.magic == kMinfsMagicDir && prev_checked && !dot_or_dotdot) {
@@ -448,6 +654,9 @@ zx_status_t MinfsChecker::CheckInode(ino_t ino, ino_t parent, bool dot_or_dotdot
         if ((status = CheckDirectory(&inode, ino, parent, CD_DUMP)) < 0) {
             return status;
         }
+        if (inode.dir_index && (status = CheckDirIndex(&inode, ino)) < 0) {
+            return status;
+        }
         if ((status = CheckDirectory(&inode, ino, parent, CD_RECURSE)) < 0) {
             return status;
         }
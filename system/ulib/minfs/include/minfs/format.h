@@ -35,7 +35,13 @@ typedef uint32_t ino_t;
 
 constexpr uint64_t kMinfsMagic0         = (0x002153466e694d21ULL);
 constexpr uint64_t kMinfsMagic1         = (0x385000d3d3d3d304ULL);
-constexpr uint32_t kMinfsVersion        = 0x00000005;
+constexpr uint32_t kMinfsVersion        = 0x00000007;
+// Last version without hashed directory indexes. Volumes of this version are
+// still mounted, but their directories are never indexed.
+constexpr uint32_t kMinfsVersionNoDirIndex = 0x00000006;
+// Last version which only understands direct/indirect block maps. Volumes of
+// this version are still mounted, but never gain extent-mapped inodes.
+constexpr uint32_t kMinfsVersionBlockMap = 0x00000005;
 
 constexpr ino_t kMinfsRootIno           = 1;
 constexpr uint32_t kMinfsFlagClean      = 0x00000001; // Currently unused
@@ -50,6 +56,12 @@ constexpr uint32_t kMinfsIndirect       = 31;
 constexpr uint32_t kMinfsDoublyIndirect = 1;
 
 constexpr uint32_t kMinfsDirectPerIndirect = (kMinfsBlockSize / sizeof(blk_t));
+
+// Inode flags
+constexpr uint32_t kMinfsInodeFlagExtents = 0x00000001; // Blocks are mapped by extents
+
+constexpr uint32_t kMinfsInlineExtents  = 15;
+constexpr uint32_t kMinfsMagicExtent    = 0x45787421;
 // not possible to have a block at or past this one
 // due to the limitations of the inode and indirect blocks
 // constexpr uint64_t kMinfsMaxFileBlock = (kMinfsDirect + (kMinfsIndirect * kMinfsDirectPerIndirect)
@@ -63,10 +75,13 @@ constexpr uint64_t kMinfsMaxFileSize  = kMinfsMaxFileBlock * kMinfsBlockSize;
 
 constexpr uint32_t kMinfsTypeFile = 8;
 constexpr uint32_t kMinfsTypeDir  = 4;
+// Hashed directory indexes; never appears in a dirent.
+constexpr uint32_t kMinfsTypeDirIndex = 0x10;
 
 constexpr uint32_t MinfsMagic(uint32_t T) { return 0xAA6f6e00 | T; }
 constexpr uint32_t kMinfsMagicDir  = MinfsMagic(kMinfsTypeDir);
 constexpr uint32_t kMinfsMagicFile = MinfsMagic(kMinfsTypeFile);
+constexpr uint32_t kMinfsMagicDirIndex = MinfsMagic(kMinfsTypeDirIndex);
 constexpr uint32_t MinfsMagicType(uint32_t n) { return n & 0xFF; }
 
 constexpr size_t kFVMBlockInodeBmStart = 0x10000;
@@ -98,6 +113,14 @@ typedef struct {
     uint32_t dat_slices;    // Slices allocated to file data section
 } minfs_info_t;
 
+// A run of |count| file blocks starting at file-relative block |start|,
+// backed by the data blocks starting at |bno|.
+typedef struct {
+    blk_t start;
+    blk_t bno;
+    uint32_t count;
+} minfs_extent_t;
+
 // Notes:
 // - the ibm, abm, ino, and dat regions must be in that order
 //   and may not overlap
@@ -111,6 +134,10 @@ typedef struct {
 //     ino_block + ino / kMinfsInodesPerBlock
 //   at offset: ino % kMinfsInodesPerBlock
 // - inode 0 is never used, should be marked allocated but ignored
+// - extent-mapped inodes keep their extents sorted by |start| and
+//   non-overlapping; the first kMinfsInlineExtents live in the inode,
+//   the rest in the extent block chain starting at |extent_next|.
+//   Extent blocks are counted in the inode's block_count
 
 typedef struct {
     uint32_t magic;
@@ -122,15 +149,43 @@ typedef struct {
     uint32_t seq_num;               // bumped when modified
     uint32_t gen_num;               // bumped when deleted
     uint32_t dirent_count;          // for directories
-    uint32_t rsvd[5];
-    blk_t dnum[kMinfsDirect];    // direct blocks
-    blk_t inum[kMinfsIndirect];  // indirect blocks
-    blk_t dinum[kMinfsDoublyIndirect]; // doubly indirect blocks
+    uint32_t flags;                 // kMinfsInodeFlag*
+    uint32_t extent_count;          // total extents (inline + spilled)
+    ino_t dir_index;                // for directories: hashed index, or zero
+    uint32_t rsvd[2];
+    union {
+        // Block-mapped inodes (no kMinfsInodeFlagExtents)
+        struct {
+            blk_t dnum[kMinfsDirect];    // direct blocks
+            blk_t inum[kMinfsIndirect];  // indirect blocks
+            blk_t dinum[kMinfsDoublyIndirect]; // doubly indirect blocks
+        };
+        // Extent-mapped inodes (kMinfsInodeFlagExtents)
+        struct {
+            minfs_extent_t extents[kMinfsInlineExtents];
+            blk_t extent_next;      // first extent block, or zero
+            uint32_t extent_rsvd[2];
+        };
+    };
 } minfs_inode_t;
 
 static_assert(sizeof(minfs_inode_t) == kMinfsInodeSize,
               "minfs inode size is wrong");
 
+// Extents which do not fit in the inode spill into a chain of extent blocks.
+constexpr uint32_t kMinfsExtentsPerBlock = (kMinfsBlockSize - 16) / sizeof(minfs_extent_t);
+
+typedef struct {
+    uint32_t magic;                 // kMinfsMagicExtent
+    uint32_t count;                 // extents used in this block
+    blk_t next;                     // next extent block, or zero
+    uint32_t rsvd;
+    minfs_extent_t extents[kMinfsExtentsPerBlock];
+} minfs_extent_block_t;
+
+static_assert(sizeof(minfs_extent_block_t) <= kMinfsBlockSize,
+              "minfs extent block size is wrong");
+
 typedef struct {
     ino_t ino;                      // inode number
     uint32_t reclen;                // Low 28 bits: Length of record
@@ -177,6 +232,46 @@ static_assert(kMinfsMaxDirectorySize <= kMinfsReclenMask,
 //   also increase in size.
 
 
+// Directories with many entries are given a hashed index: an inode of type
+// kMinfsTypeDirIndex, referenced only by the directory's |dir_index|, whose
+// contents are a header followed by an open-addressed (linearly probed) table
+// of slots mapping the hash of each name in the directory to the offset of
+// its dirent. The index is only valid while its |seq_num| matches the
+// directory's; otherwise lookups fall back to scanning the directory, and the
+// index is rebuilt on the next modification.
+constexpr uint32_t kMinfsDirIndexThreshold = 256;   // dirents before indexing
+constexpr uint32_t kMinfsDirIndexMinSlots  = 1024;
+
+typedef struct {
+    uint32_t magic;                 // kMinfsMagicDirIndex
+    uint32_t seq_num;               // seq_num of the indexed directory
+    uint32_t slot_count;            // power of two
+    uint32_t entry_count;           // slots in use
+    uint32_t tail;                  // offset of the directory's last dirent
+    uint32_t rsvd[3];
+} minfs_dir_index_header_t;
+
+typedef struct {
+    uint32_t hash;                  // fnv1a32 of the name
+    uint32_t loc;                   // dirent offset + 1, or zero if free
+} minfs_dir_index_slot_t;
+
+static_assert(sizeof(minfs_dir_index_header_t) % sizeof(minfs_dir_index_slot_t) == 0,
+              "minfs dir index header must be slot aligned");
+
+constexpr size_t DirIndexSize(uint32_t slot_count) {
+    return sizeof(minfs_dir_index_header_t) + slot_count * sizeof(minfs_dir_index_slot_t);
+}
+
+inline uint32_t DirIndexHash(const char* name, size_t len) {
+    return fnv1a32(name, len);
+}
+
+// Notes:
+// - every live dirent (including '.' and '..') has exactly one slot, which is
+//   reachable from slot (hash & (slot_count - 1)) without crossing a free slot
+// - the table is kept at most half full
+
 // blocksize   8K    16K    32K
 // 16 dir =  128K   256K   512K
 // 32 ind =  512M  1024M  2048M
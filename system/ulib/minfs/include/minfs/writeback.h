@@ -11,6 +11,7 @@
 #endif
 
 #include <fbl/algorithm.h>
+#include <fbl/intrusive_double_list.h>
 #include <fbl/intrusive_hash_table.h>
 #include <fbl/intrusive_single_list.h>
 #include <fbl/macros.h>
@@ -61,6 +62,8 @@ public:
     // as a later point in time.
     void Enqueue(zx_handle_t vmo, uint64_t vmo_offset, uint64_t dev_offset, uint64_t nblocks);
     size_t Count() const { return count_; }
+    // Returns true if |count| more requests may be enqueued.
+    bool HasRoom(size_t count) const { return count_ + count < MAX_TXN_MESSAGES - 1; }
     write_request_t* Requests() { return &requests_[0]; }
 
     // Activate the transaction, writing it out to disk.
@@ -93,18 +96,19 @@ using WriteTxn = fs::WriteTxn<kMinfsBlockSize, Bcache>;
 class WritebackWork : public fbl::SinglyLinkedListable<fbl::unique_ptr<WritebackWork>> {
 public:
     WritebackWork(Bcache* bc);
+    ~WritebackWork();
 
     // Return the WritebackWork to the default state that it was in
     // after being created.
     void Reset();
 
 #ifdef __Fuchsia__
-    // Actually transacts the enqueued work, and resets the WritebackWork to
-    // its initial state.
+    // Signals the closure (if any) with the outcome of writing the work to
+    // disk, and resets the WritebackWork to its initial state.
     //
-    // Returns the number of blocks of the writeback buffer that have been
-    // consumed.
-    size_t Complete(zx_handle_t vmo, vmoid_t vmoid);
+    // The WritebackBuffer sends the enqueued requests to disk itself, possibly
+    // merged with those of other works.
+    void Complete(zx_status_t status);
 
     // Adds a closure to the WritebackWork, such that it will be signalled
     // when the WritebackWork is flushed to disk.
@@ -124,7 +128,11 @@ public:
     WriteTxn* txn() { return &txn_; }
 private:
 #ifdef __Fuchsia__
+    friend class WritebackBuffer;
     SyncCallback closure_; // Optional.
+    // The first error from any earlier piece of a work too large to send to
+    // disk in one transaction.
+    zx_status_t split_status_ = ZX_OK;
 #endif
     WriteTxn txn_;
     size_t node_count_;
@@ -136,8 +144,16 @@ private:
 
 #ifdef __Fuchsia__
 
-// WritebackBuffer which manages a writeback buffer (and background thread,
-// which flushes this buffer out to disk).
+// WritebackBuffer which manages a writeback buffer (and background threads,
+// which flush this buffer out to disk).
+//
+// Each background thread takes all the works queued so far, up to the limit
+// of a single block FIFO transaction, and sends them to disk together.
+// Adjacent extents are merged, and blocks rewritten by a later work are only
+// sent once.  Several such batches may be in flight at once, as long as they
+// touch disjoint blocks; batches are retired (freeing their buffer space and
+// signalling their closures) strictly in the order they were enqueued, so a
+// closure still implies that all earlier work is on disk.
 class WritebackBuffer {
 public:
     // Calls constructor, return an error if anything goes wrong.
@@ -175,6 +191,23 @@ private:
     // safely guarantee that space exists within the buffer.
     void CopyToBufferLocked(WriteTxn* txn) __TA_REQUIRES(writeback_lock_);
 
+    // Work which is sent to disk as a single block FIFO transaction.
+    struct Batch;
+
+    // Moves works from the front of |work_queue_| into |batch|, stopping
+    // when a work would not fit in one transaction or when it writes blocks
+    // that a batch in flight is still writing. A work which does not fit
+    // even in an empty batch is split across several.
+    void FillBatchLocked(Batch* batch) __TA_REQUIRES(writeback_lock_);
+
+    // Returns true if any request of |batch| writes blocks which a batch in
+    // flight is also writing.
+    bool OverlapsInFlightLocked(const Batch& batch) const __TA_REQUIRES(writeback_lock_);
+
+    // Retires completed batches from the front of |in_flight_|, releasing
+    // their space in the writeback buffer.
+    void RetireBatchesLocked() __TA_REQUIRES(writeback_lock_);
+
     static int WritebackThread(void* arg);
 
     // The waiter struct may be used as a stack-allocated queue for producers.
@@ -184,16 +217,37 @@ private:
     using WorkQueue = Queue<fbl::unique_ptr<WritebackWork>>;
     using ProducerQueue = Queue<Waiter*>;
 
+    struct Batch : public fbl::DoublyLinkedListable<Batch*> {
+        WorkQueue works;
+        // Requests in units of minfs blocks, no two of which write the same
+        // block.
+        block_fifo_request_t requests[MAX_TXN_MESSAGES];
+        size_t count = 0;
+        // Blocks of the writeback buffer consumed by |works| and |split|.
+        size_t blocks = 0;
+        // A work, still at the front of the work queue, of which this batch
+        // only sends the first requests.
+        WritebackWork* split = nullptr;
+        zx_status_t status = ZX_OK;
+        bool done = false;
+        bool retired = false;
+    };
+
+    // The number of background threads, and so the maximum number of
+    // batches in flight.
+    static constexpr size_t kWritebackThreads = 4;
+
     // Signalled when the writeback buffer can be consumed by the background
-    // thread.
+    // threads, and when a batch is retired.
     cnd_t consumer_cvar_;
     // Signalled when the writeback buffer has space to add txns.
     cnd_t producer_cvar_;
 
-    // Work associated with the "writeback" thread, which manages work items,
-    // and flushes them to disk. This thread acts as a consumer of the
+    // Work associated with the "writeback" threads, which manage work items,
+    // and flush them to disk. These threads act as consumers of the
     // writeback buffer.
-    thrd_t writeback_thrd_;
+    thrd_t writeback_thrds_[kWritebackThreads];
+    size_t thread_count_ = 0;
     Bcache* bc_;
     fbl::Mutex writeback_lock_;
 
@@ -203,6 +257,8 @@ private:
     // Tracks all the pending Writeback Work operations which exist in the
     // writeback buffer and are ready to be sent to disk.
     WorkQueue work_queue_ __TA_GUARDED(writeback_lock_){};
+    // Batches being written to disk, in the order their works were enqueued.
+    fbl::DoublyLinkedList<Batch*> in_flight_ __TA_GUARDED(writeback_lock_){};
     bool unmounting_ __TA_GUARDED(writeback_lock_){false};
     fbl::unique_ptr<MappedVmo> buffer_{};
     vmoid_t buffer_vmoid_ = VMOID_INVALID;
@@ -23,6 +23,7 @@
 #include <fbl/macros.h>
 #include <fbl/ref_ptr.h>
 #include <fbl/unique_ptr.h>
+#include <fbl/vector.h>
 
 #include <fs/block-txn.h>
 #include <fs/mapped-vmo.h>
@@ -53,8 +54,10 @@ namespace minfs {
 
 #ifdef __Fuchsia__
 using RawBitmap = bitmap::RawBitmapGeneric<bitmap::VmoStorage>;
+using SummaryBitmap = bitmap::SummaryBitmapGeneric<bitmap::VmoStorage>;
 #else
 using RawBitmap = bitmap::RawBitmapGeneric<bitmap::DefaultStorage>;
+using SummaryBitmap = bitmap::SummaryBitmapGeneric<bitmap::DefaultStorage>;
 #endif
 
 #ifdef __Fuchsia__
@@ -110,6 +113,11 @@ public:
     // Allocate a new data block.
     zx_status_t BlockNew(WriteTxn* txn, blk_t hint, blk_t* out_bno);
 
+    // Allocate between one and |want| contiguous data blocks, returning the
+    // first in |out_bno| and the run length in |out_count|.
+    zx_status_t BlocksNew(WriteTxn* txn, blk_t hint, blk_t want, blk_t* out_bno,
+                          blk_t* out_count);
+
     // free block in block bitmap
     zx_status_t BlockFree(WriteTxn* txn, blk_t bno);
 
@@ -190,7 +198,9 @@ private:
     uint32_t ibmblks_{};
     uint32_t inoblks_{};
     RawBitmap inode_map_{};
-    RawBitmap block_map_{};
+    // Block allocation searches skip over full regions of the volume using
+    // the summary, which must be refreshed after the bitmap is read in.
+    SummaryBitmap block_map_{};
 
     // Vnodes exist in the hash table as long as one or more reference exists;
     // when the Vnode is deleted, it is immediately removed from the map.
@@ -345,6 +355,38 @@ private:
     static zx_status_t DirentCallbackAppend(fbl::RefPtr<VnodeMinfs>, minfs_dirent_t*, DirArgs*,
                                             DirectoryOffset*);
 
+    // Visits dirents starting at |offs|; the body of |ForEachDirent|.
+    zx_status_t ForEachDirentFrom(DirArgs* args, const DirentCallback func,
+                                  DirectoryOffset* offs);
+
+    // Hashed directory index (see format.h).
+    //
+    // Returns true if the directory has an index which is up to date, loading it if
+    // needed. An index which is missing, stale or damaged is not used, and is rebuilt
+    // (or created, for directories which have grown past kMinfsDirIndexThreshold) by
+    // |DirIndexSync| at the next modification of the directory.
+    bool DirIndexUsable();
+    zx_status_t DirIndexLoad();
+    // Returns ZX_ERR_NOT_FOUND only if the index proves |name| is absent; other
+    // errors mean the directory must be scanned instead.
+    zx_status_t DirIndexFind(fbl::StringPiece name, size_t* off_out);
+    // Record the addition or removal of the dirent for |name| at |off|, or a new
+    // last dirent. Failures mark the index for rebuilding.
+    void DirIndexInsert(WritebackWork* wb, fbl::StringPiece name, size_t off);
+    void DirIndexRemove(WritebackWork* wb, fbl::StringPiece name, size_t off);
+    void DirIndexSetTail(size_t off);
+    // Called once |inode_.seq_num| has been bumped for a modification; |indexed|
+    // is whether the index was usable beforehand.
+    void DirIndexSync(WritebackWork* wb, bool indexed);
+    // Writes |slot| at index |i| in |txn|, unless the transaction is too full.
+    zx_status_t DirIndexWriteSlot(WriteTxn* txn, const minfs_dir_index_slot_t& slot,
+                                  uint32_t i);
+    // Rewrites the whole index from the contents of the directory, in
+    // transactions of its own which are enqueued ahead of the caller's.
+    zx_status_t DirIndexBuild();
+    // Frees the index inode, leaving the directory unindexed.
+    void DirIndexDrop(WriteTxn* txn);
+
     zx_status_t UnlinkChild(WritebackWork* wb, fbl::RefPtr<VnodeMinfs> child,
                             minfs_dirent_t* de, DirectoryOffset* offs);
     // Remove the link to a vnode (referring to inodes exclusively).
@@ -381,6 +423,12 @@ private:
     // Allocate the block if requested with a non-null "txn".
     zx_status_t GetBno(WriteTxn* txn, blk_t n, blk_t* bno);
 
+    // |GetBno| for a write which continues for |remaining| bytes from the start of
+    // block |n|. Extent-mapped files allocate the whole unmapped run at once, and
+    // raise |reserved_end| past the blocks allocated ahead of |n|.
+    zx_status_t GetBnoForWrite(WriteTxn* txn, blk_t n, size_t remaining, blk_t* bno,
+                               blk_t* reserved_end);
+
     // Acquire (or allocate) a direct block |*bno|. If allocation occurs,
     // |*dirty| is set to true, and the inode block is written to disk.
     //
@@ -449,6 +497,34 @@ private:
                                            size_t count, uint32_t dib_vmo_offset,
                                            uint32_t ib_vmo_offset, blk_t* diarray, bool* dirty);
 
+    // Extent-mapped inodes keep their complete, sorted extent list in |extents_|, loaded
+    // on first use from the inode and its chain of extent blocks.
+    bool IsExtentMapped() const { return (inode_.flags & kMinfsInodeFlagExtents) != 0; }
+    zx_status_t LoadExtents();
+
+    // Returns the index of the first extent which ends after file block |n|, or
+    // |extents_.size()| if there is none. Sequential lookups within one extent are O(1).
+    size_t FindExtent(blk_t n);
+
+    // Extent-mapped equivalents of |GetBno| and |BlocksShrink|. Newly allocated blocks are
+    // placed directly after their predecessor when possible, so that appends extend the
+    // last extent rather than adding a new one.
+    //
+    // If block |n| is unmapped, |GetBnoExtent| allocates up to |run| blocks starting at
+    // |n| as one physical run, and returns how many it allocated in |out_allocated|.
+    zx_status_t GetBnoExtent(WriteTxn* txn, blk_t n, blk_t run, blk_t* bno,
+                             blk_t* out_allocated);
+    zx_status_t BlocksShrinkExtents(WriteTxn* txn, blk_t start);
+
+    // Releases the blocks mapped for file blocks [start, end), splitting an extent if
+    // the range falls within it.
+    zx_status_t BlocksUnmapExtents(WriteTxn* txn, blk_t start, blk_t end);
+
+    // Writes |extents_| back to the inode and the extent block chain, growing or shrinking
+    // the chain as needed. Only chain blocks holding extents at index |first_dirty| or
+    // later (or whose |next| link changed) are rewritten.
+    zx_status_t ExtentsSync(WriteTxn* txn, size_t first_dirty);
+
     // Update the vnode's inode and write it to disk.
     void InodeSync(WriteTxn* txn, uint32_t flags);
 
@@ -515,6 +591,9 @@ private:
     //                                                              by doubly indirect blocks
     fbl::unique_ptr<MappedVmo> vmo_indirect_{};
 
+    // Staging area for the extent block chain, one block per entry in |extent_blocks_|.
+    fbl::unique_ptr<MappedVmo> vmo_extents_{};
+
     vmoid_t vmoid_{};
     vmoid_t vmoid_indirect_{};
 
@@ -525,6 +604,18 @@ private:
     ino_t ino_{};
     minfs_inode_t inode_{};
 
+    // Valid once |extents_loaded_|; only used by extent-mapped inodes.
+    fbl::Vector<minfs_extent_t> extents_;
+    fbl::Vector<blk_t> extent_blocks_;
+    size_t extent_cursor_{};
+    bool extents_loaded_{};
+
+    // Only used by directories with |inode_.dir_index|: the index inode once loaded,
+    // and a copy of its header, which is written back by |DirIndexSync|.
+    fbl::RefPtr<VnodeMinfs> dir_index_;
+    minfs_dir_index_header_t dir_index_hdr_{};
+    bool dir_index_rebuild_{};
+
     // This field tracks the current number of file descriptors with
     // an open reference to this Vnode. Notably, this is distinct from the
     // VnodeMinfs's own refcount, since there may still be filesystem
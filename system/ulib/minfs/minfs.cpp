@@ -87,6 +87,7 @@ void minfs_dump_inode(const minfs_inode_t* inode, ino_t ino) {
     xprintf("inode[%u]: size:   %10u\n", ino, inode->size);
     xprintf("inode[%u]: blocks: %10u\n", ino, inode->block_count);
     xprintf("inode[%u]: links:  %10u\n", ino, inode->link_count);
+    xprintf("inode[%u]: flags:  %10u\n", ino, inode->flags);
 }
 
 zx_status_t minfs_check_info(const minfs_info_t* info, Bcache* bc) {
@@ -98,7 +99,8 @@ zx_status_t minfs_check_info(const minfs_info_t* info, Bcache* bc) {
         FS_TRACE_ERROR("minfs: bad magic\n");
         return ZX_ERR_INVALID_ARGS;
     }
-    if (info->version != kMinfsVersion) {
+    if (info->version != kMinfsVersion && info->version != kMinfsVersionNoDirIndex &&
+        info->version != kMinfsVersionBlockMap) {
         FS_TRACE_ERROR("minfs: FS Version: %08x. Driver version: %08x\n", info->version,
               kMinfsVersion);
         return ZX_ERR_INVALID_ARGS;
@@ -315,6 +317,30 @@ zx_status_t Minfs::InoFree(VnodeMinfs* vn, WriteTxn* txn) {
     txn->Enqueue(ibm_id, bitbno, info_.ibm_block + bitbno, 1);
     uint32_t block_count = vn->inode_.block_count;
 
+    if (vn->IsExtentMapped()) {
+        zx_status_t status;
+        if ((status = vn->LoadExtents()) != ZX_OK) {
+            return status;
+        }
+        // release every block of every extent, then the extent blocks themselves
+        for (size_t n = 0; n < vn->extents_.size(); n++) {
+            const minfs_extent_t& e = vn->extents_[n];
+            for (uint32_t m = 0; m < e.count; m++) {
+                block_count--;
+                BlockFree(txn, e.bno + m);
+            }
+        }
+        for (size_t n = 0; n < vn->extent_blocks_.size(); n++) {
+            block_count--;
+            BlockFree(txn, vn->extent_blocks_[n]);
+        }
+
+        CountUpdate(txn);
+        ZX_DEBUG_ASSERT(block_count == 0);
+        ZX_DEBUG_ASSERT(vn->IsUnlinked());
+        return ZX_OK;
+    }
+
     // release all direct blocks
     for (unsigned n = 0; n < kMinfsDirect; n++) {
         if (vn->inode_.dnum[n] == 0) {
@@ -624,7 +650,7 @@ zx_status_t Minfs::InoNew(WriteTxn* txn, const minfs_inode_t* inode, ino_t* ino_
 
 zx_status_t Minfs::VnodeNew(WriteTxn* txn, fbl::RefPtr<VnodeMinfs>* out, uint32_t type) {
     TRACE_DURATION("minfs", "Minfs::VnodeNew");
-    if ((type != kMinfsTypeFile) && (type != kMinfsTypeDir)) {
+    if ((type != kMinfsTypeFile) && (type != kMinfsTypeDir) && (type != kMinfsTypeDirIndex)) {
         return ZX_ERR_INVALID_ARGS;
     }
 
@@ -742,38 +768,64 @@ zx_status_t Minfs::BlockFree(WriteTxn* txn, blk_t bno) {
 // If hint is nonzero it indicates which block number to start the search for
 // free blocks from.
 zx_status_t Minfs::BlockNew(WriteTxn* txn, blk_t hint, blk_t* out_bno) {
+    blk_t count;
+    return BlocksNew(txn, hint, 1, out_bno, &count);
+}
+
+// Allocate a run of between one and |want| physically contiguous data blocks.
+//
+// A run starting exactly at |hint| is preferred, then the first free run of
+// the full length after |hint|, and only then the first free block anywhere.
+zx_status_t Minfs::BlocksNew(WriteTxn* txn, blk_t hint, blk_t want, blk_t* out_bno,
+                             blk_t* out_count) {
+    ZX_DEBUG_ASSERT(want > 0);
     size_t bitoff_start;
     zx_status_t status;
-    if ((status = block_map_.Find(false, hint, block_map_.size(), 1, &bitoff_start)) != ZX_OK) {
-        if ((status = block_map_.Find(false, 0, hint, 1, &bitoff_start)) != ZX_OK) {
-            size_t old_size = block_map_.size();
-            if ((status = AddBlocks()) != ZX_OK) {
-                return status;
-            } else if ((status = block_map_.Find(false, old_size, block_map_.size(),
-                                                 1, &bitoff_start)) != ZX_OK) {
-                return status;
+    if (hint != 0 && hint < block_map_.size() && block_map_.Scan(hint, hint + 1, false) > hint) {
+        bitoff_start = hint;
+    } else if (want == 1 || block_map_.Find(false, hint, block_map_.size(), want,
+                                            &bitoff_start) != ZX_OK) {
+        if ((status = block_map_.Find(false, hint, block_map_.size(), 1,
+                                      &bitoff_start)) != ZX_OK) {
+            if ((status = block_map_.Find(false, 0, hint, 1, &bitoff_start)) != ZX_OK) {
+                size_t old_size = block_map_.size();
+                if ((status = AddBlocks()) != ZX_OK) {
+                    return status;
+                } else if ((status = block_map_.Find(false, old_size, block_map_.size(),
+                                                     1, &bitoff_start)) != ZX_OK) {
+                    return status;
+                }
             }
         }
     }
+    size_t bitoff_end = block_map_.Scan(bitoff_start,
+                                        fbl::min(block_map_.size(), bitoff_start + want), false);
+    ZX_DEBUG_ASSERT(bitoff_end > bitoff_start);
 
-    status = block_map_.Set(bitoff_start, bitoff_start + 1);
+    status = block_map_.Set(bitoff_start, bitoff_end);
     assert(status == ZX_OK);
-    info_.alloc_block_count++;
     blk_t bno = static_cast<blk_t>(bitoff_start);
+    blk_t count = static_cast<blk_t>(bitoff_end - bitoff_start);
+    info_.alloc_block_count += count;
     ValidateBno(bno);
+    ValidateBno(bno + count - 1);
 
-    // obtain the in-memory bitmap block
-    blk_t bmbno_rel = bno / kMinfsBlockBits;       // bmbno relative to bitmap
-    blk_t bmbno_abs = info_.abm_block + bmbno_rel; // bmbno relative to block device
+    // obtain the in-memory bitmap blocks covering the run
+    blk_t bmbno_rel = bno / kMinfsBlockBits; // bmbno relative to bitmap
+    blk_t bmbno_end = (bno + count - 1) / kMinfsBlockBits + 1;
 
 // commit the bitmap
 #ifdef __Fuchsia__
-    txn->Enqueue(block_map_.StorageUnsafe()->GetVmo(), bmbno_rel, bmbno_abs, 1);
+    txn->Enqueue(block_map_.StorageUnsafe()->GetVmo(), bmbno_rel, info_.abm_block + bmbno_rel,
+                 bmbno_end - bmbno_rel);
 #else
-    void* bmdata = fs::GetBlock<kMinfsBlockSize>(block_map_.StorageUnsafe()->GetData(), bmbno_rel);
-    bc_->Writeblk(bmbno_abs, bmdata);
+    for (blk_t i = bmbno_rel; i < bmbno_end; i++) {
+        void* bmdata = fs::GetBlock<kMinfsBlockSize>(block_map_.StorageUnsafe()->GetData(), i);
+        bc_->Writeblk(info_.abm_block + i, bmdata);
+    }
 #endif
     *out_bno = bno;
+    *out_count = count;
 
     CountUpdate(txn);
     return ZX_OK;
@@ -905,6 +957,7 @@ zx_status_t Minfs::Create(fbl::unique_ptr<Bcache> bc, const minfs_info_t* info,
         FS_TRACE_ERROR("Minfs::Create failed to read initial blocks: %d\n", status);
         return status;
     }
+    fs->block_map_.UpdateSummary();
 
     fbl::unique_ptr<MappedVmo> buffer;
     // TODO(smklein): Create max buffer size relative to total RAM size.
@@ -934,6 +987,7 @@ zx_status_t Minfs::Create(fbl::unique_ptr<Bcache> bc, const minfs_info_t* info,
             FS_TRACE_ERROR("minfs: failed reading alloc bitmap\n");
         }
     }
+    fs->block_map_.UpdateSummary();
     for (uint32_t n = 0; n < fs->ibmblks_; n++) {
         void* bmdata = fs::GetBlock<kMinfsBlockSize>(fs->inode_map_.StorageUnsafe()->GetData(), n);
         if (fs->ReadIbm(n, bmdata)) {
@@ -1185,7 +1239,11 @@ zx_status_t Mkfs(fbl::unique_ptr<Bcache> bc) {
     ino[kMinfsRootIno].block_count = 1;
     ino[kMinfsRootIno].link_count = 2;
     ino[kMinfsRootIno].dirent_count = 2;
-    ino[kMinfsRootIno].dnum[0] = 1;
+    ino[kMinfsRootIno].flags = kMinfsInodeFlagExtents;
+    ino[kMinfsRootIno].extent_count = 1;
+    ino[kMinfsRootIno].extents[0].start = 0;
+    ino[kMinfsRootIno].extents[0].bno = 1;
+    ino[kMinfsRootIno].extents[0].count = 1;
     bc->Writeblk(info.ino_block, blk);
 
     memset(blk, 0, sizeof(blk));
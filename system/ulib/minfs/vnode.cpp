@@ -32,6 +32,14 @@
 namespace {
 
 zx_time_t minfs_gettime_utc() {
+#ifndef __Fuchsia__
+    // Host tools stamp files with SOURCE_DATE_EPOCH, when it is set, so that
+    // images built from the same inputs are identical.
+    const char* epoch = getenv("SOURCE_DATE_EPOCH");
+    if (epoch != nullptr) {
+        return ZX_SEC(strtoull(epoch, nullptr, 10));
+    }
+#endif
     // linux/zircon compatible
     struct timespec ts;
     clock_gettime(CLOCK_REALTIME, &ts);
@@ -212,6 +220,10 @@ zx_status_t VnodeMinfs::BlocksShrinkDoublyIndirect(WriteTxn *txn, uint32_t ibind
 // Delete all blocks (relative to a file) from "start" (inclusive) to the end of
 // the file. Does not update mtime/atime.
 zx_status_t VnodeMinfs::BlocksShrink(WriteTxn *txn, blk_t start) {
+    if (IsExtentMapped()) {
+        return BlocksShrinkExtents(txn, start);
+    }
+
     bool dirty = false;
     zx_status_t status = ZX_OK;
     size_t size = (kMinfsIndirect + kMinfsDoublyIndirect) * kMinfsBlockSize;
@@ -379,6 +391,23 @@ zx_status_t VnodeMinfs::InitVmo() {
     }
     ReadTxn txn(fs_->bc_.get());
 
+    if (IsExtentMapped()) {
+        if ((status = LoadExtents()) != ZX_OK) {
+            vmo_.reset();
+            return status;
+        }
+        // Each extent is a single contiguous read.
+        for (size_t i = 0; i < extents_.size(); i++) {
+            const minfs_extent_t& e = extents_[i];
+            fs_->ValidateBno(e.bno);
+            fs_->ValidateBno(e.bno + e.count - 1);
+            txn.Enqueue(vmoid_, e.start, e.bno + fs_->info_.dat_block, e.count);
+        }
+        status = txn.Flush();
+        ValidateVmoTail();
+        return status;
+    }
+
     // Initialize all direct blocks
     blk_t bno;
     for (uint32_t d = 0; d < kMinfsDirect; d++) {
@@ -629,6 +658,11 @@ void VnodeMinfs::ClearIndirectBlock(blk_t bno) {
 
 // Get the bno corresponding to the nth logical block within the file.
 zx_status_t VnodeMinfs::GetBno(WriteTxn* txn, blk_t n, blk_t* bno) {
+    if (IsExtentMapped()) {
+        blk_t allocated;
+        return GetBnoExtent(txn, n, 1, bno, &allocated);
+    }
+
     bool dirty = false;
 
     if (n < kMinfsDirect) {
@@ -685,6 +719,318 @@ zx_status_t VnodeMinfs::GetBno(WriteTxn* txn, blk_t n, blk_t* bno) {
     return ZX_ERR_OUT_OF_RANGE;
 }
 
+zx_status_t VnodeMinfs::LoadExtents() {
+    if (extents_loaded_) {
+        return ZX_OK;
+    }
+
+    const uint32_t count = inode_.extent_count;
+    if (count > kMinfsMaxFileBlock) {
+        return ZX_ERR_IO_DATA_INTEGRITY;
+    }
+    fbl::AllocChecker ac;
+    extents_.reserve(count, &ac);
+    if (!ac.check()) {
+        return ZX_ERR_NO_MEMORY;
+    }
+
+    uint32_t inline_count = fbl::min(count, kMinfsInlineExtents);
+    for (uint32_t i = 0; i < inline_count; i++) {
+        extents_.push_back(inode_.extents[i]);
+    }
+
+    // Walk the chain of extent blocks holding the remainder.
+    blk_t next = inode_.extent_next;
+    zx_status_t status = ZX_OK;
+    while (extents_.size() < count) {
+        if (next == 0 || next >= fs_->info_.block_count) {
+            status = ZX_ERR_IO_DATA_INTEGRITY;
+            break;
+        }
+        uint8_t bdata[kMinfsBlockSize];
+        if ((status = fs_->ReadDat(next, bdata)) != ZX_OK) {
+            break;
+        }
+        const minfs_extent_block_t* eb = reinterpret_cast<const minfs_extent_block_t*>(bdata);
+        if (eb->magic != kMinfsMagicExtent || eb->count == 0 ||
+            eb->count > kMinfsExtentsPerBlock || eb->count > count - extents_.size()) {
+            status = ZX_ERR_IO_DATA_INTEGRITY;
+            break;
+        }
+        extent_blocks_.push_back(next, &ac);
+        if (!ac.check()) {
+            status = ZX_ERR_NO_MEMORY;
+            break;
+        }
+        for (uint32_t i = 0; i < eb->count; i++) {
+            extents_.push_back(eb->extents[i]);
+        }
+        next = eb->next;
+    }
+
+    if (status != ZX_OK) {
+        FS_TRACE_ERROR("minfs: ino#%u: failed to load extents: %d\n", ino_, status);
+        extents_.reset();
+        extent_blocks_.reset();
+        return status;
+    }
+    extent_cursor_ = 0;
+    extents_loaded_ = true;
+    return ZX_OK;
+}
+
+size_t VnodeMinfs::FindExtent(blk_t n) {
+    if (extent_cursor_ < extents_.size()) {
+        const minfs_extent_t& e = extents_[extent_cursor_];
+        if (e.start <= n && n - e.start < e.count) {
+            return extent_cursor_;
+        }
+    }
+
+    size_t lo = 0;
+    size_t hi = extents_.size();
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (extents_[mid].start + extents_[mid].count <= n) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+zx_status_t VnodeMinfs::GetBnoExtent(WriteTxn* txn, blk_t n, blk_t run, blk_t* bno,
+                                     blk_t* out_allocated) {
+    *out_allocated = 0;
+    zx_status_t status;
+    if ((status = LoadExtents()) != ZX_OK) {
+        return status;
+    }
+
+    size_t index = FindExtent(n);
+    if (index < extents_.size() && extents_[index].start <= n) {
+        const minfs_extent_t& e = extents_[index];
+        extent_cursor_ = index;
+        *bno = e.bno + (n - e.start);
+        fs_->ValidateBno(*bno);
+        return ZX_OK;
+    }
+
+    if (txn == nullptr) {
+        *bno = 0;
+        return ZX_OK;
+    }
+
+    // Aim for the block which would keep this file block physically adjacent
+    // to its logical predecessor, and fill as much of the hole before the next
+    // extent as the caller is about to write in one run.
+    minfs_extent_t* prev = index > 0 ? &extents_[index - 1] : nullptr;
+    minfs_extent_t* next = index < extents_.size() ? &extents_[index] : nullptr;
+    blk_t hint = 0;
+    if (prev != nullptr) {
+        hint = prev->bno + (n - prev->start);
+        if (hint >= fs_->info_.block_count) {
+            hint = 0;
+        }
+    }
+    blk_t want = fbl::max(run, 1u);
+    if (next != nullptr) {
+        want = fbl::min(want, next->start - n);
+    }
+
+    blk_t new_bno;
+    blk_t count;
+    if ((status = fs_->BlocksNew(txn, hint, want, &new_bno, &count)) != ZX_OK) {
+        return status;
+    }
+    inode_.block_count += count;
+
+    bool extends_prev = prev != nullptr && prev->start + prev->count == n &&
+                        prev->bno + prev->count == new_bno;
+    bool extends_next = next != nullptr && next->start == n + count &&
+                        next->bno == new_bno + count;
+    size_t first_dirty;
+    if (extends_prev && extends_next) {
+        prev->count += count + next->count;
+        extents_.erase(index);
+        first_dirty = index - 1;
+    } else if (extends_prev) {
+        prev->count += count;
+        first_dirty = index - 1;
+    } else if (extends_next) {
+        next->start -= count;
+        next->bno -= count;
+        next->count += count;
+        first_dirty = index;
+    } else {
+        fbl::AllocChecker ac;
+        minfs_extent_t e = { n, new_bno, count };
+        extents_.insert(index, e, &ac);
+        if (!ac.check()) {
+            for (blk_t i = 0; i < count; i++) {
+                fs_->BlockFree(txn, new_bno + i);
+            }
+            inode_.block_count -= count;
+            return ZX_ERR_NO_MEMORY;
+        }
+        first_dirty = index;
+    }
+
+    if ((status = ExtentsSync(txn, first_dirty)) != ZX_OK) {
+        return status;
+    }
+    extent_cursor_ = first_dirty;
+    *bno = new_bno;
+    *out_allocated = count;
+    return ZX_OK;
+}
+
+zx_status_t VnodeMinfs::BlocksShrinkExtents(WriteTxn* txn, blk_t start) {
+    return BlocksUnmapExtents(txn, start, kMinfsMaxFileBlock);
+}
+
+zx_status_t VnodeMinfs::BlocksUnmapExtents(WriteTxn* txn, blk_t start, blk_t end) {
+    zx_status_t status;
+    if ((status = LoadExtents()) != ZX_OK) {
+        return status;
+    }
+
+    bool dirty = false;
+    size_t first_dirty = extents_.size();
+    size_t index = FindExtent(start);
+    while (index < extents_.size() && extents_[index].start < end) {
+        minfs_extent_t& e = extents_[index];
+        const blk_t e_end = e.start + e.count;
+        const blk_t lo = fbl::max(e.start, start);
+        const blk_t hi = fbl::min(e_end, end);
+        if (lo > e.start && hi < e_end) {
+            // The range punches a hole in the middle of this extent; split off
+            // its tail before releasing anything so that failure is harmless.
+            fbl::AllocChecker ac;
+            minfs_extent_t tail = { hi, e.bno + (hi - e.start), e_end - hi };
+            extents_.insert(index + 1, tail, &ac);
+            if (!ac.check()) {
+                return ZX_ERR_NO_MEMORY;
+            }
+        }
+
+        minfs_extent_t& cur = extents_[index];
+        for (blk_t i = lo; i < hi; i++) {
+            fs_->ValidateBno(cur.bno + (i - cur.start));
+            fs_->BlockFree(txn, cur.bno + (i - cur.start));
+            inode_.block_count--;
+        }
+        dirty = true;
+        first_dirty = fbl::min(first_dirty, index);
+        if (lo == cur.start && hi == cur.start + cur.count) {
+            extents_.erase(index);
+        } else if (lo == cur.start) {
+            cur.bno += hi - cur.start;
+            cur.count -= hi - cur.start;
+            cur.start = hi;
+            index++;
+        } else {
+            cur.count = lo - cur.start;
+            index++;
+        }
+    }
+    extent_cursor_ = 0;
+
+    if (!dirty) {
+        return ZX_OK;
+    }
+    return ExtentsSync(txn, first_dirty);
+}
+
+zx_status_t VnodeMinfs::ExtentsSync(WriteTxn* txn, size_t first_dirty) {
+    const size_t count = extents_.size();
+    const size_t spilled = count > kMinfsInlineExtents ? count - kMinfsInlineExtents : 0;
+    const size_t needed = (spilled + kMinfsExtentsPerBlock - 1) / kMinfsExtentsPerBlock;
+    const size_t old_blocks = extent_blocks_.size();
+
+    size_t first_block = 0;
+    if (first_dirty > kMinfsInlineExtents) {
+        first_block = (first_dirty - kMinfsInlineExtents) / kMinfsExtentsPerBlock;
+    }
+    if (needed != old_blocks) {
+        // The last surviving block of the old chain gets a new |next| link, and
+        // any appended blocks must be written in full.
+        size_t boundary = fbl::min(old_blocks, needed);
+        first_block = fbl::min(first_block, boundary > 0 ? boundary - 1 : 0);
+    }
+
+    zx_status_t status;
+    while (extent_blocks_.size() < needed) {
+        blk_t hint = extent_blocks_.is_empty() ? 0 : extent_blocks_[extent_blocks_.size() - 1];
+        blk_t bno;
+        if ((status = fs_->BlockNew(txn, hint, &bno)) != ZX_OK) {
+            return status;
+        }
+        fbl::AllocChecker ac;
+        extent_blocks_.push_back(bno, &ac);
+        if (!ac.check()) {
+            fs_->BlockFree(txn, bno);
+            return ZX_ERR_NO_MEMORY;
+        }
+        inode_.block_count++;
+    }
+    while (extent_blocks_.size() > needed) {
+        fs_->BlockFree(txn, extent_blocks_[extent_blocks_.size() - 1]);
+        extent_blocks_.pop_back();
+        inode_.block_count--;
+    }
+
+#ifdef __Fuchsia__
+    if (needed > 0) {
+        size_t vmo_size = needed * kMinfsBlockSize;
+        if (vmo_extents_ == nullptr) {
+            if ((status = MappedVmo::Create(vmo_size, "minfs-extents", &vmo_extents_)) != ZX_OK) {
+                return status;
+            }
+        } else if (vmo_extents_->GetSize() < vmo_size) {
+            if ((status = vmo_extents_->Grow(vmo_size)) != ZX_OK) {
+                return status;
+            }
+        }
+    }
+#endif
+
+    for (size_t b = first_block; b < needed; b++) {
+#ifdef __Fuchsia__
+        uintptr_t addr = reinterpret_cast<uintptr_t>(vmo_extents_->GetData()) +
+                         b * kMinfsBlockSize;
+        void* bdata = reinterpret_cast<void*>(addr);
+#else
+        uint8_t bdata[kMinfsBlockSize];
+#endif
+        memset(bdata, 0, kMinfsBlockSize);
+        minfs_extent_block_t* eb = reinterpret_cast<minfs_extent_block_t*>(bdata);
+        size_t first = kMinfsInlineExtents + b * kMinfsExtentsPerBlock;
+        eb->magic = kMinfsMagicExtent;
+        eb->count = static_cast<uint32_t>(fbl::min(count - first,
+                                                   static_cast<size_t>(kMinfsExtentsPerBlock)));
+        eb->next = b + 1 < needed ? extent_blocks_[b + 1] : 0;
+        memcpy(eb->extents, &extents_[first], eb->count * sizeof(minfs_extent_t));
+#ifdef __Fuchsia__
+        txn->Enqueue(vmo_extents_->GetVmo(), b, extent_blocks_[b] + fs_->info_.dat_block, 1);
+#else
+        fs_->bc_->Writeblk(extent_blocks_[b] + fs_->info_.dat_block, bdata);
+#endif
+    }
+
+    // The inline extents live in the inode itself.
+    memset(inode_.extents, 0, sizeof(inode_.extents));
+    size_t inline_count = fbl::min(count, static_cast<size_t>(kMinfsInlineExtents));
+    if (inline_count > 0) {
+        memcpy(inode_.extents, &extents_[0], inline_count * sizeof(minfs_extent_t));
+    }
+    inode_.extent_next = needed > 0 ? extent_blocks_[0] : 0;
+    inode_.extent_count = static_cast<uint32_t>(count);
+    InodeSync(txn, kMxFsSyncDefault);
+    return ZX_OK;
+}
+
 // Immediately stop iterating over the directory.
 #define DIR_CB_DONE 0
 // Access the next direntry in the directory. Offsets updated.
@@ -825,6 +1171,10 @@ zx_status_t VnodeMinfs::UnlinkChild(WritebackWork* wb,
     if ((status = WriteExactInternal(wb->txn(), de, MINFS_DIRENT_SIZE, off)) != ZX_OK) {
         return status;
     }
+    DirIndexRemove(wb, fbl::StringPiece(de->name, de->namelen), offs->off);
+    if (de->reclen & kMinfsReclenLast) {
+        DirIndexSetTail(off);
+    }
 
     if (de->reclen & kMinfsReclenLast) {
         // Truncating the directory merely removed unused space; if it fails,
@@ -980,6 +1330,10 @@ zx_status_t VnodeMinfs::DirentCallbackAppend(fbl::RefPtr<VnodeMinfs> vndir, minf
         if (status != ZX_OK) {
             return status;
         }
+        vndir->DirIndexInsert(args->wb, args->name, off);
+        if (de->reclen & kMinfsReclenLast) {
+            vndir->DirIndexSetTail(off);
+        }
         vndir->inode_.dirent_count++;
         if (args->type == kMinfsTypeDir) {
             // Child directory has '..' which will point to parent directory
@@ -1019,6 +1373,7 @@ zx_status_t VnodeMinfs::DirentCallbackAppend(fbl::RefPtr<VnodeMinfs> vndir, minf
         offs->off += size;
         // create new entry in the remaining space
         char data[kMinfsMaxDirentSize];
+        memset(data, 0, sizeof(data));
         de = (minfs_dirent_t*) data;
         de->reclen = extra | (was_last_record ? kMinfsReclenLast : 0);
         return add_dirent(fbl::move(vndir), de, args, offs->off);
@@ -1038,30 +1393,60 @@ zx_status_t VnodeMinfs::DirentCallbackAppend(fbl::RefPtr<VnodeMinfs> vndir, minf
 //          Since 'func' may create / remove surrounding dirents, it is responsible for
 //          updating the offset information to access the next dirent.
 zx_status_t VnodeMinfs::ForEachDirent(DirArgs* args, const DirentCallback func) {
-    char data[kMinfsMaxDirentSize];
-    minfs_dirent_t* de = (minfs_dirent_t*) data;
     DirectoryOffset offs = {
         .off = 0,
         .off_prev = 0,
     };
-    while (offs.off + MINFS_DIRENT_SIZE < kMinfsMaxDirectorySize) {
-        xprintf("Reading dirent at offset %zd\n", offs.off);
+    // An indexed directory goes straight to the dirent being looked for, and
+    // appends at its tail, only searching the whole directory for free space
+    // once the tail is full. Dirents found through the index have no known
+    // predecessor, so unlinking them does not coalesce backwards.
+    if (DirIndexUsable()) {
+        if (func == DirentCallbackAppend) {
+            offs.off = offs.off_prev = dir_index_hdr_.tail;
+            zx_status_t status = ForEachDirentFrom(args, func, &offs);
+            if (status != ZX_ERR_NOT_FOUND) {
+                return status;
+            }
+            offs.off = offs.off_prev = 0;
+        } else {
+            size_t off;
+            zx_status_t status = DirIndexFind(args->name, &off);
+            if (status == ZX_ERR_NOT_FOUND) {
+                return status;
+            } else if (status == ZX_OK) {
+                offs.off = offs.off_prev = off;
+            }
+        }
+    }
+    return ForEachDirentFrom(args, func, &offs);
+}
+
+zx_status_t VnodeMinfs::ForEachDirentFrom(DirArgs* args, const DirentCallback func,
+                                          DirectoryOffset* offs) {
+    char data[kMinfsMaxDirentSize];
+    minfs_dirent_t* de = (minfs_dirent_t*) data;
+    while (offs->off + MINFS_DIRENT_SIZE < kMinfsMaxDirectorySize) {
+        xprintf("Reading dirent at offset %zd\n", offs->off);
         size_t r;
-        zx_status_t status = ReadInternal(data, kMinfsMaxDirentSize, offs.off, &r);
+        zx_status_t status = ReadInternal(data, kMinfsMaxDirentSize, offs->off, &r);
         if (status != ZX_OK) {
             return status;
-        } else if ((status = validate_dirent(de, r, offs.off)) != ZX_OK) {
+        } else if ((status = validate_dirent(de, r, offs->off)) != ZX_OK) {
             return status;
         }
 
-        switch ((status = func(fbl::RefPtr<VnodeMinfs>(this), de, args, &offs))) {
+        switch ((status = func(fbl::RefPtr<VnodeMinfs>(this), de, args, offs))) {
         case DIR_CB_NEXT:
             break;
-        case DIR_CB_SAVE_SYNC:
+        case DIR_CB_SAVE_SYNC: {
+            bool indexed = DirIndexUsable();
             inode_.seq_num++;
+            DirIndexSync(args->wb, indexed);
             InodeSync(args->wb->txn(), kMxFsSyncMtime);
             args->wb->PinVnode(fbl::move(fbl::WrapRefPtr(this)));
             return ZX_OK;
+        }
         case DIR_CB_DONE:
         default:
             return status;
@@ -1070,6 +1455,345 @@ zx_status_t VnodeMinfs::ForEachDirent(DirArgs* args, const DirentCallback func)
     return ZX_ERR_NOT_FOUND;
 }
 
+// Writing a slot or the header of an existing index touches one index block
+// and the index inode.
+constexpr size_t kDirIndexUpdateRequests = 2;
+// Writing one block of a new index may also allocate it and its indirect
+// blocks, each with its own bitmap block, and update the superblock.
+constexpr size_t kDirIndexBlockRequests = 8;
+
+// Returns true if |count| more requests fit in |txn|. Host transactions are
+// written through as they are enqueued, so they never fill up.
+static bool TxnHasRoom(WriteTxn* txn, size_t count) {
+#ifdef __Fuchsia__
+    return txn->HasRoom(count);
+#else
+    return true;
+#endif
+}
+
+bool VnodeMinfs::DirIndexUsable() {
+    if (inode_.dir_index == 0 || dir_index_rebuild_) {
+        return false;
+    }
+    if (dir_index_ == nullptr && DirIndexLoad() != ZX_OK) {
+        dir_index_rebuild_ = true;
+        return false;
+    }
+    if (dir_index_hdr_.seq_num != inode_.seq_num) {
+        // The directory was modified without updating the index.
+        dir_index_rebuild_ = true;
+        return false;
+    }
+    return true;
+}
+
+zx_status_t VnodeMinfs::DirIndexLoad() {
+    fbl::RefPtr<VnodeMinfs> index;
+    zx_status_t status;
+    if ((status = fs_->VnodeGet(&index, inode_.dir_index)) != ZX_OK) {
+        return status;
+    } else if (index->inode_.magic != kMinfsMagicDirIndex) {
+        FS_TRACE_ERROR("minfs: ino#%u: dir index ino#%u has bad magic %#x\n",
+                       ino_, inode_.dir_index, index->inode_.magic);
+        return ZX_ERR_IO_DATA_INTEGRITY;
+    }
+    dir_index_ = fbl::move(index);
+
+    minfs_dir_index_header_t hdr;
+    if ((status = dir_index_->ReadExactInternal(&hdr, sizeof(hdr), 0)) != ZX_OK) {
+        return status;
+    }
+    if ((hdr.magic != kMinfsMagicDirIndex) || (hdr.slot_count == 0) ||
+        (hdr.slot_count & (hdr.slot_count - 1)) || (hdr.entry_count >= hdr.slot_count) ||
+        (hdr.tail >= kMinfsMaxDirectorySize) ||
+        (dir_index_->inode_.size < DirIndexSize(hdr.slot_count))) {
+        FS_TRACE_ERROR("minfs: ino#%u: bad dir index header\n", ino_);
+        return ZX_ERR_IO_DATA_INTEGRITY;
+    }
+    dir_index_hdr_ = hdr;
+    return ZX_OK;
+}
+
+zx_status_t VnodeMinfs::DirIndexFind(fbl::StringPiece name, size_t* off_out) {
+    char data[kMinfsMaxDirentSize];
+    minfs_dirent_t* de = (minfs_dirent_t*) data;
+    const uint32_t hash = DirIndexHash(name.data(), name.length());
+    const uint32_t mask = dir_index_hdr_.slot_count - 1;
+    uint32_t i = hash & mask;
+    for (uint32_t probes = 0; probes < dir_index_hdr_.slot_count; probes++, i = (i + 1) & mask) {
+        minfs_dir_index_slot_t slot;
+        if (dir_index_->ReadExactInternal(&slot, sizeof(slot), DirIndexSize(i)) != ZX_OK) {
+            break;
+        } else if (slot.loc == 0) {
+            return ZX_ERR_NOT_FOUND;
+        } else if (slot.hash != hash) {
+            continue;
+        }
+        size_t off = slot.loc - 1;
+        size_t r;
+        if ((ReadInternal(data, kMinfsMaxDirentSize, off, &r) != ZX_OK) ||
+            (validate_dirent(de, r, off) != ZX_OK)) {
+            break;
+        }
+        if ((de->ino != 0) && fbl::StringPiece(de->name, de->namelen) == name) {
+            *off_out = off;
+            return ZX_OK;
+        }
+    }
+    FS_TRACE_ERROR("minfs: ino#%u: dir index is damaged\n", ino_);
+    dir_index_rebuild_ = true;
+    return ZX_ERR_IO_DATA_INTEGRITY;
+}
+
+void VnodeMinfs::DirIndexInsert(WritebackWork* wb, fbl::StringPiece name, size_t off) {
+    if (!DirIndexUsable()) {
+        return;
+    }
+    // Keep the table at most half full, growing it by rebuilding.
+    if ((dir_index_hdr_.entry_count + 1) * 2 > dir_index_hdr_.slot_count) {
+        dir_index_rebuild_ = true;
+        return;
+    }
+    const uint32_t hash = DirIndexHash(name.data(), name.length());
+    const uint32_t mask = dir_index_hdr_.slot_count - 1;
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+        minfs_dir_index_slot_t slot;
+        if (dir_index_->ReadExactInternal(&slot, sizeof(slot), DirIndexSize(i)) != ZX_OK) {
+            break;
+        } else if (slot.loc != 0) {
+            continue;
+        }
+        slot.hash = hash;
+        slot.loc = static_cast<uint32_t>(off + 1);
+        if (DirIndexWriteSlot(wb->txn(), slot, i) != ZX_OK) {
+            break;
+        }
+        dir_index_hdr_.entry_count++;
+        wb->PinVnode(dir_index_);
+        return;
+    }
+    dir_index_rebuild_ = true;
+}
+
+void VnodeMinfs::DirIndexRemove(WritebackWork* wb, fbl::StringPiece name, size_t off) {
+    if (!DirIndexUsable()) {
+        return;
+    }
+    const uint32_t hash = DirIndexHash(name.data(), name.length());
+    const uint32_t mask = dir_index_hdr_.slot_count - 1;
+    minfs_dir_index_slot_t slot;
+    uint32_t hole = hash & mask;
+    for (uint32_t probes = 0;; probes++, hole = (hole + 1) & mask) {
+        if ((probes == dir_index_hdr_.slot_count) ||
+            (dir_index_->ReadExactInternal(&slot, sizeof(slot), DirIndexSize(hole)) != ZX_OK) ||
+            (slot.loc == 0)) {
+            dir_index_rebuild_ = true;
+            return;
+        } else if (slot.loc == off + 1) {
+            break;
+        }
+    }
+
+    // Rather than leaving a tombstone, move back any later slot of the same
+    // probe run which can no longer be reached past the hole.
+    for (uint32_t i = (hole + 1) & mask;; i = (i + 1) & mask) {
+        if (dir_index_->ReadExactInternal(&slot, sizeof(slot), DirIndexSize(i)) != ZX_OK) {
+            dir_index_rebuild_ = true;
+            return;
+        } else if (slot.loc == 0) {
+            break;
+        }
+        uint32_t home = slot.hash & mask;
+        bool reachable = (hole <= i) ? (hole < home && home <= i) : (hole < home || home <= i);
+        if (reachable) {
+            continue;
+        }
+        if (DirIndexWriteSlot(wb->txn(), slot, hole) != ZX_OK) {
+            dir_index_rebuild_ = true;
+            return;
+        }
+        hole = i;
+    }
+    memset(&slot, 0, sizeof(slot));
+    if (DirIndexWriteSlot(wb->txn(), slot, hole) != ZX_OK) {
+        dir_index_rebuild_ = true;
+        return;
+    }
+    dir_index_hdr_.entry_count--;
+    wb->PinVnode(dir_index_);
+}
+
+zx_status_t VnodeMinfs::DirIndexWriteSlot(WriteTxn* txn, const minfs_dir_index_slot_t& slot,
+                                          uint32_t i) {
+    // Rather than overflow the operation's transaction, give up on the index
+    // for now; the directory is scanned until it is rebuilt.
+    if (!TxnHasRoom(txn, kDirIndexUpdateRequests)) {
+        return ZX_ERR_NO_RESOURCES;
+    }
+    return dir_index_->WriteExactInternal(txn, &slot, sizeof(slot), DirIndexSize(i));
+}
+
+void VnodeMinfs::DirIndexSetTail(size_t off) {
+    if (DirIndexUsable()) {
+        dir_index_hdr_.tail = static_cast<uint32_t>(off);
+    }
+}
+
+void VnodeMinfs::DirIndexSync(WritebackWork* wb, bool indexed) {
+    if (indexed && !dir_index_rebuild_ && TxnHasRoom(wb->txn(), kDirIndexUpdateRequests)) {
+        dir_index_hdr_.seq_num = inode_.seq_num;
+        if (dir_index_->WriteExactInternal(wb->txn(), &dir_index_hdr_,
+                                           sizeof(dir_index_hdr_), 0) == ZX_OK) {
+            wb->PinVnode(dir_index_);
+            return;
+        }
+    } else if ((fs_->info_.version <= kMinfsVersionNoDirIndex) ||
+               (inode_.dir_index == 0 && inode_.dirent_count < kMinfsDirIndexThreshold)) {
+        return;
+    }
+    if (DirIndexBuild() != ZX_OK) {
+        FS_TRACE_WARN("minfs: ino#%u: cannot index directory; falling back to scanning it\n",
+                      ino_);
+        // Freeing the index touches as many blocks as writing it did.
+        fbl::AllocChecker ac;
+        fbl::unique_ptr<WritebackWork> work(new (&ac) WritebackWork(fs_->bc_.get()));
+        if (!ac.check()) {
+            DirIndexDrop(wb->txn());
+            return;
+        }
+        DirIndexDrop(work->txn());
+        fs_->EnqueueWork(fbl::move(work));
+    }
+}
+
+zx_status_t VnodeMinfs::DirIndexBuild() {
+    uint32_t slot_count = kMinfsDirIndexMinSlots;
+    while (slot_count < inode_.dirent_count * 4) {
+        slot_count *= 2;
+    }
+    const size_t len = DirIndexSize(slot_count);
+    fbl::AllocChecker ac;
+    fbl::unique_ptr<uint8_t[]> table(new (&ac) uint8_t[len]());
+    if (!ac.check()) {
+        return ZX_ERR_NO_MEMORY;
+    }
+    auto hdr = reinterpret_cast<minfs_dir_index_header_t*>(table.get());
+    auto slots = reinterpret_cast<minfs_dir_index_slot_t*>(hdr + 1);
+    hdr->magic = kMinfsMagicDirIndex;
+    hdr->seq_num = inode_.seq_num;
+    hdr->slot_count = slot_count;
+
+    char data[kMinfsMaxDirentSize];
+    minfs_dirent_t* de = (minfs_dirent_t*) data;
+    zx_status_t status;
+    size_t off = 0;
+    while (true) {
+        if (off + MINFS_DIRENT_SIZE >= kMinfsMaxDirectorySize) {
+            return ZX_ERR_IO_DATA_INTEGRITY;
+        }
+        size_t r;
+        if ((status = ReadInternal(data, kMinfsMaxDirentSize, off, &r)) != ZX_OK) {
+            return status;
+        } else if ((status = validate_dirent(de, r, off)) != ZX_OK) {
+            return status;
+        }
+        if (de->ino != 0) {
+            if ((hdr->entry_count + 1) * 2 > slot_count) {
+                // More dirents than |dirent_count| claims.
+                return ZX_ERR_IO_DATA_INTEGRITY;
+            }
+            uint32_t hash = DirIndexHash(de->name, de->namelen);
+            uint32_t i = hash & (slot_count - 1);
+            while (slots[i].loc != 0) {
+                i = (i + 1) & (slot_count - 1);
+            }
+            slots[i].hash = hash;
+            slots[i].loc = static_cast<uint32_t>(off + 1);
+            hdr->entry_count++;
+        }
+        if (de->reclen & kMinfsReclenLast) {
+            hdr->tail = static_cast<uint32_t>(off);
+            break;
+        }
+        off += MinfsReclen(de, off);
+    }
+
+    // The table can run to hundreds of blocks, scattered over a fragmented
+    // volume, which is far more than fits in the transaction of the operation
+    // that triggered the build. It is written out ahead of that operation in
+    // a series of transactions of its own, each ended before it could
+    // overflow. The header carries the directory's new seq_num, which only
+    // reaches the disk with the operation, so a partially written index is
+    // never trusted.
+    fbl::unique_ptr<WritebackWork> piece;
+    auto next_piece = [this, &piece]() -> zx_status_t {
+        fbl::AllocChecker ac;
+        piece.reset(new (&ac) WritebackWork(fs_->bc_.get()));
+        return ac.check() ? ZX_OK : ZX_ERR_NO_MEMORY;
+    };
+    auto flush_piece = [this, &piece](fbl::RefPtr<VnodeMinfs> vn) {
+        if (vn != nullptr) {
+            piece->PinVnode(fbl::move(vn));
+        }
+        fs_->EnqueueWork(fbl::move(piece));
+    };
+    if ((status = next_piece()) != ZX_OK) {
+        return status;
+    }
+
+    fbl::RefPtr<VnodeMinfs> index = dir_index_;
+    if (index == nullptr &&
+        (status = fs_->VnodeNew(piece->txn(), &index, kMinfsTypeDirIndex)) != ZX_OK) {
+        flush_piece(nullptr);
+        return status;
+    }
+    // Hold on to a new index even if writing it fails, so that it gets dropped.
+    inode_.dir_index = index->ino_;
+    dir_index_ = index;
+    for (size_t done = 0; done < len; done += kMinfsBlockSize) {
+        if (!TxnHasRoom(piece->txn(), kDirIndexBlockRequests)) {
+            flush_piece(index);
+            if ((status = next_piece()) != ZX_OK) {
+                return status;
+            }
+        }
+        size_t n = fbl::min(len - done, static_cast<size_t>(kMinfsBlockSize));
+        if ((status = index->WriteExactInternal(piece->txn(), table.get() + done, n,
+                                                done)) != ZX_OK) {
+            flush_piece(index);
+            return status;
+        }
+    }
+    if (index->inode_.size > len) {
+        // The table never shrinks, but the previous index may have been damaged.
+        flush_piece(index);
+        if ((status = next_piece()) != ZX_OK) {
+            return status;
+        }
+        index->TruncateInternal(piece->txn(), len);
+    }
+    index->InodeSync(piece->txn(), kMxFsSyncMtime);
+    flush_piece(index);
+    dir_index_hdr_ = *hdr;
+    dir_index_rebuild_ = false;
+    return ZX_OK;
+}
+
+void VnodeMinfs::DirIndexDrop(WriteTxn* txn) {
+    if (dir_index_ == nullptr && inode_.dir_index != 0) {
+        // Only an inode which really is an index may be freed along with it.
+        DirIndexLoad();
+    }
+    if (dir_index_ != nullptr) {
+        dir_index_->inode_.link_count = 0;
+        dir_index_->Purge(txn);
+        dir_index_.reset();
+    }
+    inode_.dir_index = 0;
+    dir_index_rebuild_ = false;
+}
+
 void VnodeMinfs::fbl_recycle() {
     if (fd_count_ != 0 || !IsUnlinked()) {
         // If this node has not been purged already, remove it from the
@@ -1128,13 +1852,16 @@ zx_status_t VnodeMinfs::Open(uint32_t flags, fbl::RefPtr<Vnode>* out_redirect) {
 void VnodeMinfs::Purge(WriteTxn* txn) {
     ZX_DEBUG_ASSERT(fd_count_ == 0);
     ZX_DEBUG_ASSERT(IsUnlinked());
+    if (IsDirectory()) {
+        DirIndexDrop(txn);
+    }
 #ifdef __Fuchsia__
     {
         fbl::AutoLock lock(&fs_->hash_lock_);
         fs_->VnodeReleaseLocked(this);
     }
     // TODO(smklein): Only init indirect vmo if it's needed
-    if (InitIndirectVmo() == ZX_OK) {
+    if (IsExtentMapped() || InitIndirectVmo() == ZX_OK) {
         fs_->InoFree(this, txn);
     } else {
         fprintf(stderr, "minfs: Failed to Init Indirect VMO while purging %u\n", ino_);
@@ -1253,6 +1980,22 @@ zx_status_t VnodeMinfs::Write(const void* data, size_t len, size_t offset,
     return ZX_OK;
 }
 
+zx_status_t VnodeMinfs::GetBnoForWrite(WriteTxn* txn, blk_t n, size_t remaining, blk_t* bno,
+                                       blk_t* reserved_end) {
+    if (!IsExtentMapped()) {
+        return GetBno(txn, n, bno);
+    }
+
+    size_t run = fbl::min((remaining + kMinfsBlockSize - 1) / kMinfsBlockSize,
+                          static_cast<size_t>(kMinfsMaxFileBlock - n));
+    blk_t allocated;
+    zx_status_t status = GetBnoExtent(txn, n, static_cast<blk_t>(run), bno, &allocated);
+    if (status == ZX_OK) {
+        *reserved_end = fbl::max(*reserved_end, n + allocated);
+    }
+    return status;
+}
+
 zx_status_t VnodeMinfs::Append(const void* data, size_t len, size_t* out_end,
                                size_t* out_actual) {
     zx_status_t status = Write(data, len, inode_.size, out_actual);
@@ -1279,6 +2022,7 @@ zx_status_t VnodeMinfs::WriteInternal(WriteTxn* txn, const void* data,
     const void* const start = data;
     uint32_t n = static_cast<uint32_t>(off / kMinfsBlockSize);
     size_t adjust = off % kMinfsBlockSize;
+    blk_t reserved_end = 0;
 
     while ((len > 0) && (n < kMinfsMaxFileBlock)) {
         size_t xfer;
@@ -1305,14 +2049,14 @@ zx_status_t VnodeMinfs::WriteInternal(WriteTxn* txn, const void* data,
 
         // Update this block on-disk
         blk_t bno;
-        if ((status = GetBno(txn, n, &bno)) != ZX_OK) {
+        if ((status = GetBnoForWrite(txn, n, adjust + len, &bno, &reserved_end)) != ZX_OK) {
             goto done;
         }
         ZX_DEBUG_ASSERT(bno != 0);
         txn->Enqueue(vmo_.get(), n, bno + fs_->info_.dat_block, 1);
 #else
         blk_t bno;
-        if ((status = GetBno(txn, n, &bno)) != ZX_OK) {
+        if ((status = GetBnoForWrite(txn, n, adjust + len, &bno, &reserved_end)) != ZX_OK) {
             goto done;
         }
         ZX_DEBUG_ASSERT(bno != 0);
@@ -1336,6 +2080,11 @@ zx_status_t VnodeMinfs::WriteInternal(WriteTxn* txn, const void* data,
     }
 
 done:
+    if (reserved_end > n) {
+        // Don't leave blocks allocated ahead of a failed write mapped with
+        // whatever they last held on disk.
+        BlocksUnmapExtents(txn, n, reserved_end);
+    }
     len = (uintptr_t)data - (uintptr_t)start;
     if (len == 0) {
         // If more than zero bytes were requested, but zero bytes were written,
@@ -1530,6 +2279,10 @@ zx_status_t VnodeMinfs::Allocate(Minfs* fs, uint32_t type, fbl::RefPtr<VnodeMinf
     (*out)->inode_.magic = MinfsMagic(type);
     (*out)->inode_.create_time = (*out)->inode_.modify_time = minfs_gettime_utc();
     (*out)->inode_.link_count = (type == kMinfsTypeDir ? 2 : 1);
+    // Volumes which predate extents must stay readable by older drivers.
+    if (fs->info_.version > kMinfsVersionBlockMap) {
+        (*out)->inode_.flags = kMinfsInodeFlagExtents;
+    }
     return ZX_OK;
 }
 
@@ -1582,6 +2335,7 @@ zx_status_t VnodeMinfs::Create(fbl::RefPtr<fs::Vnode>* out, fbl::StringPiece nam
     // If the new node is a directory, fill it with '.' and '..'.
     if (type == kMinfsTypeDir) {
         char bdata[DirentSize(1) + DirentSize(2)];
+        memset(bdata, 0, sizeof(bdata));
         minfs_dir_init(bdata, vn->ino_, ino_);
         size_t expected = DirentSize(1) + DirentSize(2);
         if (vn->WriteExactInternal(wb->txn(), bdata, expected, 0) != ZX_OK) {
@@ -102,10 +102,15 @@ WritebackWork::WritebackWork(Bcache* bc) :
 #endif
     txn_(bc), node_count_(0) {}
 
+// Defined here, where VnodeMinfs is complete, so the header can be used on
+// its own.
+WritebackWork::~WritebackWork() = default;
+
 void WritebackWork::Reset() {
 #ifdef __Fuchsia__
     ZX_DEBUG_ASSERT(txn_.Count() == 0);
     closure_ = nullptr;
+    split_status_ = ZX_OK;
 #endif
     while (0 < node_count_) {
         vn_[--node_count_] = nullptr;
@@ -113,16 +118,14 @@ void WritebackWork::Reset() {
 }
 
 #ifdef __Fuchsia__
-// Returns the number of blocks of the writeback buffer that have been
-// consumed
-size_t WritebackWork::Complete(zx_handle_t vmo, vmoid_t vmoid) {
-    size_t blk_count = txn_.BlkCount();
-    zx_status_t status = txn_.Flush(vmo, vmoid);
+void WritebackWork::Complete(zx_status_t status) {
+    if (split_status_ != ZX_OK) {
+        status = split_status_;
+    }
     if (closure_) {
         closure_(status);
     }
     Reset();
-    return blk_count;
 }
 
 void WritebackWork::SetClosure(SyncCallback closure) {
@@ -160,10 +163,13 @@ zx_status_t WritebackBuffer::Create(Bcache* bc, fbl::unique_ptr<MappedVmo> buffe
         return ZX_ERR_NO_RESOURCES;
     } else if (cnd_init(&wb->producer_cvar_) != thrd_success) {
         return ZX_ERR_NO_RESOURCES;
-    } else if (thrd_create_with_name(&wb->writeback_thrd_,
-                                     WritebackBuffer::WritebackThread, wb.get(),
-                                     "minfs-writeback") != thrd_success) {
-        return ZX_ERR_NO_RESOURCES;
+    }
+    for (; wb->thread_count_ < kWritebackThreads; wb->thread_count_++) {
+        if (thrd_create_with_name(&wb->writeback_thrds_[wb->thread_count_],
+                                  WritebackBuffer::WritebackThread, wb.get(),
+                                  "minfs-writeback") != thrd_success) {
+            return ZX_ERR_NO_RESOURCES;
+        }
     }
     zx_status_t status = wb->bc_->AttachVmo(wb->buffer_->GetVmo(), &wb->buffer_vmoid_);
     if (status != ZX_OK) {
@@ -179,14 +185,16 @@ WritebackBuffer::WritebackBuffer(Bcache* bc, fbl::unique_ptr<MappedVmo> buffer)
     cap_(buffer_->GetSize() / kMinfsBlockSize) {}
 
 WritebackBuffer::~WritebackBuffer() {
-    // Block until the background thread completes itself.
+    // Block until the background threads complete themselves.
     {
         fbl::AutoLock lock(&writeback_lock_);
         unmounting_ = true;
-        cnd_signal(&consumer_cvar_);
+        cnd_broadcast(&consumer_cvar_);
+    }
+    for (size_t i = 0; i < thread_count_; i++) {
+        int r;
+        thrd_join(writeback_thrds_[i], &r);
     }
-    int r;
-    thrd_join(writeback_thrd_, &r);
 
     if (buffer_vmoid_ != VMOID_INVALID) {
         block_fifo_request_t request;
@@ -315,39 +323,217 @@ void WritebackBuffer::Enqueue(fbl::unique_ptr<WritebackWork> work) {
     cnd_signal(&consumer_cvar_);
 }
 
+namespace {
+
+// Adds a write of |length| blocks, from |vmo_offset| in the writeback buffer
+// to |dev_offset| on disk, to the |*count| requests in |reqs|.
+//
+// Any blocks which the existing requests also write are dropped from them,
+// since the new request holds the latest contents of those blocks. As a
+// result no two requests overlap, and the device may execute them in any
+// order.
+//
+// Returns false, leaving |reqs| unmodified, if there is no room for the new
+// request.
+bool AddRequest(block_fifo_request_t* reqs, size_t* count, uint64_t vmo_offset,
+                uint64_t dev_offset, uint64_t length) {
+    block_fifo_request_t out[MAX_TXN_MESSAGES];
+    size_t n = 0;
+    const uint64_t dev_end = dev_offset + length;
+    for (size_t i = 0; i < *count; i++) {
+        const block_fifo_request_t& r = reqs[i];
+        const uint64_t r_end = r.dev_offset + r.length;
+        if (r_end <= dev_offset || dev_end <= r.dev_offset) {
+            if (n == MAX_TXN_MESSAGES) {
+                return false;
+            }
+            out[n++] = r;
+            continue;
+        }
+        // Keep whatever part of |r| lies below and above the new request.
+        if (r.dev_offset < dev_offset) {
+            if (n == MAX_TXN_MESSAGES) {
+                return false;
+            }
+            out[n] = r;
+            out[n++].length = dev_offset - r.dev_offset;
+        }
+        if (dev_end < r_end) {
+            if (n == MAX_TXN_MESSAGES) {
+                return false;
+            }
+            out[n] = r;
+            out[n].vmo_offset += dev_end - r.dev_offset;
+            out[n].dev_offset = dev_end;
+            out[n++].length = r_end - dev_end;
+        }
+    }
+
+    // Extend a request which the new one immediately follows or precedes, in
+    // both the buffer and on disk.
+    bool merged = false;
+    for (size_t i = 0; i < n && !merged; i++) {
+        block_fifo_request_t& r = out[i];
+        if (r.vmo_offset + r.length == vmo_offset && r.dev_offset + r.length == dev_offset) {
+            r.length += length;
+            merged = true;
+        } else if (vmo_offset + length == r.vmo_offset && dev_end == r.dev_offset) {
+            r.vmo_offset = vmo_offset;
+            r.dev_offset = dev_offset;
+            r.length += length;
+            merged = true;
+        }
+    }
+    if (!merged) {
+        if (n == MAX_TXN_MESSAGES) {
+            return false;
+        }
+        out[n].vmo_offset = vmo_offset;
+        out[n].dev_offset = dev_offset;
+        out[n++].length = length;
+    }
+
+    memcpy(reqs, out, n * sizeof(block_fifo_request_t));
+    *count = n;
+    return true;
+}
+
+} // namespace
+
+void WritebackBuffer::FillBatchLocked(Batch* batch) {
+    while (!work_queue_.is_empty()) {
+        WritebackWork* work = &work_queue_.front();
+        WriteTxn* txn = work->txn();
+
+        // Add the work's requests to a copy of the batch, so nothing changes
+        // if the work doesn't fit.
+        Batch candidate;
+        memcpy(candidate.requests, batch->requests, batch->count * sizeof(block_fifo_request_t));
+        candidate.count = batch->count;
+        size_t added = 0;
+        while (added < txn->Count() &&
+               AddRequest(candidate.requests, &candidate.count, txn->Requests()[added].vmo_offset,
+                          txn->Requests()[added].dev_offset, txn->Requests()[added].length)) {
+            added++;
+        }
+        if ((added < txn->Count() && batch->count > 0) || OverlapsInFlightLocked(candidate)) {
+            return;
+        }
+
+        memcpy(batch->requests, candidate.requests,
+               candidate.count * sizeof(block_fifo_request_t));
+        batch->count = candidate.count;
+        for (size_t i = 0; i < added; i++) {
+            batch->blocks += txn->Requests()[i].length;
+        }
+        if (added < txn->Count()) {
+            // Even an empty batch can't hold this work, since its requests
+            // split each other into more pieces than one transaction holds.
+            // Send the requests which fit now, and leave the rest of the work
+            // at the front of the queue; it completes with its last piece.
+            static_assert(fbl::is_pod<write_request_t>::value, "Can't memmove non-POD");
+            memmove(txn->Requests(), txn->Requests() + added,
+                    (txn->Count() - added) * sizeof(write_request_t));
+            txn->count_ -= added;
+            batch->split = work;
+            return;
+        }
+        txn->count_ = 0;
+        batch->works.push(work_queue_.pop());
+    }
+}
+
+bool WritebackBuffer::OverlapsInFlightLocked(const Batch& batch) const {
+    for (const auto& other : in_flight_) {
+        for (size_t i = 0; i < other.count; i++) {
+            const block_fifo_request_t& a = other.requests[i];
+            for (size_t j = 0; j < batch.count; j++) {
+                const block_fifo_request_t& b = batch.requests[j];
+                if (a.dev_offset < b.dev_offset + b.length &&
+                    b.dev_offset < a.dev_offset + a.length) {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+void WritebackBuffer::RetireBatchesLocked() {
+    bool retired = false;
+    while (!in_flight_.is_empty() && in_flight_.front().done) {
+        Batch* batch = in_flight_.pop_front();
+        start_ = (start_ + batch->blocks) % cap_;
+        len_ -= batch->blocks;
+        batch->retired = true;
+        retired = true;
+    }
+    if (retired) {
+        cnd_signal(&producer_cvar_);
+        // Wake both the owners of the retired batches, and any thread waiting
+        // for them to finish before it can send its own.
+        cnd_broadcast(&consumer_cvar_);
+    }
+}
+
 int WritebackBuffer::WritebackThread(void* arg) {
     WritebackBuffer* b = reinterpret_cast<WritebackBuffer*>(arg);
+    const uint32_t kDiskBlocksPerMinfsBlock = kMinfsBlockSize / b->bc_->BlockSize();
 
     b->writeback_lock_.Acquire();
     while (true) {
-        while (!b->work_queue_.is_empty()) {
-            auto work = b->work_queue_.pop();
-            TRACE_DURATION("minfs", "WritebackBuffer::WritebackThread");
-
-            // Stay unlocked while processing a unit of work
-            b->writeback_lock_.Release();
+        Batch batch;
+        b->FillBatchLocked(&batch);
+        if (batch.works.is_empty() && batch.split == nullptr) {
+            // Before waiting, we should check if we're unmounting.
+            if (b->unmounting_ && b->work_queue_.is_empty()) {
+                b->writeback_lock_.Release();
+                b->bc_->FreeTxnId();
+                return 0;
+            }
+            cnd_wait(&b->consumer_cvar_, b->writeback_lock_.GetInternal());
+            continue;
+        }
+        b->in_flight_.push_back(&batch);
 
-            // TODO(smklein): We could add additional validation that the blocks
-            // in "work" are contiguous and in the range of [start_, len_) (including
-            // wraparound).
-            size_t blks_consumed = work->Complete(b->buffer_->GetVmo(), b->buffer_vmoid_);
-            TRACE_FLOW_END("minfs", "writeback", reinterpret_cast<trace_flow_id_t>(work.get()));
-            work = nullptr;
+        // Stay unlocked while sending the batch to disk
+        b->writeback_lock_.Release();
+        {
+            TRACE_DURATION("minfs", "WritebackBuffer::WritebackThread");
+            // Build the outgoing requests in "disk blocks", not "Minfs
+            // blocks". The batch itself must not change while it is in
+            // flight, since other threads compare against it.
+            block_fifo_request_t blk_reqs[MAX_TXN_MESSAGES];
+            for (size_t i = 0; i < batch.count; i++) {
+                blk_reqs[i].txnid = b->bc_->TxnId();
+                blk_reqs[i].vmoid = b->buffer_vmoid_;
+                blk_reqs[i].opcode = BLOCKIO_WRITE;
+                blk_reqs[i].vmo_offset = batch.requests[i].vmo_offset * kDiskBlocksPerMinfsBlock;
+                blk_reqs[i].dev_offset = batch.requests[i].dev_offset * kDiskBlocksPerMinfsBlock;
+                blk_reqs[i].length = batch.requests[i].length * kDiskBlocksPerMinfsBlock;
+            }
+            batch.status = b->bc_->Txn(blk_reqs, batch.count);
+        }
+        b->writeback_lock_.Acquire();
 
-            // Relock before checking the state of the queue
-            b->writeback_lock_.Acquire();
-            b->start_ = (b->start_ + blks_consumed) % b->cap_;
-            b->len_ -= blks_consumed;
-            cnd_signal(&b->producer_cvar_);
+        // Batches finish in any order, but are retired in the order they
+        // were sent, so that a completion implies all earlier work is on disk.
+        if (batch.split != nullptr && batch.status != ZX_OK) {
+            batch.split->split_status_ = batch.status;
+        }
+        batch.done = true;
+        b->RetireBatchesLocked();
+        while (!batch.retired) {
+            cnd_wait(&b->consumer_cvar_, b->writeback_lock_.GetInternal());
         }
 
-        // Before waiting, we should check if we're unmounting.
-        if (b->unmounting_) {
-            b->writeback_lock_.Release();
-            b->bc_->FreeTxnId();
-            return 0;
+        b->writeback_lock_.Release();
+        while (!batch.works.is_empty()) {
+            auto work = batch.works.pop();
+            work->Complete(batch.status);
+            TRACE_FLOW_END("minfs", "writeback", reinterpret_cast<trace_flow_id_t>(work.get()));
         }
-        cnd_wait(&b->consumer_cvar_, b->writeback_lock_.GetInternal());
+        b->writeback_lock_.Acquire();
     }
 }
 
@@ -0,0 +1,88 @@
+// Copyright 2018 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <bitmap/raw-bitmap.h>
+#include <bitmap/storage.h>
+#include <zircon/syscalls.h>
+
+#include "bench.h"
+
+namespace {
+
+using RawBitmap = bitmap::RawBitmapGeneric<bitmap::DefaultStorage>;
+using SummaryBitmap = bitmap::SummaryBitmapGeneric<bitmap::DefaultStorage>;
+
+constexpr size_t kSize = 1 << 24;
+constexpr int kIterations = 100;
+
+zx_time_t ticks_to_ns(uint64_t ticks) {
+    __uint128_t temp = (__uint128_t)ticks * ZX_SEC(1) / zx_ticks_per_second();
+    return (zx_time_t)temp;
+}
+
+// Fills the bitmap the way an allocator that has been running a while tends
+// to: everything below |full| is allocated except for one free bit every
+// |hole_stride| bits, and the rest is free.
+template <typename Bitmap>
+bool Fill(Bitmap* bitmap, size_t full, size_t hole_stride) {
+    if (bitmap->Reset(kSize) != ZX_OK || bitmap->Set(0, full) != ZX_OK) {
+        return false;
+    }
+    if (hole_stride != 0) {
+        for (size_t i = hole_stride - 1; i < full; i += hole_stride) {
+            bitmap->ClearOne(i);
+        }
+    }
+    return true;
+}
+
+// Returns the average time taken to find a free run of |run_len| bits.
+template <typename Bitmap>
+zx_time_t TimeFind(const Bitmap& bitmap, size_t run_len) {
+    size_t out = 0;
+    uint64_t ticks = zx_ticks_get();
+    for (int i = 0; i < kIterations; i++) {
+        bitmap.Find(false, 0, kSize, run_len, &out);
+    }
+    ticks = zx_ticks_get() - ticks;
+    return ticks_to_ns(ticks) / kIterations;
+}
+
+template <typename Bitmap>
+bool Run(const char* name, size_t full, size_t hole_stride, size_t run_len) {
+    Bitmap bitmap;
+    if (!Fill(&bitmap, full, hole_stride)) {
+        printf("\tfailed to set up %s bitmap\n", name);
+        return false;
+    }
+    zx_time_t t = TimeFind(bitmap, run_len);
+    printf("\t%-8s took %" PRIu64 " nsecs to find %zu free bits in %zu bits, "
+           "%zu full, hole every %zu\n", name, t, run_len, kSize, full, hole_stride);
+    return true;
+}
+
+bool RunBoth(size_t full, size_t hole_stride, size_t run_len) {
+    return Run<RawBitmap>("raw", full, hole_stride, run_len) &&
+           Run<SummaryBitmap>("summary", full, hole_stride, run_len);
+}
+
+} // namespace
+
+int bitmap_run_benchmark(void) {
+    printf("starting bitmap benchmark\n");
+
+    // Free space only at the end.
+    bool ok = RunBoth(kSize - 1024, 0, 1) && RunBoth(kSize - 1024, 0, 512);
+    // Single free bits scattered through the full region, which a search for
+    // a longer run has to step over.
+    ok = ok && RunBoth(kSize - 1024, 4096, 1) && RunBoth(kSize - 1024, 4096, 512);
+    // Half full.
+    ok = ok && RunBoth(kSize / 2, 0, 512);
+
+    printf("done with benchmark\n");
+    return ok ? 0 : -1;
+}
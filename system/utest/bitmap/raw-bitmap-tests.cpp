@@ -441,6 +441,62 @@ static bool GrowFailure(void) {
     END_TEST;
 }
 
+// Applies the same sequence of pseudo-random Sets and Clears to a summarized
+// bitmap and a plain one, large enough to need three levels of summary, and
+// checks that they always scan and find the same bits.
+template <typename SummaryBitmap>
+static bool SummaryMatchesRaw(void) {
+    BEGIN_TEST;
+
+    const size_t kSize = kBits * kBits * kBits + 77;
+    SummaryBitmap summary;
+    RawBitmapGeneric<DefaultStorage> raw;
+    ASSERT_EQ(summary.Reset(kSize), ZX_OK);
+    ASSERT_EQ(raw.Reset(kSize), ZX_OK);
+
+    uint32_t seed = 1;
+    auto next = [&seed](size_t max) {
+        seed = seed * 1103515245 + 12345;
+        return static_cast<size_t>((seed >> 8) % max);
+    };
+
+    for (int round = 0; round < 200; round++) {
+        // Mostly short ranges, with the occasional run covering many words.
+        size_t off = next(kSize);
+        size_t len = next(round % 8 == 0 ? kSize - off + 1 : fbl::min<size_t>(kSize - off + 1, 200));
+        if (round % 2 == 0 || round % 3 == 0) {
+            EXPECT_EQ(summary.Set(off, off + len), ZX_OK);
+            EXPECT_EQ(raw.Set(off, off + len), ZX_OK);
+        } else {
+            EXPECT_EQ(summary.Clear(off, off + len), ZX_OK);
+            EXPECT_EQ(raw.Clear(off, off + len), ZX_OK);
+        }
+
+        for (int i = 0; i < 16; i++) {
+            size_t bitoff = next(kSize);
+            size_t bitmax = bitoff + next(kSize - bitoff + 1);
+            bool is_set = i % 2 == 0;
+            EXPECT_EQ(summary.Scan(bitoff, bitmax, is_set), raw.Scan(bitoff, bitmax, is_set));
+
+            if (bitmax > bitoff) {
+                size_t run_len = next(256) + 1;
+                size_t summary_out, raw_out;
+                EXPECT_EQ(summary.Find(is_set, bitoff, bitmax, run_len, &summary_out),
+                          raw.Find(is_set, bitoff, bitmax, run_len, &raw_out));
+                EXPECT_EQ(summary_out, raw_out);
+            }
+        }
+    }
+
+    summary.ClearAll();
+    size_t out;
+    EXPECT_EQ(summary.Find(true, 0, kSize, 1, &out), ZX_ERR_NO_RESOURCES);
+    EXPECT_EQ(summary.Find(false, 0, kSize, kSize, &out), ZX_OK);
+    EXPECT_EQ(out, 0u);
+
+    END_TEST;
+}
+
 #define RUN_TEMPLATIZED_TEST(test, specialization) RUN_TEST(test<specialization>)
 #define ALL_TESTS(specialization)                           \
     RUN_TEMPLATIZED_TEST(InitializedEmpty, specialization)  \
@@ -461,6 +517,13 @@ ALL_TESTS(RawBitmapGeneric<VmoStorage>)
 RUN_TEST(GrowAcrossPage<RawBitmapGeneric<VmoStorage>>)
 RUN_TEST(GrowShrink<RawBitmapGeneric<VmoStorage>>)
 RUN_TEST(GrowFailure<RawBitmapGeneric<DefaultStorage>>)
+ALL_TESTS(SummaryBitmapGeneric<DefaultStorage>)
+ALL_TESTS(SummaryBitmapGeneric<VmoStorage>)
+RUN_TEST(GrowAcrossPage<SummaryBitmapGeneric<VmoStorage>>)
+RUN_TEST(GrowShrink<SummaryBitmapGeneric<VmoStorage>>)
+RUN_TEST(GrowFailure<SummaryBitmapGeneric<DefaultStorage>>)
+RUN_TEST(SummaryMatchesRaw<SummaryBitmapGeneric<DefaultStorage>>)
+RUN_TEST(SummaryMatchesRaw<SummaryBitmapGeneric<VmoStorage>>)
 END_TEST_CASE(raw_bitmap_tests);
 
 } // namespace tests
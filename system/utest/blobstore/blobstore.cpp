@@ -844,6 +844,121 @@ static bool CreateUmountRemountSmall(void) {
     END_TEST;
 }
 
+// Reads scattered ranges of a blob which is not yet in memory, checking that
+// on-demand verification returns the right data wherever the read lands.
+template <fs_test_type_t TestType>
+static bool PartialReadAfterRemount(void) {
+    BEGIN_TEST;
+    test_info_t test_info;
+    ASSERT_EQ(StartBlobstoreTest<TestType>(&test_info), 0, "Mounting Blobstore");
+
+    const size_t kBlockSize = blobstore::kBlobstoreBlockSize;
+    fbl::unique_ptr<blob_info_t> info;
+    ASSERT_TRUE(GenerateBlob((1 << 20) + 1234, &info));
+
+    int fd;
+    ASSERT_TRUE(MakeBlob(info->path, info->merkle.get(), info->size_merkle,
+                         info->data.get(), info->size_data, &fd));
+    ASSERT_EQ(close(fd), 0);
+    ASSERT_EQ(umount(MOUNT_PATH), ZX_OK, "Could not unmount blobstore");
+    ASSERT_EQ(MountBlobstore(test_info.ramdisk_path), 0, "Could not re-mount blobstore");
+
+    fd = open(info->path, O_RDONLY);
+    ASSERT_GT(fd, 0, "Failed to open blob");
+
+    // Tail first, then a read straddling a block boundary in the middle,
+    // then the first byte.
+    const struct {
+        size_t off;
+        size_t len;
+    } kReads[] = {
+        {info->size_data - 100, 100},
+        {kBlockSize * 70 - 17, kBlockSize + 34},
+        {0, 1},
+    };
+    char buf[2 * kBlockSize];
+    for (const auto& r : kReads) {
+        ASSERT_EQ(pread(fd, buf, r.len, r.off), static_cast<ssize_t>(r.len));
+        ASSERT_EQ(memcmp(buf, &info->data[r.off], r.len), 0, "Read data, but it was bad");
+    }
+
+    // Reading the rest of the blob must still match, with some blocks
+    // already verified and others not.
+    ASSERT_TRUE(VerifyContents(fd, info->data.get(), info->size_data));
+    ASSERT_EQ(close(fd), 0);
+    ASSERT_EQ(unlink(info->path), 0);
+
+    ASSERT_EQ(EndBlobstoreTest<TestType>(&test_info), 0, "unmounting blobstore");
+    END_TEST;
+}
+
+// Reads the tail of a blob with a three level Merkle tree on its own, where the
+// tail is shorter than a digest's share of its parent node.  Corrupting that
+// parent node on disk must make the read fail.
+template <fs_test_type_t TestType>
+static bool ShortTailWithCorruptParent(void) {
+    BEGIN_TEST;
+    test_info_t test_info;
+    ASSERT_EQ(StartBlobstoreTest<TestType>(&test_info), 0, "Mounting Blobstore");
+
+    const size_t kNodeSize = MerkleTree::kNodeSize;
+    const size_t kTailLen = 100;
+    fbl::unique_ptr<blob_info_t> info;
+    ASSERT_TRUE(GenerateBlob((kNodeSize / Digest::kLength + 1) * kNodeSize + kTailLen, &info));
+    ASSERT_EQ(info->size_merkle, 3 * kNodeSize);
+    const size_t tail_off = info->size_data - kTailLen;
+
+    int fd;
+    ASSERT_TRUE(MakeBlob(info->path, info->merkle.get(), info->size_merkle,
+                         info->data.get(), info->size_data, &fd));
+    ASSERT_EQ(close(fd), 0);
+    ASSERT_EQ(umount(MOUNT_PATH), ZX_OK, "Could not unmount blobstore");
+    ASSERT_EQ(MountBlobstore(test_info.ramdisk_path), 0, "Could not re-mount blobstore");
+
+    char buf[kTailLen];
+    fd = open(info->path, O_RDONLY);
+    ASSERT_GT(fd, 0, "Failed to open blob");
+    ASSERT_EQ(pread(fd, buf, kTailLen, tail_off), static_cast<ssize_t>(kTailLen));
+    ASSERT_EQ(memcmp(buf, &info->data[tail_off], kTailLen), 0, "Read data, but it was bad");
+    ASSERT_EQ(close(fd), 0);
+    ASSERT_EQ(umount(MOUNT_PATH), ZX_OK, "Could not unmount blobstore");
+
+    // Find the second node of the tree's first level, which holds the tail's
+    // digest, and flip a bit of the digest before it.
+    const char* parent = &info->merkle[kNodeSize];
+    fbl::unique_fd dev(open(test_info.ramdisk_path, O_RDWR));
+    ASSERT_TRUE(dev, "Could not open ramdisk");
+    const size_t kChunk = 128 * kNodeSize;
+    fbl::AllocChecker ac;
+    fbl::unique_ptr<char[]> chunk(new (&ac) char[kChunk]);
+    ASSERT_TRUE(ac.check());
+    off_t found = -1;
+    for (off_t off = 0; found < 0; off += kChunk) {
+        ASSERT_EQ(pread(dev.get(), chunk.get(), kChunk, off), static_cast<ssize_t>(kChunk),
+                  "Could not find the Merkle tree on disk");
+        for (size_t i = 0; i < kChunk; i += kNodeSize) {
+            if (memcmp(&chunk[i], parent, kNodeSize) == 0) {
+                found = off + i;
+                chunk[i] ^= 1;
+                ASSERT_EQ(pwrite(dev.get(), &chunk[i], kNodeSize, found),
+                          static_cast<ssize_t>(kNodeSize));
+                break;
+            }
+        }
+    }
+    dev.reset();
+
+    ASSERT_EQ(MountBlobstore(test_info.ramdisk_path), 0, "Could not re-mount blobstore");
+    fd = open(info->path, O_RDONLY);
+    ASSERT_GT(fd, 0, "Failed to open blob");
+    ASSERT_LT(pread(fd, buf, kTailLen, tail_off), 0, "Expected reading to fail");
+    ASSERT_EQ(close(fd), 0);
+    ASSERT_EQ(unlink(info->path), 0);
+
+    ASSERT_EQ(EndBlobstoreTest<TestType>(&test_info), 0, "unmounting blobstore");
+    END_TEST;
+}
+
 enum TestState {
     empty,
     configured,
@@ -1608,6 +1723,8 @@ RUN_TEST_FOR_ALL_TYPES(MEDIUM, CorruptedBlob)
 RUN_TEST_FOR_ALL_TYPES(MEDIUM, CorruptedDigest)
 RUN_TEST_FOR_ALL_TYPES(MEDIUM, EdgeAllocation)
 RUN_TEST_FOR_ALL_TYPES(MEDIUM, CreateUmountRemountSmall)
+RUN_TEST_FOR_ALL_TYPES(MEDIUM, PartialReadAfterRemount)
+RUN_TEST_FOR_ALL_TYPES(MEDIUM, ShortTailWithCorruptParent)
 RUN_TEST_FOR_ALL_TYPES(MEDIUM, EarlyRead)
 RUN_TEST_FOR_ALL_TYPES(MEDIUM, WaitForRead)
 RUN_TEST_FOR_ALL_TYPES(MEDIUM, WriteSeekIgnored)
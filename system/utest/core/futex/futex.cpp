@@ -4,6 +4,8 @@
 
 #include <inttypes.h>
 #include <limits.h>
+#include <fbl/alloc_checker.h>
+#include <fbl/unique_ptr.h>
 #include <zircon/syscalls.h>
 #include <zircon/threads.h>
 #include <unittest/unittest.h>
@@ -526,6 +528,217 @@ static bool test_event_signaling() {
     END_TEST;
 }
 
+// A minimal futex-based mutex: 0 is unlocked, 1 locked, 2 locked with waiters.
+class StressMutex {
+public:
+    void lock() {
+        int c = 0;
+        if (__atomic_compare_exchange_n(&state_, &c, 1, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return;
+        }
+        if (c != 2) {
+            c = __atomic_exchange_n(&state_, 2, __ATOMIC_ACQUIRE);
+        }
+        while (c != 0) {
+            zx_futex_wait(&state_, 2, ZX_TIME_INFINITE);
+            c = __atomic_exchange_n(&state_, 2, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    void unlock() {
+        if (__atomic_exchange_n(&state_, 0, __ATOMIC_RELEASE) == 2) {
+            zx_futex_wake(&state_, 1);
+        }
+    }
+
+private:
+    zx_futex_t state_ = 0;
+};
+
+static constexpr int kStressThreads = 8;
+
+struct MutexStressArgs {
+    StressMutex* mutexes;
+    int* counters;
+    int num_mutexes;
+    int iterations;
+    int seed;
+};
+
+static int mutex_stress_thread(void* arg) {
+    auto args = static_cast<MutexStressArgs*>(arg);
+    for (int i = 0; i < args->iterations; i++) {
+        int m = (args->seed + i * 7) % args->num_mutexes;
+        args->mutexes[m].lock();
+        args->counters[m]++;
+        args->mutexes[m].unlock();
+    }
+    return 0;
+}
+
+// Runs threads that each lock and unlock mutexes picked from a set of
+// |num_mutexes|.  With few mutexes the threads fight over the same futexes;
+// with many, they mostly use unrelated futexes and should not contend in
+// the kernel either.  Reports the rate of lock/unlock pairs.
+static bool run_mutex_stress(int num_mutexes, int iterations) {
+    BEGIN_HELPER;
+    fbl::AllocChecker ac;
+    fbl::unique_ptr<StressMutex[]> mutexes(new (&ac) StressMutex[num_mutexes]);
+    ASSERT_TRUE(ac.check());
+    fbl::unique_ptr<int[]> counters(new (&ac) int[num_mutexes]());
+    ASSERT_TRUE(ac.check());
+    MutexStressArgs args[kStressThreads];
+    thrd_t threads[kStressThreads];
+
+    // Join every thread that did start before checking, so a failure
+    // can't free the mutexes out from under them.
+    zx_time_t start = zx_clock_get(ZX_CLOCK_MONOTONIC);
+    int started = 0;
+    while (started < kStressThreads) {
+        args[started] = {mutexes.get(), counters.get(), num_mutexes, iterations, started};
+        if (thrd_create_with_name(&threads[started], mutex_stress_thread, &args[started],
+                                  "mutex_stress") != thrd_success) {
+            break;
+        }
+        started++;
+    }
+    for (int i = 0; i < started; i++) {
+        EXPECT_EQ(thrd_join(threads[i], NULL), thrd_success);
+    }
+    zx_time_t elapsed = zx_clock_get(ZX_CLOCK_MONOTONIC) - start;
+    ASSERT_EQ(started, kStressThreads, "failed to create stress threads");
+
+    int total = 0;
+    for (int i = 0; i < num_mutexes; i++) {
+        total += counters[i];
+    }
+    EXPECT_EQ(total, kStressThreads * iterations, "lost a mutex-protected increment");
+
+    unittest_printf("\n%d threads, %3d mutexes: %" PRIu64 " lock/unlock per second",
+                    kStressThreads, num_mutexes,
+                    static_cast<uint64_t>(total) * ZX_SEC(1) / (elapsed ? elapsed : 1));
+    END_HELPER;
+}
+
+static bool test_futex_mutex_stress() {
+    BEGIN_TEST;
+    static const int kNumMutexes[] = {1, 8, 64, 512};
+    for (int num_mutexes : kNumMutexes) {
+        ASSERT_TRUE(run_mutex_stress(num_mutexes, 20000));
+    }
+    unittest_printf("\n");
+    END_TEST;
+}
+
+// Each thread takes tokens from its own queue and passes them to the next
+// thread's queue.  cnd_broadcast() requeues condvar waiters onto the
+// mutex's futex, and the short timed waits make waiters time out while
+// requeued, so this exercises requeue between unrelated futexes.
+struct TokenQueue {
+    mtx_t mutex;
+    cnd_t cond;
+    int tokens;
+};
+
+struct TokenRingArgs {
+    TokenQueue* in;
+    TokenQueue* out;
+    int rounds;
+    const bool* cancel;
+};
+
+static int token_ring_thread(void* arg) {
+    auto args = static_cast<TokenRingArgs*>(arg);
+    for (int i = 0; i < args->rounds; i++) {
+        mtx_lock(&args->in->mutex);
+        while (args->in->tokens == 0) {
+            if (__atomic_load_n(args->cancel, __ATOMIC_RELAXED)) {
+                mtx_unlock(&args->in->mutex);
+                return 0;
+            }
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            cnd_timedwait(&args->in->cond, &args->in->mutex, &deadline);
+        }
+        args->in->tokens--;
+        mtx_unlock(&args->in->mutex);
+
+        mtx_lock(&args->out->mutex);
+        args->out->tokens++;
+        cnd_broadcast(&args->out->cond);
+        mtx_unlock(&args->out->mutex);
+    }
+    return 0;
+}
+
+static bool test_futex_requeue_stress() {
+    BEGIN_TEST;
+    constexpr int kRounds = 5000;
+    constexpr int kTokens = 3;
+    TokenQueue queues[kStressThreads];
+    TokenRingArgs args[kStressThreads];
+    thrd_t threads[kStressThreads];
+    bool cancel = false;
+
+    for (int i = 0; i < kStressThreads; i++) {
+        ASSERT_EQ(mtx_init(&queues[i].mutex, mtx_plain), thrd_success);
+        ASSERT_EQ(cnd_init(&queues[i].cond), thrd_success);
+        queues[i].tokens = 0;
+    }
+
+    // The tokens only go in once the whole ring is running.  If a thread
+    // can't be created the ring would never complete, so the threads that
+    // did start are told to give up and joined before the test fails.
+    zx_time_t start = zx_clock_get(ZX_CLOCK_MONOTONIC);
+    int started = 0;
+    while (started < kStressThreads) {
+        args[started] = {&queues[started], &queues[(started + 1) % kStressThreads], kRounds,
+                         &cancel};
+        if (thrd_create_with_name(&threads[started], token_ring_thread, &args[started],
+                                  "token_ring") != thrd_success) {
+            __atomic_store_n(&cancel, true, __ATOMIC_RELAXED);
+            break;
+        }
+        started++;
+    }
+    if (started == kStressThreads) {
+        mtx_lock(&queues[0].mutex);
+        queues[0].tokens = kTokens;
+        cnd_broadcast(&queues[0].cond);
+        mtx_unlock(&queues[0].mutex);
+    }
+    for (int i = 0; i < started; i++) {
+        EXPECT_EQ(thrd_join(threads[i], NULL), thrd_success);
+    }
+    zx_time_t elapsed = zx_clock_get(ZX_CLOCK_MONOTONIC) - start;
+    if (started < kStressThreads) {
+        for (int i = 0; i < kStressThreads; i++) {
+            cnd_destroy(&queues[i].cond);
+            mtx_destroy(&queues[i].mutex);
+        }
+        ASSERT_EQ(started, kStressThreads, "failed to create token ring threads");
+    }
+
+    // Every thread passed on as many tokens as it took, so the initial
+    // tokens are back in the first queue.
+    for (int i = 0; i < kStressThreads; i++) {
+        EXPECT_EQ(queues[i].tokens, (i == 0) ? kTokens : 0);
+        cnd_destroy(&queues[i].cond);
+        mtx_destroy(&queues[i].mutex);
+    }
+
+    unittest_printf("\n%d threads: %" PRIu64 " token passes per second\n", kStressThreads,
+                    static_cast<uint64_t>(kStressThreads * kRounds) * ZX_SEC(1) /
+                        (elapsed ? elapsed : 1));
+    END_TEST;
+}
+
 BEGIN_TEST_CASE(futex_tests)
 RUN_TEST(test_futex_wait_value_mismatch);
 RUN_TEST(test_futex_wait_timeout);
@@ -545,6 +758,8 @@ RUN_TEST(test_futex_thread_killed);
 RUN_TEST(test_futex_thread_suspended);
 RUN_TEST(test_futex_misaligned);
 RUN_TEST(test_event_signaling);
+RUN_TEST_LARGE(test_futex_mutex_stress);
+RUN_TEST_LARGE(test_futex_requeue_stress);
 END_TEST_CASE(futex_tests)
 
 #ifndef BUILD_COMBINED_TESTS
@@ -18,4 +18,6 @@ MODULE_NAME := futex-test
 MODULE_LIBS := \
     system/ulib/fdio system/ulib/zircon system/ulib/unittest system/ulib/c
 
+MODULE_STATIC_LIBS := system/ulib/fbl
+
 include make/module.mk
@@ -2,8 +2,11 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <inttypes.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <threads.h>
 
 #include <zircon/process.h>
 #include <zircon/syscalls.h>
@@ -144,10 +147,199 @@ static bool handle_rights_test(void) {
     END_TEST;
 }
 
+#define LOOKUP_THREADS 8
+
+typedef struct {
+    zx_handle_t event;
+    zx_handle_t channel;
+    int iterations;
+    atomic_int errors;
+} lookup_bench_args_t;
+
+static int lookup_bench_thread(void* arg) {
+    lookup_bench_args_t* args = arg;
+    for (int i = 0; i < args->iterations; i++) {
+        zx_info_handle_basic_t info;
+        if (zx_object_get_info(args->event, ZX_INFO_HANDLE_BASIC,
+                               &info, sizeof(info), NULL, NULL) != ZX_OK) {
+            atomic_fetch_add(&args->errors, 1);
+        }
+        // Nothing is ever written, so this only looks up the handle.
+        if (zx_channel_read(args->channel, 0u, NULL, NULL, 0u, 0u, NULL, NULL) !=
+            ZX_ERR_SHOULD_WAIT) {
+            atomic_fetch_add(&args->errors, 1);
+        }
+    }
+    return 0;
+}
+
+// Many threads of one process looking up the same handles, as a
+// multithreaded server does. Reports the rate of handle lookups; only run
+// when performance tests are requested.
+static bool handle_lookup_bench_test(void) {
+    BEGIN_TEST;
+
+    const int iterations = 20000;
+    zx_handle_t event, ch0, ch1;
+    ASSERT_EQ(zx_event_create(0u, &event), ZX_OK, "");
+    ASSERT_EQ(zx_channel_create(0u, &ch0, &ch1), ZX_OK, "");
+
+    for (int n = 1; n <= LOOKUP_THREADS; n *= 2) {
+        lookup_bench_args_t args = {event, ch0, iterations, 0};
+        thrd_t threads[LOOKUP_THREADS];
+
+        zx_time_t start = zx_clock_get(ZX_CLOCK_MONOTONIC);
+        for (int i = 0; i < n; i++) {
+            ASSERT_EQ(thrd_create_with_name(&threads[i], lookup_bench_thread, &args,
+                                            "lookup_bench"), thrd_success, "");
+        }
+        for (int i = 0; i < n; i++) {
+            ASSERT_EQ(thrd_join(threads[i], NULL), thrd_success, "");
+        }
+        zx_time_t elapsed = zx_clock_get(ZX_CLOCK_MONOTONIC) - start;
+
+        EXPECT_EQ(atomic_load(&args.errors), 0, "handle lookup failed");
+        uint64_t lookups = 2u * (uint64_t)iterations * (uint64_t)n;
+        unittest_printf("\n%d threads: %" PRIu64 " handle lookups per second", n,
+                        lookups * ZX_SEC(1) / (elapsed ? elapsed : 1));
+    }
+    unittest_printf("\n");
+
+    zx_handle_close(event);
+    zx_handle_close(ch0);
+    zx_handle_close(ch1);
+    END_TEST;
+}
+
+typedef struct {
+    atomic_uint value;
+    atomic_bool done;
+    zx_koid_t koid[2];
+    zx_rights_t rights[2];
+    atomic_int errors;
+} lookup_race_args_t;
+
+static int lookup_race_thread(void* arg) {
+    lookup_race_args_t* args = arg;
+    while (!atomic_load(&args->done)) {
+        zx_info_handle_basic_t info;
+        zx_status_t status = zx_object_get_info(atomic_load(&args->value), ZX_INFO_HANDLE_BASIC,
+                                                &info, sizeof(info), NULL, NULL);
+        if (status == ZX_ERR_BAD_HANDLE)
+            continue;
+        // A live handle must report one of the two objects with the rights
+        // that its handles were created with.
+        if (status != ZX_OK ||
+            !((info.koid == args->koid[0] && info.rights == args->rights[0]) ||
+              (info.koid == args->koid[1] && info.rights == args->rights[1]))) {
+            atomic_fetch_add(&args->errors, 1);
+        }
+    }
+    return 0;
+}
+
+// Looks up handles while another thread creates and closes them, so that
+// lookups race with handle slots being torn down and reused.
+static bool handle_lookup_race_test(void) {
+    BEGIN_TEST;
+
+    zx_handle_t events[2];
+    lookup_race_args_t args = {0, false, {0, 0}, {ZX_RIGHT_READ, ZX_RIGHT_WRITE}, 0};
+    for (int i = 0; i < 2; i++) {
+        ASSERT_EQ(zx_event_create(0u, &events[i]), ZX_OK, "");
+        zx_info_handle_basic_t info;
+        ASSERT_EQ(zx_object_get_info(events[i], ZX_INFO_HANDLE_BASIC,
+                                     &info, sizeof(info), NULL, NULL), ZX_OK, "");
+        args.koid[i] = info.koid;
+    }
+
+    thrd_t threads[LOOKUP_THREADS];
+    for (int i = 0; i < LOOKUP_THREADS; i++) {
+        ASSERT_EQ(thrd_create_with_name(&threads[i], lookup_race_thread, &args,
+                                        "lookup_race"), thrd_success, "");
+    }
+    for (int i = 0; i < 50000; i++) {
+        zx_handle_t h;
+        ASSERT_EQ(zx_handle_duplicate(events[i % 2], args.rights[i % 2], &h), ZX_OK, "");
+        atomic_store(&args.value, h);
+        ASSERT_EQ(zx_handle_close(h), ZX_OK, "");
+    }
+    atomic_store(&args.done, true);
+    for (int i = 0; i < LOOKUP_THREADS; i++) {
+        ASSERT_EQ(thrd_join(threads[i], NULL), thrd_success, "");
+    }
+
+    EXPECT_EQ(atomic_load(&args.errors), 0, "lookup returned the wrong object");
+    zx_handle_close(events[0]);
+    zx_handle_close(events[1]);
+    END_TEST;
+}
+
+typedef struct {
+    zx_handle_t event;
+    int iterations;
+    atomic_int errors;
+} dup_close_args_t;
+
+static int dup_close_thread(void* arg) {
+    dup_close_args_t* args = arg;
+    for (int i = 0; i < args->iterations; i++) {
+        zx_handle_t h;
+        if (zx_handle_duplicate(args->event, ZX_RIGHT_SAME_RIGHTS, &h) != ZX_OK ||
+            zx_handle_close(h) != ZX_OK) {
+            atomic_fetch_add(&args->errors, 1);
+        }
+    }
+    return 0;
+}
+
+// Creates and destroys handles to one object from many threads at once and
+// checks that the object's handle count comes back to where it started.
+// Also reports the rate of duplicate/close pairs.
+static bool handle_dup_close_stress_test(void) {
+    BEGIN_TEST;
+
+    const int iterations = 20000;
+    zx_handle_t event;
+    ASSERT_EQ(zx_event_create(0u, &event), ZX_OK, "");
+
+    for (int n = 1; n <= LOOKUP_THREADS; n *= 2) {
+        dup_close_args_t args = {event, iterations, 0};
+        thrd_t threads[LOOKUP_THREADS];
+
+        zx_time_t start = zx_clock_get(ZX_CLOCK_MONOTONIC);
+        for (int i = 0; i < n; i++) {
+            ASSERT_EQ(thrd_create_with_name(&threads[i], dup_close_thread, &args,
+                                            "dup_close"), thrd_success, "");
+        }
+        for (int i = 0; i < n; i++) {
+            ASSERT_EQ(thrd_join(threads[i], NULL), thrd_success, "");
+        }
+        zx_time_t elapsed = zx_clock_get(ZX_CLOCK_MONOTONIC) - start;
+
+        EXPECT_EQ(atomic_load(&args.errors), 0, "duplicate or close failed");
+        zx_info_handle_count_t info;
+        ASSERT_EQ(zx_object_get_info(event, ZX_INFO_HANDLE_COUNT,
+                                     &info, sizeof(info), NULL, NULL), ZX_OK, "");
+        EXPECT_EQ(info.handle_count, 1u, "handle count did not return to 1");
+
+        uint64_t pairs = (uint64_t)iterations * (uint64_t)n;
+        unittest_printf("\n%d threads: %" PRIu64 " duplicate/close per second", n,
+                        pairs * ZX_SEC(1) / (elapsed ? elapsed : 1));
+    }
+    unittest_printf("\n");
+
+    zx_handle_close(event);
+    END_TEST;
+}
+
 BEGIN_TEST_CASE(handle_info_tests)
 RUN_TEST(handle_info_test)
 RUN_TEST(handle_related_koid_test)
 RUN_TEST(handle_rights_test)
+RUN_TEST(handle_lookup_race_test)
+RUN_TEST_PERFORMANCE(handle_lookup_bench_test)
+RUN_TEST(handle_dup_close_stress_test)
 END_TEST_CASE(handle_info_tests)
 
 #ifndef BUILD_COMBINED_TESTS
@@ -7,6 +7,9 @@
 #include <stdlib.h>
 
 #include <digest/digest.h>
+#include <fbl/alloc_checker.h>
+#include <fbl/unique_ptr.h>
+#include <zircon/syscalls.h>
 #include <zircon/assert.h>
 #include <zircon/status.h>
 #include <unittest/unittest.h>
@@ -300,6 +303,46 @@ bool CreateAll(void) {
     END_TEST;
 }
 
+// Used by CreateParallelAll below.  Checks the tree is byte-for-byte the same
+// as the one written by |Create|, and not just the root.
+bool CreateParallel(size_t data_len, const char* digest) {
+    zx_status_t rc;
+    size_t tree_len = MerkleTree::GetTreeLength(data_len);
+    Digest actual;
+    ASSERT_OK(MerkleTree::Create(gData, data_len, gTree, tree_len, &actual));
+    uint8_t expected_tree[sizeof(gTree)];
+    memcpy(expected_tree, gTree, tree_len);
+    memset(gTree, 0xa5, tree_len);
+    ASSERT_OK(MerkleTree::CreateParallel(gData, data_len, gTree, tree_len,
+                                         &actual, 4));
+    Digest expected;
+    ASSERT_OK(expected.Parse(digest, strlen(digest)));
+    ASSERT_TRUE(actual == expected, "Incorrect root digest");
+    ASSERT_EQ(memcmp(expected_tree, gTree, tree_len), 0, "Incorrect tree");
+    return true;
+}
+
+bool CreateParallelAll(void) {
+    BEGIN_TEST;
+    for (size_t i = 0; i < kNumCases; ++i) {
+        if (!CreateParallel(kCases[i].data_len, kCases[i].digest)) {
+            unittest_printf_critical(
+                "CreateParallelAll failed with data length of %zu\n",
+                kCases[i].data_len);
+        }
+    }
+    END_TEST;
+}
+
+bool CreateParallelTreeTooSmall(void) {
+    BEGIN_TEST_WITH_RC;
+    Digest digest;
+    ASSERT_ERR(ZX_ERR_BUFFER_TOO_SMALL,
+               MerkleTree::CreateParallel(gData, kLarge, gTree, kNodeSize,
+                                          &digest, 4));
+    END_TEST;
+}
+
 // Used by CreateFinalCAll below.
 bool CreateFinalC(size_t data_len, const char* digest) {
     zx_status_t rc;
@@ -626,6 +669,71 @@ bool VerifyBadLeaves(void) {
     END_TEST;
 }
 
+bool VerifyParallelBadLeaves(void) {
+    BEGIN_TEST_WITH_RC;
+    size_t tree_len = MerkleTree::GetTreeLength(kUnalignedLarge);
+    Digest digest;
+    ASSERT_OK(MerkleTree::Create(gData, kUnalignedLarge, gTree, tree_len,
+                                 &digest));
+    ASSERT_OK(MerkleTree::VerifyParallel(gData, kUnalignedLarge, gTree,
+                                         tree_len, 0, kUnalignedLarge, digest,
+                                         4));
+    // Corrupt the last node, which is checked by the last thread, and make
+    // sure parts of the data not including it still verify.
+    gData[kUnalignedLarge - 1] ^= 1;
+    ASSERT_ERR(ZX_ERR_IO_DATA_INTEGRITY,
+               MerkleTree::VerifyParallel(gData, kUnalignedLarge, gTree,
+                                          tree_len, 0, kUnalignedLarge, digest,
+                                          4));
+    ASSERT_OK(MerkleTree::VerifyParallel(gData, kUnalignedLarge, gTree,
+                                         tree_len, 0, kLarge, digest, 4));
+    gData[kUnalignedLarge - 1] ^= 1;
+    END_TEST;
+}
+
+// A blob of over 2MB has a three level tree.  If the last node is shorter
+// than a digest's share of its parent node, verifying it alone must still
+// check the parent node against the level above it.
+bool VerifyShortTailOfDeepTree(void) {
+    BEGIN_TEST_WITH_RC;
+    const size_t kDigestsPerNode = kNodeSize / Digest::kLength;
+    const size_t kDataLen = (kDigestsPerNode + 1) * kNodeSize + 100;
+    const size_t kTailOff = kDataLen - 100;
+    fbl::AllocChecker ac;
+    fbl::unique_ptr<uint8_t[]> data(new (&ac) uint8_t[kDataLen]);
+    ASSERT_TRUE(ac.check());
+    size_t tree_len = MerkleTree::GetTreeLength(kDataLen);
+    ASSERT_EQ(tree_len, kNodeSize * 3);
+    fbl::unique_ptr<uint8_t[]> tree(new (&ac) uint8_t[tree_len]);
+    ASSERT_TRUE(ac.check());
+    for (size_t i = 0; i < kDataLen; ++i) {
+        data[i] = static_cast<uint8_t>(rand());
+    }
+    Digest digest;
+    ASSERT_OK(MerkleTree::Create(data.get(), kDataLen, tree.get(), tree_len,
+                                 &digest));
+    ASSERT_OK(MerkleTree::Verify(data.get(), kDataLen, tree.get(), tree_len,
+                                 kTailOff, 100, digest));
+    ASSERT_OK(MerkleTree::VerifyParallel(data.get(), kDataLen, tree.get(),
+                                         tree_len, kTailOff, 100, digest, 4));
+    // Corrupt the second node of the first tree level, which holds the
+    // tail's digest, without touching that digest.
+    tree[kNodeSize] ^= 1;
+    ASSERT_ERR(ZX_ERR_IO_DATA_INTEGRITY,
+               MerkleTree::Verify(data.get(), kDataLen, tree.get(), tree_len,
+                                  kTailOff, 100, digest));
+    ASSERT_ERR(ZX_ERR_IO_DATA_INTEGRITY,
+               MerkleTree::Verify(data.get(), kDataLen, tree.get(), tree_len,
+                                  kTailOff + 99, 1, digest));
+    ASSERT_ERR(ZX_ERR_IO_DATA_INTEGRITY,
+               MerkleTree::VerifyParallel(data.get(), kDataLen, tree.get(),
+                                          tree_len, kTailOff, 100, digest, 4));
+    // The first node's path up the tree is untouched.
+    ASSERT_OK(MerkleTree::Verify(data.get(), kDataLen, tree.get(), tree_len,
+                                 0, kNodeSize, digest));
+    END_TEST;
+}
+
 bool CreateAndVerifyHugePRNGData(void) {
     BEGIN_TEST_WITH_RC;
     Digest digest;
@@ -692,6 +800,56 @@ bool CreateAndVerifyHugePRNGData(void) {
     END_TEST;
 }
 
+// Times creating and verifying trees for a range of blob sizes with one
+// thread and with one thread per CPU.
+bool BenchmarkParallel(void) {
+    BEGIN_TEST_WITH_RC;
+    // Sizes run are 128K, 512K, 2M, 8M and 32M.
+    const size_t kMaxLen = 32 << 20;
+    fbl::AllocChecker ac;
+    fbl::unique_ptr<uint8_t[]> data(new (&ac) uint8_t[kMaxLen]);
+    ASSERT_TRUE(ac.check());
+    fbl::unique_ptr<uint8_t[]> tree(
+        new (&ac) uint8_t[MerkleTree::GetTreeLength(kMaxLen)]);
+    ASSERT_TRUE(ac.check());
+    for (size_t i = 0; i < kMaxLen; ++i) {
+        data[i] = static_cast<uint8_t>(rand());
+    }
+    unittest_printf("\n%10s %12s %12s %12s %12s\n", "size", "create(1)",
+                    "create(N)", "verify(1)", "verify(N)");
+    for (size_t data_len = 128 << 10; data_len <= kMaxLen; data_len <<= 2) {
+        size_t tree_len = MerkleTree::GetTreeLength(data_len);
+        Digest serial;
+        Digest parallel;
+        zx_time_t times[4];
+        zx_time_t start = zx_clock_get(ZX_CLOCK_MONOTONIC);
+        ASSERT_OK(MerkleTree::Create(data.get(), data_len, tree.get(),
+                                     tree_len, &serial));
+        times[0] = zx_clock_get(ZX_CLOCK_MONOTONIC) - start;
+        start = zx_clock_get(ZX_CLOCK_MONOTONIC);
+        ASSERT_OK(MerkleTree::CreateParallel(data.get(), data_len, tree.get(),
+                                             tree_len, &parallel));
+        times[1] = zx_clock_get(ZX_CLOCK_MONOTONIC) - start;
+        ASSERT_TRUE(serial == parallel, "Incorrect root digest");
+        start = zx_clock_get(ZX_CLOCK_MONOTONIC);
+        ASSERT_OK(MerkleTree::Verify(data.get(), data_len, tree.get(),
+                                     tree_len, 0, data_len, serial));
+        times[2] = zx_clock_get(ZX_CLOCK_MONOTONIC) - start;
+        start = zx_clock_get(ZX_CLOCK_MONOTONIC);
+        ASSERT_OK(MerkleTree::VerifyParallel(data.get(), data_len, tree.get(),
+                                             tree_len, 0, data_len, serial));
+        times[3] = zx_clock_get(ZX_CLOCK_MONOTONIC) - start;
+        // Report throughput in MB/s.
+        double mb = static_cast<double>(data_len) / (1 << 20);
+        unittest_printf("%9zuK %12.1f %12.1f %12.1f %12.1f\n", data_len >> 10,
+                        mb * ZX_SEC(1) / static_cast<double>(times[0]),
+                        mb * ZX_SEC(1) / static_cast<double>(times[1]),
+                        mb * ZX_SEC(1) / static_cast<double>(times[2]),
+                        mb * ZX_SEC(1) / static_cast<double>(times[3]));
+    }
+    END_TEST;
+}
+
 } // namespace
 
 BEGIN_TEST_CASE(MerkleTreeTests)
@@ -716,6 +874,8 @@ RUN_TEST(CreateFinalWithoutTree)
 RUN_TEST(CreateFinalMissingDigest)
 RUN_TEST(CreateFinalIncompleteData)
 RUN_TEST(CreateAll)
+RUN_TEST(CreateParallelAll)
+RUN_TEST(CreateParallelTreeTooSmall)
 RUN_TEST(CreateFinalCAll)
 RUN_TEST(CreateCAll)
 RUN_TEST(CreateByteByByte)
@@ -739,5 +899,8 @@ RUN_TEST(VerifyGoodPartOfBadTree)
 RUN_TEST(VerifyBadTree)
 RUN_TEST(VerifyGoodPartOfBadLeaves)
 RUN_TEST(VerifyBadLeaves)
+RUN_TEST(VerifyParallelBadLeaves)
+RUN_TEST(VerifyShortTailOfDeepTree)
 RUN_TEST(CreateAndVerifyHugePRNGData)
+RUN_TEST_PERFORMANCE(BenchmarkParallel)
 END_TEST_CASE(MerkleTreeTests)
@@ -202,6 +202,59 @@ bool benchmark_path_walk(void) {
     END_TEST;
 }
 
+#define LOOKUP_DIR MOUNT_POINT "/lookup"
+
+// The goal of this benchmark is to measure how name lookup scales with the
+// number of entries in a single directory, for names which are present and
+// names which are not.
+template <size_t NumFiles>
+bool benchmark_directory_lookup(void) {
+    BEGIN_TEST;
+    printf("\nBenchmarking Directory lookup (%lu entries)\n", NumFiles);
+    ASSERT_EQ(mkdir(LOOKUP_DIR, 0666), 0, "Could not make directory");
+    char path[PATH_MAX];
+    uint64_t start;
+
+    start = zx_ticks_get();
+    for (size_t i = 0; i < NumFiles; i++) {
+        snprintf(path, sizeof(path), LOOKUP_DIR "/file-%08zu", i);
+        int fd = open(path, O_CREAT | O_EXCL | O_RDWR, 0644);
+        ASSERT_GE(fd, 0, "Could not create file");
+        ASSERT_EQ(close(fd), 0);
+    }
+    time_end("create", start);
+
+    start = zx_ticks_get();
+    for (size_t i = 0; i < NumFiles; i++) {
+        struct stat buf;
+        snprintf(path, sizeof(path), LOOKUP_DIR "/file-%08zu", i);
+        ASSERT_EQ(stat(path, &buf), 0, "Could not stat file");
+    }
+    time_end("stat (present)", start);
+
+    start = zx_ticks_get();
+    for (size_t i = 0; i < NumFiles; i++) {
+        struct stat buf;
+        snprintf(path, sizeof(path), LOOKUP_DIR "/missing-%08zu", i);
+        ASSERT_EQ(stat(path, &buf), -1, "Missing file found");
+    }
+    time_end("stat (absent)", start);
+
+    start = zx_ticks_get();
+    for (size_t i = 0; i < NumFiles; i++) {
+        snprintf(path, sizeof(path), LOOKUP_DIR "/file-%08zu", i);
+        ASSERT_EQ(unlink(path), 0, "Could not unlink file");
+    }
+    time_end("unlink", start);
+
+    ASSERT_EQ(unlink(LOOKUP_DIR), 0, "Could not unlink directory");
+    int fd = open(MOUNT_POINT, O_DIRECTORY | O_RDONLY);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(syncfs(fd), 0);
+    ASSERT_EQ(close(fd), 0);
+    END_TEST;
+}
+
 BEGIN_TEST_CASE(basic_benchmarks)
 RUN_TEST_PERFORMANCE((benchmark_write_read<16 * KB, 1024>))
 RUN_TEST_PERFORMANCE((benchmark_write_read<16 * KB, 2048>))
@@ -212,4 +265,6 @@ RUN_TEST_PERFORMANCE((benchmark_path_walk<125>))
 RUN_TEST_PERFORMANCE((benchmark_path_walk<250>))
 RUN_TEST_PERFORMANCE((benchmark_path_walk<500>))
 RUN_TEST_PERFORMANCE((benchmark_path_walk<1000>))
+RUN_TEST_PERFORMANCE((benchmark_directory_lookup<1000>))
+RUN_TEST_PERFORMANCE((benchmark_directory_lookup<10000>))
 END_TEST_CASE(basic_benchmarks)
@@ -0,0 +1,298 @@
+// Copyright 2018 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <fbl/alloc_checker.h>
+#include <fbl/unique_fd.h>
+#include <fbl/unique_ptr.h>
+#include <minfs/format.h>
+#include <minfs/fsck.h>
+
+#include "util.h"
+
+namespace {
+
+constexpr size_t kBlockSize = minfs::kMinfsBlockSize;
+
+// The tests below read and patch the image underneath the mounted filesystem.
+// This is safe on the host, where every minfs update is written through to
+// MOUNT_PATH as soon as the operation which made it completes.
+bool read_info(minfs::minfs_info_t* info) {
+    fbl::unique_fd fd(open(MOUNT_PATH, O_RDONLY));
+    ASSERT_TRUE(fd);
+    ASSERT_EQ(pread(fd.get(), info, sizeof(*info), 0), (ssize_t)sizeof(*info));
+    return true;
+}
+
+bool inode_offset(const char* filename, off_t* out) {
+    struct stat st;
+    ASSERT_EQ(emu_stat(filename, &st), 0);
+    minfs::minfs_info_t info;
+    ASSERT_TRUE(read_info(&info));
+    *out = (info.ino_block + st.st_ino / minfs::kMinfsInodesPerBlock) * kBlockSize +
+           (st.st_ino % minfs::kMinfsInodesPerBlock) * minfs::kMinfsInodeSize;
+    return true;
+}
+
+bool read_inode(const char* filename, minfs::minfs_inode_t* inode) {
+    off_t off;
+    ASSERT_TRUE(inode_offset(filename, &off));
+    fbl::unique_fd fd(open(MOUNT_PATH, O_RDONLY));
+    ASSERT_TRUE(fd);
+    ASSERT_EQ(pread(fd.get(), inode, sizeof(*inode), off), (ssize_t)sizeof(*inode));
+    ASSERT_NE(inode->flags & minfs::kMinfsInodeFlagExtents, 0u);
+    return true;
+}
+
+bool write_inode(const char* filename, const minfs::minfs_inode_t* inode) {
+    off_t off;
+    ASSERT_TRUE(inode_offset(filename, &off));
+    fbl::unique_fd fd(open(MOUNT_PATH, O_RDWR));
+    ASSERT_TRUE(fd);
+    ASSERT_EQ(pwrite(fd.get(), inode, sizeof(*inode), off), (ssize_t)sizeof(*inode));
+    return true;
+}
+
+zx_status_t check_image() {
+    fbl::unique_fd fd(open(MOUNT_PATH, O_RDWR));
+    if (!fd) {
+        return ZX_ERR_IO;
+    }
+    fbl::unique_ptr<minfs::Bcache> bc;
+    zx_status_t status;
+    if ((status = minfs::Bcache::Create(&bc, fbl::move(fd),
+                                        static_cast<uint32_t>(DEFAULT_DISK_SIZE /
+                                                              kBlockSize))) != ZX_OK) {
+        return status;
+    }
+    return minfs::minfs_check(fbl::move(bc));
+}
+
+bool fill_pattern(uint8_t* buf, size_t len, uint8_t seed) {
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = static_cast<uint8_t>(seed + i / kBlockSize + i);
+    }
+    return true;
+}
+
+bool check_contents(const char* filename, const uint8_t* expected, size_t len) {
+    fbl::AllocChecker ac;
+    fbl::unique_ptr<uint8_t[]> buf(new (&ac) uint8_t[len]);
+    ASSERT_TRUE(ac.check());
+    int fd = emu_open(filename, O_RDONLY, 0644);
+    ASSERT_GT(fd, 0);
+    ASSERT_STREAM_ALL(emu_read, fd, buf.get(), len);
+    ASSERT_EQ(memcmp(buf.get(), expected, len), 0);
+    ASSERT_EQ(emu_close(fd), 0);
+    return true;
+}
+
+// Appends of any size should keep extending a single extent, with no
+// extent blocks, while the blocks after the file are free.
+bool test_extent_append(void) {
+    BEGIN_TEST;
+
+    constexpr size_t kChunk = 3 * kBlockSize + 123;
+    constexpr size_t kChunks = 40;
+    fbl::AllocChecker ac;
+    fbl::unique_ptr<uint8_t[]> data(new (&ac) uint8_t[kChunk * kChunks]);
+    ASSERT_TRUE(ac.check());
+    fill_pattern(data.get(), kChunk * kChunks, 1);
+
+    const char* filename = "::append";
+    int fd = emu_open(filename, O_RDWR | O_CREAT, 0644);
+    ASSERT_GT(fd, 0);
+    for (size_t i = 0; i < kChunks; i++) {
+        ASSERT_STREAM_ALL(emu_write, fd, data.get() + i * kChunk, kChunk);
+    }
+    ASSERT_EQ(emu_close(fd), 0);
+
+    minfs::minfs_inode_t inode;
+    ASSERT_TRUE(read_inode(filename, &inode));
+    ASSERT_EQ(inode.extent_count, 1u);
+    ASSERT_EQ(inode.extent_next, 0u);
+    ASSERT_EQ(inode.block_count, (kChunk * kChunks + kBlockSize - 1) / kBlockSize);
+    ASSERT_TRUE(check_contents(filename, data.get(), kChunk * kChunks));
+    ASSERT_EQ(check_image(), ZX_OK);
+
+    END_TEST;
+}
+
+// A single write into fragmented free space should be placed as one run
+// rather than scattered over the holes one block at a time.
+bool test_extent_run_allocation(void) {
+    BEGIN_TEST;
+
+    constexpr size_t kBlocks = 64;
+    uint8_t block[kBlockSize];
+
+    // Interleave two files block by block, then release one of them to
+    // leave a stretch of single-block holes.
+    const char* sparse = "::interleaved";
+    const char* holes = "::holes";
+    int fd_a = emu_open(sparse, O_RDWR | O_CREAT, 0644);
+    ASSERT_GT(fd_a, 0);
+    int fd_b = emu_open(holes, O_RDWR | O_CREAT, 0644);
+    ASSERT_GT(fd_b, 0);
+    for (size_t i = 0; i < kBlocks; i++) {
+        fill_pattern(block, sizeof(block), static_cast<uint8_t>(i));
+        ASSERT_STREAM_ALL(emu_write, fd_a, block, sizeof(block));
+        ASSERT_STREAM_ALL(emu_write, fd_b, block, sizeof(block));
+    }
+    ASSERT_EQ(emu_ftruncate(fd_b, 0), 0);
+    ASSERT_EQ(emu_close(fd_b), 0);
+
+    // One extent per block spills into an extent block.
+    minfs::minfs_inode_t inode;
+    ASSERT_TRUE(read_inode(sparse, &inode));
+    ASSERT_EQ(inode.extent_count, kBlocks);
+    ASSERT_NE(inode.extent_next, 0u);
+    ASSERT_EQ(inode.block_count, kBlocks + 1);
+    ASSERT_EQ(check_image(), ZX_OK);
+
+    constexpr size_t kRun = 32 * kBlockSize;
+    fbl::AllocChecker ac;
+    fbl::unique_ptr<uint8_t[]> data(new (&ac) uint8_t[kRun]);
+    ASSERT_TRUE(ac.check());
+    fill_pattern(data.get(), kRun, 7);
+    const char* filename = "::run";
+    int fd = emu_open(filename, O_RDWR | O_CREAT, 0644);
+    ASSERT_GT(fd, 0);
+    ASSERT_STREAM_ALL(emu_write, fd, data.get(), kRun);
+    ASSERT_EQ(emu_close(fd), 0);
+
+    ASSERT_TRUE(read_inode(filename, &inode));
+    ASSERT_EQ(inode.extent_count, 1u);
+    ASSERT_EQ(inode.block_count, kRun / kBlockSize);
+    ASSERT_TRUE(check_contents(filename, data.get(), kRun));
+
+    // Truncating the fragmented file back under the inline limit releases
+    // its extent block along with the data.
+    minfs::minfs_info_t before;
+    ASSERT_TRUE(read_info(&before));
+    ASSERT_EQ(emu_ftruncate(fd_a, 8 * kBlockSize), 0);
+    ASSERT_TRUE(read_inode(sparse, &inode));
+    ASSERT_EQ(inode.extent_count, 8u);
+    ASSERT_EQ(inode.extent_next, 0u);
+    ASSERT_EQ(inode.block_count, 8u);
+    minfs::minfs_info_t after;
+    ASSERT_TRUE(read_info(&after));
+    ASSERT_EQ(before.alloc_block_count - after.alloc_block_count, kBlocks + 1 - 8);
+    ASSERT_EQ(check_image(), ZX_OK);
+
+    // Truncating within the run trims the extent in place.
+    fd = emu_open(filename, O_RDWR, 0644);
+    ASSERT_GT(fd, 0);
+    ASSERT_EQ(emu_ftruncate(fd, 5 * kBlockSize + 1), 0);
+    ASSERT_EQ(emu_close(fd), 0);
+    ASSERT_TRUE(read_inode(filename, &inode));
+    ASSERT_EQ(inode.extent_count, 1u);
+    ASSERT_EQ(inode.extents[0].count, 6u);
+    ASSERT_EQ(inode.block_count, 6u);
+    ASSERT_TRUE(check_contents(filename, data.get(), 5 * kBlockSize + 1));
+
+    ASSERT_EQ(emu_ftruncate(fd_a, 0), 0);
+    ASSERT_TRUE(read_inode(sparse, &inode));
+    ASSERT_EQ(inode.extent_count, 0u);
+    ASSERT_EQ(inode.block_count, 0u);
+    ASSERT_EQ(emu_close(fd_a), 0);
+    ASSERT_EQ(check_image(), ZX_OK);
+
+    END_TEST;
+}
+
+// Filling a hole allocates at most the hole, and merges with the extents
+// on either side when the run lands between them.
+bool test_extent_fill_hole(void) {
+    BEGIN_TEST;
+
+    constexpr size_t kBlocks = 21;
+    fbl::AllocChecker ac;
+    fbl::unique_ptr<uint8_t[]> data(new (&ac) uint8_t[kBlocks * kBlockSize]);
+    ASSERT_TRUE(ac.check());
+    fill_pattern(data.get(), kBlocks * kBlockSize, 3);
+
+    const char* filename = "::hole";
+    int fd = emu_open(filename, O_RDWR | O_CREAT, 0644);
+    ASSERT_GT(fd, 0);
+    ASSERT_EQ(emu_pwrite(fd, data.get(), kBlockSize, 0), (ssize_t)kBlockSize);
+    const size_t last = (kBlocks - 1) * kBlockSize;
+    ASSERT_EQ(emu_pwrite(fd, data.get() + last, kBlockSize, last), (ssize_t)kBlockSize);
+
+    minfs::minfs_inode_t inode;
+    ASSERT_TRUE(read_inode(filename, &inode));
+    ASSERT_EQ(inode.extent_count, 2u);
+    ASSERT_EQ(inode.block_count, 2u);
+
+    ASSERT_EQ(emu_pwrite(fd, data.get() + kBlockSize, last - kBlockSize, kBlockSize),
+              (ssize_t)(last - kBlockSize));
+    ASSERT_EQ(emu_close(fd), 0);
+
+    ASSERT_TRUE(read_inode(filename, &inode));
+    ASSERT_EQ(inode.extent_count, 1u);
+    ASSERT_EQ(inode.extents[0].count, kBlocks);
+    ASSERT_EQ(inode.block_count, kBlocks);
+    ASSERT_TRUE(check_contents(filename, data.get(), kBlocks * kBlockSize));
+    ASSERT_EQ(check_image(), ZX_OK);
+
+    END_TEST;
+}
+
+// fsck must reject extent lists which overlap or point outside the volume.
+bool test_extent_fsck(void) {
+    BEGIN_TEST;
+
+    uint8_t block[kBlockSize];
+    const char* filename = "::fsck";
+    int fd = emu_open(filename, O_RDWR | O_CREAT, 0644);
+    ASSERT_GT(fd, 0);
+    for (size_t i = 0; i < 4; i++) {
+        fill_pattern(block, sizeof(block), static_cast<uint8_t>(i));
+        ASSERT_EQ(emu_pwrite(fd, block, sizeof(block), 2 * i * kBlockSize),
+                  (ssize_t)sizeof(block));
+    }
+    ASSERT_EQ(emu_close(fd), 0);
+    ASSERT_EQ(check_image(), ZX_OK);
+
+    minfs::minfs_inode_t good;
+    ASSERT_TRUE(read_inode(filename, &good));
+    ASSERT_EQ(good.extent_count, 4u);
+
+    minfs::minfs_info_t info;
+    ASSERT_TRUE(read_info(&info));
+
+    minfs::minfs_inode_t bad = good;
+    bad.extents[1].start = bad.extents[0].start;
+    ASSERT_TRUE(write_inode(filename, &bad));
+    ASSERT_NE(check_image(), ZX_OK);
+
+    bad = good;
+    bad.extents[3].bno = info.block_count - 1;
+    bad.extents[3].count = 2;
+    ASSERT_TRUE(write_inode(filename, &bad));
+    ASSERT_NE(check_image(), ZX_OK);
+
+    bad = good;
+    bad.extents[2].count = 0;
+    ASSERT_TRUE(write_inode(filename, &bad));
+    ASSERT_NE(check_image(), ZX_OK);
+
+    bad = good;
+    bad.extent_count = minfs::kMinfsInlineExtents + 1;
+    ASSERT_TRUE(write_inode(filename, &bad));
+    ASSERT_NE(check_image(), ZX_OK);
+
+    ASSERT_TRUE(write_inode(filename, &good));
+    ASSERT_EQ(check_image(), ZX_OK);
+
+    END_TEST;
+}
+
+} // namespace
+
+RUN_MINFS_TESTS(extent_tests,
+    RUN_TEST_MEDIUM(test_extent_fill_hole)
+    RUN_TEST_MEDIUM(test_extent_append)
+    RUN_TEST_MEDIUM(test_extent_run_allocation)
+    RUN_TEST_MEDIUM(test_extent_fsck)
+)
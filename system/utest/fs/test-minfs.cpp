@@ -7,6 +7,8 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <minfs/format.h>
@@ -64,9 +66,75 @@ bool TestQueryInfo(void) {
     END_TEST;
 }
 
+// Directory indexes can span many blocks. Build them on a volume whose free
+// space is all single-block holes, so that no two index blocks are
+// contiguous and each one needs its own write request.
+bool TestDirIndexFragmented(void) {
+    BEGIN_TEST;
+
+    constexpr int kFillers = 512;
+    char path[128];
+    char data[minfs::kMinfsBlockSize];
+    memset(data, 'f', sizeof(data));
+    for (int i = 0; i < kFillers; i++) {
+        snprintf(path, sizeof(path), "%s/filler_%d", MOUNT_PATH, i);
+        int fd = open(path, O_CREAT | O_RDWR | O_EXCL);
+        ASSERT_GT(fd, 0, "Failed to create filler");
+        ASSERT_EQ(write(fd, data, sizeof(data)), sizeof(data));
+        ASSERT_EQ(close(fd), 0);
+    }
+    for (int i = 0; i < kFillers; i += 2) {
+        snprintf(path, sizeof(path), "%s/filler_%d", MOUNT_PATH, i);
+        ASSERT_EQ(unlink(path), 0);
+    }
+
+    // Enough entries to grow the index to over 32 blocks, more than twice
+    // the number of requests a single transaction can hold.
+    constexpr int kEntries = 5000;
+    const char* dir = MOUNT_PATH "/indexed";
+    ASSERT_EQ(mkdir(dir, 0755), 0);
+    for (int i = 0; i < kEntries; i++) {
+        snprintf(path, sizeof(path), "%s/entry_%d", dir, i);
+        int fd = open(path, O_CREAT | O_RDWR | O_EXCL);
+        ASSERT_GT(fd, 0, "Failed to create entry");
+        ASSERT_EQ(close(fd), 0);
+    }
+
+    struct stat st;
+    for (int i = 0; i < kEntries; i++) {
+        snprintf(path, sizeof(path), "%s/entry_%d", dir, i);
+        ASSERT_EQ(stat(path, &st), 0, "Indexed entry missing");
+    }
+    for (int i = 0; i < kEntries; i += 3) {
+        snprintf(path, sizeof(path), "%s/entry_%d", dir, i);
+        ASSERT_EQ(unlink(path), 0);
+    }
+    for (int i = 0; i < kEntries; i++) {
+        snprintf(path, sizeof(path), "%s/entry_%d", dir, i);
+        ASSERT_EQ(stat(path, &st), (i % 3 == 0) ? -1 : 0);
+    }
+
+    for (int i = 0; i < kEntries; i++) {
+        if (i % 3 != 0) {
+            snprintf(path, sizeof(path), "%s/entry_%d", dir, i);
+            ASSERT_EQ(unlink(path), 0);
+        }
+    }
+    ASSERT_EQ(rmdir(dir), 0);
+    for (int i = 1; i < kFillers; i += 2) {
+        snprintf(path, sizeof(path), "%s/filler_%d", MOUNT_PATH, i);
+        ASSERT_EQ(unlink(path), 0);
+    }
+    END_TEST;
+}
+
 #define RUN_MINFS_TESTS(name, CASE_TESTS) \
     FS_TEST_CASE(name, DEFAULT_DISK_SIZE, CASE_TESTS, FS_TEST_FVM, minfs, 1)
 
 RUN_MINFS_TESTS(FsMinfsTestsFvm,
     RUN_TEST_MEDIUM(TestQueryInfo)
 )
+
+FS_TEST_CASE(FsMinfsDirIndexTests, DEFAULT_DISK_SIZE,
+    RUN_TEST_LARGE(TestDirIndexFragmented),
+    FS_TEST_NORMAL, minfs, 1)
@@ -2,6 +2,9 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <signal.h>
+#include <threads.h>
+
 #include <fbl/string.h>
 #include <fbl/unique_fd.h>
 #include <fvm/container.h>
@@ -21,6 +24,7 @@ static char system_path[PATH_MAX];
 static char blobfs_path[PATH_MAX];
 static char sparse_path[PATH_MAX];
 static char sparse_lz4_path[PATH_MAX];
+static char corrupt_path[PATH_MAX];
 static char fvm_path[PATH_MAX];
 
 constexpr uint32_t kData      = 1;
@@ -43,6 +47,7 @@ static uint32_t gFileFlags = 0;
 typedef enum {
     SPARSE,
     SPARSE_LZ4,
+    SPARSE_LZ4_CHUNKED,
     FVM,
     FVM_NEW,
     FVM_OFFSET,
@@ -131,6 +136,16 @@ bool CreateSparse(compress_type_t compress) {
     END_HELPER;
 }
 
+bool CheckSparseFlags(const char* path, uint32_t flags) {
+    BEGIN_HELPER;
+    fbl::unique_fd fd(open(path, O_RDONLY));
+    ASSERT_TRUE(fd, "Unable to open sparse file");
+    fvm::sparse_image_t image;
+    ASSERT_EQ(read(fd.get(), &image, sizeof(image)), sizeof(image));
+    ASSERT_EQ(image.flags, flags, "Unexpected sparse flags");
+    END_HELPER;
+}
+
 bool StatFile(const char* path, off_t* length) {
     BEGIN_HELPER;
     fbl::unique_fd fd(open(path, O_RDWR, 0755));
@@ -151,7 +166,7 @@ bool ReportContainer(const char* path, off_t offset) {
     return true;
 }
 
-bool ReportSparse(bool compress) {
+bool ReportSparse(compress_type_t compress) {
     if (compress) {
         printf("Decompressing sparse file\n");
         if (fvm::decompress_sparse(sparse_lz4_path, sparse_path) != ZX_OK) {
@@ -365,9 +380,16 @@ bool CreateAndReport(container_t type) {
         }
         case SPARSE_LZ4: {
             ASSERT_TRUE(CreateSparse(LZ4));
+            ASSERT_TRUE(CheckSparseFlags(sparse_lz4_path, fvm::kSparseFlagLz4));
             ASSERT_TRUE(ReportSparse(LZ4));
             break;
         }
+        case SPARSE_LZ4_CHUNKED: {
+            ASSERT_TRUE(CreateSparse(LZ4_CHUNKED));
+            ASSERT_TRUE(CheckSparseFlags(sparse_lz4_path, fvm::kSparseFlagLz4Chunks));
+            ASSERT_TRUE(ReportSparse(LZ4_CHUNKED));
+            break;
+        }
         case FVM: {
             ASSERT_TRUE(CreateFvm(true, 0));
             ASSERT_TRUE(ReportFvm(0));
@@ -409,9 +431,197 @@ bool TestPartitions() {
     END_TEST;
 }
 
+// Reads the whole chunked sparse image, and finds the chunk index at the end of
+// its header.
+bool ReadChunkedImage(fbl::unique_ptr<uint8_t[]>* out, size_t* out_length,
+                      size_t* index_offset) {
+    BEGIN_HELPER;
+    off_t length;
+    ASSERT_TRUE(StatFile(sparse_lz4_path, &length));
+    fbl::AllocChecker ac;
+    fbl::unique_ptr<uint8_t[]> image(new (&ac) uint8_t[length]);
+    ASSERT_TRUE(ac.check());
+    fbl::unique_fd fd(open(sparse_lz4_path, O_RDONLY));
+    ASSERT_TRUE(fd, "Unable to open sparse file");
+    ASSERT_EQ(read(fd.get(), image.get(), length), length);
+
+    auto hdr = reinterpret_cast<fvm::sparse_image_t*>(image.get());
+    ASSERT_EQ(hdr->flags, fvm::kSparseFlagLz4Chunks);
+    size_t off = sizeof(fvm::sparse_image_t);
+    for (size_t p = 0; p < hdr->partition_count; p++) {
+        auto part = reinterpret_cast<fvm::partition_descriptor_t*>(image.get() + off);
+        off += sizeof(fvm::partition_descriptor_t) +
+               part->extent_count * sizeof(fvm::extent_descriptor_t);
+    }
+    ASSERT_LE(off + sizeof(fvm::chunk_index_t), hdr->header_length);
+
+    *out = fbl::move(image);
+    *out_length = length;
+    *index_offset = off;
+    END_HELPER;
+}
+
+// Writes |length| bytes of |image| to a file and decompresses it with a
+// SparseReader, returning the first failure.
+zx_status_t DecompressImage(const uint8_t* image, size_t length) {
+    fbl::unique_fd fd(open(corrupt_path, O_RDWR | O_CREAT | O_TRUNC, 0644));
+    if (!fd || write(fd.get(), image, length) != static_cast<ssize_t>(length) ||
+        lseek(fd.get(), 0, SEEK_SET) != 0) {
+        return ZX_ERR_IO;
+    }
+    unlink(corrupt_path);
+
+    zx_status_t status;
+    fbl::unique_ptr<fvm::SparseReader> reader;
+    if ((status = fvm::SparseReader::Create(fbl::move(fd), &reader)) != ZX_OK) {
+        return status;
+    }
+    return reader->WriteDecompressed(fbl::unique_fd(open("/dev/null", O_WRONLY)));
+}
+
+typedef struct {
+    int fd;
+    const uint8_t* data;
+    size_t length;
+} pipe_writer_t;
+
+int WritePipe(void* arg) {
+    auto writer = static_cast<pipe_writer_t*>(arg);
+    size_t off = 0;
+    while (off < writer->length) {
+        ssize_t r = write(writer->fd, writer->data + off, writer->length - off);
+        if (r <= 0) {
+            break;
+        }
+        off += r;
+    }
+    close(writer->fd);
+    return 0;
+}
+
+// Same as DecompressImage, but streams the image through a pipe so the
+// reader can't tell how long it is up front.
+zx_status_t DecompressStream(const uint8_t* image, size_t length) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return ZX_ERR_IO;
+    }
+    pipe_writer_t writer = { fds[1], image, length };
+    thrd_t thread;
+    if (thrd_create(&thread, WritePipe, &writer) != thrd_success) {
+        close(fds[0]);
+        close(fds[1]);
+        return ZX_ERR_NO_RESOURCES;
+    }
+
+    zx_status_t status;
+    {
+        fbl::unique_ptr<fvm::SparseReader> reader;
+        fbl::unique_fd fd(fds[0]);
+        if ((status = fvm::SparseReader::Create(fbl::move(fd), &reader)) == ZX_OK) {
+            status = reader->WriteDecompressed(fbl::unique_fd(open("/dev/null", O_WRONLY)));
+        }
+    }
+    thrd_join(thread, nullptr);
+    return status;
+}
+
+bool TestSparseFlagValidation() {
+    BEGIN_TEST;
+    ASSERT_TRUE(CreatePartitions());
+    ASSERT_TRUE(CreateSparse(LZ4_CHUNKED));
+    fbl::unique_ptr<uint8_t[]> image;
+    size_t length, index_offset;
+    ASSERT_TRUE(ReadChunkedImage(&image, &length, &index_offset));
+    auto hdr = reinterpret_cast<fvm::sparse_image_t*>(image.get());
+
+    ASSERT_EQ(DecompressImage(image.get(), length), ZX_OK);
+
+    hdr->flags = fvm::kSparseFlagLz4Chunks | 0x80;
+    ASSERT_EQ(DecompressImage(image.get(), length), ZX_ERR_NOT_SUPPORTED,
+              "Unknown flags should be rejected");
+    hdr->flags = fvm::kSparseFlagLz4Chunks | fvm::kSparseFlagLz4;
+    ASSERT_NE(DecompressImage(image.get(), length), ZX_OK,
+              "Conflicting flags should be rejected");
+    hdr->flags = fvm::kSparseFlagLz4Chunks;
+
+    ASSERT_TRUE(DestroyAll());
+    END_TEST;
+}
+
+bool TestChunkIndexOutOfRange() {
+    BEGIN_TEST;
+    ASSERT_TRUE(CreatePartitions());
+    ASSERT_TRUE(PopulatePartitions(2, 10, (1 << 20)));
+    ASSERT_TRUE(CreateSparse(LZ4_CHUNKED));
+    fbl::unique_ptr<uint8_t[]> image;
+    size_t length, index_offset;
+    ASSERT_TRUE(ReadChunkedImage(&image, &length, &index_offset));
+    auto index = reinterpret_cast<fvm::chunk_index_t*>(image.get() + index_offset);
+    auto chunks = reinterpret_cast<fvm::chunk_descriptor_t*>(index + 1);
+    ASSERT_GT(index->chunk_count, 1);
+
+    // A chunk which claims one more byte than the image holds
+    const uint64_t first_length = chunks[0].compressed_length;
+    chunks[0].compressed_length = first_length + 1;
+    ASSERT_EQ(DecompressImage(image.get(), length), ZX_ERR_IO_DATA_INTEGRITY,
+              "Chunks past the end of the image should be rejected");
+    chunks[0].compressed_length = 0;
+    ASSERT_EQ(DecompressImage(image.get(), length), ZX_ERR_IO_DATA_INTEGRITY);
+    chunks[0].compressed_length = UINT64_MAX;
+    ASSERT_EQ(DecompressImage(image.get(), length), ZX_ERR_IO_DATA_INTEGRITY);
+    chunks[0].compressed_length = first_length;
+
+    // Chunk counts and sizes that don't match the extents
+    index->chunk_count++;
+    ASSERT_EQ(DecompressImage(image.get(), length), ZX_ERR_IO_DATA_INTEGRITY);
+    index->chunk_count--;
+    const uint64_t chunk_size = index->chunk_size;
+    index->chunk_size = fvm::kSparseChunkSizeMax + 1;
+    ASSERT_EQ(DecompressImage(image.get(), length), ZX_ERR_IO_DATA_INTEGRITY);
+    index->chunk_size = chunk_size;
+
+    // A chunk boundary moved within the image only fails once decompressed
+    chunks[0].compressed_length--;
+    chunks[1].compressed_length++;
+    ASSERT_NE(DecompressImage(image.get(), length), ZX_OK);
+    chunks[0].compressed_length++;
+    chunks[1].compressed_length--;
+
+    ASSERT_EQ(DecompressImage(image.get(), length), ZX_OK);
+    ASSERT_TRUE(DestroyAll());
+    END_TEST;
+}
+
+bool TestChunkTruncated() {
+    BEGIN_TEST;
+    ASSERT_TRUE(CreatePartitions());
+    ASSERT_TRUE(PopulatePartitions(2, 10, (1 << 20)));
+    ASSERT_TRUE(CreateSparse(LZ4_CHUNKED));
+    fbl::unique_ptr<uint8_t[]> image;
+    size_t length, index_offset;
+    ASSERT_TRUE(ReadChunkedImage(&image, &length, &index_offset));
+    auto hdr = reinterpret_cast<fvm::sparse_image_t*>(image.get());
+
+    // A truncated file is caught from the chunk index, before any data is
+    // read; a truncated stream once the short chunk is read.
+    ASSERT_EQ(DecompressStream(image.get(), length), ZX_OK);
+    ASSERT_EQ(DecompressImage(image.get(), length - 1), ZX_ERR_IO_DATA_INTEGRITY);
+    ASSERT_NE(DecompressStream(image.get(), length - 1), ZX_OK);
+    const size_t mid_data = hdr->header_length + (length - hdr->header_length) / 2;
+    ASSERT_EQ(DecompressImage(image.get(), mid_data), ZX_ERR_IO_DATA_INTEGRITY);
+    ASSERT_NE(DecompressStream(image.get(), mid_data), ZX_OK);
+    ASSERT_NE(DecompressStream(image.get(), hdr->header_length - 1), ZX_OK);
+
+    ASSERT_TRUE(DestroyAll());
+    END_TEST;
+}
+
 bool Setup() {
     BEGIN_HELPER;
     srand(time(0));
+    // Streaming tests close the read end of a pipe early on failure
+    signal(SIGPIPE, SIG_IGN);
     GenerateDirectory("/tmp/", 20, test_dir);
     ASSERT_EQ(mkdir(test_dir, 0755), 0, "Failed to create test path");
     printf("Created test path %s\n", test_dir);
@@ -420,6 +630,7 @@ bool Setup() {
     sprintf(blobfs_path, "%sblobfs.bin", test_dir);
     sprintf(sparse_path, "%ssparse.bin", test_dir);
     sprintf(sparse_lz4_path, "%ssparse.bin.lz4", test_dir);
+    sprintf(corrupt_path, "%scorrupt.bin.lz4", test_dir);
     sprintf(fvm_path, "%sfvm.bin", test_dir);
     END_HELPER;
 }
@@ -452,14 +663,19 @@ bool Cleanup() {
 BEGIN_TEST_CASE(fvm_host_tests)
 RUN_TEST_MEDIUM(TestEmptyPartitions<SPARSE>)
 RUN_TEST_MEDIUM(TestEmptyPartitions<SPARSE_LZ4>)
+RUN_TEST_MEDIUM(TestEmptyPartitions<SPARSE_LZ4_CHUNKED>)
 RUN_TEST_MEDIUM(TestEmptyPartitions<FVM>)
 RUN_TEST_MEDIUM(TestEmptyPartitions<FVM_NEW>)
 RUN_TEST_MEDIUM(TestEmptyPartitions<FVM_OFFSET>)
 RUN_TEST_MEDIUM((TestPartitions<SPARSE, 10, 100, (1 << 20)>))
 RUN_TEST_MEDIUM((TestPartitions<SPARSE_LZ4, 10, 100, (1 << 20)>))
+RUN_TEST_MEDIUM((TestPartitions<SPARSE_LZ4_CHUNKED, 10, 100, (1 << 20)>))
 RUN_TEST_MEDIUM((TestPartitions<FVM, 10, 100, (1 << 20)>))
 RUN_TEST_MEDIUM((TestPartitions<FVM_NEW, 10, 100, (1 << 20)>))
 RUN_TEST_MEDIUM((TestPartitions<FVM_OFFSET, 10, 100, (1 << 20)>))
+RUN_TEST_MEDIUM(TestSparseFlagValidation)
+RUN_TEST_MEDIUM(TestChunkIndexOutOfRange)
+RUN_TEST_MEDIUM(TestChunkTruncated)
 END_TEST_CASE(fvm_host_tests)
 
 int main(int argc, char** argv) {
@@ -0,0 +1,40 @@
+# Copyright 2018 The Fuchsia Authors. All rights reserved.
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+MODULE := $(LOCAL_DIR)
+
+MODULE_TYPE := usertest
+
+MODULE_NAME := minfs-test
+
+MODULE_SRCS := \
+    $(LOCAL_DIR)/writeback.cpp \
+
+MODULE_STATIC_LIBS := \
+    system/ulib/minfs \
+    system/ulib/fs \
+    system/ulib/async.cpp \
+    system/ulib/async \
+    system/ulib/async.loop-cpp \
+    system/ulib/async.loop \
+    system/ulib/block-client \
+    system/ulib/trace \
+    system/ulib/zx \
+    system/ulib/zxcpp \
+    system/ulib/fbl \
+    system/ulib/sync \
+
+MODULE_LIBS := \
+    system/ulib/async.default \
+    system/ulib/bitmap \
+    system/ulib/c \
+    system/ulib/fdio \
+    system/ulib/fs-management \
+    system/ulib/trace-engine \
+    system/ulib/unittest \
+    system/ulib/zircon \
+
+include make/module.mk
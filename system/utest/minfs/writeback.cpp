@@ -0,0 +1,162 @@
+// Copyright 2018 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Tests for the minfs writeback buffer, driven directly against a ramdisk.
+
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fbl/unique_fd.h>
+#include <fbl/unique_ptr.h>
+#include <fs-management/ramdisk.h>
+#include <fs/mapped-vmo.h>
+#include <minfs/bcache.h>
+#include <minfs/format.h>
+#include <minfs/writeback.h>
+#include <sync/completion.h>
+#include <unittest/unittest.h>
+#include <zircon/device/block.h>
+#include <zx/vmo.h>
+
+namespace minfs {
+namespace {
+
+constexpr uint32_t kDiskBlocks = 64;
+constexpr uint64_t kRamdiskBlockSize = 512;
+
+class Ramdisk {
+public:
+    Ramdisk() {}
+    ~Ramdisk() {
+        if (path_[0] != '\0') {
+            destroy_ramdisk(path_);
+        }
+    }
+
+    bool Init() {
+        ASSERT_EQ(create_ramdisk(kRamdiskBlockSize,
+                                 kDiskBlocks * kMinfsBlockSize / kRamdiskBlockSize, path_), 0);
+        fbl::unique_fd fd(open(path_, O_RDWR));
+        ASSERT_TRUE(fd);
+        ASSERT_EQ(Bcache::Create(&bc_, fbl::move(fd), kDiskBlocks), ZX_OK);
+        return true;
+    }
+
+    Bcache* bc() { return bc_.get(); }
+
+private:
+    char path_[PATH_MAX] = {};
+    fbl::unique_ptr<Bcache> bc_;
+};
+
+// Fills minfs block |n| of |vmo| with |value|.
+bool FillBlock(const zx::vmo& vmo, uint64_t n, uint8_t value) {
+    uint8_t data[kMinfsBlockSize];
+    memset(data, value, sizeof(data));
+    size_t actual;
+    ASSERT_EQ(vmo.write(data, n * kMinfsBlockSize, sizeof(data), &actual), ZX_OK);
+    ASSERT_EQ(actual, sizeof(data));
+    return true;
+}
+
+bool CheckBlock(Bcache* bc, blk_t bno, uint8_t value) {
+    uint8_t data[kMinfsBlockSize];
+    ASSERT_EQ(bc->Readblk(bno, data), ZX_OK);
+    for (size_t i = 0; i < sizeof(data); i++) {
+        ASSERT_EQ(data[i], value, "Unexpected block contents");
+    }
+    return true;
+}
+
+// Enqueues |work| and waits for its closure, returning the status it was
+// completed with in |out|.
+bool EnqueueAndWait(WritebackBuffer* wb, fbl::unique_ptr<WritebackWork> work,
+                    zx_status_t* out) {
+    completion_t completion;
+    zx_status_t status = ZX_ERR_INTERNAL;
+    work->SetClosure([&completion, &status](zx_status_t s) {
+        status = s;
+        completion_signal(&completion);
+    });
+    wb->Enqueue(fbl::move(work));
+    ASSERT_EQ(completion_wait(&completion, ZX_TIME_INFINITE), ZX_OK);
+    *out = status;
+    return true;
+}
+
+// A single work whose requests punch holes in an earlier request of its own
+// splits into more pieces than MAX_TXN_MESSAGES. It must still be written out,
+// with each block holding the contents of the last request to write it.
+bool TestWorkLargerThanTxn(void) {
+    BEGIN_TEST;
+
+    Ramdisk ramdisk;
+    ASSERT_TRUE(ramdisk.Init());
+    Bcache* bc = ramdisk.bc();
+
+    fbl::unique_ptr<MappedVmo> buffer;
+    ASSERT_EQ(MappedVmo::Create(kDiskBlocks * kMinfsBlockSize, "minfs-writeback-test",
+                                &buffer), ZX_OK);
+    fbl::unique_ptr<WritebackBuffer> wb;
+    ASSERT_EQ(WritebackBuffer::Create(bc, fbl::move(buffer), &wb), ZX_OK);
+
+    // One long request, followed by single blocks overwriting every other
+    // block within it. WriteTxn holds at most MAX_TXN_MESSAGES - 2 requests.
+    constexpr uint64_t kHoles = MAX_TXN_MESSAGES - 3;
+    constexpr uint64_t kLength = 2 * kHoles + 2;
+    zx::vmo vmo;
+    ASSERT_EQ(zx::vmo::create((kLength + kHoles) * kMinfsBlockSize, 0, &vmo), ZX_OK);
+    for (uint64_t i = 0; i < kLength; i++) {
+        ASSERT_TRUE(FillBlock(vmo, i, 0xaa));
+    }
+    for (uint64_t i = 0; i < kHoles; i++) {
+        ASSERT_TRUE(FillBlock(vmo, kLength + i, 0xbb));
+    }
+
+    fbl::unique_ptr<WritebackWork> work(new WritebackWork(bc));
+    work->txn()->Enqueue(vmo.get(), 0, 0, kLength);
+    for (uint64_t i = 0; i < kHoles; i++) {
+        work->txn()->Enqueue(vmo.get(), kLength + i, 2 * i + 1, 1);
+    }
+    ASSERT_EQ(work->txn()->Count(), kHoles + 1);
+    // The holes split the long request into kHoles + 1 pieces.
+    static_assert(2 * kHoles + 1 > MAX_TXN_MESSAGES, "Work fits in one transaction");
+
+    zx_status_t status;
+    ASSERT_TRUE(EnqueueAndWait(wb.get(), fbl::move(work), &status));
+    ASSERT_EQ(status, ZX_OK);
+
+    // A later work rewriting some of the same blocks must land after every
+    // piece of the split one.
+    ASSERT_TRUE(FillBlock(vmo, 0, 0xcc));
+    ASSERT_TRUE(FillBlock(vmo, 1, 0xcc));
+    work.reset(new WritebackWork(bc));
+    work->txn()->Enqueue(vmo.get(), 0, 2 * kHoles - 1, 2);
+    ASSERT_TRUE(EnqueueAndWait(wb.get(), fbl::move(work), &status));
+    ASSERT_EQ(status, ZX_OK);
+    wb.reset();
+
+    for (blk_t bno = 0; bno < kLength; bno++) {
+        uint8_t expected = (bno % 2 == 1 && bno < 2 * kHoles) ? 0xbb : 0xaa;
+        if (bno == 2 * kHoles - 1 || bno == 2 * kHoles) {
+            expected = 0xcc;
+        }
+        ASSERT_TRUE(CheckBlock(bc, bno, expected));
+    }
+
+    END_TEST;
+}
+
+} // namespace
+} // namespace minfs
+
+BEGIN_TEST_CASE(minfs_writeback_tests)
+RUN_TEST_MEDIUM(minfs::TestWorkLargerThanTxn)
+END_TEST_CASE(minfs_writeback_tests)
+
+int main(int argc, char** argv) {
+    return unittest_run_all_tests(argc, argv) ? 0 : -1;
+}
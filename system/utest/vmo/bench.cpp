@@ -7,12 +7,14 @@
 #include <inttypes.h>
 #include <sys/types.h>
 #include <stdlib.h>
+#include <threads.h>
 #include <unistd.h>
 
 #include <zircon/compiler.h>
 #include <zircon/process.h>
 #include <zircon/syscalls.h>
 #include <fbl/algorithm.h>
+#include <fbl/atomic.h>
 
 #include "bench.h"
 
@@ -46,6 +48,60 @@ inline zx_time_t time_it(T func) {
     return ticks_to_ns(ticks);
 }
 
+namespace {
+
+constexpr uint32_t kMaxFaultThreads = 64;
+
+struct FaultWorker {
+    uintptr_t ptr;
+    size_t size;
+    const fbl::atomic<bool>* go;
+};
+
+int fault_worker(void* arg) {
+    auto worker = static_cast<FaultWorker*>(arg);
+    while (!worker->go->load())
+        ;
+    for (size_t i = 0; i < worker->size; i += PAGE_SIZE) {
+        ((volatile char *)worker->ptr)[i] = 99;
+    }
+    return 0;
+}
+
+// write fault in |size| bytes split evenly between |num_threads| threads of
+// this process, each faulting in its own vmo through its own mapping
+zx_time_t time_parallel_faults(size_t size, uint32_t num_threads) {
+    const size_t per_thread = size / num_threads;
+    FaultWorker workers[kMaxFaultThreads];
+    thrd_t threads[kMaxFaultThreads];
+    zx_handle_t vmos[kMaxFaultThreads];
+    fbl::atomic<bool> go(false);
+
+    for (uint32_t i = 0; i < num_threads; i++) {
+        zx_vmo_create(per_thread, 0, &vmos[i]);
+        zx_vmar_map(zx_vmar_root_self(), 0, vmos[i], 0, per_thread,
+                    ZX_VM_FLAG_PERM_READ | ZX_VM_FLAG_PERM_WRITE, &workers[i].ptr);
+        workers[i].size = per_thread;
+        workers[i].go = &go;
+        thrd_create(&threads[i], fault_worker, &workers[i]);
+    }
+
+    zx_time_t t = time_it([&](){
+        go.store(true);
+        for (uint32_t i = 0; i < num_threads; i++) {
+            thrd_join(threads[i], nullptr);
+        }
+    });
+
+    for (uint32_t i = 0; i < num_threads; i++) {
+        zx_vmar_unmap(zx_vmar_root_self(), workers[i].ptr, per_thread);
+        zx_handle_close(vmos[i]);
+    }
+    return t;
+}
+
+} // namespace
+
 int vmo_run_benchmark() {
     zx_time_t t;
     //zx_handle_t vmo;
@@ -188,6 +244,17 @@ int vmo_run_benchmark() {
 
     zx_handle_close(vmo);
 
+    // write fault in the same amount of memory from more and more threads in
+    // one process, which only scales if faults in an address space don't
+    // serialize on each other
+    const uint32_t num_cpus = zx_system_get_num_cpus();
+    const uint32_t max_threads = fbl::min(fbl::max(num_cpus, 8u), kMaxFaultThreads);
+    for (uint32_t num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+        t = time_parallel_faults(size, num_threads);
+        printf("\ttook %" PRIu64 " nsecs to write fault in %zu bytes from %u threads (%u cpus)\n",
+               t, size, num_threads, num_cpus);
+    }
+
     printf("done with benchmark\n");
 
     return 0;
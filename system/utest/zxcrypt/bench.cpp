@@ -0,0 +1,100 @@
+// Copyright 2018 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <zircon/status.h>
+#include <zircon/syscalls.h>
+#include <zircon/types.h>
+#include <zxcrypt/volume.h>
+
+#include "bench.h"
+#include "test-device.h"
+
+namespace zxcrypt {
+namespace testing {
+namespace {
+
+// Large enough that the volume doesn't fit in the CPU caches.
+constexpr size_t kBenchDeviceSize = 32 << 20;
+constexpr size_t kBenchBlockSize = 4096;
+constexpr int kPasses = 4;
+
+// Transfer sizes, in blocks.  The largest is split between workers; the smallest is not.
+constexpr size_t kXferBlocks[] = {1, 16, 256, 1024};
+
+double mb_per_sec(size_t bytes, uint64_t ticks) {
+    return static_cast<double>(bytes) * static_cast<double>(zx_ticks_per_second()) /
+           (static_cast<double>(ticks) * (1 << 20));
+}
+
+// Writes and then reads back the whole volume |kPasses| times using transfers of |xfer| blocks,
+// and prints the throughput of each direction.
+bool Run(TestDevice* device, size_t xfer) {
+    zx_status_t rc;
+    size_t count = device->block_count();
+    size_t bytes = count * device->block_size() * kPasses;
+
+    uint64_t ticks = zx_ticks_get();
+    for (int pass = 0; pass < kPasses; ++pass) {
+        for (size_t off = 0; off + xfer <= count; off += xfer) {
+            if ((rc = device->WriteVmo(off, xfer)) != ZX_OK) {
+                printf("\twrite failed: %s\n", zx_status_get_string(rc));
+                return false;
+            }
+        }
+    }
+    double write = mb_per_sec(bytes, zx_ticks_get() - ticks);
+
+    ticks = zx_ticks_get();
+    for (int pass = 0; pass < kPasses; ++pass) {
+        for (size_t off = 0; off + xfer <= count; off += xfer) {
+            if ((rc = device->ReadVmo(off, xfer)) != ZX_OK) {
+                printf("\tread failed: %s\n", zx_status_get_string(rc));
+                return false;
+            }
+        }
+    }
+    double read = mb_per_sec(bytes, zx_ticks_get() - ticks);
+
+    if (!device->CheckMatch(0, (count - count % xfer) * device->block_size())) {
+        printf("\tdata read back does not match data written\n");
+        return false;
+    }
+    printf("%8zu KB: write %8.1f MB/s, read %8.1f MB/s\n", xfer * device->block_size() / 1024,
+           write, read);
+    return true;
+}
+
+} // namespace
+} // namespace testing
+} // namespace zxcrypt
+
+int zxcrypt_run_benchmark(void) {
+    using zxcrypt::Volume;
+    using zxcrypt::testing::TestDevice;
+    zx_status_t rc;
+
+    TestDevice device;
+    if ((rc = device.GenerateKey(Volume::kAES256_XTS_SHA256)) != ZX_OK ||
+        (rc = device.Create(zxcrypt::testing::kBenchDeviceSize, zxcrypt::testing::kBenchBlockSize,
+                            false /* not FVM */)) != ZX_OK ||
+        (rc = Volume::Create(device.parent(), device.key())) != ZX_OK ||
+        (rc = device.BindZxcrypt()) != ZX_OK) {
+        printf("failed to set up zxcrypt volume: %s\n", zx_status_get_string(rc));
+        return -1;
+    }
+
+    printf("zxcrypt throughput over a %zu MB ramdisk with %" PRIu32 " CPUs:\n",
+           device.size() >> 20, zx_system_get_num_cpus());
+    for (size_t xfer : zxcrypt::testing::kXferBlocks) {
+        if (!zxcrypt::testing::Run(&device, xfer)) {
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -2,9 +2,16 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <string.h>
+
 #include <unittest/unittest.h>
 
+#include "bench.h"
+
 int main(int argc, char** argv) {
     srand(0);
+    if (argc > 1 && !strcmp(argv[1], "bench")) {
+        return zxcrypt_run_benchmark();
+    }
     return unittest_run_all_tests(argc, argv) ? 0 : -1;
 }
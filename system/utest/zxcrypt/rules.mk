@@ -9,6 +9,7 @@ MODULE := $(LOCAL_DIR)
 MODULE_TYPE := usertest
 
 MODULE_SRCS += \
+    $(LOCAL_DIR)/bench.cpp \
     $(LOCAL_DIR)/main.c \
     $(LOCAL_DIR)/test-device.cpp \
     $(LOCAL_DIR)/volume.cpp \
@@ -454,6 +454,31 @@ bool TestVmoManyToOne(Volume::Version version, bool fvm) {
 }
 DEFINE_EACH_DEVICE(TestVmoManyToOne);
 
+bool TestVmoLargeTransfer(Volume::Version version, bool fvm) {
+    BEGIN_TEST;
+
+    // Large enough that the device splits each transfer between several workers.
+    TestDevice device;
+    ASSERT_OK(device.GenerateKey(version));
+    ASSERT_OK(device.Create(kDeviceSize * 16, kBlockSize, fvm));
+    ASSERT_OK(Volume::Create(device.parent(), device.key()));
+    ASSERT_OK(device.BindZxcrypt());
+    size_t n = device.block_count();
+
+    EXPECT_OK(device.WriteVmo(0, n));
+    EXPECT_OK(device.ReadVmo(0, n));
+    EXPECT_TRUE(device.CheckMatch(0, device.size()));
+
+    // Read back in the opposite split to the one written.
+    ASSERT_OK(device.BindZxcrypt());
+    EXPECT_OK(device.ReadVmo(0, n / 2));
+    EXPECT_OK(device.ReadVmo(n / 2, n - n / 2));
+    EXPECT_TRUE(device.CheckMatch(0, device.size()));
+
+    END_TEST;
+}
+DEFINE_EACH_DEVICE(TestVmoLargeTransfer);
+
 // TODO(aarongreen): Currently, we're using XTS, which provides no data integrity.  When possible,
 // we should switch to an AEAD, which would allow us to detect data corruption when doing I/O.
 // bool TestBadData(void) {
@@ -483,6 +508,7 @@ RUN_EACH_DEVICE(TestVmoAllBlocks)
 RUN_EACH_DEVICE(TestVmoOutOfBounds)
 RUN_EACH_DEVICE(TestVmoOneToMany)
 RUN_EACH_DEVICE(TestVmoManyToOne)
+RUN_EACH_DEVICE(TestVmoLargeTransfer)
 END_TEST_CASE(ZxcryptTest)
 
 } // namespace